@@ -1,11 +1,13 @@
 #include <arch/Hat.h>
 #include <debug/Log.h>
 #include <memory/Pmm.h>
+#include <memory/TlbShootdown.h>
 #include <Memory.h>
 #include <Maths.h>
 
 #define PFLUSH(vaddr) do { asm volatile("pflush %0" :: "a"(vaddr) : "memory"); } while(false)
 #define PFLUSHA() do { asm volatile("pflushan" ::: "memory"); } while(false)
+#define PFLUSHA_GLOBAL() do { asm volatile("pflusha" ::: "memory"); } while(false)
 
 namespace Npk
 {
@@ -13,6 +15,8 @@ namespace Npk
     constexpr size_t PagingLevels = 3;
     constexpr uint32_t ResidentFlag = 3;
     constexpr uint32_t WriteProtectFlag = 1 << 2;
+    constexpr uint32_t AccessedFlag = 1 << 3; //"used" in motorola terms
+    constexpr uint32_t ModifiedFlag = 1 << 4;
     constexpr uint32_t GlobalFlag = 1 << 10;
 
     struct PageTable
@@ -23,6 +27,7 @@ namespace Npk
     struct HatMap
     {
         PageTable* root;
+        Memory::TlbContext tlb;
     };
 
     struct WalkResult
@@ -50,6 +55,50 @@ namespace Npk
         indices[1] = (vaddr >> 12) & 0x3F;
     }
 
+    constexpr size_t FlushRangeMaxPages = 32;
+    constexpr size_t LevelShifts[PagingLevels + 1] = { 0, 12, 18, 25 };
+    constexpr size_t LevelEntries[PagingLevels + 1] = { 0, 64, 128, 128 };
+
+    static inline size_t GetLevelIndex(uintptr_t vaddr, size_t level)
+    { return (vaddr >> LevelShifts[level]) & (LevelEntries[level] - 1); }
+
+    //returns the start of the area covered by the next descriptor at this level, clamped to `top`.
+    static inline uintptr_t NextEntryAddr(uintptr_t vaddr, size_t level, uintptr_t top)
+    {
+        const uintptr_t coverage = 1ul << LevelShifts[level];
+        const uintptr_t next = sl::AlignDown(vaddr, coverage) + coverage;
+        return (next <= vaddr || next > top) ? top : next;
+    }
+
+    static inline uint32_t BuildEntry(uintptr_t paddr, HatFlags flags)
+    {
+        uint32_t entry = ResidentFlag | (paddr & descAddrMask);
+        if ((flags & HatFlags::Write) == HatFlags::None)
+            entry |= WriteProtectFlag;
+        if ((flags & HatFlags::Global) != HatFlags::None)
+            entry |= GlobalFlag;
+        return entry;
+    }
+
+    static void FlushRange(uintptr_t base, size_t length)
+    {
+        if (length / PageSize > FlushRangeMaxPages)
+        {
+            PFLUSHA_GLOBAL(); //the range may contain global (kernel) pages, pflushan would skip them.
+            return;
+        }
+
+        for (size_t i = 0; i < length; i += PageSize)
+            PFLUSH(base + i);
+    }
+
+    //flushes locally, then on any other cores that may have cached translations from this map.
+    static void FlushEverywhere(HatMap* map, uintptr_t base, size_t length)
+    {
+        FlushRange(base, length);
+        Memory::TlbShootdown(map, map->tlb, base, length);
+    }
+
     static inline WalkResult WalkTables(PageTable* root, uintptr_t vaddr)
     {
         size_t indices[PagingLevels + 1];
@@ -106,9 +155,17 @@ namespace Npk
     HatMap* HatCreateMap()
     {
         HatMap* map = new HatMap();
+        if (map == nullptr)
+            return nullptr;
         map->root = reinterpret_cast<PageTable*>(PMM::Global().Alloc());
+        if (map->root == nullptr)
+        {
+            delete map;
+            return nullptr;
+        }
         sl::memset(AddHhdm(map), 0, sizeof(PageTable));
 
+        Memory::InitTlbContext(map->tlb);
         return map;
     }
 
@@ -133,6 +190,28 @@ namespace Npk
         return (*clusterBase & tableAddrMask) + (index * sizeof(PageTable));
     }
 
+    //neighbouring ranges can share page tables, so new ones are installed with a CAS rather
+    //than under a lock. Returns the table now referenced by `pte`, or nullptr if we're out of memory.
+    static PageTable* InstallPageTable(uint32_t* pte, size_t index)
+    {
+        uint32_t entry = __atomic_load_n(pte, __ATOMIC_ACQUIRE);
+        if ((entry & ResidentFlag) == 0)
+        {
+            const uint32_t newPt = AllocPageTable(pte, index);
+            if (newPt == 0)
+                return nullptr;
+            sl::memset(reinterpret_cast<void*>(AddHhdm(newPt)), 0, sizeof(PageTable));
+            const uint32_t desired = (tableAddrMask & newPt) | ResidentFlag;
+
+            if (__atomic_compare_exchange_n(pte, &entry, desired, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                entry = desired;
+            else
+                PMM::Global().Free(newPt, 1);
+        }
+
+        return reinterpret_cast<PageTable*>((entry & descAddrMask) + hhdmBase);
+    }
+
     bool HatDoMap(HatMap* map, uintptr_t vaddr, uintptr_t paddr, size_t mode, HatFlags flags, bool flush)
     {
         ASSERT_(map != nullptr);
@@ -148,21 +227,14 @@ namespace Npk
 
         while (path.level != 1)
         {
-            const uint32_t newPt = AllocPageTable(path.pte, indices[path.level]);
-            sl::memset(reinterpret_cast<void*>(AddHhdm(newPt)), 0, sizeof(PageTable));
-            *path.pte = tableAddrMask & newPt;
-            *path.pte |= ResidentFlag;
-
+            PageTable* pt = InstallPageTable(path.pte, indices[path.level]);
+            if (pt == nullptr)
+                return false;
             path.level--;
-            auto pt = reinterpret_cast<PageTable*>(newPt + hhdmBase);
             path.pte = &pt->ptes[indices[path.level]];
         }
 
-        *path.pte = ResidentFlag | (paddr & descAddrMask);
-        if ((flags & HatFlags::Write) == HatFlags::None)
-            *path.pte |= WriteProtectFlag;
-        if ((flags & HatFlags::Global) != HatFlags::None)
-            *path.pte |= GlobalFlag;
+        __atomic_store_n(path.pte, BuildEntry(paddr, flags), __ATOMIC_RELEASE);
 
         if (flush)
             PFLUSH(vaddr);
@@ -182,7 +254,7 @@ namespace Npk
         *path.pte = 0;
 
         if (flush)
-            PFLUSH(vaddr);
+            FlushEverywhere(map, vaddr, PageSize);
 
         return true;
     }
@@ -210,25 +282,230 @@ namespace Npk
         if (paddr.HasValue())
             *path.pte = (*path.pte & ~descAddrMask) | (*paddr & descAddrMask);
         if (flags.HasValue())
+            *path.pte = BuildEntry(*path.pte & descAddrMask, *flags);
+
+        if (flush)
+            FlushEverywhere(map, vaddr, PageSize);
+        return true;
+    }
+
+    bool HatClearAccessed(HatMap* map, uintptr_t vaddr, bool flush)
+    {
+        ASSERT_(map != nullptr);
+
+        const WalkResult path = WalkTables(map->root, vaddr);
+        if (!path.complete)
+            return false;
+
+        //the MMU can update the entry behind our back, so the flag is cleared atomically.
+        const bool accessed = (__atomic_fetch_and(path.pte, ~AccessedFlag, __ATOMIC_RELAXED) & AccessedFlag) != 0;
+        if (flush && accessed)
+            FlushEverywhere(map, vaddr, PageSize);
+        return accessed;
+    }
+
+    //Finds the next page descriptor at or above `vaddr`, skipping over unmapped areas. Returns the
+    //page table containing it, or nullptr if there are no more translations below `top`.
+    static PageTable* FindNextLeaf(PageTable* root, uintptr_t& vaddr, uintptr_t top)
+    {
+        while (vaddr < top)
         {
-            *path.pte = (*path.pte & descAddrMask) | ResidentFlag;
-            if ((*flags & HatFlags::Write) == HatFlags::None)
-                *path.pte |= WriteProtectFlag;
-            if ((*flags & HatFlags::Global) != HatFlags::None)
-                *path.pte |= GlobalFlag;
+            PageTable* pt = AddHhdm(root);
+            for (size_t level = PagingLevels; level > 0; level--)
+            {
+                const uint32_t entry = pt->ptes[GetLevelIndex(vaddr, level)];
+                if ((entry & ResidentFlag) == 0)
+                {
+                    vaddr = NextEntryAddr(vaddr, level, top);
+                    break;
+                }
+                if (level == 1)
+                    return pt;
+
+                pt = reinterpret_cast<PageTable*>((entry & descAddrMask) + hhdmBase);
+            }
+        }
+
+        return nullptr;
+    }
+
+    bool HatMapRange(HatMap* map, uintptr_t vaddr, size_t length, size_t mode, HatFlags flags, 
+        HatPhysFunc getPhys, void* arg, bool flush)
+    {
+        ASSERT_(map != nullptr);
+        ASSERT_(getPhys != nullptr);
+        if (mode != 0)
+            return false;
+
+        const uintptr_t top = vaddr + length;
+        bool success = true;
+
+        for (uintptr_t scan = vaddr; scan < top && success;)
+        {
+            PageTable* pt = AddHhdm(map->root);
+            for (size_t level = PagingLevels; level > 1 && pt != nullptr; level--)
+            {
+                const size_t index = GetLevelIndex(scan, level);
+                pt = InstallPageTable(&pt->ptes[index], index);
+            }
+            if (pt == nullptr)
+            {
+                success = false;
+                break;
+            }
+
+            for (size_t i = GetLevelIndex(scan, 1); i < LevelEntries[1] && scan < top; i++)
+            {
+                if ((pt->ptes[i] & ResidentFlag) != 0)
+                {
+                    success = false;
+                    break;
+                }
+
+                const auto paddr = getPhys(arg, scan - vaddr);
+                if (!paddr.HasValue())
+                {
+                    success = false;
+                    break;
+                }
+                __atomic_store_n(&pt->ptes[i], BuildEntry(*paddr, flags), __ATOMIC_RELEASE);
+                scan += PageSize;
+            }
         }
 
         if (flush)
-            PFLUSH(vaddr);
-        return true;
+            FlushRange(vaddr, length);
+        return success;
+    }
+
+    size_t HatUnmapRange(HatMap* map, uintptr_t vaddr, size_t length, HatUnmapBatch& batch, bool flush)
+    {
+        ASSERT_(map != nullptr);
+
+        const uintptr_t top = vaddr + length;
+        uintptr_t scan = vaddr;
+        batch.count = 0;
+
+        while (batch.count < HatUnmapBatch::Capacity)
+        {
+            PageTable* pt = FindNextLeaf(map->root, scan, top);
+            if (pt == nullptr)
+                break;
+
+            for (size_t i = GetLevelIndex(scan, 1); i < LevelEntries[1] && scan < top; i++)
+            {
+                const uint32_t entry = pt->ptes[i];
+                if ((entry & ResidentFlag) != 0)
+                {
+                    if (batch.count == HatUnmapBatch::Capacity)
+                        break;
+
+                    batch.entries[batch.count].paddr = entry & descAddrMask;
+                    batch.entries[batch.count].mode = 0;
+                    batch.count++;
+                    pt->ptes[i] = 0;
+                }
+                scan = NextEntryAddr(scan, 1, top);
+            }
+        }
+
+        if (flush && scan != vaddr)
+            FlushEverywhere(map, vaddr, scan - vaddr);
+        return scan - vaddr;
+    }
+
+    void HatProtectRange(HatMap* map, uintptr_t vaddr, size_t length, HatFlags flags, 
+        HatProtectFunc filter, void* arg, bool flush)
+    {
+        ASSERT_(map != nullptr);
+
+        const uintptr_t top = vaddr + length;
+        uintptr_t scan = vaddr;
+
+        while (true)
+        {
+            PageTable* pt = FindNextLeaf(map->root, scan, top);
+            if (pt == nullptr)
+                break;
+
+            for (size_t i = GetLevelIndex(scan, 1); i < LevelEntries[1] && scan < top; i++)
+            {
+                const uint32_t entry = pt->ptes[i];
+                if ((entry & ResidentFlag) != 0)
+                {
+                    const uintptr_t paddr = entry & descAddrMask;
+                    const HatFlags newFlags = filter == nullptr ? flags : filter(arg, paddr, 0, flags);
+                    __atomic_store_n(&pt->ptes[i], BuildEntry(paddr, newFlags), __ATOMIC_RELEASE);
+                }
+                scan = NextEntryAddr(scan, 1, top);
+            }
+        }
+
+        if (flush)
+            FlushEverywhere(map, vaddr, length);
+    }
+
+    size_t HatTestClearRange(HatMap* map, uintptr_t vaddr, size_t length, bool clearDirty,
+        HatAccessFunc callback, void* arg, bool flush)
+    {
+        ASSERT_(map != nullptr);
+
+        const uint32_t clearMask = AccessedFlag | (clearDirty ? ModifiedFlag : 0);
+        const uintptr_t top = vaddr + length;
+        uintptr_t scan = vaddr;
+        size_t accessedCount = 0;
+        bool changed = false;
+
+        while (true)
+        {
+            PageTable* pt = FindNextLeaf(map->root, scan, top);
+            if (pt == nullptr)
+                break;
+
+            for (size_t i = GetLevelIndex(scan, 1); i < LevelEntries[1] && scan < top; i++)
+            {
+                const uint32_t entry = pt->ptes[i];
+                if ((entry & ResidentFlag) != 0)
+                {
+                    //the MMU can update the entry behind our back, so the flags are cleared atomically.
+                    const uint32_t prev = (entry & clearMask) == 0 ? entry
+                        : __atomic_fetch_and(&pt->ptes[i], ~clearMask, __ATOMIC_RELAXED);
+                    const bool accessed = (prev & AccessedFlag) != 0;
+                    changed = changed || (prev & clearMask) != 0;
+                    if (accessed)
+                        accessedCount++;
+                    if (callback != nullptr)
+                        callback(arg, sl::AlignDown(scan, PageSize), prev & descAddrMask, 0, accessed, (prev & ModifiedFlag) != 0);
+                }
+                scan = NextEntryAddr(scan, 1, top);
+            }
+        }
+
+        if (flush && changed)
+            FlushEverywhere(map, vaddr, length);
+        return accessedCount;
     }
 
     void HatMakeActive(HatMap* map, bool supervisor)
     {
+        Memory::TlbMapLoaded(map, map->tlb, 0);
         if (supervisor)
             asm("movec %0, %%srp" :: "d"(map->root) : "memory");
         else
             asm("movec %0, %%urp" :: "d"(map->root) : "memory");
         PFLUSHA();
     }
+
+    bool HatSyncKernelEntries()
+    {
+        return false; //the kernel always runs on its own root pointer (srp), there's nothing to sync.
+    }
+
+    void HatFlushLocal(uintptr_t vaddr, size_t length)
+    {
+        if (length == 0)
+            PFLUSHA_GLOBAL();
+        else
+            FlushRange(vaddr, length);
+    }
 }
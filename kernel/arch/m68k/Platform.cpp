@@ -1,12 +1,18 @@
 #include <arch/Platform.h>
 #include <arch/m68k/GfPic.h>
 #include <debug/Log.h>
+#include <Memory.h>
 
 namespace Npk
 {
     void ArchPrintPanicInfo(void (*Print)(const char *, ...))
     {} //no-op
 
+    size_t ArchCoreHardwareId()
+    {
+        return 0;
+    }
+
     void ExplodeKernelAndReset()
     {
         ASSERT_UNREACHABLE(); //trip reset vector
@@ -84,6 +90,11 @@ namespace Npk
         ASSERT_UNREACHABLE();
     }
 
+    void ClearPage(void* page)
+    {
+        sl::memset(page, 0, PageSize);
+    }
+
     uintptr_t GetReturnAddr(size_t level, uintptr_t start)
     {
         struct Frame
@@ -129,5 +140,10 @@ namespace Npk
         WriteSr(sr);
     }
 
+    void SetKernelStack(uintptr_t top)
+    {
+        CoreLocal().nextStack = reinterpret_cast<void*>(top);
+    }
+
     //NOTE: RoutePinInterrupt() is defined in GfPic.cpp
 }
@@ -1,11 +1,13 @@
 #include <arch/Hat.h>
 #include <memory/Pmm.h>
+#include <memory/TlbShootdown.h>
 #include <debug/Log.h>
 #include <Memory.h>
 #include <Maths.h>
 
 #define SFENCE_VMA_VADDR(vaddr) do { asm volatile("sfence.vma %0, zero" :: "r"(vaddr) : "memory"); } while (false)
-#define SFENCE_VMA_ALL() do { asm volatile("sfence.vma zero, %0" :: "r"(0) : "memory"); } while (false)
+#define SFENCE_VMA_ALL() do { asm volatile("sfence.vma zero, zero" ::: "memory"); } while (false)
+#define SFENCE_VMA_ASID(asid) do { asm volatile("sfence.vma zero, %0" :: "r"(asid) : "memory"); } while (false)
 
 namespace Npk
 {
@@ -24,10 +26,29 @@ namespace Npk
         uint64_t entries[PageTableEntries];
     };
 
+    constexpr size_t WalkCacheSize = 16;
+    constexpr size_t WalkCacheShift = 21; //each last-level page table covers 2MiB.
+
+    //Remembers the last-level page tables found by recent walks. Page tables are never freed
+    //while their map is alive and a populated non-leaf entry never changes, so cached tables
+    //never become invalid. Updates are best effort and lookups are lock-free, with `sequence`
+    //used to detect a concurrent update (odd while one is in progress).
+    struct WalkCache
+    {
+        sl::Atomic<uint32_t> sequence;
+        struct
+        {
+            sl::Atomic<uintptr_t> key;
+            sl::Atomic<PageTable*> table;
+        } entries[WalkCacheSize];
+    };
+
     struct HatMap
     {
         PageTable* root;
+        WalkCache walkCache;
         sl::Atomic<uint32_t> generation;
+        Memory::TlbContext tlb;
     };
 
     constexpr inline size_t GetPageSize(PageSizes size)
@@ -35,10 +56,16 @@ namespace Npk
 
     constexpr uint64_t ValidFlag = 1 << 0;
     constexpr uint64_t ReadFlag = 1 << 1;
+    constexpr uint64_t AccessedFlag = 1 << 6;
+    constexpr uint64_t DirtyFlag = 1 << 7;
 
     size_t pagingLevels;
     uintptr_t addrMask;
     uintptr_t satpBits; //holds config bits for when we write to satp
+    size_t maxAsid; //0 if ASIDs aren't supported
+
+    constexpr size_t SatpAsidShift = 44;
+    constexpr uint64_t SatpAsidMask = 0xFFFF;
 
     HatMap kernelMap;
 
@@ -62,6 +89,43 @@ namespace Npk
         bool complete;
     };
 
+    constexpr size_t FlushRangeMaxPages = 32; //beyond this, flush the whole TLB instead of individual pages.
+
+    static inline size_t GetLevelIndex(uintptr_t vaddr, size_t level)
+    { return (vaddr >> (12 + 9 * (level - 1))) & 0x1FF; }
+
+    //returns the start of the area covered by the next PTE at this level, clamped to `top`.
+    static inline uintptr_t NextEntryAddr(uintptr_t vaddr, size_t level, uintptr_t top)
+    {
+        const uintptr_t next = sl::AlignDown(vaddr, GetPageSize((PageSizes)level)) + GetPageSize((PageSizes)level);
+        return (next <= vaddr || next > top) ? top : next;
+    }
+
+    static inline uint64_t BuildEntry(uintptr_t paddr, HatFlags flags)
+    { return ((paddr >> 2) & addrMask) | ValidFlag | ReadFlag | ((uint64_t)flags & 0x3FF); }
+
+    static inline bool IsLeafEntry(uint64_t entry)
+    { return (entry & 0b1110) != 0; }
+
+    static void FlushRange(uintptr_t base, size_t length)
+    {
+        if (length / PageSize > FlushRangeMaxPages)
+        {
+            SFENCE_VMA_ALL();
+            return;
+        }
+
+        for (size_t i = 0; i < length; i += PageSize)
+            SFENCE_VMA_VADDR(base + i);
+    }
+
+    //flushes locally, then on any other harts that may have cached translations from this map.
+    static void FlushEverywhere(HatMap* map, uintptr_t base, size_t length)
+    {
+        FlushRange(base, length);
+        Memory::TlbShootdown(map, map->tlb, base, length);
+    }
+
     static inline void GetAddressIndices(uintptr_t vaddr, size_t* indices)
     {
         if (pagingLevels > 4)
@@ -73,16 +137,56 @@ namespace Npk
         indices[1] = (vaddr >> 12) & 0x1FF;
     }
 
-    static inline WalkResult WalkTables(PageTable* root, uintptr_t vaddr)
+    static inline PageTable* WalkCacheLookup(WalkCache& cache, uintptr_t vaddr)
+    {
+        const uintptr_t key = (vaddr >> WalkCacheShift) + 1; //0 is reserved for empty slots.
+        auto& entry = cache.entries[(vaddr >> WalkCacheShift) % WalkCacheSize];
+
+        const uint32_t sequence = cache.sequence.Load(sl::Acquire);
+        if (sequence & 1)
+            return nullptr;
+        const uintptr_t foundKey = entry.key.Load(sl::Relaxed);
+        PageTable* table = entry.table.Load(sl::Relaxed);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        if (foundKey != key || cache.sequence.Load(sl::Relaxed) != sequence)
+            return nullptr;
+        return table;
+    }
+
+    static inline void WalkCacheInsert(WalkCache& cache, uintptr_t vaddr, PageTable* table)
+    {
+        uint32_t sequence = cache.sequence.Load(sl::Relaxed);
+        if ((sequence & 1) || !cache.sequence.CompareExchange(sequence, sequence + 1, sl::Acquire))
+            return; //someone else is updating the cache, dont wait for them.
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        auto& entry = cache.entries[(vaddr >> WalkCacheShift) % WalkCacheSize];
+        entry.key.Store((vaddr >> WalkCacheShift) + 1, sl::Relaxed);
+        entry.table.Store(table, sl::Relaxed);
+        cache.sequence.Store(sequence + 2, sl::Release);
+    }
+
+    static inline WalkResult WalkTables(HatMap* map, uintptr_t vaddr)
     {
-        //TODO: use fractal paging to accelerate same-space lookups
+        WalkResult result {};
+        if (PageTable* leafTable = WalkCacheLookup(map->walkCache, vaddr); leafTable != nullptr)
+        {
+            result.pte = &leafTable->entries[GetLevelIndex(vaddr, 1)];
+            result.level = 1;
+            result.complete = *result.pte & ValidFlag;
+            return result;
+        }
+
         size_t indices[pagingLevels + 1];
         GetAddressIndices(vaddr, indices);
 
-        WalkResult result {};
-        PageTable* pt = AddHhdm(root);
+        PageTable* pt = AddHhdm(map->root);
         for (size_t i = pagingLevels; i > 0; i--)
         {
+            if (i == 1)
+                WalkCacheInsert(map->walkCache, vaddr, pt);
+
             result.pte = &pt->entries[indices[i]];
             result.level = i;
             if ((*result.pte & ValidFlag) == 0)
@@ -103,12 +207,49 @@ namespace Npk
         return result;
     }
     
+    //Populates a non-leaf PTE with a new page table, unless another core beat us to it.
+    //Neighbouring VmRanges can share intermediate page tables, so this is done with a CAS
+    //instead of a lock. Returns nullptr if the PTE is a leaf or we're out of memory.
+    static PageTable* InstallPageTable(HatMap* map, uint64_t* pte, size_t level)
+    {
+        uint64_t entry = __atomic_load_n(pte, __ATOMIC_ACQUIRE);
+        if ((entry & ValidFlag) == 0)
+        {
+            const uint64_t newPt = PMM::Global().Alloc();
+            if (newPt == 0)
+                return nullptr;
+            sl::memset(reinterpret_cast<void*>(AddHhdm(newPt)), 0, PageSize);
+            const uint64_t desired = ((newPt >> 2) & addrMask) | ValidFlag;
+
+            if (__atomic_compare_exchange_n(pte, &entry, desired, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            {
+                entry = desired;
+                //other address spaces copy the kernel's root entries, let them know there's a new one.
+                if (map == &kernelMap && level == pagingLevels)
+                    kernelMap.generation++;
+            }
+            else
+                PMM::Global().Free(newPt, 1);
+        }
+
+        if ((entry & 0b1110) != 0)
+            return nullptr;
+        return reinterpret_cast<PageTable*>(((entry & addrMask) << 2) + hhdmBase);
+    }
+    
     void HatInit()
     {
         //Note that we're only querying the paging mode here, we dont modify it.
         //All that should have been done by the bootloader (or much earlier in the kernel).
         satpBits = ReadCsr("satp") & (0xFul << 60);
         pagingLevels = (satpBits >> 60) - 5;
+
+        //the number of ASID bits is discovered by writing all 1s to the field and reading it back.
+        const uint64_t prevSatp = ReadCsr("satp");
+        WriteCsr("satp", prevSatp | (SatpAsidMask << SatpAsidShift));
+        maxAsid = (ReadCsr("satp") >> SatpAsidShift) & SatpAsidMask;
+        WriteCsr("satp", prevSatp);
+        SFENCE_VMA_ALL();
         const size_t maxTranslationLevel = sl::Min(pagingLevels, 4ul);
         limits.modeCount = pagingLevels - 1;
         
@@ -139,8 +280,8 @@ namespace Npk
 
         constexpr const char* SizeStrs[] = { "", "4KiB", "2MiB", "1GiB", "512GiB" };
         Log("HHDM mapped with %s pages", LogLevel::Verbose, SizeStrs[hhdmPageSize]);
-        Log("Hat init (paging): levels=%lu, maxMapSize=%s", LogLevel::Info,
-            pagingLevels, SizeStrs[maxTranslationLevel]);
+        Log("Hat init (paging): levels=%lu, maxMapSize=%s, maxAsid=%zu", LogLevel::Info,
+            pagingLevels, SizeStrs[maxTranslationLevel], maxAsid);
     }
 
     const HatLimits& HatGetLimits()
@@ -159,9 +300,17 @@ namespace Npk
     HatMap* HatCreateMap()
     {
         HatMap* map = new HatMap;
+        if (map == nullptr)
+            return nullptr;
         map->root = reinterpret_cast<PageTable*>(PMM::Global().Alloc());
+        if (map->root == nullptr)
+        {
+            delete map;
+            return nullptr;
+        }
         sl::memset(AddHhdm(map->root), 0, PageSize / 2);
 
+        Memory::InitTlbContext(map->tlb);
         SyncWithMasterMap(map);
         return map;
     }
@@ -204,31 +353,27 @@ namespace Npk
         const PageSizes selectedSize = (PageSizes)(mode + 1);
         size_t indices[pagingLevels + 1];
         GetAddressIndices(vaddr, indices);
-        WalkResult path = WalkTables(map->root, vaddr);
+        WalkResult path = WalkTables(map, vaddr);
 
         if (path.complete)
             return false;
+        if (path.level < (size_t)selectedSize)
+            return false;
 
         while (path.level != (size_t)selectedSize)
         {
-            const uint64_t newPt = PMM::Global().Alloc();
-            sl::memset(reinterpret_cast<void*>(AddHhdm(newPt)), 0, PageSize);
-            *path.pte = (newPt >> 2) & addrMask;
-            *path.pte |= ValidFlag;
+            auto pt = InstallPageTable(map, path.pte, path.level);
+            if (pt == nullptr)
+                return false;
 
             path.level--;
-            auto pt = reinterpret_cast<PageTable*>(newPt + hhdmBase);
             path.pte = &pt->entries[indices[path.level]];
         }
 
-        *path.pte = (paddr >> 2) & addrMask;
-        *path.pte |= ValidFlag | ReadFlag;
-        *path.pte |= (uint64_t)flags & 0x3FF;
+        __atomic_store_n(path.pte, BuildEntry(paddr, flags), __ATOMIC_RELEASE);
 
         if (flush)
             SFENCE_VMA_VADDR(vaddr);
-        if (map == &kernelMap)
-            kernelMap.generation++;
         return true;
     }
 
@@ -236,7 +381,7 @@ namespace Npk
     {
         ASSERT_(map != nullptr);
 
-        const WalkResult path = WalkTables(map->root, vaddr);
+        const WalkResult path = WalkTables(map, vaddr);
         if (!path.complete)
             return false;
 
@@ -245,8 +390,8 @@ namespace Npk
         *path.pte = 0;
 
         if (flush)
-            SFENCE_VMA_VADDR(vaddr);
-        if (map == &kernelMap)
+            FlushEverywhere(map, vaddr, PageSize);
+        if (map == &kernelMap && path.level == pagingLevels)
             kernelMap.generation++;
         return true;
     }
@@ -255,7 +400,7 @@ namespace Npk
     {
         ASSERT_(map != nullptr);
 
-        const WalkResult path = WalkTables(map->root, vaddr);
+        const WalkResult path = WalkTables(map, vaddr);
         if (!path.complete)
             return {};
 
@@ -268,7 +413,7 @@ namespace Npk
     {
         ASSERT_(map != nullptr);
 
-        const WalkResult path = WalkTables(map->root, vaddr);
+        const WalkResult path = WalkTables(map, vaddr);
         if (!path.complete)
             return false;
 
@@ -278,21 +423,267 @@ namespace Npk
             *path.pte = (*path.pte & addrMask) | ((uint64_t)*flags & 0x3FF) | ReadFlag | ValidFlag;
 
         if (flush)
-            SFENCE_VMA_VADDR(vaddr);
-        if (map == &kernelMap)
-            kernelMap.generation++;
+            FlushEverywhere(map, vaddr, PageSize);
         return true;
     }
 
+    bool HatClearAccessed(HatMap* map, uintptr_t vaddr, bool flush)
+    {
+        ASSERT_(map != nullptr);
+
+        const WalkResult path = WalkTables(map, vaddr);
+        if (!path.complete)
+            return false;
+
+        //the MMU can update the entry behind our back, so the flag is cleared atomically.
+        const bool accessed = (__atomic_fetch_and(path.pte, ~AccessedFlag, __ATOMIC_RELAXED) & AccessedFlag) != 0;
+        if (flush && accessed)
+            FlushEverywhere(map, vaddr, PageSize);
+        return accessed;
+    }
+
+    //Finds the next leaf PTE at or above `vaddr`, skipping over unmapped areas. Returns the page table
+    //containing it (and its level), or nullptr if there are no more translations below `top`.
+    static PageTable* FindNextLeaf(PageTable* root, uintptr_t& vaddr, uintptr_t top, size_t& level)
+    {
+        while (vaddr < top)
+        {
+            PageTable* pt = AddHhdm(root);
+            for (level = pagingLevels; level > 0; level--)
+            {
+                const uint64_t entry = pt->entries[GetLevelIndex(vaddr, level)];
+                if ((entry & ValidFlag) == 0)
+                {
+                    vaddr = NextEntryAddr(vaddr, level, top);
+                    break;
+                }
+                if (IsLeafEntry(entry))
+                    return pt;
+
+                pt = reinterpret_cast<PageTable*>(((entry & addrMask) << 2) + hhdmBase);
+            }
+        }
+
+        return nullptr;
+    }
+
+    bool HatMapRange(HatMap* map, uintptr_t vaddr, size_t length, size_t mode, HatFlags flags, 
+        HatPhysFunc getPhys, void* arg, bool flush)
+    {
+        ASSERT_(map != nullptr);
+        ASSERT_(getPhys != nullptr);
+        if (mode >= limits.modeCount)
+            return false;
+
+        const size_t selectedLevel = mode + 1;
+        const size_t granuleSize = GetPageSize((PageSizes)selectedLevel);
+        const uintptr_t top = vaddr + length;
+        bool success = true;
+
+        for (uintptr_t scan = vaddr; scan < top && success;)
+        {
+            PageTable* pt = AddHhdm(map->root);
+            for (size_t level = pagingLevels; level > selectedLevel && pt != nullptr; level--)
+                pt = InstallPageTable(map, &pt->entries[GetLevelIndex(scan, level)], level);
+            if (pt == nullptr)
+            {
+                success = false;
+                break;
+            }
+
+            for (size_t i = GetLevelIndex(scan, selectedLevel); i < PageTableEntries && scan < top; i++)
+            {
+                if ((pt->entries[i] & ValidFlag) != 0)
+                {
+                    success = false;
+                    break;
+                }
+
+                const auto paddr = getPhys(arg, scan - vaddr);
+                if (!paddr.HasValue())
+                {
+                    success = false;
+                    break;
+                }
+                __atomic_store_n(&pt->entries[i], BuildEntry(*paddr, flags), __ATOMIC_RELEASE);
+                scan += granuleSize;
+            }
+        }
+
+        if (flush)
+            FlushRange(vaddr, length);
+        return success;
+    }
+
+    size_t HatUnmapRange(HatMap* map, uintptr_t vaddr, size_t length, HatUnmapBatch& batch, bool flush)
+    {
+        ASSERT_(map != nullptr);
+
+        const uintptr_t top = vaddr + length;
+        uintptr_t scan = vaddr;
+        size_t level;
+        batch.count = 0;
+
+        while (batch.count < HatUnmapBatch::Capacity)
+        {
+            PageTable* pt = FindNextLeaf(map->root, scan, top, level);
+            if (pt == nullptr)
+                break;
+
+            for (size_t i = GetLevelIndex(scan, level); i < PageTableEntries && scan < top; i++)
+            {
+                const uint64_t entry = pt->entries[i];
+                if ((entry & ValidFlag) != 0)
+                {
+                    if (!IsLeafEntry(entry) || batch.count == HatUnmapBatch::Capacity)
+                        break;
+
+                    batch.entries[batch.count].paddr = (entry & addrMask) << 2;
+                    batch.entries[batch.count].mode = level - 1;
+                    batch.count++;
+                    pt->entries[i] = 0;
+                }
+                scan = NextEntryAddr(scan, level, top);
+            }
+        }
+
+        if (flush && scan != vaddr)
+            FlushEverywhere(map, vaddr, scan - vaddr);
+        return scan - vaddr;
+    }
+
+    void HatProtectRange(HatMap* map, uintptr_t vaddr, size_t length, HatFlags flags, 
+        HatProtectFunc filter, void* arg, bool flush)
+    {
+        ASSERT_(map != nullptr);
+
+        const uintptr_t top = vaddr + length;
+        uintptr_t scan = vaddr;
+        size_t level;
+
+        while (true)
+        {
+            PageTable* pt = FindNextLeaf(map->root, scan, top, level);
+            if (pt == nullptr)
+                break;
+
+            for (size_t i = GetLevelIndex(scan, level); i < PageTableEntries && scan < top; i++)
+            {
+                const uint64_t entry = pt->entries[i];
+                if ((entry & ValidFlag) != 0)
+                {
+                    if (!IsLeafEntry(entry))
+                        break;
+
+                    const uintptr_t paddr = (entry & addrMask) << 2;
+                    const HatFlags newFlags = filter == nullptr ? flags : filter(arg, paddr, level - 1, flags);
+                    __atomic_store_n(&pt->entries[i], BuildEntry(paddr, newFlags), __ATOMIC_RELEASE);
+                }
+                scan = NextEntryAddr(scan, level, top);
+            }
+        }
+
+        if (flush)
+            FlushEverywhere(map, vaddr, length);
+    }
+
+    size_t HatTestClearRange(HatMap* map, uintptr_t vaddr, size_t length, bool clearDirty,
+        HatAccessFunc callback, void* arg, bool flush)
+    {
+        ASSERT_(map != nullptr);
+
+        const uint64_t clearMask = AccessedFlag | (clearDirty ? DirtyFlag : 0);
+        const uintptr_t top = vaddr + length;
+        uintptr_t scan = vaddr;
+        size_t level;
+        size_t accessedCount = 0;
+        bool changed = false;
+
+        while (true)
+        {
+            PageTable* pt = FindNextLeaf(map->root, scan, top, level);
+            if (pt == nullptr)
+                break;
+
+            for (size_t i = GetLevelIndex(scan, level); i < PageTableEntries && scan < top; i++)
+            {
+                const uint64_t entry = pt->entries[i];
+                if ((entry & ValidFlag) != 0)
+                {
+                    if (!IsLeafEntry(entry))
+                        break;
+
+                    //the MMU can update the entry behind our back, so the flags are cleared atomically.
+                    const uint64_t prev = (entry & clearMask) == 0 ? entry 
+                        : __atomic_fetch_and(&pt->entries[i], ~clearMask, __ATOMIC_RELAXED);
+                    const bool accessed = (prev & AccessedFlag) != 0;
+                    changed = changed || (prev & clearMask) != 0;
+                    if (accessed)
+                        accessedCount++;
+                    if (callback != nullptr)
+                        callback(arg, sl::AlignDown(scan, GetPageSize((PageSizes)level)), (prev & addrMask) << 2, 
+                            level - 1, accessed, (prev & DirtyFlag) != 0);
+                }
+                scan = NextEntryAddr(scan, level, top);
+            }
+        }
+
+        if (flush && changed)
+            FlushEverywhere(map, vaddr, length);
+        return accessedCount;
+    }
+
     void HatMakeActive(HatMap* map, bool supervisor)
     {
         (void)supervisor;
         ASSERT_(map != nullptr);
 
-        if (map != &kernelMap)
+        //the kernel's root entries only need to be copied if they've changed since we last did.
+        if (map != &kernelMap && map->generation.Load() != kernelMap.generation.Load())
             SyncWithMasterMap(map);
         
-        WriteCsr("satp", satpBits | ((uintptr_t)map->root >> 12));
-        SFENCE_VMA_ALL();
+        //the kernel map always uses ASID 0 and is flushed whenever it's loaded, other maps
+        //only need their ASID flushed if they've changed since this hart last loaded them.
+        const Memory::TlbLoadResult tlb = Memory::TlbMapLoaded(map, map->tlb, maxAsid);
+        WriteCsr("satp", satpBits | ((uint64_t)tlb.tag << SatpAsidShift) | ((uintptr_t)map->root >> 12));
+        if (tlb.tag == 0)
+            SFENCE_VMA_ALL();
+        else if (tlb.flush)
+            SFENCE_VMA_ASID(tlb.tag);
+    }
+
+    bool HatSyncKernelEntries()
+    {
+        const uintptr_t activeRoot = (ReadCsr("satp") & ((1ul << 44) - 1)) << 12;
+        if (activeRoot == reinterpret_cast<uintptr_t>(kernelMap.root))
+            return false;
+
+        //we dont know which HatMap this is, so its generation is left alone: the next
+        //HatMakeActive() will copy the entries again, which is harmless.
+        const PageTable* source = AddHhdm(kernelMap.root);
+        PageTable* dest = reinterpret_cast<PageTable*>(AddHhdm(activeRoot));
+        bool copied = false;
+        for (size_t i = PageTableEntries / 2; i < PageTableEntries; i++)
+        {
+            const uint64_t entry = __atomic_load_n(&source->entries[i], __ATOMIC_ACQUIRE);
+            if ((entry & ValidFlag) == 0 || dest->entries[i] == entry)
+                continue;
+
+            __atomic_store_n(&dest->entries[i], entry, __ATOMIC_RELEASE);
+            copied = true;
+        }
+
+        //the hart may have cached the invalid entry, unlike x86.
+        if (copied)
+            SFENCE_VMA_ALL();
+        return copied;
+    }
+
+    void HatFlushLocal(uintptr_t vaddr, size_t length)
+    {
+        if (length == 0)
+            SFENCE_VMA_ALL();
+        else
+            FlushRange(vaddr, length);
     }
 }
@@ -1,6 +1,7 @@
 #include <arch/riscv64/Interrupts.h>
 #include <arch/riscv64/Sbi.h>
 #include <arch/riscv64/Aia.h>
+#include <arch/Hat.h>
 #include <debug/Log.h>
 #include <debug/Panic.h>
 #include <interrupts/Ipi.h>
@@ -91,7 +92,7 @@ extern "C"
             if (frame->ec < hhdmBase && VMM::CurrentActive())
                 handled = VMM::Current().HandleFault(frame->ec, faultFlags);
             else if (frame->ec > hhdmBase)
-                handled = VMM::Kernel().HandleFault(frame->ec, faultFlags);
+                handled = HatSyncKernelEntries() || VMM::Kernel().HandleFault(frame->ec, faultFlags);
 
             if (!handled && !ProgramManager::Global().ServeException(exception))
                 Debug::PanicWithException(exception, frame->fp);
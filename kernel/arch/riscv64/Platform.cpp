@@ -1,6 +1,7 @@
 #include <arch/Platform.h>
 #include <arch/riscv64/Sbi.h>
 #include <Maths.h>
+#include <Memory.h>
 #include <stdint.h>
 
 namespace Npk
@@ -17,6 +18,11 @@ namespace Npk
             cfg->isaString);
     }
 
+    size_t ArchCoreHardwareId()
+    {
+        return CoreLocal().id; //core ids are hart ids on riscv
+    }
+
     void ExplodeKernelAndReset()
     {
         WriteCsr("stvec", 0);
@@ -62,6 +68,11 @@ namespace Npk
     void ExtendedRegsFence()
     {}
 
+    void ClearPage(void* page)
+    {
+        sl::memset(page, 0, PageSize); //TODO: use cbo.zero when Zicboz is available
+    }
+
     uintptr_t GetReturnAddr(size_t level, uintptr_t start)
     {
         struct Frame
@@ -98,6 +109,11 @@ namespace Npk
         //TODO: make use of this on riscv
     }
 
+    void SetKernelStack(uintptr_t top)
+    {
+        CoreLocal().nextStack = reinterpret_cast<void*>(top);
+    }
+
     bool RoutePinInterrupt(size_t core, size_t vector, size_t gsi)
     {
         return false;
@@ -37,6 +37,7 @@ namespace Npk
         { .leaf {1, 0}, .index = 'd', .shift = 4, .name = "tsc" },
         { .leaf {1, 0}, .index = 'c', .shift = 24, .name = "tsc-d" },
         { .leaf {0x8000'0007, 0}, .index = 'd', .shift = 8, .name = "inv-tsc" },
+        { .leaf {1, 0}, .index = 'c', .shift = 17, .name = "pcid" },
     };
 
     struct CpuidLeaf
@@ -1,6 +1,7 @@
 #include <arch/Hat.h>
 #include <arch/x86_64/Cpuid.h>
 #include <memory/Pmm.h>
+#include <memory/TlbShootdown.h>
 #include <debug/Log.h>
 #include <Memory.h>
 #include <Maths.h>
@@ -24,10 +25,29 @@ namespace Npk
         uint64_t entries[PageTableEntries];
     };
 
+    constexpr size_t WalkCacheSize = 16;
+    constexpr size_t WalkCacheShift = 21; //each last-level page table covers 2MiB.
+
+    //Remembers the last-level page tables found by recent walks. Page tables are never freed
+    //while their map is alive and a populated non-leaf entry never changes, so cached tables
+    //never become invalid. Updates are best effort and lookups are lock-free, with `sequence`
+    //used to detect a concurrent update (odd while one is in progress).
+    struct WalkCache
+    {
+        sl::Atomic<uint32_t> sequence;
+        struct
+        {
+            sl::Atomic<uintptr_t> key;
+            sl::Atomic<PageTable*> table;
+        } entries[WalkCacheSize];
+    };
+
     struct HatMap
     {
         PageTable* root;
+        WalkCache walkCache;
         sl::Atomic<uint32_t> generation;
+        Memory::TlbContext tlb;
     };
 
     constexpr inline size_t GetPageSize(PageSizes size)
@@ -35,6 +55,8 @@ namespace Npk
 
     constexpr uint64_t PresentFlag = 1 << 0;
     constexpr uint64_t SizeFlag = 1 << 7;
+    constexpr uint64_t AccessedFlag = 1 << 5;
+    constexpr uint64_t DirtyFlag = 1 << 6;
     constexpr uint64_t NxFlag = 1ul << 63;
 
     size_t pagingLevels;
@@ -45,6 +67,7 @@ namespace Npk
     {
         bool nx;
         bool globalPages;
+        bool pcid;
     } mmuFeatures;
 
     HatLimits limits 
@@ -66,6 +89,19 @@ namespace Npk
         bool complete;
     };
 
+    constexpr size_t FlushRangeMaxPages = 32; //beyond this, flush the whole TLB instead of individual pages.
+    constexpr uint64_t Cr3NoFlush = 1ul << 63; //when loading a tagged cr3: keep translations cached under this pcid.
+
+    static inline size_t GetLevelIndex(uintptr_t vaddr, size_t level)
+    { return (vaddr >> (12 + 9 * (level - 1))) & 0x1FF; }
+
+    //returns the start of the area covered by the next PTE at this level, clamped to `top`.
+    static inline uintptr_t NextEntryAddr(uintptr_t vaddr, size_t level, uintptr_t top)
+    {
+        const uintptr_t next = sl::AlignDown(vaddr, GetPageSize((PageSizes)level)) + GetPageSize((PageSizes)level);
+        return (next <= vaddr || next > top) ? top : next; //handle wrapping at the top of the address space.
+    }
+
     static inline void GetAddressIndices(uintptr_t vaddr, size_t* indices)
     {
         if (pagingLevels > 4)
@@ -76,18 +112,58 @@ namespace Npk
         indices[1] = (vaddr >> 12) & 0x1FF;
     }
 
+    static inline PageTable* WalkCacheLookup(WalkCache& cache, uintptr_t vaddr)
+    {
+        const uintptr_t key = (vaddr >> WalkCacheShift) + 1; //0 is reserved for empty slots.
+        auto& entry = cache.entries[(vaddr >> WalkCacheShift) % WalkCacheSize];
+
+        const uint32_t sequence = cache.sequence.Load(sl::Acquire);
+        if (sequence & 1)
+            return nullptr;
+        const uintptr_t foundKey = entry.key.Load(sl::Relaxed);
+        PageTable* table = entry.table.Load(sl::Relaxed);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        if (foundKey != key || cache.sequence.Load(sl::Relaxed) != sequence)
+            return nullptr;
+        return table;
+    }
+
+    static inline void WalkCacheInsert(WalkCache& cache, uintptr_t vaddr, PageTable* table)
+    {
+        uint32_t sequence = cache.sequence.Load(sl::Relaxed);
+        if ((sequence & 1) || !cache.sequence.CompareExchange(sequence, sequence + 1, sl::Acquire))
+            return; //someone else is updating the cache, dont wait for them.
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        auto& entry = cache.entries[(vaddr >> WalkCacheShift) % WalkCacheSize];
+        entry.key.Store((vaddr >> WalkCacheShift) + 1, sl::Relaxed);
+        entry.table.Store(table, sl::Relaxed);
+        cache.sequence.Store(sequence + 2, sl::Release);
+    }
+
     //Internal helper function, walks the page tables as long as they are valid,
     //returns the PTE where translation ended and at what level.
-    static inline WalkResult WalkTables(PageTable* root, uintptr_t vaddr)
+    static inline WalkResult WalkTables(HatMap* map, uintptr_t vaddr)
     {
-        //TODO: use fractal paging to accelerate walks in the same address space
+        WalkResult result {};
+        if (PageTable* leafTable = WalkCacheLookup(map->walkCache, vaddr); leafTable != nullptr)
+        {
+            result.pte = &leafTable->entries[GetLevelIndex(vaddr, 1)];
+            result.level = 1;
+            result.complete = *result.pte & PresentFlag;
+            return result;
+        }
+
         size_t indices[MaxPtIndices];
         GetAddressIndices(vaddr, indices);
 
-        WalkResult result {};
-        PageTable* pt = AddHhdm(root);
+        PageTable* pt = AddHhdm(map->root);
         for (size_t i = pagingLevels; i > 0; i--)
         {
+            if (i == 1)
+                WalkCacheInsert(map->walkCache, vaddr, pt);
+
             result.pte = &pt->entries[indices[i]];
             result.level = i;
             if ((*result.pte & PresentFlag) == 0)
@@ -108,6 +184,92 @@ namespace Npk
         return result;
     }
 
+    //Builds a leaf PTE. Note that the execute flag is backwards on x86: we set it to mark a page
+    //as 'no execute', rather than setting the flag to enable instruction fetches from it.
+    //Kernel translations are always global: they're identical in every address space, and
+    //invlpg only reaches non-global translations cached under the current pcid.
+    static inline uint64_t BuildEntry(HatMap* map, uintptr_t paddr, HatFlags flags, size_t level)
+    {
+        if (map == &kernelMap)
+            flags |= HatFlags::Global;
+
+        uint64_t entry = ((uint64_t)flags & 0xFFF) | PresentFlag;
+        entry |= paddr & addrMask;
+
+        if (level > (size_t)PageSizes::_4K)
+            entry |= SizeFlag;
+        if (mmuFeatures.nx && (NxFlag & (uint64_t)flags) == 0)
+            entry |= NxFlag;
+        if (!mmuFeatures.globalPages)
+            entry &= ~(uint64_t)HatFlags::Global;
+        return entry;
+    }
+
+    static inline bool IsLeafEntry(uint64_t entry, size_t level)
+    { return level == 1 || (level <= limits.modeCount && (entry & SizeFlag) != 0); }
+
+    static void FlushAll()
+    {
+        //reloading cr3 doesnt flush global pages, toggling cr4.pge flushes everything.
+        if (mmuFeatures.globalPages)
+        {
+            const uint64_t cr4 = ReadCr4();
+            WriteCr4(cr4 & ~(1ul << 7));
+            WriteCr4(cr4);
+        }
+        else
+            WriteCr3(ReadCr3());
+    }
+
+    static void FlushRange(uintptr_t base, size_t length)
+    {
+        if (length / PageSize > FlushRangeMaxPages)
+            return FlushAll();
+
+        for (size_t i = 0; i < length; i += PageSize)
+            INVLPG(base + i);
+    }
+
+    //flushes locally, then on any other cores that may have cached translations from this map.
+    //Note that invlpg on any address within a large page flushes the whole page.
+    static void FlushEverywhere(HatMap* map, uintptr_t base, size_t length)
+    {
+        FlushRange(base, length);
+        Memory::TlbShootdown(map, map->tlb, base, length);
+    }
+
+    //Populates a non-leaf PTE with a new page table, if another core hasn't already done so.
+    //Mappings in the same range are serialized by the VMM, but neighbouring ranges can share
+    //intermediate page tables, so we race to install them rather than taking a lock.
+    //Returns the page table now referenced by the PTE, or nullptr if it's a large page or we're
+    //out of memory.
+    static PageTable* InstallPageTable(HatMap* map, uint64_t* pte, size_t level)
+    {
+        uint64_t entry = __atomic_load_n(pte, __ATOMIC_ACQUIRE);
+        if ((entry & PresentFlag) == 0)
+        {
+            const uint64_t newPt = PMM::Global().Alloc();
+            if (newPt == 0)
+                return nullptr;
+            sl::memset(reinterpret_cast<void*>(AddHhdm(newPt)), 0, PageSize);
+            const uint64_t desired = (addrMask & newPt) | PresentFlag | (uint64_t)HatFlags::Write;
+
+            if (__atomic_compare_exchange_n(pte, &entry, desired, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            {
+                entry = desired;
+                //other address spaces copy the kernel's root entries, let them know there's a new one.
+                if (map == &kernelMap && level == pagingLevels)
+                    kernelMap.generation++;
+            }
+            else
+                PMM::Global().Free(newPt, 1); //lost the race, entry now holds the winner's PTE.
+        }
+
+        if ((entry & SizeFlag) != 0)
+            return nullptr;
+        return reinterpret_cast<PageTable*>((entry & addrMask) + hhdmBase);
+    }
+
     void HatInit()
     {
         //Note that we only read the paging mode, the system should have set the appropriate
@@ -120,6 +282,8 @@ namespace Npk
             limits.modeCount = 2; //if the cpu doesn't support gigabyte pages, don't advertise it.
         mmuFeatures.nx = CpuHasFeature(CpuFeature::NoExecute);
         mmuFeatures.globalPages = CpuHasFeature(CpuFeature::GlobalPages);
+        //pcids rely on kernel translations being global, see BuildEntry().
+        mmuFeatures.pcid = mmuFeatures.globalPages && CpuHasFeature(CpuFeature::Pcid);
 
         //determine the mask needed to separate the physical address from the flags
         addrMask = 1ul << (9 * pagingLevels + 12);
@@ -151,20 +315,40 @@ namespace Npk
         constexpr const char* SizeStrs[] = { "", "4KiB", "2MiB", "1GiB" };
         Log("HHDM mapped with %s pages, length adjusted to 0x%lx", LogLevel::Verbose, 
             SizeStrs[hhdmPageSize], hhdmLength);
-        Log("Hat init (paging): levels=%lu, maxMapSize=%s, nx=%s, globalPages=%s", LogLevel::Info,
-            pagingLevels, SizeStrs[maxTranslationLevel],
-            mmuFeatures.nx ? "yes" : "no", mmuFeatures.globalPages ? "yes" : "no");
+        Log("Hat init (paging): levels=%lu, maxMapSize=%s, nx=%s, globalPages=%s, pcid=%s", LogLevel::Info,
+            pagingLevels, SizeStrs[maxTranslationLevel], mmuFeatures.nx ? "yes" : "no", 
+            mmuFeatures.globalPages ? "yes" : "no", mmuFeatures.pcid ? "yes" : "no");
     }
 
     const HatLimits& HatGetLimits()
     { return limits; }
 
+    static void SyncWithMasterMap(HatMap* map)
+    {
+        map->generation = kernelMap.generation.Load();
+
+        const PageTable* source = AddHhdm(kernelMap.root);
+        PageTable* dest = AddHhdm(map->root);
+
+        for (size_t i = PageTableEntries / 2; i < PageTableEntries; i++)
+            dest->entries[i] = source->entries[i];
+    }
+
     HatMap* HatCreateMap()
     {
         HatMap* map = new HatMap;
+        if (map == nullptr)
+            return nullptr;
         map->root = reinterpret_cast<PageTable*>(PMM::Global().Alloc());
+        if (map->root == nullptr)
+        {
+            delete map;
+            return nullptr;
+        }
         sl::memset(AddHhdm(map->root), 0, PageSize / 2);
 
+        Memory::InitTlbContext(map->tlb);
+        SyncWithMasterMap(map);
         return map;
     }
 
@@ -206,43 +390,30 @@ namespace Npk
         const PageSizes selectedSize = (PageSizes)(mode + 1);
         size_t indices[MaxPtIndices];
         GetAddressIndices(vaddr, indices);
-        WalkResult path = WalkTables(map->root, vaddr);
+        WalkResult path = WalkTables(map, vaddr);
 
         if (path.complete)
             return false; //translation already exists for this vaddr
+        if (path.level < (size_t)selectedSize)
+            return false; //smaller translations already exist within this area
         
         //create any additional page tables we need to, to reach our target translation
         //size (and paging level).
         while (path.level != (size_t)selectedSize)
         {
-            const uint64_t newPt = PMM::Global().Alloc();
-            sl::memset(reinterpret_cast<void*>(AddHhdm(newPt)), 0, PageSize);
-            *path.pte = addrMask & newPt;
-            *path.pte |= PresentFlag | (uint64_t)HatFlags::Write;
+            auto pt = InstallPageTable(map, path.pte, path.level);
+            if (pt == nullptr)
+                return false;
 
             path.level--;
-            auto pt = reinterpret_cast<PageTable*>(newPt + hhdmBase);
             path.pte = &pt->entries[indices[path.level]];
         }
 
-        //start setting flags in the final PTE. Note that the execute flag is backwards on x86:
-        //we set it to mark a page as 'no execute', rather than setting the flag to enable instruction
-        //fetches from it.
-        *path.pte = ((uint64_t)flags & 0xFFF) | PresentFlag;
-        *path.pte |= paddr & addrMask;
-
-        if (selectedSize > PageSizes::_4K)
-            *path.pte |= SizeFlag;
-        if (mmuFeatures.nx && (NxFlag & (uint64_t)flags) == 0)
-            *path.pte |= NxFlag;
-        if (!mmuFeatures.globalPages)
-            *path.pte &= ~(uint64_t)(1 << 5); //global page bit
+        //single store, so the mmu never sees a partially built entry.
+        __atomic_store_n(path.pte, BuildEntry(map, paddr, flags, (size_t)selectedSize), __ATOMIC_RELEASE);
 
-        //flush the TLB if requested, and update kernel generation count if we need to
         if (flush)
             INVLPG(vaddr);
-        if (map == &kernelMap)
-            kernelMap.generation++;
         return true;
     }
 
@@ -250,7 +421,7 @@ namespace Npk
     {
         ASSERT_(map != nullptr);
 
-        const WalkResult path = WalkTables(map->root, vaddr);
+        const WalkResult path = WalkTables(map, vaddr);
         if (!path.complete)
             return false;
 
@@ -261,7 +432,7 @@ namespace Npk
 
         //flush TLB if requested, and update kernel generation count if required
         if (flush)
-            INVLPG(vaddr);
+            FlushEverywhere(map, vaddr, PageSize);
         if (map == &kernelMap && path.level == pagingLevels)
             kernelMap.generation++;
 
@@ -272,7 +443,7 @@ namespace Npk
     {
         ASSERT_(map != nullptr);
 
-        const WalkResult path = WalkTables(map->root, vaddr);
+        const WalkResult path = WalkTables(map, vaddr);
         if (!path.complete)
             return {};
 
@@ -285,40 +456,226 @@ namespace Npk
     {
         ASSERT_(map != nullptr);
 
-        const WalkResult path = WalkTables(map->root, vaddr);
+        const WalkResult path = WalkTables(map, vaddr);
         if (!path.complete)
             return false;
 
         if (paddr.HasValue())
             *path.pte = (*path.pte & ~addrMask) | (*paddr & addrMask);
         if (flags.HasValue())
+            *path.pte = BuildEntry(map, *path.pte & addrMask, *flags, path.level);
+
+        if (flush)
+            FlushEverywhere(map, vaddr, PageSize);
+        return true;
+    }
+
+    bool HatClearAccessed(HatMap* map, uintptr_t vaddr, bool flush)
+    {
+        ASSERT_(map != nullptr);
+
+        const WalkResult path = WalkTables(map, vaddr);
+        if (!path.complete)
+            return false;
+
+        //the MMU can update the entry behind our back, so the flag is cleared atomically.
+        const bool accessed = (__atomic_fetch_and(path.pte, ~AccessedFlag, __ATOMIC_RELAXED) & AccessedFlag) != 0;
+        if (flush && accessed)
+            FlushEverywhere(map, vaddr, PageSize);
+        return accessed;
+    }
+
+    //Finds the next leaf PTE at or above `vaddr`, skipping over unmapped areas. Returns the page table
+    //containing it (and its level), or nullptr if there are no more translations below `top`.
+    static PageTable* FindNextLeaf(PageTable* root, uintptr_t& vaddr, uintptr_t top, size_t& level)
+    {
+        while (vaddr < top)
         {
-            uint64_t newFlags = ((uint64_t)*flags & 0xFFF) | PresentFlag;
+            PageTable* pt = AddHhdm(root);
+            for (level = pagingLevels; level > 0; level--)
+            {
+                const uint64_t entry = pt->entries[GetLevelIndex(vaddr, level)];
+                if ((entry & PresentFlag) == 0)
+                {
+                    vaddr = NextEntryAddr(vaddr, level, top);
+                    break;
+                }
+                if (IsLeafEntry(entry, level))
+                    return pt;
+
+                pt = reinterpret_cast<PageTable*>((entry & addrMask) + hhdmBase);
+            }
+        }
 
-            if (path.level > (size_t)PageSizes::_4K)
-                newFlags |= PageSize;
-            if (mmuFeatures.nx && (NxFlag & (uint64_t)*flags) == 0)
-                newFlags |= NxFlag;
-            if (!mmuFeatures.globalPages)
-                newFlags &= ~(1 << 5);
+        return nullptr;
+    }
+
+    bool HatMapRange(HatMap* map, uintptr_t vaddr, size_t length, size_t mode, HatFlags flags, 
+        HatPhysFunc getPhys, void* arg, bool flush)
+    {
+        ASSERT_(map != nullptr);
+        ASSERT_(getPhys != nullptr);
+        if (mode >= limits.modeCount)
+            return false;
+
+        const size_t selectedLevel = mode + 1;
+        const size_t granuleSize = GetPageSize((PageSizes)selectedLevel);
+        const uintptr_t top = vaddr + length;
+        bool success = true;
+
+        for (uintptr_t scan = vaddr; scan < top && success;)
+        {
+            //walk (creating page tables as needed) to the target level once per table, then fill it.
+            PageTable* pt = AddHhdm(map->root);
+            for (size_t level = pagingLevels; level > selectedLevel && pt != nullptr; level--)
+                pt = InstallPageTable(map, &pt->entries[GetLevelIndex(scan, level)], level);
+            if (pt == nullptr)
+            {
+                success = false; //a larger translation already covers this area, or no memory.
+                break;
+            }
 
-            *path.pte = (*path.pte & addrMask) | newFlags;
+            for (size_t i = GetLevelIndex(scan, selectedLevel); i < PageTableEntries && scan < top; i++)
+            {
+                if ((pt->entries[i] & PresentFlag) != 0)
+                {
+                    success = false;
+                    break;
+                }
+
+                const auto paddr = getPhys(arg, scan - vaddr);
+                if (!paddr.HasValue())
+                {
+                    success = false;
+                    break;
+                }
+                __atomic_store_n(&pt->entries[i], BuildEntry(map, *paddr, flags, selectedLevel), __ATOMIC_RELEASE);
+                scan += granuleSize;
+            }
         }
 
         if (flush)
-            INVLPG(vaddr);
-        return true;
+            FlushRange(vaddr, length);
+        return success;
     }
 
-    static void SyncWithMasterMap(HatMap* map)
+    size_t HatUnmapRange(HatMap* map, uintptr_t vaddr, size_t length, HatUnmapBatch& batch, bool flush)
     {
-        map->generation = kernelMap.generation.Load();
+        ASSERT_(map != nullptr);
 
-        const PageTable* source = AddHhdm(kernelMap.root);
-        PageTable* dest = AddHhdm(map->root);
+        const uintptr_t top = vaddr + length;
+        uintptr_t scan = vaddr;
+        size_t level;
+        batch.count = 0;
 
-        for (size_t i = PageTableEntries / 2; i < PageTableEntries; i++)
-            dest->entries[i] = source->entries[i];
+        while (batch.count < HatUnmapBatch::Capacity)
+        {
+            PageTable* pt = FindNextLeaf(map->root, scan, top, level);
+            if (pt == nullptr)
+                break;
+
+            //clear all the translations in this table, until we find a lower level table.
+            for (size_t i = GetLevelIndex(scan, level); i < PageTableEntries && scan < top; i++)
+            {
+                const uint64_t entry = pt->entries[i];
+                if ((entry & PresentFlag) != 0)
+                {
+                    if (!IsLeafEntry(entry, level) || batch.count == HatUnmapBatch::Capacity)
+                        break;
+
+                    batch.entries[batch.count].paddr = entry & addrMask;
+                    batch.entries[batch.count].mode = level - 1;
+                    batch.count++;
+                    pt->entries[i] = 0;
+                }
+                scan = NextEntryAddr(scan, level, top);
+            }
+        }
+
+        if (flush && scan != vaddr)
+            FlushEverywhere(map, vaddr, scan - vaddr);
+        return scan - vaddr;
+    }
+
+    void HatProtectRange(HatMap* map, uintptr_t vaddr, size_t length, HatFlags flags, 
+        HatProtectFunc filter, void* arg, bool flush)
+    {
+        ASSERT_(map != nullptr);
+
+        const uintptr_t top = vaddr + length;
+        uintptr_t scan = vaddr;
+        size_t level;
+
+        while (true)
+        {
+            PageTable* pt = FindNextLeaf(map->root, scan, top, level);
+            if (pt == nullptr)
+                break;
+
+            for (size_t i = GetLevelIndex(scan, level); i < PageTableEntries && scan < top; i++)
+            {
+                const uint64_t entry = pt->entries[i];
+                if ((entry & PresentFlag) != 0)
+                {
+                    if (!IsLeafEntry(entry, level))
+                        break;
+
+                    const uintptr_t paddr = entry & addrMask;
+                    const HatFlags newFlags = filter == nullptr ? flags : filter(arg, paddr, level - 1, flags);
+                    __atomic_store_n(&pt->entries[i], BuildEntry(map, paddr, newFlags, level), __ATOMIC_RELEASE);
+                }
+                scan = NextEntryAddr(scan, level, top);
+            }
+        }
+
+        if (flush)
+            FlushEverywhere(map, vaddr, length);
+    }
+
+    size_t HatTestClearRange(HatMap* map, uintptr_t vaddr, size_t length, bool clearDirty,
+        HatAccessFunc callback, void* arg, bool flush)
+    {
+        ASSERT_(map != nullptr);
+
+        const uint64_t clearMask = AccessedFlag | (clearDirty ? DirtyFlag : 0);
+        const uintptr_t top = vaddr + length;
+        uintptr_t scan = vaddr;
+        size_t level;
+        size_t accessedCount = 0;
+        bool changed = false;
+
+        while (true)
+        {
+            PageTable* pt = FindNextLeaf(map->root, scan, top, level);
+            if (pt == nullptr)
+                break;
+
+            for (size_t i = GetLevelIndex(scan, level); i < PageTableEntries && scan < top; i++)
+            {
+                const uint64_t entry = pt->entries[i];
+                if ((entry & PresentFlag) != 0)
+                {
+                    if (!IsLeafEntry(entry, level))
+                        break;
+
+                    //the MMU can update the entry behind our back, so the flags are cleared atomically.
+                    const uint64_t prev = (entry & clearMask) == 0 ? entry 
+                        : __atomic_fetch_and(&pt->entries[i], ~clearMask, __ATOMIC_RELAXED);
+                    const bool accessed = (prev & AccessedFlag) != 0;
+                    changed = changed || (prev & clearMask) != 0;
+                    if (accessed)
+                        accessedCount++;
+                    if (callback != nullptr)
+                        callback(arg, sl::AlignDown(scan, GetPageSize((PageSizes)level)), prev & addrMask, 
+                            level - 1, accessed, (prev & DirtyFlag) != 0);
+                }
+                scan = NextEntryAddr(scan, level, top);
+            }
+        }
+
+        if (flush && changed)
+            FlushEverywhere(map, vaddr, length);
+        return accessedCount;
     }
 
     void HatMakeActive(HatMap* map, bool supervisor)
@@ -326,8 +683,48 @@ namespace Npk
         (void)supervisor;
 
         ASSERT_(map != nullptr);
-        if (map != &kernelMap)
+        //the kernel's root entries only need to be copied if they've changed since we last did.
+        if (map != &kernelMap && map->generation.Load() != kernelMap.generation.Load())
             SyncWithMasterMap(map);
-        asm volatile("mov %0, %%cr3" :: "r"(map->root) : "memory");
+
+        //the kernel map always uses pcid 0, and is flushed whenever it's loaded.
+        const size_t maxTags = mmuFeatures.pcid ? Memory::MaxTlbTags : 0;
+        const Memory::TlbLoadResult tlb = Memory::TlbMapLoaded(map, map->tlb, maxTags);
+        uint64_t cr3 = reinterpret_cast<uint64_t>(map->root) | tlb.tag;
+        if (tlb.tag != 0 && !tlb.flush)
+            cr3 |= Cr3NoFlush;
+        asm volatile("mov %0, %%cr3" :: "r"(cr3) : "memory");
+    }
+
+    bool HatSyncKernelEntries()
+    {
+        const uintptr_t activeRoot = ReadCr3() & addrMask;
+        if (activeRoot == reinterpret_cast<uintptr_t>(kernelMap.root))
+            return false;
+
+        //we dont know which HatMap this is, so its generation is left alone: the next
+        //HatMakeActive() will copy the entries again, which is harmless.
+        const PageTable* source = AddHhdm(kernelMap.root);
+        PageTable* dest = reinterpret_cast<PageTable*>(AddHhdm(activeRoot));
+        bool copied = false;
+        for (size_t i = PageTableEntries / 2; i < PageTableEntries; i++)
+        {
+            const uint64_t entry = __atomic_load_n(&source->entries[i], __ATOMIC_ACQUIRE);
+            if ((entry & PresentFlag) == 0 || dest->entries[i] == entry)
+                continue;
+
+            __atomic_store_n(&dest->entries[i], entry, __ATOMIC_RELEASE);
+            copied = true;
+        }
+
+        return copied;
+    }
+
+    void HatFlushLocal(uintptr_t vaddr, size_t length)
+    {
+        if (length == 0)
+            FlushAll();
+        else
+            FlushRange(vaddr, length);
     }
 }
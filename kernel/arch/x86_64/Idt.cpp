@@ -1,5 +1,6 @@
 #include <arch/x86_64/Idt.h>
 #include <arch/x86_64/Apic.h>
+#include <arch/Hat.h>
 #include <debug/Log.h>
 #include <debug/Panic.h>
 #include <io/IntrRouter.h>
@@ -25,7 +26,7 @@ namespace Npk
             low = (addr & 0xFFFF) | ((addr & 0xFFFF'0000) << 32);
             high = addr >> 32;
             low |= SelectorKernelCode << 16;
-            low |= ((ist & 0b11) | (0b1110 << 8) | (syscall ? (3 << 13) : (0 << 13)) | (1 << 15)) << 32;
+            low |= ((ist & 0b111) | (0b1110 << 8) | (syscall ? (3 << 13) : (0 << 13)) | (1 << 15)) << 32;
         }
     };
 
@@ -45,6 +46,10 @@ namespace Npk
 
         for (size_t i = 0; i < IntVectorCount; i++)
             idtEntries[i] = IdtEntry((uintptr_t)VectorStub0 + i * 0x10, false, 0);
+
+        //double faults and page faults run on their own stacks, see TrapLeaveIst().
+        idtEntries[0x8] = IdtEntry((uintptr_t)VectorStub0 + 0x8 * 0x10, false, IstDoubleFault);
+        idtEntries[0xE] = IdtEntry((uintptr_t)VectorStub0 + 0xE * 0x10, false, IstPageFault);
     }
 
 
@@ -112,7 +117,7 @@ extern "C"
             if (cr2 < hhdmBase && VMM::CurrentActive())
                 handled = VMM::Current().HandleFault(cr2, flags);
             else if (cr2 > hhdmBase)
-                handled = VMM::Kernel().HandleFault(cr2, flags);
+                handled = HatSyncKernelEntries() || VMM::Kernel().HandleFault(cr2, flags);
             
             if (!handled && !ProgramManager::Global().ServeException(exception))
                 PanicWithException(exception, frame->rbp);
@@ -123,6 +128,80 @@ extern "C"
             PanicWithException(exception, frame->rbp);
     }
     
+    static bool BackStackPage(uintptr_t page)
+    {
+        using namespace Npk;
+        using namespace Npk::Memory;
+
+        VMM* vmm = nullptr;
+        if (page >= hhdmBase)
+            vmm = &VMM::Kernel();
+        else if (VMM::CurrentActive())
+            vmm = &VMM::Current();
+        else
+            return false;
+
+        //mapped pages that aren't shared (the zero page counts as shared) are writable, like VMM::CopyIn().
+        const auto phys = vmm->GetPhysical(page);
+        const PageInfo* info = phys.HasValue() ? PMM::Global().Lookup(sl::AlignDown(*phys, PageSize)) : nullptr;
+        if (phys.HasValue() && (info == nullptr || info->shares.Load() == 0))
+            return true;
+        return vmm->HandleFault(page, VmFaultFlag::Write);
+    }
+
+    /* Page faults arrive on this core's IST stack, so that a fault caused by the cpu pushing a
+     * trap frame onto an unbacked (demand paged) stack page can be serviced. That stack is reused
+     * by the next page fault, so the frame is moved to where the cpu would have put it on the
+     * interrupted stack before anything can enable interrupts or switch threads. Any pages of the
+     * interrupted stack the frame lands on are backed first, with the run level raised so that
+     * nothing else runs on the IST stack meanwhile. A nested page fault while doing this (e.g. in
+     * the kernel heap) would overwrite our frame, so the IST entry is lowered for the duration.
+     * Faults from user mode never run on the user stack, they're moved to the thread's kernel stack
+     * (tss->rsp0) where any other trap from user mode would have been.
+     */
+    Npk::TrapFrame* TrapLeaveIst(Npk::TrapFrame* frame)
+    {
+        using namespace Npk;
+        using namespace Npk::Tasking;
+
+        uintptr_t stackTop = sl::AlignDown(frame->iret.rsp, 16);
+        if ((frame->iret.cs & 3) != 0)
+            stackTop = sl::AlignDown(reinterpret_cast<uintptr_t>(CoreLocal().nextStack), 16);
+        TrapFrame* moved = reinterpret_cast<TrapFrame*>(stackTop - sizeof(TrapFrame));
+        if (stackTop >= hhdmBase)
+            HatSyncKernelEntries();
+
+        if (CoreLocalAvailable() && CoreLocal()[LocalPtr::ArchConfig] != nullptr)
+        {
+            const uintptr_t cr2 = ReadCr2();
+            Tss* tss = static_cast<ArchConfig*>(CoreLocal()[LocalPtr::ArchConfig])->tss;
+            const uint64_t istTop = tss->ist[IstPageFault - 1];
+            tss->ist[IstPageFault - 1] = istTop - IstStackSize / 2;
+            const auto prevRl = EnsureRunLevel(RunLevel::Dpc);
+
+            bool backed = true;
+            for (uintptr_t page = sl::AlignDown((uintptr_t)moved, PageSize); page < stackTop && backed; page += PageSize)
+                backed = BackStackPage(page);
+
+            //any queued dpcs or thread switches are left until TrapDispatch() lowers the run level,
+            //they can't happen on the IST stack.
+            if (prevRl.HasValue())
+            {
+                CoreLocal().runLevel = *prevRl;
+                SetHardwareRunLevel(*prevRl);
+            }
+            tss->ist[IstPageFault - 1] = istTop;
+
+            if (!backed)
+                Log("Unable to back stack for trap frame at 0x%tx: rip=0x%tx, cr2=0x%tx", LogLevel::Fatal,
+                    (uintptr_t)moved, frame->iret.rip, cr2);
+            WriteCr2(cr2); //in case of a nested fault, TrapDispatch() needs the original address.
+        }
+
+        sl::memcopy(frame, moved, sizeof(TrapFrame));
+        return moved;
+    }
+
     void TrapDispatch(Npk::TrapFrame* frame)
     {
         using namespace Npk;
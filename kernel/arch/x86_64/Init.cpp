@@ -4,6 +4,8 @@
 #include <boot/CommonInit.h>
 #include <debug/Log.h>
 #include <interfaces/driver/Api.h>
+#include <memory/Vmm.h>
+#include <Memory.h>
 
 namespace Npk
 {
@@ -57,6 +59,49 @@ namespace Npk
             : "rdi");
     }
 
+    static Tss* InitCoreTss()
+    {
+        /* Each core gets its own copy of the GDT so it can have its own TSS, which is only used for
+         * the interrupt stack table: page faults and double faults run on their own stacks. This way a
+         * fault caused by the cpu pushing a trap frame (like touching an unbacked or guard page of
+         * a thread's stack) can still be handled, see TrapLeaveIst().
+         */
+        Tss* tss = new Tss();
+        const size_t istSlots[] = { IstPageFault, IstDoubleFault };
+        for (size_t slot : istSlots)
+        {
+            auto stack = VMM::Kernel().Alloc(IstStackSize, 3, VmFlag::Anon | VmFlag::Write | VmFlag::Guarded);
+            ASSERT_(stack.HasValue());
+            tss->ist[slot - 1] = *stack + IstStackSize;
+        }
+        tss->ioPermBase = sizeof(Tss); //no io permission bitmap
+
+        //rsp0 is the current thread's stack: there's no thread yet, and nothing can enter user mode
+        //before the scheduler switches to one, which sets it via SetKernelStack().
+
+        constexpr size_t GdtEntryCount = sizeof(gdtEntries) / sizeof(uint64_t);
+        uint64_t* coreGdt = new uint64_t[GdtEntryCount];
+        sl::memcopy(gdtEntries, coreGdt, sizeof(gdtEntries));
+
+        const uint64_t base = reinterpret_cast<uintptr_t>(tss);
+        const uint64_t limit = sizeof(Tss) - 1;
+        coreGdt[SelectorTss / 8] = (limit & 0xFFFF) | ((base & 0xFF'FFFF) << 16) | (0x89ul << 40)
+            | ((limit & 0xF'0000) << 32) | ((base & 0xFF00'0000) << 32);
+        coreGdt[SelectorTss / 8 + 1] = base >> 32;
+
+        struct [[gnu::packed, gnu::aligned(8)]]
+        {
+            uint16_t limit;
+            uint64_t base;
+        } coreGdtr;
+        coreGdtr.limit = sizeof(gdtEntries) - 1;
+        coreGdtr.base = reinterpret_cast<uint64_t>(coreGdt);
+
+        //the selectors are the same as the shared gdt, so the segment registers dont need reloading.
+        asm volatile("lgdt %0; ltr %1" :: "m"(coreGdtr), "r"(SelectorTss) : "memory");
+        return tss;
+    }
+
     void ArchKernelEntry()
     {
 #ifdef NPK_X86_DEBUGCON_ENABLED
@@ -78,10 +123,13 @@ namespace Npk
     void ArchInitCore(size_t myId)
     {
         LoadGdt();
+        ArchConfig* config = new ArchConfig();
+        config->tss = InitCoreTss();
         LoadIdt();
 
         CoreLocalInfo* clb = new CoreLocalInfo();
         WriteMsr(MsrGsBase, reinterpret_cast<uintptr_t>(clb));
+        clb->subsystemPtrs[(size_t)LocalPtr::ArchConfig] = config;
         clb->subsystemPtrs[(size_t)LocalPtr::IntrControl] = new LocalApic();
         clb->id = myId;
         clb->runLevel = RunLevel::Dpc;
@@ -100,17 +148,20 @@ namespace Npk
             cr4 |= 1 << 11; //prevents system store instructions in user mode (sidt/sgdt)
         if (CpuHasFeature(CpuFeature::GlobalPages))
             cr4 |= 1 << 7; //global pages: pages that are global.
+        if (CpuHasFeature(CpuFeature::Pcid) && (cr4 & (1 << 7)))
+            cr4 |= 1 << 17; //process-context identifiers: tag TLB entries by address space.
         WriteCr4(cr4);
 
         if (CpuHasFeature(CpuFeature::NoExecute))
             WriteMsr(MsrEfer, ReadMsr(MsrEfer) | (1 << 11));
 
         //my stack overfloweth (alt title: maximum maintainability).
-        Log("Cpu features enabled: wp%s%s%s%s%s.", LogLevel::Info, 
+        Log("Cpu features enabled: wp%s%s%s%s%s%s.", LogLevel::Info, 
             cr4 & (1 << 21) ? ", smap" : "",
             cr4 & (1 << 20) ? ", smep" : "",
             cr4 & (1 << 11) ? ", umip" : "",
             cr4 & (1 << 7) ? ", gbl-pages" : "",
+            cr4 & (1 << 17) ? ", pcid" : "",
             CpuHasFeature(CpuFeature::NoExecute) ? ", nx" : "");
 
         //TODO: init fpu and sse state
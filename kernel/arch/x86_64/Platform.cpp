@@ -1,6 +1,7 @@
 #include <arch/Platform.h>
 #include <arch/x86_64/Apic.h>
 #include <arch/x86_64/Cpuid.h>
+#include <arch/x86_64/Idt.h>
 #include <debug/Log.h>
 #include <Maths.h>
 #include <Memory.h>
@@ -18,6 +19,11 @@ namespace Npk
         Print(ArchPanicStr, cfg->xSaveBitmap, cfg->xSaveBufferSize);
     }
 
+    size_t ArchCoreHardwareId()
+    {
+        return LocalApic::Local().Id();
+    }
+
     void ExplodeKernelAndReset()
     {
         struct [[gnu::packed, gnu::aligned(8)]]
@@ -137,6 +143,18 @@ namespace Npk
         WriteCr0(ReadCr0() | (1 << 3));
     }
 
+    void ClearPage(void* page)
+    {
+        //non-temporal stores: pages are usually cleared ahead of time, so dont pollute the caches with them.
+        uint64_t* access = static_cast<uint64_t*>(page);
+        for (size_t i = 0; i < PageSize / sizeof(uint64_t); i += 4)
+        {
+            asm volatile("movnti %1, 0(%0); movnti %1, 8(%0); movnti %1, 16(%0); movnti %1, 24(%0)" 
+                :: "r"(access + i), "r"(0ul) : "memory");
+        }
+        asm volatile("sfence" ::: "memory");
+    }
+
     uintptr_t GetReturnAddr(size_t level, uintptr_t start)
     {
         struct Frame
@@ -179,6 +197,14 @@ namespace Npk
         }
     }
 
+    void SetKernelStack(uintptr_t top)
+    {
+        CoreLocal().nextStack = reinterpret_cast<void*>(top);
+        auto config = static_cast<ArchConfig*>(CoreLocal()[LocalPtr::ArchConfig]);
+        if (config != nullptr && config->tss != nullptr)
+            config->tss->rsp[0] = top;
+    }
+
     bool RoutePinInterrupt(size_t core, size_t vector, size_t gsi)
     {
         uint8_t pin = gsi;
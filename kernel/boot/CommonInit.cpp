@@ -11,6 +11,7 @@
 #include <debug/TerminalDriver.h>
 #include <debug/Log.h>
 #include <debug/Symbols.h>
+#include <debug/Benchmarks.h>
 #include <debug/MagicKeys.h>
 #include <drivers/DriverManager.h>
 #include <filesystem/Filesystem.h>
@@ -19,6 +20,9 @@
 #include <memory/Pmm.h>
 #include <memory/Vmm.h>
 #include <memory/Heap.h>
+#include <memory/TlbShootdown.h>
+#include <memory/PageMerging.h>
+#include <memory/PageAging.h>
 #include <tasking/Clock.h>
 #include <tasking/Scheduler.h>
 #include <NanoPrintf.h>
@@ -45,6 +49,12 @@ namespace Npk
     {
         (void)arg;
         ArchThreadedInit();
+        PMM::Global().InitReclaim();
+        PMM::Global().InitZeroPool();
+        Memory::PageMerger::Global().Init();
+        Memory::PageAging::Global().Init();
+        VMM::InitPrefetch();
+        Debug::StartBenchmarks();
 
         Drivers::ScanForModules("/initdisk/drivers");
 
@@ -124,8 +134,11 @@ namespace Npk
         InitLocalTimers();
 
         //TODO: per-core heap caches
+        PMM::Global().InitLocalCache();
+        VMM::InitLocalCache();
         Debug::InitCoreLogBuffers();
         Interrupts::InitIpiMailbox();
+        Memory::InitTlbShootdown();
         Io::InterruptRouter::Global().InitCore();
         Tasking::Scheduler::Global().AddEngine();
     }
@@ -182,6 +195,7 @@ namespace Npk
             Config::SetRsdp(*rsdp);
         if (auto fdt = GetDtb(); fdt.HasValue()) //TODO: replace this junk with smoldtb
             Config::DeviceTree::Global().Init(*fdt);
+        PMM::Global().InitNuma();
 
         ArchLateKernelEntry();
 
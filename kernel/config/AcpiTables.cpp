@@ -107,6 +107,28 @@ namespace Npk::Config
             table->signature, oem, table->revision, table->length);
     }
 
+    sl::Opt<const Sras*> FindSras(const Srat* srat, SrasType type, const Sras* begin)
+    {
+        ASSERT(srat != nullptr, "SRAT is null");
+
+        sl::CNativePtr scan = srat;
+        const uintptr_t sratEnd = scan.raw + srat->length;
+        scan = scan.Offset(sizeof(Srat));
+
+        while (scan.raw < sratEnd)
+        {
+            const Sras* sras = scan.As<const Sras>();
+            if (sras->length == 0)
+                break;
+            if (sras->type == type && sras > begin)
+                return sras;
+
+            scan.raw += sras->length;
+        }
+
+        return {};
+    }
+
     sl::Opt<const RhctNode*> FindRhctNode(const Rhct* rhct, RhctNodeType type, const RhctNode* begin)
     {
         ASSERT(rhct != nullptr, "RHCT is null");
@@ -0,0 +1,226 @@
+#include <debug/Benchmarks.h>
+#include <debug/Log.h>
+#include <boot/CommonInit.h>
+#include <config/ConfigStore.h>
+#include <memory/Vmm.h>
+#include <memory/virtual/AnonVmDriver.h>
+#include <tasking/Clock.h>
+#include <tasking/Threads.h>
+#include <tasking/Scheduler.h>
+#include <tasking/Waitable.h>
+#include <Atomic.h>
+#include <Maths.h>
+#include <Memory.h>
+
+namespace Npk::Debug
+{
+    constexpr size_t FaultBenchDefaultPages = 4096;
+    constexpr size_t FaultBenchDefaultThreads = 8;
+    constexpr size_t CopyBenchMinLength = 4 * KiB;
+    constexpr size_t CopyBenchMaxLength = 64 * MiB;
+    constexpr size_t DupBenchMinLength = 64 * KiB;
+    constexpr size_t DupBenchMaxLength = 64 * MiB;
+
+    struct FaultBenchData
+    {
+        uintptr_t base;
+        size_t pagesPerThread;
+        sl::Atomic<size_t> nextSlice;
+        sl::Atomic<size_t> remaining;
+        Tasking::Waitable done;
+    };
+
+    static void FaultBenchThread(void* arg)
+    {
+        FaultBenchData& data = *static_cast<FaultBenchData*>(arg);
+
+        //each thread touches its own slice of the range, so every access is a fault on a distinct page.
+        const size_t slice = data.nextSlice.FetchAdd(1);
+        const uintptr_t sliceBase = data.base + slice * data.pagesPerThread * PageSize;
+        for (size_t i = 0; i < data.pagesPerThread; i++)
+            *reinterpret_cast<volatile uint8_t*>(sliceBase + i * PageSize) = 1;
+
+        if (data.remaining.FetchSub(1) == 1)
+            data.done.Signal();
+        Tasking::Thread::Current().Exit(0);
+    }
+
+    /* Measures page fault throughput in the kernel VMM (which is shared by all cores) as more
+     * threads fault concurrently. The zero page and superpages are disabled for the test range
+     * so that every page touched goes through VMM::HandleFault().
+     */
+    static void RunFaultBenchmark(size_t maxThreads, size_t pagesPerThread)
+    {
+        using namespace Tasking;
+        using Memory::Virtual::AnonFeature;
+        const uintptr_t disableFeatures = (uintptr_t)AnonFeature::ZeroPage | (uintptr_t)AnonFeature::Superpages;
+        //static since the last worker may still be inside data.done.Signal() after we've woken up.
+        static FaultBenchData data {};
+
+        for (size_t threadCount = 1; threadCount <= maxThreads; threadCount *= 2)
+        {
+            const size_t length = threadCount * pagesPerThread * PageSize;
+            auto base = VMM::Kernel().Alloc(length, disableFeatures, VmFlags(VmFlag::Anon) | VmFlag::Write);
+            if (!base.HasValue())
+            {
+                Log("Fault benchmark: failed to allocate %zu bytes.", LogLevel::Error, length);
+                return;
+            }
+
+            data.base = *base;
+            data.pagesPerThread = pagesPerThread;
+            data.nextSlice = 0;
+            data.remaining = threadCount;
+
+            const size_t faultsBegin = VMM::Kernel().GetStats().faults;
+            const size_t begin = GetUptime().ToMicros();
+            for (size_t i = 0; i < threadCount; i++)
+            {
+                auto thread = Thread::Create(Process::Kernel().Id(), FaultBenchThread, &data);
+                ASSERT_(thread != nullptr);
+                thread->Start(nullptr);
+            }
+
+            WaitEntry waitEntry;
+            WaitManager::WaitOne(&data.done, &waitEntry, { sl::TimeScale::Millis, -1ul });
+            const size_t elapsed = sl::Max(GetUptime().ToMicros() - begin, 1ul);
+            const size_t faults = VMM::Kernel().GetStats().faults - faultsBegin;
+
+            Log("Fault benchmark: threads=%zu, pages=%zu, faults=%zu, time=%zuus, %zu pages/ms", LogLevel::Info,
+                threadCount, threadCount * pagesPerThread, faults, elapsed,
+                (threadCount * pagesPerThread * 1000) / elapsed);
+
+            VMM::Kernel().Free(*base);
+        }
+    }
+
+    /* Compares VMM::CopyIn() throughput with and without remapping, copying from a kernel buffer
+     * into a user address space for each power-of-4 length from 4KiB to 64MiB. The kernel buffer
+     * is rewritten before each copy (outside of the timed part), so remapping always starts from
+     * private pages rather than ones still shared from the previous copy.
+     */
+    static void RunCopyBenchmark()
+    {
+        using Memory::Virtual::AnonFeature;
+        const uintptr_t disableFeatures = (uintptr_t)AnonFeature::Superpages;
+
+        VMM* user = new VMM();
+        auto src = VMM::Kernel().Alloc(CopyBenchMaxLength, disableFeatures, VmFlags(VmFlag::Anon) | VmFlag::Write);
+        auto dest = user->Alloc(CopyBenchMaxLength, disableFeatures, VmFlags(VmFlag::Anon) | VmFlag::Write | VmFlag::User);
+        if (!src.HasValue() || !dest.HasValue())
+        {
+            Log("Copy benchmark: failed to allocate buffers.", LogLevel::Error);
+            if (src.HasValue())
+                VMM::Kernel().Free(*src);
+            delete user;
+            return;
+        }
+
+        for (size_t length = CopyBenchMinLength; length <= CopyBenchMaxLength; length *= 4)
+        {
+            for (size_t remap = 0; remap < 2; remap++)
+            {
+                sl::memset(reinterpret_cast<void*>(*src), static_cast<uint8_t>(length + remap), length);
+
+                const size_t begin = Tasking::GetUptime().ToMicros();
+                const size_t copied = user->CopyIn(reinterpret_cast<void*>(*dest), reinterpret_cast<void*>(*src), length, remap);
+                const size_t elapsed = sl::Max(Tasking::GetUptime().ToMicros() - begin, 1ul);
+
+                Log("Copy benchmark: length=%zuKiB, remap=%s, copied=%zu, time=%zuus, %zu MiB/s", LogLevel::Info,
+                    length / KiB, remap ? "yes" : "no", copied, elapsed, (copied * 1000000 / elapsed) / MiB);
+            }
+        }
+
+        VMM::Kernel().Free(*src);
+        delete user;
+    }
+
+    /* Times VMM::Duplicate() of a populated anon range, followed by writing to every page of the
+     * copy (breaking each share). The contents of both ranges are checked afterwards, so this
+     * doubles as a test of copy-on-write: the copy must see the original data before it's written,
+     * and the source must not see any of the writes.
+     */
+    static void RunDuplicateBenchmark()
+    {
+        for (size_t length = DupBenchMinLength; length <= DupBenchMaxLength; length *= 4)
+        {
+            auto src = VMM::Kernel().Alloc(length, 0, VmFlags(VmFlag::Anon) | VmFlag::Write);
+            if (!src.HasValue())
+            {
+                Log("Duplicate benchmark: failed to allocate %zu bytes.", LogLevel::Error, length);
+                return;
+            }
+            for (size_t i = 0; i < length; i += PageSize)
+                *reinterpret_cast<volatile size_t*>(*src + i) = i;
+
+            const size_t dupBegin = Tasking::GetUptime().ToMicros();
+            auto dest = VMM::Kernel().Duplicate(*src, VMM::Kernel());
+            const size_t dupElapsed = sl::Max(Tasking::GetUptime().ToMicros() - dupBegin, 1ul);
+            if (!dest.HasValue())
+            {
+                Log("Duplicate benchmark: failed to duplicate %zu bytes.", LogLevel::Error, length);
+                VMM::Kernel().Free(*src);
+                return;
+            }
+
+            size_t mismatches = 0;
+            for (size_t i = 0; i < length; i += PageSize)
+            {
+                if (*reinterpret_cast<volatile size_t*>(*dest + i) != i)
+                    mismatches++;
+            }
+
+            const size_t writeBegin = Tasking::GetUptime().ToMicros();
+            for (size_t i = 0; i < length; i += PageSize)
+                *reinterpret_cast<volatile size_t*>(*dest + i) = ~i;
+            const size_t writeElapsed = sl::Max(Tasking::GetUptime().ToMicros() - writeBegin, 1ul);
+
+            for (size_t i = 0; i < length; i += PageSize)
+            {
+                if (*reinterpret_cast<volatile size_t*>(*src + i) != i)
+                    mismatches++;
+            }
+
+            Log("Duplicate benchmark: length=%zuKiB, duplicate=%zuus, write=%zuus, mismatches=%zu", 
+                mismatches == 0 ? LogLevel::Info : LogLevel::Error, length / KiB, dupElapsed, writeElapsed,
+                mismatches);
+
+            VMM::Kernel().Free(*dest);
+            VMM::Kernel().Free(*src);
+        }
+    }
+
+    static void BenchmarkThread(void* arg)
+    {
+        (void)arg;
+
+        //demand paging isnt available until all cores have finished init.
+        while (CoresInEarlyInit())
+            Tasking::Scheduler::Global().Yield();
+
+        const size_t faultThreads = Config::GetConfigNumber("kernel.debug.bench_fault_threads", FaultBenchDefaultThreads);
+        const size_t faultPages = Config::GetConfigNumber("kernel.debug.bench_fault_pages", FaultBenchDefaultPages);
+        if (Config::GetConfigNumber("kernel.debug.bench_faults", false))
+            RunFaultBenchmark(faultThreads, faultPages);
+        if (Config::GetConfigNumber("kernel.debug.bench_copy", false))
+            RunCopyBenchmark();
+        if (Config::GetConfigNumber("kernel.debug.bench_duplicate", false))
+            RunDuplicateBenchmark();
+
+        Tasking::Thread::Current().Exit(0);
+    }
+
+    void StartBenchmarks()
+    {
+        if (!Config::GetConfigNumber("kernel.debug.bench_faults", false)
+            && !Config::GetConfigNumber("kernel.debug.bench_copy", false)
+            && !Config::GetConfigNumber("kernel.debug.bench_duplicate", false))
+            return;
+
+        using namespace Tasking;
+        auto thread = Thread::Create(Process::Kernel().Id(), BenchmarkThread, nullptr);
+        ASSERT_(thread != nullptr);
+        thread->Start(nullptr);
+        Log("Benchmarks thread spawned: id=%zu", LogLevel::Info, thread->Id());
+    }
+}
@@ -6,11 +6,50 @@
 
 namespace Npk::Filesystem
 {
+    constexpr size_t FileCacheShrinkerPriority = 10;
+
     FileCacheInfo cacheInfo;
 
     sl::SpinLock cachesLock;
     sl::Vector<sl::Handle<FileCache>> caches; //TODO: better cache than this
 
+    /* Units that were trimmed from a file (and had no other references) are kept on this list
+     * until the PMM asks for memory back. The cache is currently the only copy of a file's
+     * data (there's no backing storage to write back to), so live units cant be evicted.
+     */
+    sl::SpinLock orphansLock;
+    FileCacheUnit* orphans;
+    size_t orphanCount;
+    Memory::PmShrinker cacheShrinker;
+
+    static size_t FileCacheShrinkerCount(void* arg)
+    {
+        (void)arg;
+        return orphanCount * (cacheInfo.unitSize / PageSize);
+    }
+
+    static size_t FileCacheShrinkerReclaim(void* arg, size_t pages)
+    {
+        (void)arg;
+
+        size_t freed = 0;
+        while (freed < pages)
+        {
+            sl::ScopedLock scopeLock(orphansLock);
+            FileCacheUnit* unit = orphans;
+            if (unit == nullptr)
+                break;
+            orphans = unit->nextOrphan;
+            orphanCount--;
+            scopeLock.Release();
+
+            CleanupFileCacheUnit(unit);
+            freed += cacheInfo.unitSize / PageSize;
+        }
+
+        return freed;
+    }
+
     void CleanupFileCacheUnit(FileCacheUnit* unit)
     {
         ASSERT_(unit->owner == nullptr);
@@ -41,6 +80,16 @@ namespace Npk::Filesystem
         ASSERT(cacheInfo.unitSize != -1ul, "Unable to select cache unit size");
         ASSERT(sl::IsPowerOfTwo(cacheInfo.unitSize), "Bad cache unit size");
 
+        orphans = nullptr;
+        orphanCount = 0;
+        cacheShrinker.name = "file-cache";
+        cacheShrinker.priority = FileCacheShrinkerPriority;
+        cacheShrinker.directSafe = true;
+        cacheShrinker.count = FileCacheShrinkerCount;
+        cacheShrinker.reclaim = FileCacheShrinkerReclaim;
+        cacheShrinker.arg = nullptr;
+        PMM::Global().RegisterShrinker(&cacheShrinker);
+
         auto conv = sl::ConvertUnits(cacheInfo.unitSize, sl::UnitBase::Binary);
         Log("File cache initialized: unitSize=0x%zx (%zu.%zu%sB)", LogLevel::Info,
             cacheInfo.unitSize, conv.major, conv.minor, conv.prefix);
@@ -77,17 +126,6 @@ namespace Npk::Filesystem
         return cache;
     }
 
-    static void TrimFcuNode(FileCacheUnit* fcu)
-    {
-        if (auto left = FcuTree::GetLeft(fcu); left != nullptr)
-            TrimFcuNode(left);
-        if (auto right = FcuTree::GetRight(fcu); right != nullptr)
-            TrimFcuNode(right);
-
-        fcu->owner = nullptr;
-        fcu->references--;
-    }
-
     bool SetFileCacheLength(sl::Handle<FileCache> cache, size_t length)
     {
         VALIDATE_(cache.Valid(), false);
@@ -97,18 +135,29 @@ namespace Npk::Filesystem
         if (length <= cache->length)
             return true; //extending file, nothing more to do
 
-        //reducing a file's length, drop references to any cache units beyond new size
-        FileCacheUnit* scan = cache->units.GetRoot();
+        //reducing a file's length, remove any cache units beyond the new size and drop our pin on them.
+        //Units with no other references can be freed when memory is needed, otherwise the last
+        //handle to be released will free it.
+        FileCacheUnit* scan = cache->units.First();
         while (scan != nullptr)
         {
+            FileCacheUnit* next = FcuTree::Successor(scan);
             if (scan->offset < cache->length)
             {
-                scan = FcuTree::GetRight(scan);
+                scan = next;
                 continue;
             }
 
-            TrimFcuNode(scan);
-            scan = cache->units.GetRoot();
+            cache->units.Remove(scan);
+            scan->owner = nullptr;
+            if (scan->references.FetchSub(1) == 1)
+            {
+                sl::ScopedLock orphanLock(orphansLock);
+                scan->nextOrphan = orphans;
+                orphans = scan;
+                orphanCount++;
+            }
+            scan = next;
         }
 
         return true;
@@ -143,6 +192,7 @@ namespace Npk::Filesystem
         newUnit->offset = fileOffset;
         newUnit->physBase = physicalMem;
         newUnit->owner = *cache;
+        newUnit->nextOrphan = nullptr;
         newUnit->references = 1; //TODO: remove this pin
         if (mountOpts->writable)
             newUnit->flags.Set(FcuFlag::Writable);
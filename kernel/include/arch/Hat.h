@@ -12,6 +12,11 @@
     or some other esoteric method.
 
     The HAT API is intended for use mainly by the VMM, and not by other kernel subsystems.
+
+    The HAT does not serialize operations on a single mapping, callers must ensure only one
+    core is modifying a given translation at a time (the VMM does this with a lock per VmRange).
+    Intermediate page tables are installed atomically, so operations on unrelated addresses
+    can run concurrently within the same address space.
 */
 
 #ifdef NPK_ARCH_INCLUDE_HAT
@@ -83,6 +88,69 @@ namespace Npk
     //attempts to update an existing mapping: either flags, physical address of both.
     bool HatSyncMap(HatMap* map, uintptr_t vaddr, sl::Opt<uintptr_t> paddr, sl::Opt<HatFlags> flags, bool flush);
 
+    //clears the accessed flag of an existing mapping, returning whether it was set. Without `flush`
+    //a core with a cached translation may not set the flag again until the translation is evicted.
+    bool HatClearAccessed(HatMap* map, uintptr_t vaddr, bool flush);
+
+    /*
+        Batched versions of the above, these operate on all translations within [vaddr, vaddr + length).
+        Each page table is walked once rather than once per page, and if `flush` is set the TLB
+        is flushed once for the whole range (either per-page or entirely, whichever is cheaper)
+        after all the page tables have been updated.
+    */
+    //returns the physical address to map at `offset` bytes into a range passed to HatMapRange(),
+    //or an empty optional (e.g. out of memory) to stop mapping and have HatMapRange() fail.
+    using HatPhysFunc = sl::Opt<uintptr_t> (*)(void* arg, size_t offset);
+    //returns the flags to use for an existing mapping being modified by HatProtectRange().
+    using HatProtectFunc = HatFlags (*)(void* arg, uintptr_t paddr, size_t mode, HatFlags flags);
+    //called by HatTestClearRange() for each translation, with the state of its flags before they were cleared.
+    using HatAccessFunc = void (*)(void* arg, uintptr_t vaddr, uintptr_t paddr, size_t mode, bool accessed, bool dirty);
+
+    //the physical memory previously mapped by a call to HatUnmapRange().
+    struct HatUnmapBatch
+    {
+        static constexpr size_t Capacity = 64;
+
+        size_t count;
+        struct
+        {
+            uintptr_t paddr;
+            size_t mode;
+        } entries[Capacity];
+    };
+
+    //creates translations for an entire range using the same mode and flags. If a translation
+    //already exists in the range, `getPhys` fails or a page table can't be allocated the function
+    //fails, mappings created up until that point are kept.
+    bool HatMapRange(HatMap* map, uintptr_t vaddr, size_t length, size_t mode, HatFlags flags, 
+        HatPhysFunc getPhys, void* arg, bool flush);
+
+    //removes existing translations until either `batch` is full or the end of the range is reached.
+    //Returns the number of bytes processed, callers should call again for any remaining bytes.
+    //Any requested TLB flush is complete before this returns, so `batch` can be freed immediately.
+    size_t HatUnmapRange(HatMap* map, uintptr_t vaddr, size_t length, HatUnmapBatch& batch, bool flush);
+
+    //updates the flags of all existing translations in a range, unmapped areas are skipped.
+    //`filter` is optional and can be used to adjust the flags for individual mappings.
+    void HatProtectRange(HatMap* map, uintptr_t vaddr, size_t length, HatFlags flags, 
+        HatProtectFunc filter, void* arg, bool flush);
+
+    //clears the accessed flag (and the dirty flag if `clearDirty` is set) of all existing translations
+    //in a range, passing their previous state to `callback`. Returns the number of translations that
+    //had been accessed. Without `flush` cores may not set the accessed flag again until a cached
+    //translation is evicted, which is usually acceptable for aging but not if dirty flags are cleared.
+    size_t HatTestClearRange(HatMap* map, uintptr_t vaddr, size_t length, bool clearDirty,
+        HatAccessFunc callback, void* arg, bool flush);
+
+    //flushes any cached translations for a range on the local core only, a length of 0
+    //flushes the entire TLB.
+    void HatFlushLocal(uintptr_t vaddr, size_t length);
+
     //replaces the currently active HAT address space with this one.
     void HatMakeActive(HatMap* map, bool supervisor);
+
+    //copies any kernel root entries that are missing from the active address space. Kernel threads
+    //keep whatever address space was loaded (lazy TLB), which may predate a new kernel root entry.
+    //Returns whether anything was copied, if so a kernel page fault should just be retried.
+    bool HatSyncKernelEntries();
 }
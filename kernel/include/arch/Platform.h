@@ -20,6 +20,8 @@ namespace Npk
         Logs,
         HeapCache,
         IntrRouting,
+        PmmCache,
+        VmQuantumCache,
 
         Count
     };
@@ -61,6 +63,7 @@ namespace Npk
     struct ExtendedRegs;
 
     void ArchPrintPanicInfo(void (*Print)(const char* format, ...));
+    size_t ArchCoreHardwareId(); //id firmware tables use for this core (apic id, hart id)
     void ExplodeKernelAndReset();
     void Wfi();
     bool InterruptsEnabled();
@@ -77,10 +80,12 @@ namespace Npk
     void SaveExtendedRegs(ExtendedRegs* regs);
     void LoadExtendedRegs(ExtendedRegs* regs);
     void ExtendedRegsFence();
+    void ClearPage(void* page);
 
     uintptr_t GetReturnAddr(size_t level, uintptr_t start);
     void SendIpi(size_t dest);
     void SetHardwareRunLevel(RunLevel rl);
+    void SetKernelStack(uintptr_t top); //stack used by traps from user mode, see CoreLocalInfo::nextStack
     uintptr_t MsiAddress(size_t core, size_t vector);
     uintptr_t MsiData(size_t core, size_t vector);
     void MsiExtract(uintptr_t addr, uintptr_t data, size_t& core, size_t& vector);
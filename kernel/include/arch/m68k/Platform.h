@@ -81,6 +81,7 @@ namespace Npk
 
     constexpr inline size_t PageSize = 0x1000;
     constexpr inline size_t TrapFrameArgCount = 6;
+    constexpr inline bool DemandPagedStacks = false; //traps from supervisor mode use the interrupted stack
     constexpr inline size_t IntVectorAllocBase = 0x40;
     constexpr inline size_t IntVectorAllocLimit = 0xFF;
 
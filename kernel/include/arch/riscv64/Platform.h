@@ -63,6 +63,7 @@ namespace Npk
     static_assert(sizeof(TrapFrame) == 280, "Riscv64 TrapFrame size changed, update assembly sources.");
 
     constexpr inline size_t TrapFrameArgCount = 8;
+    constexpr inline bool DemandPagedStacks = false; //traps from S-mode use the interrupted stack
     constexpr inline size_t PageSize = 0x1000;
     constexpr inline size_t IntVectorAllocBase = 1;
     constexpr inline size_t IntVectorAllocLimit = 2048; //defined by AIA spec
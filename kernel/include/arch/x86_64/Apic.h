@@ -56,6 +56,9 @@ namespace Npk
         void Init();
         size_t MaxTimerNanos();
 
+        inline uint32_t Id() const
+        { return id; }
+
         bool CalibrateTimer();
         void SetTimer(bool tsc, size_t nanos, size_t vector);
         void SendEoi() const;
@@ -1,7 +1,28 @@
 #pragma once
 
+#include <stddef.h>
+#include <stdint.h>
+
 namespace Npk
 {
+    //interrupt stack table slots (1-based, 0 means use the current stack), see ArchInitCore().
+    constexpr inline size_t IstPageFault = 1;
+    constexpr inline size_t IstDoubleFault = 2;
+    constexpr inline size_t IstStackSize = 0x8000;
+
+    struct [[gnu::packed]] Tss
+    {
+        uint32_t reserved0;
+        uint64_t rsp[3];
+        uint64_t reserved1;
+        uint64_t ist[7];
+        uint64_t reserved2;
+        uint16_t reserved3;
+        uint16_t ioPermBase;
+    };
+
+    static_assert(sizeof(Tss) == 104, "x86_64 TSS has wrong size.");
+
     void PopulateIdt();
     void LoadIdt();
 }
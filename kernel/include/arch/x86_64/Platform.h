@@ -5,10 +5,13 @@
 
 namespace Npk
 {
+    struct Tss;
+
     struct ArchConfig
     {
         uint64_t xSaveBitmap;
         size_t xSaveBufferSize;
+        Tss* tss;
     };
     
     struct TrapFrame
@@ -50,6 +53,7 @@ namespace Npk
     constexpr inline size_t IntVectorIpi = 0xFE;
     constexpr inline size_t IntVectorCount = 256;
     constexpr inline size_t TrapFrameArgCount = 6;
+    constexpr inline bool DemandPagedStacks = true; //page faults run on an IST stack
 
     constexpr inline uint32_t MsrEfer = 0xC0000080;
     constexpr inline uint32_t MsrApicBase = 0x1B;
@@ -191,6 +195,12 @@ namespace Npk
         return value;
     }
 
+    [[gnu::always_inline]]
+    inline void WriteCr2(uint64_t value)
+    {
+        asm volatile("mov %0, %%cr2" :: "r"(value) : "memory");
+    }
+
     [[gnu::always_inline]]
     inline uint64_t ReadCr3()
     { 
@@ -70,6 +70,7 @@ namespace Npk::Config
     constexpr const char* SigHpet = "HPET";
     constexpr const char* SigMcfg = "MCFG";
     constexpr const char* SigSrat = "SRAT";
+    constexpr const char* SigSlit = "SLIT";
     constexpr const char* SigRhct = "RHCT";
 
     struct [[gnu::packed]] Rsdt : public Sdt
@@ -342,6 +343,12 @@ namespace Npk::Config
         Sras resStructs[];
     };
 
+    struct [[gnu::packed]] Slit : public Sdt
+    {
+        uint64_t localities;
+        uint8_t entries[]; //localities * localities matrix, indexed by proximity domain
+    };
+
     enum class RhctFlags : uint32_t
     {
         TimerCannotWake = 1 << 0,
@@ -12,5 +12,6 @@ namespace Npk::Config
     sl::Opt<const Sdt*> FindAcpiTable(const char* signature);
     void PrintSdt(const Sdt* table);
 
+    sl::Opt<const Sras*> FindSras(const Srat* srat, SrasType type, const Sras* begin = nullptr);
     sl::Opt<const RhctNode*> FindRhctNode(const Rhct* rhct, RhctNodeType type, const RhctNode* begin = nullptr);
 }
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stddef.h>
+
+namespace Npk::Debug
+{
+    /* Kernel microbenchmarks, these are intended for comparing the performance of
+     * subsystems between changes rather than producing absolute numbers. Results are
+     * written to the kernel log. Each benchmark is enabled via a config option (see
+     * docs/KernelConfig.md), and they're run in the background once init has completed.
+     */
+    void StartBenchmarks();
+}
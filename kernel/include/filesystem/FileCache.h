@@ -25,6 +25,7 @@ namespace Npk::Filesystem
         sl::Atomic<size_t> references;
 
         FileCache* owner;
+        FileCacheUnit* nextOrphan;
         uintptr_t physBase;
         size_t offset;
         FcuFlags flags;
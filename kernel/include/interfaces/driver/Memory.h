@@ -34,10 +34,14 @@
 extern "C" {
 #endif
 
+#define NPK_PM_ANY_NODE ((size_t)-1)
+
 typedef struct
 {
     uintptr_t lower_limit;
     uintptr_t upper_limit;
+    size_t alignment;
+    size_t numa_node; //preferred numa node, or NPK_PM_ANY_NODE to use the calling core's node.
 } npk_pm_limits;
 
 typedef enum
@@ -66,6 +70,16 @@ typedef enum
    npk_file_vm_flag_back_now = 1 << 1,
 } npk_file_vm_flags;
 
+typedef enum
+{
+    npk_vm_advice_normal = 0,
+    npk_vm_advice_will_need = 1,
+    npk_vm_advice_dont_need = 2,
+    npk_vm_advice_sequential = 3,
+    npk_vm_advice_random = 4,
+    npk_vm_advice_huge_page = 5,
+} npk_vm_advice;
+
 typedef struct
 {
     npk_string filepath;
@@ -104,6 +118,7 @@ bool npk_vm_free(void* vm_ptr);
 bool npk_vm_get_flags(void* vm_ptr, REQUIRED npk_vm_flags* flags);
 bool npk_vm_set_flags(void* vm_ptr, npk_vm_flags flags);
 bool npk_vm_split(void* vm_ptr, REQUIRED uintptr_t* offset);
+bool npk_vm_advise(void* vm_ptr, size_t length, npk_vm_advice advice);
 
 void* npk_heap_alloc(size_t count);
 void npk_heap_free(void* ptr, size_t count);
@@ -8,5 +8,6 @@ namespace Npk::Interrupts
     void InitIpiMailbox();
     void ProcessIpiMail();
     void SendIpiMail(size_t core, void (*callback)(void*), void* arg);
+    bool TrySendIpiMail(size_t core, void (*callback)(void*), void* arg);
     void BroadcastPanicIpi();
 }
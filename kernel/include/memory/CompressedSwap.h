@@ -0,0 +1,86 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <Locks.h>
+#include <Optional.h>
+#include <containers/RBTree.h>
+
+namespace Npk
+{
+    struct HatMap;
+}
+
+namespace Npk::Memory
+{
+    struct SwapEntry
+    {
+        HatMap* map;
+        uintptr_t vaddr;
+        size_t length;
+
+        sl::RBTreeHook hook;
+
+        inline uint8_t* Data()
+        { return reinterpret_cast<uint8_t*>(this + 1); }
+    };
+
+    struct SwapEntryLess
+    {
+        bool operator()(const SwapEntry& a, const SwapEntry& b)
+        { return a.map < b.map || (a.map == b.map && a.vaddr < b.vaddr); }
+    };
+
+    using SwapEntryTree = sl::RBTree<SwapEntry, &SwapEntry::hook, SwapEntryLess>;
+
+    struct SwapScratch;
+
+    struct CompressedSwapStats
+    {
+        size_t storedPages;
+        size_t storedBytes; //compressed size of all stored pages
+        size_t rejectedPages; //pages that didnt compress well enough to be worth storing
+        size_t swapIns;
+        size_t swapInNanos; //total time spent in Load(), divide by swapIns for the average
+    };
+
+    /* A swap backend that keeps pages in memory, but compressed. This is similar in spirit to
+     * zswap/zram on linux: cold anonymous pages are compressed and their physical memory is freed,
+     * and when they're accessed again they're decompressed into a new page. Pages are identified
+     * by the address space and virtual address they were mapped at, the caller is expected to
+     * hold the lock of the VmRange containing the address for all operations.
+     */
+    class CompressedSwap
+    {
+    private:
+        sl::TicketLock lock;
+        SwapEntryTree entries;
+        SwapScratch* freeScratch; //compression buffers not in use by Store(), protected by `lock`
+        CompressedSwapStats stats;
+        bool enabled;
+
+        SwapEntry* FindEntry(HatMap* map, uintptr_t vaddr, bool orAbove);
+
+    public:
+        static CompressedSwap& Global();
+
+        void Init();
+
+        [[gnu::always_inline]]
+        inline bool Enabled() const
+        { return enabled; }
+
+        //compresses the page at `paddr` and stores it, returns whether it was stored. The caller
+        //is responsible for freeing the physical page afterwards.
+        bool Store(HatMap* map, uintptr_t vaddr, uintptr_t paddr);
+        //returns a new page with the contents previously stored for `vaddr`, or an empty optional if
+        //nothing is stored there or there's no memory for the page (use Contains() to tell these apart).
+        //Unless `keep` is set, the stored copy is freed once the page has been allocated.
+        sl::Opt<uintptr_t> Load(HatMap* map, uintptr_t vaddr, bool keep = false);
+        //frees any pages stored in [base, base + length), returning how many were freed.
+        size_t Discard(HatMap* map, uintptr_t base, size_t length);
+        //returns whether any pages in [base, base + length) are stored.
+        bool Contains(HatMap* map, uintptr_t base, size_t length);
+        CompressedSwapStats GetStats();
+    };
+}
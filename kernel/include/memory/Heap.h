@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <memory/Slab.h>
 #include <memory/Pool.h>
+#include <memory/Pmm.h>
 #include <debug/Log.h>
 #include <containers/List.h>
 
@@ -48,9 +49,13 @@ namespace Npk::Memory
             sl::SpinLock lock;
         } cacheDepot[SlabCount];
         PoolAlloc pool;
+        PmShrinker shrinker;
 
         void* DoSlabAlloc(size_t index);
         void DoSlabFree(size_t index, void* ptr);
+        void DrainDepot(size_t index);
+        static size_t ShrinkerCount(void* arg);
+        static size_t ShrinkerReclaim(void* arg, size_t pages);
 
     public:
         static Heap& Global();
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <tasking/Clock.h>
+#include <tasking/Waitable.h>
+
+namespace Npk::Memory
+{
+    //pages idle for at least this many passes are preferred by reclaim, when aging is running.
+    constexpr size_t ReclaimMinIdleAge = 2;
+
+    struct PageAgingStats
+    {
+        size_t passes;
+        size_t scanned; //translations looked at (cumulative)
+        size_t accessed; //translations found accessed since the previous pass (cumulative)
+    };
+
+    /* Page aging: a background thread periodically walks the translations of every user address
+     * space, testing and clearing the accessed flag set by the MMU. Each physical page's PageInfo
+     * holds its idle age, the number of passes since it was last seen accessed, and each VmRange
+     * keeps a histogram of these ages from its most recent pass. This gives reclaim something
+     * better than a single accessed bit to choose victims with, and an estimate of the working
+     * set of each address space (reported in VmmStats). Cached translations aren't flushed when the
+     * accessed flag is cleared, so a page may look idle for a pass or two longer than it really is.
+     */
+    class PageAging
+    {
+    private:
+        size_t intervalMs;
+        Tasking::Waitable wakeEvent;
+        Tasking::DpcStore wakeDpc;
+        Tasking::ClockEvent wakeClock;
+        PageAgingStats stats;
+
+        static void AgingThread(void* arg);
+        static void WakeDpc(void* arg);
+
+    public:
+        static PageAging& Global();
+
+        //reads the config and starts the aging thread, if enabled.
+        void Init();
+
+        [[gnu::always_inline]]
+        inline bool Enabled() const
+        { return intervalMs != 0; }
+
+        //updates the age of a page after its accessed flag was tested, returning the new age.
+        uint32_t Touch(uintptr_t paddr, bool accessed);
+        void CountPass(size_t scanned, size_t accessed);
+        PageAgingStats GetStats();
+    };
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <Locks.h>
+#include <Optional.h>
+#include <tasking/Clock.h>
+#include <tasking/Waitable.h>
+
+namespace Npk::Memory
+{
+    constexpr size_t MergeTableBuckets = 1024;
+    constexpr size_t MergeSeenSlots = 2048;
+
+    struct MergedPage
+    {
+        MergedPage* next;
+        uint32_t hash;
+        uintptr_t paddr;
+    };
+
+    struct PageMergerStats
+    {
+        size_t scanned;
+        size_t sharedPages; //distinct pages currently held by the merge table
+        size_t merges; //pages merged into an existing copy (cumulative)
+        size_t zeroMerges; //zero-filled pages replaced by the zero page (cumulative)
+    };
+
+    /* Same-page merging: a background thread periodically scans anonymous memory in user
+     * address spaces, looking for pages with identical contents. Pages are hashed on each visit
+     * and only considered once their hash is unchanged between two visits, so frequently written
+     * pages are left alone. Once two stable pages with the same hash have been seen, one of them
+     * is entered into the merge table and later copies are mapped to it instead, using the same
+     * copy-on-write sharing as AnonVmDriver::Duplicate(). The table holds its own share of each
+     * page (so they're marked with PmFlags::Merged), and drops a page once nothing maps it.
+     */
+    class PageMerger
+    {
+    private:
+        sl::TicketLock lock;
+        MergedPage* buckets[MergeTableBuckets];
+        struct
+        {
+            uint32_t hash;
+            uintptr_t paddr;
+        } seen[MergeSeenSlots]; //recently seen stable pages, indexed by hash
+        size_t reapCursor;
+        uint32_t zeroHash;
+        size_t pagesPerRound;
+        Tasking::Waitable wakeEvent;
+        Tasking::DpcStore wakeDpc;
+        Tasking::ClockEvent wakeClock;
+        PageMergerStats stats;
+
+        static void ScanThread(void* arg);
+        static void WakeDpc(void* arg);
+        void Reap(size_t bucketCount);
+
+    public:
+        static PageMerger& Global();
+
+        //reads the config and starts the scanner thread, if enabled.
+        void Init();
+
+        //hashes the page and returns whether the contents are the same as the last time it was checked.
+        bool IsStable(uintptr_t paddr);
+        //tries to find an identical copy of a (write-protected) page. Returns the physical page that should
+        //be mapped in its place (with a share already taken), `paddr` itself if the page has been entered
+        //into the merge table, or an empty optional if the page should be left as-is. `zeroPage` is
+        //returned for pages full of zeroes, if it's non-zero.
+        sl::Opt<uintptr_t> Merge(uintptr_t paddr, uintptr_t zeroPage);
+        //returns whether `paddr` is owned by the merge table.
+        bool IsMerged(uintptr_t paddr);
+        PageMergerStats GetStats();
+    };
+}
@@ -3,6 +3,9 @@
 #include <Locks.h>
 #include <Atomic.h>
 #include <Random.h>
+#include <Optional.h>
+#include <tasking/RunLevels.h>
+#include <tasking/Waitable.h>
 
 namespace Npk { struct MemmapEntry; } //defined in interfaces/loader/Generic.h
 
@@ -12,30 +15,87 @@ namespace Npk::Memory
     {
         Used = 1 << 0,
         Busy = 1 << 1,
+        Merged = 1 << 2, //held by the same-page merging table, see PageMerging.h
     };
 
     struct PageInfo
     {
         sl::Atomic<PmFlags> flags;
         uintptr_t link;
+        //number of additional mappings sharing this page (copy-on-write), 0 if it has a single owner.
+        sl::Atomic<size_t> shares;
+        //content hash from the last time the same-page merging scanner looked at this page.
+        uint32_t mergeHash;
+        //number of aging passes since the page was last seen accessed, see PageAging.h.
+        uint16_t idleAge;
+        //number of MDLs covering this page, while non-zero it must stay mapped where it is.
+        sl::Atomic<uint16_t> pins;
     };
 
+    constexpr size_t PmBuddyOrders = 16;
+    constexpr uint8_t PmBuddyNoBlock = 0xFF;
+
+    //stored in the first page of each free block within a contiguous zone.
+    struct PmBuddyEntry
+    {
+        PmBuddyEntry* next;
+        PmBuddyEntry* prev;
+    };
+
+    /* Contiguous zones are managed by a binary buddy allocator: free memory is kept as
+     * naturally aligned power-of-two blocks on per-order lists, and blocks are merged with
+     * their buddy when freed. The bitmap tracks which pages are in use (for catching double
+     * frees), and `orders` stores the order of the free block starting at each page, or
+     * PmBuddyNoBlock if a free block doesnt begin there.
+     */
     struct PmContigZone
     {
         sl::RunLevelLock<RunLevel::Dpc> lock;
         uint8_t* bitmap;
+        uint8_t* orders;
+        PmBuddyEntry* freeLists[PmBuddyOrders];
         uintptr_t base;
         size_t count;
+        size_t freeCount;
+        size_t node;
 
         PmContigZone* next;
     };
 
-    struct PmInfoSegment
+    constexpr size_t PmAnyNode = -1ul;
+
+    struct PmAllocLimits
     {
-        PmInfoSegment* next;
-        uintptr_t base;
-        size_t length;
-        PageInfo* info;
+        uintptr_t lowerBound;
+        uintptr_t upperBound;
+        size_t alignment;
+        size_t node; //preferred numa node, or PmAnyNode to use the calling core's node.
+
+        constexpr PmAllocLimits() : lowerBound(0), upperBound(-1ul), alignment(1), node(PmAnyNode)
+        {}
+    };
+
+    constexpr size_t PmInfoLeafBits = 9;
+    constexpr size_t PmInfoMidBits = 9;
+    constexpr size_t PmInfoLeafEntries = 1ul << PmInfoLeafBits;
+    constexpr size_t PmInfoMidEntries = 1ul << PmInfoMidBits;
+
+    /* PageInfo structs are found via a radix table indexed by page frame number: the root
+     * table (sized to cover the highest physical address at boot) points to mid tables,
+     * which point to leaves holding the PageInfo for a naturally aligned run of pages.
+     * Tables are only ever added, never removed, so lookups dont need to take any locks.
+     * The `present` bitmap tracks which pages within a leaf are actually backed by memory
+     * we manage, so holes in the physical address space are still reported correctly.
+     */
+    struct PmInfoLeaf
+    {
+        sl::Atomic<uint64_t> present[PmInfoLeafEntries / 64];
+        PageInfo info[PmInfoLeafEntries];
+    };
+
+    struct PmInfoMid
+    {
+        sl::Atomic<PmInfoLeaf*> leaves[PmInfoMidEntries];
     };
 
     struct PmFreeEntry
@@ -44,18 +104,169 @@ namespace Npk::Memory
         size_t runLength;
     };
 
+    constexpr size_t PmMaxNodes = 8;
+    constexpr size_t PmMaxNodeRanges = 32;
+    constexpr uint8_t PmLocalDistance = 10;
+    constexpr uint8_t PmRemoteDistance = 20;
+
+    struct PmNodeRange
+    {
+        uintptr_t base;
+        size_t length;
+        size_t node;
+    };
+
+    /* Each numa node has its own freelist, populated with the memory the SRAT says belongs
+     * to that node. Nodes are indexed in the order they're discovered, `domain` is the
+     * acpi proximity domain. `fallback` lists all nodes (including this one) ordered by
+     * their SLIT distance from this node, closest first. Without an SRAT all memory
+     * belongs to node 0.
+     */
+    struct PmNode
+    {
+        sl::RunLevelLock<RunLevel::Dpc> lock; //TODO: lockless
+        PmFreeEntry* head;
+        size_t freePages;
+        uint32_t domain;
+        uint8_t distances[PmMaxNodes];
+        size_t fallback[PmMaxNodes];
+
+        sl::Atomic<size_t> allocs;
+        sl::Atomic<size_t> frees;
+    };
+
+    struct PmNodeStats
+    {
+        uint32_t domain;
+        size_t freePages;
+        size_t allocs;
+        size_t frees;
+    };
+
+    constexpr size_t PmCoreCacheDepth = 64;
+
+    /* Per-core magazine of free pages, used to satisfy single page allocations
+     * without touching the global freelist (and its lock). The cache is refilled
+     * from the freelist up to the low watermark when empty, and drained back down
+     * to the low watermark once it reaches the high watermark. Only the owning core
+     * modifies the cache, and it does so at RunLevel::Dpc to prevent preemption.
+     */
+    struct PmCoreCache
+    {
+        PmCoreCache* next;
+        size_t coreId;
+        size_t node;
+        size_t count;
+        size_t lowWatermark;
+        size_t highWatermark;
+
+        size_t hits;
+        size_t misses;
+        size_t refills;
+        size_t drains;
+
+        Tasking::DpcStore drainDpc;
+        sl::Atomic<bool> drainPending; //drainDpc is queued
+        uintptr_t pages[PmCoreCacheDepth];
+    };
+
+    struct PmCacheStats
+    {
+        size_t cached;
+        size_t hits;
+        size_t misses;
+        size_t refills;
+        size_t drains;
+    };
+
+    struct PmZeroPoolStats
+    {
+        size_t pooled;
+        size_t capacity;
+        size_t hits;
+        size_t misses;
+    };
+
+    using PmShrinkerCount = size_t (*)(void* arg);
+    using PmShrinkerReclaim = size_t (*)(void* arg, size_t pages);
+
+    /* Subsystems that hold onto memory they could give back (caches, empty slabs) register
+     * a shrinker with the PMM. `count` returns an estimate of how many pages could be freed,
+     * and `reclaim` tries to free up to the requested number of pages, returning how many
+     * were actually freed. Shrinkers are called in order of ascending priority, so cheaper
+     * sources of memory should use lower numbers. Shrinkers marked `directSafe` may be
+     * called by a thread that is allocating memory, so they must not take any locks that
+     * could be held across a call to the PMM. Reclaim callbacks may run while the list of
+     * shrinkers is read-locked, so they must not register or unregister shrinkers.
+     */
+    struct PmShrinker
+    {
+        PmShrinker* next;
+        const char* name;
+        size_t priority;
+        bool directSafe;
+        PmShrinkerCount count;
+        PmShrinkerReclaim reclaim;
+        void* arg;
+    };
+
+    struct PmReclaimStats
+    {
+        size_t freePages;
+        size_t lowWatermark;
+        size_t highWatermark;
+        size_t directReclaims;
+        size_t backgroundReclaims;
+        size_t pagesReclaimed;
+    };
+
     class PhysicalMemoryManager
     {
     private:
         sl::RwLock zonesLock;
-        sl::RwLock segmentsLock;
+        sl::SpinLock infoLock;
         PmContigZone* zones;
-        PmInfoSegment* segments;
+        sl::Atomic<PmInfoMid*>* infoRoot;
+        size_t infoRootCount;
+        PmNode nodes[PmMaxNodes];
+        sl::Atomic<size_t> nodeCount;
+        PmNodeRange nodeRanges[PmMaxNodeRanges];
+        sl::Atomic<size_t> nodeRangeCount;
+        struct
+        {
+            sl::SpinLock lock;
+            PmCoreCache* head;
+            size_t lowWatermark;
+            size_t highWatermark;
+        } coreCaches;
+        struct
+        {
+            sl::RunLevelLock<RunLevel::Dpc> lock;
+            uintptr_t* pages;
+            size_t count;
+            size_t capacity;
+            size_t lowWatermark;
+            sl::Atomic<size_t> hits;
+            sl::Atomic<size_t> misses;
+            sl::Atomic<bool> refillPending;
+            Tasking::Waitable refillEvent;
+            PmShrinker shrinker;
+        } zeroPool;
         struct
         {
-            sl::RunLevelLock<RunLevel::Dpc> lock; //TODO: lockless
-            PmFreeEntry* head;
-        } freelist;
+            sl::RwLock lock;
+            PmShrinker* head;
+            size_t lowWatermark;
+            size_t highWatermark;
+            bool ready;
+            size_t threadId;
+            sl::Atomic<bool> pending;
+            sl::Atomic<bool> directActive;
+            Tasking::Waitable event;
+            sl::Atomic<size_t> directReclaims;
+            sl::Atomic<size_t> backgroundReclaims;
+            sl::Atomic<size_t> pagesReclaimed;
+        } reclaim;
 
         sl::XoshiroRng rng;
         bool trashAfterUse;
@@ -63,6 +274,28 @@ namespace Npk::Memory
 
         void IngestMemory(sl::Span<MemmapEntry> entries, size_t contiguousQuota);
         void* AllocMeta(size_t size);
+        void AddPageInfo(sl::Span<MemmapEntry> entries, uintptr_t base, size_t length);
+        void TrashPage(uintptr_t physAddr);
+
+        size_t AddNode(uint32_t domain, size_t& count);
+        size_t NodeOf(uintptr_t physAddr, uintptr_t* rangeEnd = nullptr);
+        bool NodeRangeKnown(uintptr_t base, size_t length);
+        size_t FindCoreNode(size_t hwId);
+        size_t LocalNode();
+        void FreelistAddRun(uintptr_t base, size_t count);
+        size_t FreelistPop(size_t node, uintptr_t* pages, size_t count);
+        size_t FreelistPopNear(size_t node, uintptr_t* pages, size_t count);
+        void FreelistPush(const uintptr_t* pages, size_t count);
+        PmCoreCache* LocalCache();
+        void DrainCache(PmCoreCache* cache, size_t target);
+        static void DrainCacheDpc(void* arg);
+        static void ZeroPoolThread(void* arg);
+        static size_t ZeroPoolCount(void* arg);
+        static size_t ZeroPoolReclaim(void* arg, size_t pages);
+        uintptr_t DoAlloc(size_t count, PmAllocLimits limits);
+        size_t RunShrinkers(size_t pages, bool direct);
+        bool DirectReclaim(size_t pages);
+        static void ReclaimThread(void* arg);
 
     public:
         PhysicalMemoryManager() = default;
@@ -74,10 +307,37 @@ namespace Npk::Memory
         static PhysicalMemoryManager& Global();
 
         void Init();
+        //splits physical memory into numa nodes based on the SRAT/SLIT, if present.
+        void InitNuma();
         void ReclaimBootMemory();
         PageInfo* Lookup(uintptr_t physAddr);
 
-        uintptr_t Alloc(size_t count = 1);
+        //creates the page cache for the current core, called once per core during init.
+        void InitLocalCache();
+        //returns all pages held by the current core's cache to the global freelist.
+        void DrainLocalCache();
+        //requests that another core drains its page cache, this happens asynchronously.
+        void DrainCache(size_t coreId);
+        sl::Opt<PmCacheStats> GetCacheStats(size_t coreId);
+        size_t NodeCount();
+        sl::Opt<PmNodeStats> GetNodeStats(size_t node);
+
+        //starts the background thread that keeps a pool of pre-zeroed pages topped up.
+        void InitZeroPool();
+        PmZeroPoolStats GetZeroPoolStats();
+
+        //starts the background reclaim thread, shrinkers can be registered before this.
+        void InitReclaim();
+        //shrinkers must remain valid until they are unregistered.
+        void RegisterShrinker(PmShrinker* shrinker);
+        void UnregisterShrinker(PmShrinker* shrinker);
+        //returns an estimate of the number of free pages, across all nodes and zones.
+        size_t FreePages();
+        PmReclaimStats GetReclaimStats();
+
+        uintptr_t Alloc(size_t count = 1, PmAllocLimits limits = {});
+        //allocates a single page filled with zeroes, preferring pages from the pre-zeroed pool.
+        uintptr_t AllocZeroed();
         void Free(uintptr_t base, size_t count = 1);
     };
 }
@@ -32,6 +32,8 @@ namespace Npk::Memory
 
         SlabSegment* CreateSegment();
         void DestroySegment(SlabSegment* seg);
+        size_t SegmentPages();
+        bool SegmentEmpty(SlabSegment* seg);
 
     public:
         void Init(size_t slabBytes, size_t slabCountPerSeg);
@@ -42,6 +44,10 @@ namespace Npk::Memory
         bool Free(void* ptr);
 
         void CheckBounds();
+        //returns how many pages could be freed by Trim().
+        size_t TrimmablePages();
+        //frees segments with no allocated slabs, up to `maxPages` pages. Returns number of pages freed.
+        size_t Trim(size_t maxPages);
 
         [[gnu::always_inline]]
         inline size_t Size()
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <Atomic.h>
+
+namespace Npk
+{
+    struct HatMap;
+}
+
+namespace Npk::Memory
+{
+    /* Keeps TLBs on other cores coherent with changes made to an address space. The HAT calls
+     * TlbShootdown() after invalidating translations locally, which sends a single IPI to each
+     * core that has the address space loaded (or to every core, for the kernel map) and waits for
+     * them to flush the affected range.
+     * Cores running kernel threads are in 'lazy' mode: they keep whatever address space was
+     * last loaded but don't access the user half of it, so they aren't interrupted for changes
+     * to user address spaces. Instead each address space has a generation count which is
+     * incremented for every shootdown, and when a core leaves lazy mode it flushes its TLB if
+     * the generation has changed since it last flushed.
+     * The same generation is used to manage hardware address space tags (PCIDs on x86_64, ASIDs
+     * on riscv64): each core keeps a small set of recently used tags, and translations cached
+     * under a tag are only flushed if the address space has changed since it was last loaded.
+     */
+    using TlbGeneration = sl::Atomic<size_t>;
+
+    //the maximum number of hardware tags cached per-core.
+    constexpr size_t MaxTlbTags = 16;
+
+    struct TlbContext
+    {
+        TlbGeneration generation;
+        size_t id; //unique for the lifetime of the system, 0 is the kernel map.
+    };
+
+    struct TlbLoadResult
+    {
+        size_t tag; //0 means untagged
+        bool flush; //whether translations previously cached under `tag` must be discarded.
+    };
+
+    struct TlbShootdownStats
+    {
+        size_t shootdowns;
+        size_t ipisSent;
+        size_t pagesInvalidated;
+        size_t lazySkips;
+        size_t lazyFlushes;
+        size_t tagHits;
+        size_t tagMisses;
+    };
+
+    //must be called on each core after its ipi mailbox is ready, and the kernel map is loaded.
+    void InitTlbShootdown();
+    //must be called by the HAT for each address space it creates (except the kernel map).
+    void InitTlbContext(TlbContext& context);
+    //called by the HAT when an address space is loaded on the local core. If `maxTags` is
+    //non-zero a hardware tag in the range [1, maxTags] is selected for the address space.
+    TlbLoadResult TlbMapLoaded(HatMap* map, TlbContext& context, size_t maxTags);
+    void TlbEnterLazy();
+    void TlbExitLazy();
+    //invalidates [base, base + length) on all other cores that may have cached translations
+    //from `map`. The local core is expected to have already flushed these.
+    void TlbShootdown(HatMap* map, TlbContext& context, uintptr_t base, size_t length);
+    //ensures no core (including this one) has `map` loaded, cores that did are switched to
+    //the kernel map. Must be called before an address space is destroyed.
+    void TlbReleaseMap(HatMap* map);
+    TlbShootdownStats GetTlbShootdownStats();
+}
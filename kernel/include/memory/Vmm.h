@@ -5,6 +5,7 @@
 #include <Locks.h>
 #include <Optional.h>
 #include <memory/VmObject.h>
+#include <memory/Pmm.h>
 #include <containers/RBTree.h>
 #include <Flags.h>
 #include <Atomic.h>
@@ -17,6 +18,40 @@ namespace Npk
 
 namespace Npk::Memory
 {
+    //Hints about how part of an address space will be used, see VMM::Advise().
+    enum class VmAdvice
+    {
+        Normal, //no particular access pattern, fault-around adapts to what it sees.
+        WillNeed, //memory will be accessed soon, back it ahead of time (asynchronously).
+        DontNeed, //contents are no longer needed, free the backing memory but keep the range.
+        Sequential, //memory will be accessed in order, always map as far ahead as possible.
+        Random, //memory will be accessed in no particular order, dont map ahead.
+        HugePage, //prefer superpages over base pages for backing this memory.
+    };
+
+    //Recent fault activity within a range, used by VmDrivers to decide how much to map
+    //around a fault. Only accessed while holding the range's mapLock.
+    struct VmFaultHistory
+    {
+        uintptr_t lastFault;
+        uintptr_t windowTop;
+        size_t window;
+        size_t pendingAhead;
+        VmAdvice pattern; //one of Normal, Sequential or Random.
+    };
+
+    constexpr size_t VmAgeBuckets = 8;
+    constexpr size_t VmWorkingSetAge = 4; //pages idle for fewer aging passes than this count as the working set.
+
+    //Idle page ages within a range as of the last aging pass (see PageAging.h). Bucket 0 counts pages
+    //accessed since the previous pass, bucket N counts pages idle for [2^(N-1), 2^N) passes and the
+    //last bucket also includes anything older. Counts are in base pages.
+    struct VmAgeHistogram
+    {
+        size_t pages[VmAgeBuckets];
+        size_t workingSet; //in bytes
+    };
+
     struct VmRange
     {
         uintptr_t base;
@@ -24,7 +59,10 @@ namespace Npk::Memory
         VmFlags flags;
         size_t offset;
         void* token;
-        sl::Atomic<size_t> mdlCount;
+        sl::Atomic<size_t> mdlCount; //number of outstanding MDLs within this range
+        sl::TicketLock mapLock; //serializes VmDriver operations (faults, attach, etc) on this range.
+        mutable VmFaultHistory faultHistory;
+        VmAgeHistogram ages; //protected by mapLock
 
         sl::RBTreeHook hook;
 
@@ -40,6 +78,15 @@ namespace Npk::Memory
 
     using VmRangeTree = sl::RBTree<VmRange, &VmRange::hook, VmRangeLess>;
 
+    //an outstanding MDL, the pages it covers are pinned (see PageInfo::pins).
+    struct VmPinnedSpan
+    {
+        VmPinnedSpan* next;
+        uintptr_t base;
+        size_t length;
+        sl::Vector<uintptr_t> pinned; //physical pages that were pinned, one per granule
+    };
+
     struct VmHole
     {
         uintptr_t base;
@@ -72,13 +119,40 @@ namespace Npk::Memory
         Count
     };
 
+    /* Metadata slabs occupy a single page with this header at the start, so the slab owning
+     * an object can be found by aligning its address down. Free objects are kept in a per-slab
+     * freelist, with the link stored in the first word of the object. Both VmRange and VmHole
+     * begin with their base address, so this never overwrites the tree hooks: FindRange()
+     * may still be walking a range after it's freed (see there for details).
+     */
     struct VmmMetaSlab
     {
         VmmMetaSlab* next;
-        uint8_t* bitmap;
-        uintptr_t data;
+        VmmMetaSlab* prev;
+        void* freelist;
         size_t free;
         size_t total;
+        VmmMetaType type;
+    };
+
+    constexpr size_t VmQuantumClasses = 8;
+    constexpr size_t VmQuantumMaxDepth = 16;
+    constexpr size_t VmMetaCacheDepth = 16;
+
+    /* Per-core caches of free kernel address space, based on the quantum caches described
+     * in Bonwick's vmem paper. Class N holds spans of (N + 1) base pages, these are still
+     * reserved in the hole tree and keep their VmRange struct, so allocating from the cache
+     * doesn't touch the hole tree or the meta allocators (or their locks). Free metadata
+     * structs are also cached here, for allocations that miss the quantum cache. Only the owning
+     * core modifies the cache, and it does so at RunLevel::Dpc to prevent preemption.
+     */
+    struct VmQuantumCache
+    {
+        size_t counts[VmQuantumClasses];
+        VmRange* spans[VmQuantumClasses][VmQuantumMaxDepth];
+
+        size_t metaCounts[(size_t)VmmMetaType::Count];
+        void* metas[(size_t)VmmMetaType::Count][VmMetaCacheDepth];
     };
 
     enum class VmFaultFlag
@@ -97,13 +171,32 @@ namespace Npk::Memory
         size_t anonRanges;
         size_t anonWorkingSize;
         size_t anonResidentSize;
+        size_t anonSwappedSize;
+        size_t anonMergedSize; //mapped from pages shared by same-page merging, rather than a private copy
+        size_t workingSetSize; //estimated from the last aging pass of each range
         size_t fileRanges;
         size_t fileWorkingSize;
         size_t fileResidentSize;
         size_t mmioRanges;
         size_t mmioWorkingSize;
+        size_t faultAheadMapped;
+        size_t faultsAvoided;
+        size_t prefetchedSize; //backed ahead of time due to VmAdvice::WillNeed
+        size_t droppedSize; //freed due to VmAdvice::DontNeed
+        size_t quantumHits;
+        size_t quantumMisses;
+        size_t quantumCached;
+        size_t metaSlabPages;
     };
 
+    //VmDriver operations on different ranges can run in parallel, so the shared stats
+    //are updated atomically. Readers only ever take a snapshot, so no ordering is needed.
+    inline void StatAdd(size_t& stat, size_t amount)
+    { __atomic_add_fetch(&stat, amount, __ATOMIC_RELAXED); }
+
+    inline void StatSub(size_t& stat, size_t amount)
+    { __atomic_sub_fetch(&stat, amount, __ATOMIC_RELAXED); }
+
     //badge pattern
     class VirtualMemoryManager;
     class VmmKey
@@ -116,35 +209,76 @@ namespace Npk::Memory
     {
     private:
         sl::TicketLock rangesLock;
+        sl::Atomic<size_t> rangesSeq; //odd while the ranges tree is being modified, see FindRange().
         VmRangeTree ranges;
         sl::TicketLock holesLock;
         VmHoleTree holes;
         sl::TicketLock allocLock;
 
-        VmmMetaSlab* metaSlabs[(size_t)VmmMetaType::Count];
+        VmmMetaSlab* metaSlabs[(size_t)VmmMetaType::Count]; //slabs with free objects
+        VmmMetaSlab* fullMetaSlabs[(size_t)VmmMetaType::Count];
+        size_t emptyMetaSlabs[(size_t)VmmMetaType::Count];
         sl::TicketLock metaSlabLocks[(size_t)VmmMetaType::Count];
         
-        sl::TicketLock mapLock;
         HatMap* hatMap;
 
         uintptr_t globalLowerBound;
         uintptr_t globalUpperBound;
         VmmStats stats;
+        PmShrinker metaShrinker;
+        PmShrinker swapShrinker;
+        uintptr_t swapHand;
+        VirtualMemoryManager* nextUser;
+        uintptr_t mergeHand;
+        sl::TicketLock pinsLock;
+        VmPinnedSpan* pinnedSpans;
 
         VmmMetaSlab* CreateMetaSlab(VmmMetaType type);
-        bool DestroyMetaSlab(VmmMetaType type);
+        bool DestroyMetaSlab(VmmMetaType type, bool keepOne = false);
+        void* MetaSlabPop(VmmMetaType type);
+        VmmMetaSlab* MetaSlabPush(void* ptr, VmmMetaType type);
         void* AllocMeta(VmmMetaType type);
         void FreeMeta(void* ptr, VmmMetaType type);
+        static size_t MetaShrinkerCount(void* arg);
+        static size_t MetaShrinkerReclaim(void* arg, size_t pages);
+        static size_t SwapShrinkerCount(void* arg);
+        static size_t SwapShrinkerReclaim(void* arg, size_t pages);
 
         void CommonInit();
         void AdjustHole(VmHole* target, size_t offset, size_t length);
+        sl::Opt<uintptr_t> ReserveSpace(size_t length, VmAllocLimits limits = {});
+        void ReleaseSpace(uintptr_t base, size_t length);
+        VmQuantumCache* LocalQuantumCache();
+        VmRange* QuantumAlloc(size_t length, VmAllocLimits limits);
+        bool QuantumFree(VmRange* range);
+        void DrainLocalQuantumCache();
+        void BeginRangesWrite();
+        void EndRangesWrite();
+        VmRange* WalkRanges(uintptr_t addr, size_t maxDepth);
         VmRange* FindRange(uintptr_t addr);
+        VmRange* NextRange(uintptr_t addr);
+        size_t MergeRanges(size_t budget);
+        size_t AgeRanges();
+        static void UnpinPages(VmPinnedSpan& span);
+        static size_t RemapPages(VirtualMemoryManager& source, uintptr_t srcAddr, VirtualMemoryManager& dest,
+            uintptr_t destAddr, size_t length);
+        static void PrefetchThread(void* arg);
+        bool QueuePrefetch(uintptr_t base, size_t length);
+        void Prefetch(uintptr_t base, size_t length);
 
     public:
         static void InitKernel();
+        //creates this core's cache of kernel address space.
+        static void InitLocalCache();
         static VirtualMemoryManager& Kernel();
         static VirtualMemoryManager& Current();
         static bool CurrentActive();
+        //runs the same-page merging scanner over user VMMs, returns the number of pages looked at.
+        static size_t MergeScan(size_t budget);
+        //runs an aging pass over all user VMMs, returns the number of pages looked at.
+        static size_t AgeScan();
+        //starts the thread that handles VmAdvice::WillNeed, until then the advice is applied synchronously.
+        static void InitPrefetch();
 
         VirtualMemoryManager();
         VirtualMemoryManager(VmmKey);
@@ -161,11 +295,19 @@ namespace Npk::Memory
         bool HandleFault(uintptr_t addr, VmFaultFlags flags);
         //get access to this VMM's statistics. Nothing too useful here, mainly used for fun screenshots.
         VmmStats GetStats() const;
+        //returns the idle page histogram of the range containing `addr`, from its last aging pass.
+        sl::Opt<VmAgeHistogram> GetAgeHistogram(uintptr_t addr);
+        //returns the base of the lowest page in [base, base + length) that has been written to since it
+        //was mapped, this area must be inside a single range. Used to measure how deep stacks have grown.
+        sl::Opt<uintptr_t> LowestWritten(uintptr_t base, size_t length);
         
         //allocates virtual memory and returns the base address of the allocated addresses.
         sl::Opt<uintptr_t> Alloc(size_t length, uintptr_t initArg, VmFlags flags, VmAllocLimits = {});
         //frees virtual memory, returns whether freeing was successful or not.
         bool Free(uintptr_t base);
+        //creates a copy of an existing range in `dest` (which can be this VMM), returning the base address
+        //of the copy. Anonymous memory is shared copy-on-write, so this is cheap even for large ranges.
+        sl::Opt<uintptr_t> Duplicate(uintptr_t base, VirtualMemoryManager& dest);
         //gets the flags associated with a range of virtual memory.
         sl::Opt<VmFlags> GetFlags(uintptr_t base, size_t length = 0);
         //attempts to update the flags for a range of virtual memory, returns whether the operation
@@ -176,6 +318,10 @@ namespace Npk::Memory
         //actual offset the split occured at is returned (it may not be exactly what was requested
         //due to MMU constraints).
         sl::Opt<uintptr_t> Split(uintptr_t base, uintptr_t offset);
+        //tells the VMM (and the VmDrivers backing the memory) how [base, base + length) will be used,
+        //see VmAdvice for what each hint does. The area is expanded to whole pages and may span
+        //multiple ranges. Advice is only a hint, returns whether all of it was acted on.
+        bool Advise(uintptr_t base, size_t length, VmAdvice advice);
 
         //checks if some virtual memory exists, and can optionally check it's permissions
         //and type via the flags argument.
@@ -186,15 +332,20 @@ namespace Npk::Memory
         sl::Opt<uintptr_t> GetPhysical(uintptr_t vaddr);
 
         //copies data from the current address space into the one managed by this VMM.
-        //If virtual memory in this VMM isn't backed, it will trigger a page fault to
-        //provide backing before continuing the copy.
-        size_t CopyIn(void* foreignBase, void* localBase, size_t length);
-        //copies data from this VMM's address space into the current one. This function
-        //won't manually trigger page faults if the destination memory doesn't exist, 
-        //it honours whatever behaviour the platform uses.
-        size_t CopyOut(void* localBase, void* foreignBase, size_t length);
+        //If virtual memory in this VMM isn't backed (or is shared copy-on-write), it will trigger
+        //a page fault to provide backing before continuing the copy. If `allowRemap` is set, large
+        //transfers where both buffers have the same offset within a page may share the pages in
+        //the middle copy-on-write instead of copying them, leaving the local buffer read-only
+        //until it's next written to.
+        size_t CopyIn(void* foreignBase, void* localBase, size_t length, bool allowRemap = false);
+        //copies data from this VMM's address space into the current one. Memory in this VMM
+        //that isn't backed is faulted in, but this function won't manually trigger page faults
+        //if the destination memory doesn't exist, it honours whatever behaviour the platform uses.
+        //`allowRemap` is the same as for CopyIn().
+        size_t CopyOut(void* localBase, void* foreignBase, size_t length, bool allowRemap = false);
         //gets a memory descriptor list for a range of virtual memory, pinning it in place and allowing
-        //for directly access to the physical backing memory.
+        //for directly access to the physical backing memory. Only the pages covered by the MDL are pinned,
+        //and physically contiguous pages are returned as a single MdlPtr.
         sl::Opt<Mdl> AcquireMdl(uintptr_t base, size_t length);
         //allows pinned memory regions for an MDL to become fully virtual again.
         void ReleaseMdl(uintptr_t base);
@@ -8,6 +8,7 @@ namespace Npk::Memory::Virtual
     {
         FaultHandler = 1 << 0,
         ZeroPage = 1 << 1,
+        Superpages = 1 << 2,
     };
 
     class AnonVmDriver : public VmDriver
@@ -15,12 +16,37 @@ namespace Npk::Memory::Virtual
     private:
         uintptr_t zeroPage;
 
+        size_t superpageMode;
+
         struct
         {
             bool faultHandler;
             bool zeroPage;
+            bool superpages;
         } features;
 
+        //passed to the HatPhysFunc callbacks during Attach(), counts the pages they've handed out.
+        struct AnonMapArg
+        {
+            AnonVmDriver* driver;
+            size_t mapped;
+        };
+
+        bool SuperpageEligible(VmDriverContext& context, size_t hatMode, uintptr_t where);
+        bool MapSuperpage(VmDriverContext& context, size_t hatMode, uintptr_t where, HatFlags flags);
+        bool BreakShare(VmDriverContext& context, uintptr_t vaddr, uintptr_t paddr, HatFlags flags);
+        void ReleasePage(uintptr_t paddr, size_t length);
+        bool IsShared(uintptr_t paddr);
+        bool IsPinned(uintptr_t paddr);
+        sl::Opt<bool> BackPage(VmDriverContext& context, uintptr_t vaddr, HatFlags flags);
+        bool BackChunkBase(VmDriverContext& context, uintptr_t chunkBase, HatFlags flags);
+        size_t PrefetchPages(VmDriverContext& context, uintptr_t base, size_t length);
+        bool DropPages(VmDriverContext& context, uintptr_t base, size_t length);
+        AdviseResult PreferSuperpages(VmDriverContext& context, uintptr_t base, size_t length);
+        static sl::Opt<uintptr_t> ZeroPagePhys(void* arg, size_t offset);
+        static sl::Opt<uintptr_t> AllocZeroedPhys(void* arg, size_t offset);
+        static HatFlags ProtectFilter(void* arg, uintptr_t paddr, size_t mode, HatFlags flags);
+
     public:
         void Init(uintptr_t enableFeatures) override;
 
@@ -30,5 +56,11 @@ namespace Npk::Memory::Virtual
         QueryResult Query(size_t length, VmFlags flags, uintptr_t attachArg) override;
         AttachResult Attach(VmDriverContext& context, const QueryResult& query, uintptr_t attachArg) override;
         bool Detach(VmDriverContext& context) override;
+        AttachResult Duplicate(VmDriverContext& source, VmDriverContext& dest) override;
+        size_t Reclaim(VmDriverContext& context, uintptr_t& cursor, size_t pages, size_t minAge) override;
+        size_t Merge(VmDriverContext& context, uintptr_t& cursor, size_t budget) override;
+        size_t SharePages(VmDriverContext& source, uintptr_t srcAddr, VmDriverContext& dest, 
+            uintptr_t destAddr, size_t length) override;
+        AdviseResult Advise(VmDriverContext& context, uintptr_t base, size_t length, VmAdvice advice) override;
     };
 }
@@ -17,5 +17,6 @@ namespace Npk::Memory::Virtual
         SplitResult Split(VmDriverContext& context, size_t offset) override;
         AttachResult Attach(VmDriverContext& context, const QueryResult& query, uintptr_t attachArg) override;
         bool Detach(VmDriverContext& context) override;
+        AttachResult Duplicate(VmDriverContext& source, VmDriverContext& dest) override;
     };
 }
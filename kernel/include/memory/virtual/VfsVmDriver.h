@@ -28,6 +28,8 @@ namespace Npk::Memory::Virtual
             bool faultHandler;
         } features;
 
+        bool PrefetchPages(VmDriverContext& context, uintptr_t base, size_t length);
+
     public:
         void Init(uintptr_t enableFeatures) override;
 
@@ -37,6 +39,8 @@ namespace Npk::Memory::Virtual
         QueryResult Query(size_t length, VmFlags flags, uintptr_t attachArg) override;
         AttachResult Attach(VmDriverContext& context, const QueryResult& query, uintptr_t attachArg) override;
         bool Detach(VmDriverContext& context) override;
+        AttachResult Duplicate(VmDriverContext& source, VmDriverContext& dest) override;
+        AdviseResult Advise(VmDriverContext& context, uintptr_t base, size_t length, VmAdvice advice) override;
     };
 }
 
@@ -60,6 +60,12 @@ namespace Npk::Memory::Virtual
         bool success = false;
     };
 
+    struct AdviseResult
+    {
+        void* token = nullptr; //if non-null, replaces the range's token.
+        bool success = false;
+    };
+
     struct VmDriverContext
     {
         sl::TicketLock& lock;
@@ -68,6 +74,21 @@ namespace Npk::Memory::Virtual
         VmmStats& stats;
     };
 
+    /* Fault-around: when a fault occurs VmDrivers can map more than just the faulting granule,
+     * saving future faults if the program is accessing memory sequentially. The amount mapped
+     * is adjusted per-range: the window doubles each time a fault lands at the end of the previous
+     * window, and halves for faults anywhere else. Ranges advised as VmAdvice::Sequential
+     * always use the largest window, and VmAdvice::Random ranges only map the faulting granule.
+     * These functions must be called with the range's lock held.
+     */
+    //returns the number of granules to map (starting at `where`, including the faulting granule).
+    size_t FaultAroundBegin(VmDriverContext& context, uintptr_t where, size_t granuleSize, size_t initialWindow);
+    //`top` is the end of the area that was mapped, `mappedAhead` is how many granules were mapped
+    //in addition to the faulting one.
+    void FaultAroundEnd(VmDriverContext& context, uintptr_t top, size_t mappedAhead);
+    //sets the access pattern used for the range, `pattern` must be Normal, Sequential or Random.
+    void FaultAroundSetPattern(VmDriverContext& context, VmAdvice pattern);
+
     /* Each virtual memory allocation has a type associated with it, the type determines
      * which VmDriver is responsible for backing this memory. The current VmDrivers are:
      * - Kernel: this maps the kernel binary itself at startup and is also used to map MMIO.
@@ -122,5 +143,61 @@ namespace Npk::Memory::Virtual
         //that was previously attached there. The VmDriver should also clean up any auxiliary
         //resources here (used for communicating between Attach() and HandleFault() calls).
         virtual bool Detach(VmDriverContext& context) = 0;
+
+        //The VMM wants to create a copy of an existing range (`source`) in the space reserved by `dest`,
+        //which may belong to a different VMM. The contents of the new range should match the source
+        //range at the time of the call, but the driver is free to share backing memory between them.
+        //If this fails the driver must undo anything it did to `dest`, Detach() is not called for it.
+        virtual AttachResult Duplicate(VmDriverContext& source, VmDriverContext& dest) = 0;
+
+        //The VMM is under memory pressure and wants the driver to give back up to `pages` pages of
+        //backing memory from this range, returning how many were freed. Pages are scanned from `cursor`
+        //onwards, and the driver should update it to where it stopped (or the top of the range).
+        //Pages that have been idle for fewer than `minAge` aging passes should be left alone.
+        //This is optional, by default nothing is reclaimed.
+        virtual size_t Reclaim(VmDriverContext& context, uintptr_t& cursor, size_t pages, size_t minAge)
+        {
+            (void)pages;
+            (void)minAge;
+            cursor = context.range.Top();
+            return 0;
+        }
+
+        //Replaces the pages backing [destAddr, destAddr + length) in `dest` with copy-on-write shares
+        //of the pages backing the same amount of `source`, starting at `srcAddr`. Both addresses are
+        //page-aligned and the ranges use this driver. Returns how many bytes were shared, the caller
+        //copies anything left over. Optional, by default nothing is shared.
+        virtual size_t SharePages(VmDriverContext& source, uintptr_t srcAddr, VmDriverContext& dest, 
+            uintptr_t destAddr, size_t length)
+        {
+            (void)source;
+            (void)srcAddr;
+            (void)dest;
+            (void)destAddr;
+            (void)length;
+            return 0;
+        }
+
+        //The VMM has been given advice about how [base, base + length) will be used, this area is
+        //page-aligned and within the range. WillNeed advice is delivered from the VMM's prefetch thread
+        //rather than the thread that gave it. Optional, by default advice is ignored.
+        virtual AdviseResult Advise(VmDriverContext& context, uintptr_t base, size_t length, VmAdvice advice)
+        {
+            (void)context;
+            (void)base;
+            (void)length;
+            (void)advice;
+            return { .success = false };
+        }
+
+        //The same-page merging scanner is visiting this range, the driver may replace pages with
+        //identical ones found by the PageMerger. Like Reclaim() this starts at `cursor` and updates it.
+        //Returns the number of pages looked at, which should be at most `budget`. Also optional.
+        virtual size_t Merge(VmDriverContext& context, uintptr_t& cursor, size_t budget)
+        {
+            (void)budget;
+            cursor = context.range.Top();
+            return 0;
+        }
     };
 }
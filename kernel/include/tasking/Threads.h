@@ -94,6 +94,10 @@ namespace Npk::Tasking
         sl::RwLock attribsLock;
         sl::Span<ProgramAttribHeader> attribs;
 
+        uintptr_t stackBase; //lowest usable address, there's a guard page below this.
+        size_t stackSize;
+        sl::Atomic<size_t> stackHighWater;
+
         Thread() = default;
 
     public:
@@ -128,6 +132,13 @@ namespace Npk::Tasking
 
         sl::StringSpan Name(sl::StringSpan name = {});
 
+        [[gnu::always_inline]]
+        inline size_t StackSize() const
+        { return stackSize; }
+
+        //returns the most stack this thread has used so far (in bytes, rounded up to whole pages).
+        size_t StackHighWater();
+
         void SetAffinity(size_t newAffinity);
         void Start(void* arg);
         void Exit(size_t code);
@@ -160,12 +171,17 @@ namespace Npk::Tasking
         sl::Vector<Process*> processes; //TODO: hashmap/xmap of id -> pointers
         sl::Vector<Thread*> threads;
         sl::Atomic<size_t> nextId; //TODO: proper ID allocator with 'dead/pending' state for recycling
+        size_t defaultStackSize;
 
     public:
         static ProgramManager& Global();
 
         void Init();
 
+        [[gnu::always_inline]]
+        inline size_t DefaultStackSize() const
+        { return defaultStackSize; }
+
         TrapFrame** GetCurrentFrameStore();
         bool ServeException(ProgramException exception);
 
@@ -41,17 +41,23 @@ extern "C"
     DRIVER_API_FUNC
     uintptr_t npk_pm_alloc(OPTIONAL npk_pm_limits* limits)
     {
-        ASSERT_(limits == nullptr);
-        
-        return PMM::Global().Alloc();
+        return npk_pm_alloc_many(1, limits);
     }
 
     DRIVER_API_FUNC
     uintptr_t npk_pm_alloc_many(size_t count, OPTIONAL npk_pm_limits* limits)
     {
-        ASSERT_(limits == nullptr); //TODO: support me!
+        Memory::PmAllocLimits pmLimits {};
+        if (limits != nullptr)
+        {
+            pmLimits.lowerBound = limits->lower_limit;
+            if (limits->upper_limit != 0)
+                pmLimits.upperBound = limits->upper_limit;
+            pmLimits.alignment = limits->alignment;
+            pmLimits.node = limits->numa_node;
+        }
 
-        return PMM::Global().Alloc(count);
+        return PMM::Global().Alloc(count, pmLimits);
     }
 
     DRIVER_API_FUNC
@@ -141,4 +147,14 @@ extern "C"
     {
         ASSERT_UNREACHABLE();
     }
+
+    DRIVER_API_FUNC
+    bool npk_vm_advise(void* vm_ptr, size_t length, npk_vm_advice advice)
+    {
+        if (advice > npk_vm_advice_huge_page)
+            return false;
+
+        const auto vmAdvice = static_cast<Memory::VmAdvice>(advice);
+        return VMM::Kernel().Advise(reinterpret_cast<uintptr_t>(vm_ptr), length, vmAdvice);
+    }
 }
@@ -59,7 +59,7 @@ namespace Npk::Interrupts
         }
     }
 
-    void SendIpiMail(size_t dest, void (*callback)(void*), void* arg)
+    bool TrySendIpiMail(size_t dest, void (*callback)(void*), void* arg)
     {
         ASSERT(dest < mailboxes.Size(), "IPI mailbox does not exist");
 
@@ -67,7 +67,7 @@ namespace Npk::Interrupts
         IpiMailbox& mailbox = *mailboxes[dest];
         mailboxContainerLock.ReaderUnlock();
 
-        mailbox.lock.Lock();
+        sl::ScopedLock scopeLock(mailbox.lock);
         for (size_t i = 0; i < MailboxQueueDepth; i++)
         {
             if (mailbox.callbacks[i].callback != nullptr)
@@ -78,9 +78,22 @@ namespace Npk::Interrupts
             SendIpi(dest);
             
             mailbox.fullErrorCount = 0;
-            mailbox.lock.Unlock();
-            return;
+            return true;
         }
+
+        return false;
+    }
+
+    void SendIpiMail(size_t dest, void (*callback)(void*), void* arg)
+    {
+        if (TrySendIpiMail(dest, callback, arg))
+            return;
+
+        mailboxContainerLock.ReaderLock();
+        IpiMailbox& mailbox = *mailboxes[dest];
+        mailboxContainerLock.ReaderUnlock();
+
+        mailbox.lock.Lock();
         const bool emitError = (mailbox.fullErrorCount % EmitErrorOnCount) == 0;
         mailbox.fullErrorCount++;
         mailbox.lock.Unlock();
@@ -0,0 +1,188 @@
+#include <memory/CompressedSwap.h>
+#include <memory/Heap.h>
+#include <memory/Pmm.h>
+#include <arch/Platform.h>
+#include <arch/Timers.h>
+#include <config/ConfigStore.h>
+#include <debug/Log.h>
+#include <formats/Lz4.h>
+#include <Memory.h>
+
+namespace Npk::Memory
+{
+    //pages that dont compress to at least this size are left in memory, storing them wouldnt free much.
+    constexpr size_t MaxStoredSize = PageSize * 3 / 4;
+
+    /* Too big for the stack of whoever is reclaiming, so these are allocated on first use and kept
+     * around afterwards. There's at most one per concurrent call to Store().
+     */
+    struct SwapScratch
+    {
+        SwapScratch* next;
+        uint32_t table[sl::Lz4TableEntries];
+        uint8_t buffer[MaxStoredSize];
+    };
+
+    CompressedSwap globalCompressedSwap;
+
+    CompressedSwap& CompressedSwap::Global()
+    { return globalCompressedSwap; }
+
+    SwapEntry* CompressedSwap::FindEntry(HatMap* map, uintptr_t vaddr, bool orAbove)
+    {
+        //returns the entry for this address, or if `orAbove` is set the lowest entry above it
+        //within the same map.
+        SwapEntry* scan = entries.GetRoot();
+        SwapEntry* found = nullptr;
+        while (scan != nullptr)
+        {
+            if (scan->map == map && scan->vaddr == vaddr)
+                return scan;
+
+            if (map < scan->map || (map == scan->map && vaddr < scan->vaddr))
+            {
+                if (scan->map == map)
+                    found = scan;
+                scan = entries.GetLeft(scan);
+            }
+            else
+                scan = entries.GetRight(scan);
+        }
+
+        return orAbove ? found : nullptr;
+    }
+
+    void CompressedSwap::Init()
+    {
+        enabled = Config::GetConfigNumber("kernel.vmm.compressed_swap", true);
+        freeScratch = nullptr;
+        stats = {};
+
+        Log("Compressed swap %s: max stored size %zu bytes.", LogLevel::Info,
+            enabled ? "enabled" : "disabled", MaxStoredSize);
+    }
+
+    bool CompressedSwap::Store(HatMap* map, uintptr_t vaddr, uintptr_t paddr)
+    {
+        if (!enabled)
+            return false;
+
+        lock.Lock();
+        SwapScratch* scratch = freeScratch;
+        if (scratch != nullptr)
+            freeScratch = scratch->next;
+        lock.Unlock();
+        if (scratch == nullptr)
+            scratch = new SwapScratch();
+        if (scratch == nullptr)
+            return false;
+
+        //compress into the scratch buffer first so we know how much space to allocate.
+        const void* source = reinterpret_cast<const void*>(AddHhdm(paddr));
+        const size_t length = sl::Lz4Compress(source, PageSize, scratch->buffer, MaxStoredSize, scratch->table);
+        void* storage = length == 0 ? nullptr : Heap::Global().Alloc(sizeof(SwapEntry) + length);
+
+        SwapEntry* entry = nullptr;
+        if (storage != nullptr)
+        {
+            entry = new(storage) SwapEntry();
+            entry->map = map;
+            entry->vaddr = vaddr;
+            entry->length = length;
+            sl::memcopy(scratch->buffer, entry->Data(), length);
+        }
+
+        sl::ScopedLock scopeLock(lock);
+        scratch->next = freeScratch;
+        freeScratch = scratch;
+
+        if (length == 0)
+            stats.rejectedPages++;
+        if (entry == nullptr)
+            return false;
+
+        ASSERT(FindEntry(map, vaddr, false) == nullptr, "Page stored in compressed swap twice");
+        entries.Insert(entry);
+        stats.storedPages++;
+        stats.storedBytes += length;
+
+        return true;
+    }
+
+    sl::Opt<uintptr_t> CompressedSwap::Load(HatMap* map, uintptr_t vaddr, bool keep)
+    {
+        if (!enabled)
+            return {};
+
+        const size_t begin = PollTimer();
+        lock.Lock();
+        SwapEntry* entry = FindEntry(map, vaddr, false);
+        lock.Unlock();
+        if (entry == nullptr)
+            return {};
+
+        /* The entry cant be discarded while we're using it, the caller holds the lock of the owning range.
+         * The page is allocated without holding our lock (the pmm may try to reclaim into us), and before
+         * the entry is removed: if there's no memory the stored copy is kept for the next attempt.
+         */
+        const uintptr_t paddr = PMM::Global().Alloc();
+        if (paddr == 0)
+            return {};
+        const size_t length = sl::Lz4Decompress(entry->Data(), entry->length,
+            reinterpret_cast<void*>(AddHhdm(paddr)), PageSize);
+        ASSERT(length == PageSize, "Compressed swap entry is corrupt");
+
+        if (!keep)
+        {
+            lock.Lock();
+            entries.Remove(entry);
+            stats.storedPages--;
+            stats.storedBytes -= entry->length;
+            lock.Unlock();
+            Heap::Global().Free(entry, sizeof(SwapEntry) + entry->length);
+        }
+
+        __atomic_add_fetch(&stats.swapIns, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&stats.swapInNanos, PollTicksToNanos(PollTimer() - begin), __ATOMIC_RELAXED);
+        return paddr;
+    }
+
+    size_t CompressedSwap::Discard(HatMap* map, uintptr_t base, size_t length)
+    {
+        if (!enabled)
+            return 0;
+
+        size_t count = 0;
+        sl::ScopedLock scopeLock(lock);
+        SwapEntry* entry = FindEntry(map, base, true);
+        while (entry != nullptr && entry->map == map && entry->vaddr < base + length)
+        {
+            SwapEntry* next = entries.Successor(entry);
+            entries.Remove(entry);
+            stats.storedPages--;
+            stats.storedBytes -= entry->length;
+            Heap::Global().Free(entry, sizeof(SwapEntry) + entry->length);
+
+            entry = next;
+            count++;
+        }
+
+        return count;
+    }
+
+    bool CompressedSwap::Contains(HatMap* map, uintptr_t base, size_t length)
+    {
+        if (!enabled)
+            return false;
+
+        sl::ScopedLock scopeLock(lock);
+        SwapEntry* entry = FindEntry(map, base, true);
+        return entry != nullptr && entry->vaddr < base + length;
+    }
+
+    CompressedSwapStats CompressedSwap::GetStats()
+    {
+        sl::ScopedLock scopeLock(lock);
+        return stats;
+    }
+}
@@ -7,6 +7,8 @@
 
 namespace Npk::Memory
 {
+    constexpr size_t HeapShrinkerPriority = 20;
+
     sl::XoshiroRng trashGenerator;
     bool trashAfterUse;
     bool trashBeforeUse;
@@ -123,6 +125,74 @@ namespace Npk::Memory
         }
 
         pool.Init(slabs[SlabCount - 1].Size());
+
+        //the heap shrinker frees virtual memory, which can allocate, so it only runs in the background.
+        shrinker.name = "heap-slabs";
+        shrinker.priority = HeapShrinkerPriority;
+        shrinker.directSafe = false;
+        shrinker.count = ShrinkerCount;
+        shrinker.reclaim = ShrinkerReclaim;
+        shrinker.arg = this;
+        PMM::Global().RegisterShrinker(&shrinker);
+    }
+
+    void Heap::DrainDepot(size_t index)
+    {
+        auto& depot = cacheDepot[index];
+
+        sl::IntrFwdList<SlabCache> fullCaches;
+        sl::IntrFwdList<SlabCache> freeCaches;
+        depot.lock.Lock();
+        while (SlabCache* cache = depot.fullCaches.PopFront())
+            fullCaches.PushFront(cache);
+        while (SlabCache* cache = depot.freeCaches.PopFront())
+            freeCaches.PushFront(cache);
+        depot.lock.Unlock();
+
+        //return the cached slabs to their segments, and free the cache structs themselves.
+        while (SlabCache* cache = fullCaches.PopFront())
+        {
+            for (size_t i = 0; i < cache->count; i++)
+            {
+                if (!slabs[index].Free(cache->ptrs[i]))
+                    Log("KSlab (%zu) failed to free at %p", LogLevel::Error, slabs[index].Size(), cache->ptrs[i]);
+            }
+            delete cache;
+        }
+        while (SlabCache* cache = freeCaches.PopFront())
+            delete cache;
+    }
+
+    size_t Heap::ShrinkerCount(void* arg)
+    {
+        Heap& heap = *static_cast<Heap*>(arg);
+
+        size_t count = 0;
+        for (size_t i = 0; i < SlabCount; i++)
+        {
+            count += heap.slabs[i].TrimmablePages();
+
+            //slabs held in the depot dont map to whole pages, but draining them may empty a segment.
+            sl::ScopedLock depotLock(heap.cacheDepot[i].lock);
+            if (!heap.cacheDepot[i].fullCaches.Empty())
+                count++;
+        }
+
+        return count;
+    }
+
+    size_t Heap::ShrinkerReclaim(void* arg, size_t pages)
+    {
+        Heap& heap = *static_cast<Heap*>(arg);
+
+        size_t freed = 0;
+        for (size_t i = 0; i < SlabCount && freed < pages; i++)
+        {
+            heap.DrainDepot(i);
+            freed += heap.slabs[i].Trim(pages - freed);
+        }
+
+        return freed;
     }
 
     bool Heap::SwapCache(SlabCache** ptr, size_t index)
@@ -158,7 +228,7 @@ namespace Npk::Memory
             depot.lock.Lock();
             depot.fullCaches.PushFront(*ptr);
             exchange = depot.freeCaches.PopFront();
-            depot.lock.Lock();
+            depot.lock.Unlock();
 
             if (exchange == nullptr)
             {
@@ -0,0 +1,87 @@
+#include <memory/PageAging.h>
+#include <memory/Pmm.h>
+#include <memory/Vmm.h>
+#include <config/ConfigStore.h>
+#include <debug/Log.h>
+#include <tasking/Threads.h>
+
+namespace Npk::Memory
+{
+    constexpr uint16_t MaxIdleAge = 0xFFFF;
+
+    PageAging globalPageAging;
+
+    PageAging& PageAging::Global()
+    { return globalPageAging; }
+
+    void PageAging::AgingThread(void* arg)
+    {
+        PageAging& aging = *static_cast<PageAging*>(arg);
+        Tasking::WaitEntry waitEntry;
+
+        //wakeEvent is signalled by a clock event, since the wait manager doesn't support timeouts yet.
+        while (true)
+        {
+            VMM::AgeScan();
+
+            aging.wakeClock.duration = { sl::TimeScale::Millis, aging.intervalMs };
+            Tasking::QueueClockEvent(&aging.wakeClock);
+            Tasking::WaitManager::WaitOne(&aging.wakeEvent, &waitEntry, { sl::TimeScale::Millis, -1ul });
+        }
+    }
+
+    void PageAging::WakeDpc(void* arg)
+    { static_cast<PageAging*>(arg)->wakeEvent.Signal(); }
+
+    void PageAging::Init()
+    {
+        intervalMs = Config::GetConfigNumber("kernel.vmm.aging_interval", 1000);
+        stats = {};
+        if (intervalMs == 0)
+        {
+            Log("Page aging disabled.", LogLevel::Info);
+            return;
+        }
+
+        wakeDpc.data.function = WakeDpc;
+        wakeDpc.data.arg = this;
+        wakeClock.dpc = &wakeDpc;
+
+        using namespace Tasking;
+        auto thread = Thread::Create(Process::Kernel().Id(), AgingThread, this);
+        ASSERT_(thread != nullptr);
+        thread->Start(nullptr);
+
+        Log("Page aging enabled: pass every %zums, thread=%zu", LogLevel::Info, intervalMs, thread->Id());
+    }
+
+    uint32_t PageAging::Touch(uintptr_t paddr, bool accessed)
+    {
+        //pages mapped in more than one place are aged once per mapping, but any access resets them.
+        PageInfo* info = PMM::Global().Lookup(paddr);
+        if (info == nullptr)
+            return 0;
+
+        if (accessed)
+            info->idleAge = 0;
+        else if (info->idleAge < MaxIdleAge)
+            info->idleAge++;
+        return info->idleAge;
+    }
+
+    void PageAging::CountPass(size_t scanned, size_t accessed)
+    {
+        __atomic_add_fetch(&stats.passes, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&stats.scanned, scanned, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&stats.accessed, accessed, __ATOMIC_RELAXED);
+    }
+
+    PageAgingStats PageAging::GetStats()
+    {
+        PageAgingStats copy;
+        copy.passes = __atomic_load_n(&stats.passes, __ATOMIC_RELAXED);
+        copy.scanned = __atomic_load_n(&stats.scanned, __ATOMIC_RELAXED);
+        copy.accessed = __atomic_load_n(&stats.accessed, __ATOMIC_RELAXED);
+        return copy;
+    }
+}
@@ -0,0 +1,199 @@
+#include <memory/PageMerging.h>
+#include <memory/Pmm.h>
+#include <memory/Vmm.h>
+#include <arch/Platform.h>
+#include <config/ConfigStore.h>
+#include <debug/Log.h>
+#include <tasking/Threads.h>
+#include <Memory.h>
+#include <Maths.h>
+
+namespace Npk::Memory
+{
+    constexpr size_t MergeRoundMillis = 100;
+    constexpr size_t MergeReapBuckets = 64; //table buckets checked for unused pages each round.
+
+    PageMerger globalPageMerger;
+
+    //word-wise FNV-1a, 0 is reserved to mean 'not hashed yet'.
+    static uint32_t HashPage(uintptr_t paddr)
+    {
+        const uint64_t* words = reinterpret_cast<const uint64_t*>(AddHhdm(paddr));
+        uint64_t hash = 0xcbf29ce484222325;
+        for (size_t i = 0; i < PageSize / sizeof(uint64_t); i++)
+            hash = (hash ^ words[i]) * 0x100000001b3;
+
+        const uint32_t result = static_cast<uint32_t>(hash ^ (hash >> 32));
+        return result == 0 ? 1 : result;
+    }
+
+    PageMerger& PageMerger::Global()
+    { return globalPageMerger; }
+
+    void PageMerger::ScanThread(void* arg)
+    {
+        PageMerger& merger = *static_cast<PageMerger*>(arg);
+        Tasking::WaitEntry waitEntry;
+
+        //the wait manager doesn't support timeouts yet, so sleep between rounds by having
+        //a clock event signal wakeEvent.
+        while (true)
+        {
+            const size_t scanned = VMM::MergeScan(merger.pagesPerRound);
+            __atomic_add_fetch(&merger.stats.scanned, scanned, __ATOMIC_RELAXED);
+            merger.Reap(MergeReapBuckets);
+
+            merger.wakeClock.duration = { sl::TimeScale::Millis, MergeRoundMillis };
+            Tasking::QueueClockEvent(&merger.wakeClock);
+            Tasking::WaitManager::WaitOne(&merger.wakeEvent, &waitEntry, { sl::TimeScale::Millis, -1ul });
+        }
+    }
+
+    void PageMerger::WakeDpc(void* arg)
+    { static_cast<PageMerger*>(arg)->wakeEvent.Signal(); }
+
+    void PageMerger::Reap(size_t bucketCount)
+    {
+        //frees pages that only the table holds a share of, they're no longer mapped anywhere.
+        sl::ScopedLock scopeLock(lock);
+        for (size_t i = 0; i < bucketCount; i++)
+        {
+            MergedPage** prev = &buckets[reapCursor];
+            while (*prev != nullptr)
+            {
+                MergedPage* entry = *prev;
+                PageInfo* info = PMM::Global().Lookup(entry->paddr);
+                if (info->shares.Load() != 0)
+                {
+                    prev = &entry->next;
+                    continue;
+                }
+
+                *prev = entry->next;
+                info->flags.FetchAnd((PmFlags)~PmFlags::Merged, sl::Relaxed);
+                info->mergeHash = 0;
+                PMM::Global().Free(entry->paddr);
+                delete entry;
+                stats.sharedPages--;
+            }
+
+            reapCursor = (reapCursor + 1) % MergeTableBuckets;
+        }
+    }
+
+    void PageMerger::Init()
+    {
+        const size_t rate = Config::GetConfigNumber("kernel.vmm.page_merge_rate", 0);
+        if (rate == 0)
+        {
+            Log("Same-page merging disabled.", LogLevel::Info);
+            return;
+        }
+
+        for (size_t i = 0; i < MergeTableBuckets; i++)
+            buckets[i] = nullptr;
+        for (size_t i = 0; i < MergeSeenSlots; i++)
+            seen[i] = { .hash = 0, .paddr = 0 };
+        reapCursor = 0;
+        zeroHash = 0;
+        stats = {};
+        pagesPerRound = sl::Max(rate * MergeRoundMillis / 1000, 1ul);
+
+        wakeDpc.data.function = WakeDpc;
+        wakeDpc.data.arg = this;
+        wakeClock.dpc = &wakeDpc;
+
+        using namespace Tasking;
+        auto thread = Thread::Create(Process::Kernel().Id(), ScanThread, this);
+        ASSERT_(thread != nullptr);
+        thread->Start(nullptr);
+
+        Log("Same-page merging enabled: %zu pages every %zums, thread=%zu", LogLevel::Info,
+            pagesPerRound, MergeRoundMillis, thread->Id());
+    }
+
+    bool PageMerger::IsStable(uintptr_t paddr)
+    {
+        PageInfo* info = PMM::Global().Lookup(paddr);
+        if (info == nullptr)
+            return false;
+
+        const uint32_t hash = HashPage(paddr);
+        const bool stable = info->mergeHash == hash;
+        info->mergeHash = hash;
+        return stable;
+    }
+
+    sl::Opt<uintptr_t> PageMerger::Merge(uintptr_t paddr, uintptr_t zeroPage)
+    {
+        //the page was hashed before being write-protected, make sure it didnt change in between.
+        PageInfo* info = PMM::Global().Lookup(paddr);
+        const uint32_t hash = HashPage(paddr);
+        if (info == nullptr || info->mergeHash != hash)
+            return {};
+
+        const void* contents = reinterpret_cast<const void*>(AddHhdm(paddr));
+        if (zeroPage != 0)
+        {
+            if (zeroHash == 0)
+                zeroHash = HashPage(zeroPage);
+            if (hash == zeroHash && sl::memcmp(contents, reinterpret_cast<const void*>(AddHhdm(zeroPage)), PageSize) == 0)
+            {
+                __atomic_add_fetch(&stats.zeroMerges, 1, __ATOMIC_RELAXED);
+                info->mergeHash = 0;
+                return zeroPage;
+            }
+        }
+
+        sl::ScopedLock scopeLock(lock);
+        const size_t bucket = hash % MergeTableBuckets;
+        for (MergedPage* entry = buckets[bucket]; entry != nullptr; entry = entry->next)
+        {
+            if (entry->hash != hash)
+                continue;
+            if (sl::memcmp(contents, reinterpret_cast<const void*>(AddHhdm(entry->paddr)), PageSize) != 0)
+                continue;
+
+            PMM::Global().Lookup(entry->paddr)->shares.FetchAdd(1);
+            stats.merges++;
+            info->mergeHash = 0;
+            return entry->paddr;
+        }
+
+        //only give a page to the table once we've seen another page with the same contents, otherwise
+        //we'd be making every stable page copy-on-write for nothing.
+        const size_t slot = hash % MergeSeenSlots;
+        if (seen[slot].hash != hash || seen[slot].paddr == paddr)
+        {
+            seen[slot] = { .hash = hash, .paddr = paddr };
+            return {};
+        }
+
+        MergedPage* entry = new MergedPage();
+        if (entry == nullptr)
+            return {};
+
+        entry->hash = hash;
+        entry->paddr = paddr;
+        entry->next = buckets[bucket];
+        buckets[bucket] = entry;
+        info->shares.FetchAdd(1);
+        info->flags.FetchOr(PmFlags::Merged, sl::Relaxed);
+        seen[slot] = { .hash = 0, .paddr = 0 };
+        stats.sharedPages++;
+
+        return paddr;
+    }
+
+    bool PageMerger::IsMerged(uintptr_t paddr)
+    {
+        PageInfo* info = PMM::Global().Lookup(paddr);
+        return info != nullptr && (info->flags.Load(sl::Relaxed) & PmFlags::Merged) != 0;
+    }
+
+    PageMergerStats PageMerger::GetStats()
+    {
+        sl::ScopedLock scopeLock(lock);
+        return stats;
+    }
+}
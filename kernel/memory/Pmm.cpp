@@ -1,7 +1,11 @@
 #include <memory/Pmm.h>
 #include <interfaces/loader/Generic.h>
 #include <config/ConfigStore.h>
+#include <config/AcpiTables.h>
+#include <arch/Platform.h>
 #include <debug/Log.h>
+#include <tasking/Threads.h>
+#include <tasking/Scheduler.h>
 #include <Bitmap.h>
 #include <Maths.h>
 #include <Memory.h>
@@ -14,6 +18,13 @@ namespace Npk::Memory
     constexpr size_t PmMinContiguousPages = 0;
     constexpr size_t PmContiguousPagesRatio = 10;
     constexpr size_t MemmapProcessSize = 32;
+    constexpr size_t PmCacheDefaultHighWatermark = 48;
+    constexpr size_t PmCacheDefaultLowWatermark = 16;
+    constexpr size_t PmZeroPoolDefaultSize = 256;
+    constexpr size_t PmZeroPoolRefillBatch = 16;
+    constexpr size_t PmReclaimLowRatio = 64;
+    constexpr size_t PmReclaimHighRatio = 32;
+    constexpr size_t PmZeroPoolShrinkerPriority = 0;
 
 
     PMM globalPmm;
@@ -52,6 +63,199 @@ namespace Npk::Memory
         return 0;
     }
 
+    static inline size_t ZoneIndex(PmContigZone* zone, uintptr_t addr)
+    { return (addr - zone->base) / PageSize; }
+
+    static void ZoneInsertBlock(PmContigZone* zone, uintptr_t base, size_t order)
+    {
+        auto entry = reinterpret_cast<PmBuddyEntry*>(base + hhdmBase);
+        entry->prev = nullptr;
+        entry->next = zone->freeLists[order];
+        if (entry->next != nullptr)
+            entry->next->prev = entry;
+        zone->freeLists[order] = entry;
+        zone->orders[ZoneIndex(zone, base)] = order;
+    }
+
+    static void ZoneRemoveBlock(PmContigZone* zone, uintptr_t base, size_t order)
+    {
+        auto entry = reinterpret_cast<PmBuddyEntry*>(base + hhdmBase);
+        if (entry->prev != nullptr)
+            entry->prev->next = entry->next;
+        else
+            zone->freeLists[order] = entry->next;
+        if (entry->next != nullptr)
+            entry->next->prev = entry->prev;
+        zone->orders[ZoneIndex(zone, base)] = PmBuddyNoBlock;
+    }
+
+    //returns the largest order block that starts at `base` and fits before `end`.
+    static size_t LargestBlockOrder(uintptr_t base, uintptr_t end)
+    {
+        size_t order = 0;
+        while (order + 1 < PmBuddyOrders)
+        {
+            const size_t nextSize = PageSize << (order + 1);
+            if ((base & (nextSize - 1)) != 0 || base + nextSize > end)
+                break;
+            order++;
+        }
+        return order;
+    }
+
+    //returns pages to the zone's free lists, merging with free buddies where possible.
+    static void ZoneFreeRange(PmContigZone* zone, uintptr_t base, size_t count)
+    {
+        const uintptr_t end = base + count * PageSize;
+        const uintptr_t zoneEnd = zone->base + zone->count * PageSize;
+        zone->freeCount += count;
+
+        while (base < end)
+        {
+            size_t order = LargestBlockOrder(base, end);
+            const uintptr_t nextBase = base + (PageSize << order);
+
+            uintptr_t block = base;
+            while (order + 1 < PmBuddyOrders)
+            {
+                const uintptr_t buddy = block ^ (PageSize << order);
+                if (buddy < zone->base || buddy + (PageSize << order) > zoneEnd)
+                    break;
+                if (zone->orders[ZoneIndex(zone, buddy)] != order)
+                    break;
+
+                ZoneRemoveBlock(zone, buddy, order);
+                block = sl::Min(block, buddy);
+                order++;
+            }
+
+            ZoneInsertBlock(zone, block, order);
+            base = nextBase;
+        }
+    }
+
+    static uintptr_t ZoneAlloc(PmContigZone* zone, size_t count, PmAllocLimits limits)
+    {
+        size_t order = 0;
+        while ((1ul << order) < count)
+            order++;
+        while (order < PmBuddyOrders && (PageSize << order) < limits.alignment)
+            order++;
+        if (order >= PmBuddyOrders)
+            return 0;
+
+        const size_t allocSize = PageSize << order;
+        const uintptr_t lowerBound = sl::AlignUp(limits.lowerBound, allocSize);
+        const size_t length = count * PageSize;
+
+        /* Find a free block that contains a suitably aligned sub-block within the requested limits.
+         * Without any limits the first block of any order will do, but with them we may need
+         * to search the list.
+         */
+        uintptr_t block = 0;
+        uintptr_t target = 0;
+        size_t blockOrder = order;
+        for (; blockOrder < PmBuddyOrders && block == 0; blockOrder++)
+        {
+            for (PmBuddyEntry* scan = zone->freeLists[blockOrder]; scan != nullptr; scan = scan->next)
+            {
+                const uintptr_t scanBase = reinterpret_cast<uintptr_t>(scan) - hhdmBase;
+                const uintptr_t scanEnd = sl::Min(scanBase + (PageSize << blockOrder), limits.upperBound);
+                const uintptr_t candidate = sl::Max(scanBase, lowerBound);
+                if (candidate >= scanEnd || scanEnd - candidate < length)
+                    continue;
+
+                block = scanBase;
+                target = candidate;
+                break;
+            }
+        }
+        if (block == 0)
+            return 0;
+        blockOrder--;
+
+        //split the block down until we have the target sub-block, returning the other halves.
+        ZoneRemoveBlock(zone, block, blockOrder);
+        while (blockOrder > order)
+        {
+            blockOrder--;
+            const uintptr_t half = PageSize << blockOrder;
+            if (target >= block + half)
+            {
+                ZoneInsertBlock(zone, block, blockOrder);
+                block += half;
+            }
+            else
+                ZoneInsertBlock(zone, block + half, blockOrder);
+        }
+
+        for (size_t i = 0; i < count; i++)
+            sl::BitmapSet(zone->bitmap, ZoneIndex(zone, block) + i);
+        zone->freeCount -= 1ul << order;
+
+        //give back any excess pages from rounding up to a power of 2
+        if (count < (1ul << order))
+            ZoneFreeRange(zone, block + length, (1ul << order) - count);
+        return block;
+    }
+
+    void PMM::AddPageInfo(sl::Span<MemmapEntry> entries, uintptr_t base, size_t length)
+    {
+        constexpr size_t MidPages = sl::AlignUp(sizeof(PmInfoMid), PageSize) / PageSize;
+        constexpr size_t LeafPages = sl::AlignUp(sizeof(PmInfoLeaf), PageSize) / PageSize;
+
+        //metadata comes from the memory being ingested if possible, otherwise try the contiguous zones.
+        auto ClaimTable = [&](size_t pages) -> void*
+        {
+            uintptr_t addr = ClaimFromSmallest(entries, pages);
+            if (addr == 0)
+                addr = Alloc(pages);
+            if (addr == 0)
+                return nullptr;
+
+            sl::memset(reinterpret_cast<void*>(addr + hhdmBase), 0, pages * PageSize);
+            return reinterpret_cast<void*>(addr + hhdmBase);
+        };
+
+        sl::ScopedLock scopeLock(infoLock);
+        size_t pfn = base / PageSize;
+        const size_t endPfn = (base + length) / PageSize;
+        while (pfn < endPfn)
+        {
+            const size_t rootIndex = pfn >> (PmInfoLeafBits + PmInfoMidBits);
+            if (rootIndex >= infoRootCount)
+            {
+                Log("Cannot create PageInfo for 0x%tx, above highest expected physical address", LogLevel::Error,
+                    pfn * PageSize);
+                return;
+            }
+
+            PmInfoMid* mid = infoRoot[rootIndex].Load(sl::Relaxed);
+            if (mid == nullptr)
+            {
+                mid = static_cast<PmInfoMid*>(ClaimTable(MidPages));
+                ASSERT(mid != nullptr, "Failed to allocate PageInfo table");
+                infoRoot[rootIndex].Store(mid, sl::Release);
+            }
+
+            auto& leafSlot = mid->leaves[(pfn >> PmInfoLeafBits) & (PmInfoMidEntries - 1)];
+            PmInfoLeaf* leaf = leafSlot.Load(sl::Relaxed);
+            if (leaf == nullptr)
+            {
+                leaf = static_cast<PmInfoLeaf*>(ClaimTable(LeafPages));
+                ASSERT(leaf != nullptr, "Failed to allocate PageInfo table");
+                leafSlot.Store(leaf, sl::Release);
+            }
+
+            //mark pages as present a word at a time, there's no need to do it per-page.
+            const size_t index = pfn & (PmInfoLeafEntries - 1);
+            const size_t count = sl::Min(endPfn - pfn, 64 - (index % 64));
+            const uint64_t mask = (count == 64 ? ~0ul : ((1ul << count) - 1)) << (index % 64);
+            leaf->present[index / 64].FetchOr(mask, sl::Relaxed);
+            pfn += count;
+        }
+    }
+
     void PMM::IngestMemory(sl::Span<MemmapEntry> entries, size_t contiguousQuota)
     {
         size_t totalPages = 0;
@@ -61,8 +265,7 @@ namespace Npk::Memory
         SortMemoryMapBySize(entries);
 
         //reserve contiguous regions, starting from largest chunk of physical memory
-        zones = nullptr;
-        size_t contigZones = 0;
+        PmContigZone* prevZones = zones;
         for (size_t i = 0; i < contiguousQuota;)
         {
             const size_t count = sl::Min(contiguousQuota - i, (size_t)entries[0].length / PageSize);
@@ -70,7 +273,7 @@ namespace Npk::Memory
             entries[0].length -= count * PageSize;
 
             const size_t bitmapBytes = sl::AlignUp(count, 8) / 8;
-            const size_t metadataBytes = bitmapBytes + (2 * sizeof(PmContigZone));
+            const size_t metadataBytes = bitmapBytes + count + (2 * sizeof(PmContigZone));
             const uintptr_t metadataAddr = ClaimFromSmallest(entries, sl::AlignUp(metadataBytes, PageSize) / PageSize);
             ASSERT_(metadataAddr != 0);
 
@@ -79,103 +282,49 @@ namespace Npk::Memory
             zone->base = entries[0].base + entries[0].length;
             zone->count = count;
             zone->bitmap = reinterpret_cast<uint8_t*>(zone + 1);
+            zone->orders = zone->bitmap + bitmapBytes;
             sl::memset(zone->bitmap, 0, bitmapBytes);
+            sl::memset(zone->orders, PmBuddyNoBlock, count);
+            for (size_t o = 0; o < PmBuddyOrders; o++)
+                zone->freeLists[o] = nullptr;
+            zone->freeCount = 0;
+            zone->node = NodeOf(zone->base);
+            ZoneFreeRange(zone, zone->base, zone->count);
 
             zonesLock.WriterLock();
             zone->next = zones;
             zones = zone;
             zonesLock.WriterUnlock();
 
-            contigZones++;
             Log("Contiguous physical memory zone: base=0x%tx, count=%zu", LogLevel::Verbose, zone->base,  zone->count);
             SortMemoryMapBySize(entries); //sort memory map again, since we just modified it.
         }
 
-        //allocate space for pageinfo segments
-        const size_t segmentStoreBytes = sizeof(PmInfoSegment) * (entries.Size() + contigZones + 1);
-        const size_t infoStoreSize = segmentStoreBytes + sizeof(PageInfo) * (totalPages+ 1);
-        uintptr_t infoStoreAddr = ClaimFromSmallest(entries, sl::AlignUp(infoStoreSize, PageSize) / PageSize);
-        ASSERT_(infoStoreAddr != 0);
-        infoStoreAddr = sl::AlignUp(infoStoreAddr, sizeof(PmInfoSegment)) + hhdmBase;
-
-        size_t segmentIndex = 0;
-        size_t infoIndex = 0;
-        auto segmentStore = reinterpret_cast<PmInfoSegment*>(infoStoreAddr);
-        auto infoStore = reinterpret_cast<PageInfo*>(sl::AlignUp(infoStoreAddr + segmentStoreBytes, sizeof(PageInfo)));
-        segments = nullptr;
-
-        //create mappings from usable regions to PageInfo database
-        PmInfoSegment* tail = nullptr;
-        for (size_t i = 0; i < entries.Size(); i++)
-        {
-            if (entries[i].length == 0)
-                continue;
-
-            PmInfoSegment* segment = &segmentStore[segmentIndex++];
-            new(segment) PmInfoSegment();
-            segment->base = entries[i].base;
-            segment->length = entries[i].length;
-            segment->info = infoStore + infoIndex;
-            infoIndex += segment->length / PageSize;
-
-            if (tail == nullptr)
-                tail = segment;
-            else
-            {
-                tail->next = segment;
-                tail = segment;
-            }
-
-            Log("PageInfo segment added: base=0x%tx, count=%zu, store=%p", LogLevel::Verbose,
-                segment->base, segment->length / PageSize, segment->info);
-        }
-
-        //also create info mappings for pages in contiguous zones
-        for (PmContigZone* zone = zones; zone != nullptr; zone = zone->next)
+        //create PageInfo entries for the new memory, including any contiguous zones we just reserved.
+        if (infoRoot == nullptr)
         {
-            PmInfoSegment* segment = &segmentStore[segmentIndex++];
-            new(segment) PmInfoSegment();
-            segment->base = zone->base;
-            segment->length = zone->count * PageSize;
-            segment->info = infoStore + infoIndex;
-            infoIndex += segment->length / PageSize;
-
-            if (tail == nullptr)
-                tail = segment;
-            else
-            {
-                tail->next = segment;
-                tail = segment;
-            }
+            const size_t rootBytes = infoRootCount * sizeof(sl::Atomic<PmInfoMid*>);
+            const uintptr_t rootAddr = ClaimFromSmallest(entries, sl::AlignUp(rootBytes, PageSize) / PageSize);
+            ASSERT_(rootAddr != 0);
 
-            Log("PageInfo (contig zone) segment added: base=0x%tx, count=%zu, store=%p", LogLevel::Verbose,
-                segment->base, segment->length / PageSize, segment->info);
+            sl::memset(reinterpret_cast<void*>(rootAddr + hhdmBase), 0, rootBytes);
+            infoRoot = reinterpret_cast<sl::Atomic<PmInfoMid*>*>(rootAddr + hhdmBase);
         }
 
-        segmentsLock.WriterLock();
-        if (segments == nullptr)
-            segments = tail;
-        else
+        for (size_t i = 0; i < entries.Size(); i++)
         {
-            PmInfoSegment* currentTail = segments;
-            while (currentTail->next != nullptr)
-                currentTail = segments->next;
-            currentTail->next = tail;
+            if (entries[i].length != 0)
+                AddPageInfo(entries, entries[i].base, entries[i].length);
         }
-        segmentsLock.WriterUnlock();
+        for (PmContigZone* zone = zones; zone != prevZones; zone = zone->next)
+            AddPageInfo(entries, zone->base, zone->count * PageSize);
 
-        //all other physical memory is added to the freelist
-        freelist.head = nullptr;
+        //all other physical memory is added to the freelist of the node it belongs to
         for (size_t i = 0; i < entries.Size(); i++)
         {
             if (entries[i].length == 0)
                 continue;
-
-            auto entry = reinterpret_cast<PmFreeEntry*>(entries[i].base + hhdmBase);
-            entry->runLength = entries[i].length / PageSize;
-
-            entry->next = freelist.head;
-            freelist.head = entry;
+            FreelistAddRun(entries[i].base, entries[i].length / PageSize);
         }
     }
 
@@ -199,6 +348,24 @@ namespace Npk::Memory
         }
         usablePages /= PageSize;
 
+        //size the PageInfo root table to cover all memory we'll ever ingest, including reclaimable memory.
+        uintptr_t highestAddr = 0;
+        for (size_t accum = 0, count = entries.Size(); count == entries.Size(); accum += count)
+        {
+            count = GetUsableMemmap(entries, accum);
+            for (size_t i = 0; i < count; i++)
+                highestAddr = sl::Max(highestAddr, entries[i].base + entries[i].length);
+        }
+        for (size_t accum = 0, count = entries.Size(); count == entries.Size(); accum += count)
+        {
+            count = GetReclaimableMemmap(entries, accum);
+            for (size_t i = 0; i < count; i++)
+                highestAddr = sl::Max(highestAddr, entries[i].base + entries[i].length);
+        }
+        constexpr size_t RootEntrySpan = PmInfoLeafEntries * PmInfoMidEntries * PageSize;
+        infoRoot = nullptr;
+        infoRootCount = sl::AlignUp(highestAddr, RootEntrySpan) / RootEntrySpan;
+
         auto conv = sl::ConvertUnits(usablePages * PageSize, sl::UnitBase::Binary);
         Log("PMM has %zu usable pages (%zu.%zu %sB), over %zu regions.", LogLevel::Info, usablePages,
             conv.major, conv.minor, conv.prefix, entriesAccum);
@@ -215,6 +382,34 @@ namespace Npk::Memory
         if (trashAfterUse || trashBeforeUse)
             new (&rng) sl::XoshiroRng();
 
+        //a high watermark of 0 disables the per-core caches entirely
+        coreCaches.head = nullptr;
+        coreCaches.highWatermark = Config::GetConfigNumber("kernel.pmm.cache_high_watermark", PmCacheDefaultHighWatermark);
+        coreCaches.highWatermark = sl::Min(coreCaches.highWatermark, PmCoreCacheDepth);
+        coreCaches.lowWatermark = Config::GetConfigNumber("kernel.pmm.cache_low_watermark", PmCacheDefaultLowWatermark);
+        coreCaches.lowWatermark = sl::Min(coreCaches.lowWatermark, coreCaches.highWatermark / 2);
+        Log("PMM per-core caches: high=%zu, low=%zu, depth=%zu", LogLevel::Verbose, coreCaches.highWatermark,
+            coreCaches.lowWatermark, PmCoreCacheDepth);
+
+        //watermarks are a fraction of usable memory by default
+        reclaim.head = nullptr;
+        reclaim.ready = false;
+        reclaim.lowWatermark = Config::GetConfigNumber("kernel.pmm.reclaim_low_pages", usablePages / PmReclaimLowRatio);
+        reclaim.highWatermark = Config::GetConfigNumber("kernel.pmm.reclaim_high_pages", usablePages / PmReclaimHighRatio);
+        reclaim.highWatermark = sl::Max(reclaim.highWatermark, reclaim.lowWatermark);
+        Log("PMM reclaim watermarks: low=%zu, high=%zu", LogLevel::Verbose, reclaim.lowWatermark,
+            reclaim.highWatermark);
+
+        //until we've parsed the SRAT (which requires the vmm), all memory belongs to a single node.
+        zones = nullptr;
+        nodeCount = 1;
+        nodeRangeCount = 0;
+        nodes[0].head = nullptr;
+        nodes[0].freePages = 0;
+        nodes[0].domain = 0;
+        nodes[0].distances[0] = PmLocalDistance;
+        nodes[0].fallback[0] = 0;
+
         entriesAccum = 0;
         while (true)
         {
@@ -228,6 +423,146 @@ namespace Npk::Memory
         }
     }
 
+    size_t PMM::AddNode(uint32_t domain, size_t& count)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            if (nodes[i].domain == domain)
+                return i;
+        }
+
+        if (count == PmMaxNodes)
+        {
+            Log("Too many numa nodes (max %zu), memory for domain %u will be added to node 0.", LogLevel::Error,
+                PmMaxNodes, domain);
+            return 0;
+        }
+
+        //node 0 is live (its freelist is in use), so only its domain is updated.
+        PmNode& node = nodes[count];
+        if (count != 0)
+        {
+            node.head = nullptr;
+            node.freePages = 0;
+        }
+        node.domain = domain;
+        return count++;
+    }
+
+    void PMM::InitNuma()
+    {
+        using namespace Config;
+        auto maybeSrat = FindAcpiTable(SigSrat);
+        if (!maybeSrat.HasValue())
+        {
+            Log("No SRAT found, all physical memory is in a single numa node.", LogLevel::Info);
+            return;
+        }
+        auto srat = static_cast<const Srat*>(*maybeSrat);
+
+        /* Allocations can happen while we're parsing the SRAT (logging, the heap), so the node table is
+         * built beyond the published nodeCount/nodeRangeCount and only made visible once it's complete.
+         * Until then everything continues to use node 0.
+         */
+        size_t newNodeCount = 0;
+        size_t newRangeCount = 0;
+        for (auto sras = FindSras(srat, SrasType::Memory); sras.HasValue(); sras = FindSras(srat, SrasType::Memory, *sras))
+        {
+            auto memory = static_cast<const SratStructs::MemorySras*>(*sras);
+            if (((uint32_t)memory->flags & (uint32_t)SratStructs::MemorySrasFlags::Enabled) == 0)
+                continue;
+
+            const uintptr_t base = memory->baseLow | ((uint64_t)memory->baseHigh << 32);
+            const size_t length = memory->lengthLow | ((uint64_t)memory->lengthHigh << 32);
+            if (length == 0)
+                continue;
+            if (newRangeCount == PmMaxNodeRanges)
+            {
+                Log("Too many SRAT memory ranges (max %zu), ignoring the rest.", LogLevel::Error, PmMaxNodeRanges);
+                break;
+            }
+
+            const size_t node = AddNode(memory->domain, newNodeCount);
+            nodeRanges[newRangeCount].base = base;
+            nodeRanges[newRangeCount].length = length;
+            nodeRanges[newRangeCount].node = node;
+            newRangeCount++;
+            Log("Numa memory range: base=0x%tx, length=0x%zx, domain=%u, node=%zu", LogLevel::Verbose,
+                base, length, memory->domain, node);
+        }
+
+        if (newNodeCount == 0)
+        {
+            nodes[0].domain = 0;
+            Log("SRAT contains no memory ranges, all physical memory is in a single numa node.", LogLevel::Info);
+            return;
+        }
+
+        //populate distances from the SLIT, or use the default local/remote distances.
+        const Slit* slit = nullptr;
+        if (auto maybeSlit = FindAcpiTable(SigSlit); maybeSlit.HasValue())
+            slit = static_cast<const Slit*>(*maybeSlit);
+
+        for (size_t i = 0; i < newNodeCount; i++)
+        {
+            for (size_t j = 0; j < newNodeCount; j++)
+            {
+                const uint32_t from = nodes[i].domain;
+                const uint32_t to = nodes[j].domain;
+                if (slit != nullptr && from < slit->localities && to < slit->localities)
+                    nodes[i].distances[j] = slit->entries[from * slit->localities + to];
+                else
+                    nodes[i].distances[j] = (i == j) ? PmLocalDistance : PmRemoteDistance;
+            }
+
+            //sort nodes by distance (insertion sort, there are at most PmMaxNodes). This is done in a
+            //scratch buffer as node 0's fallback list is being read by concurrent allocations.
+            size_t fallback[PmMaxNodes];
+            for (size_t j = 0; j < newNodeCount; j++)
+            {
+                size_t k = j;
+                for (; k > 0 && nodes[i].distances[fallback[k - 1]] > nodes[i].distances[j]; k--)
+                    fallback[k] = fallback[k - 1];
+                fallback[k] = j;
+            }
+            for (size_t j = 0; j < newNodeCount; j++)
+                nodes[i].fallback[j] = fallback[j];
+        }
+
+        nodeRangeCount.Store(newRangeCount, sl::Release);
+        nodeCount.Store(newNodeCount, sl::Release);
+
+        //all memory was added to node 0 until now, take it so it can be redistributed to the correct nodes.
+        sl::ScopedLock scopeLock(nodes[0].lock);
+        PmFreeEntry* list = nodes[0].head;
+        nodes[0].head = nullptr;
+        nodes[0].freePages = 0;
+        scopeLock.Release();
+
+        while (list != nullptr)
+        {
+            PmFreeEntry* next = list->next;
+            const uintptr_t base = reinterpret_cast<uintptr_t>(list) - hhdmBase;
+            if (!NodeRangeKnown(base, list->runLength * PageSize))
+            {
+                Log("Physical memory 0x%tx (%zu pages) is not fully described by the SRAT, using node %zu",
+                    LogLevel::Warning, base, list->runLength, NodeOf(base));
+            }
+            FreelistAddRun(base, list->runLength);
+            list = next;
+        }
+
+        for (PmContigZone* zone = zones; zone != nullptr; zone = zone->next)
+            zone->node = NodeOf(zone->base);
+
+        for (size_t i = 0; i < newNodeCount; i++)
+        {
+            auto conv = sl::ConvertUnits(nodes[i].freePages * PageSize, sl::UnitBase::Binary);
+            Log("Numa node %zu: domain=%u, free=%zu.%zu %sB, nearest=%zu", LogLevel::Info, i, nodes[i].domain,
+                conv.major, conv.minor, conv.prefix, newNodeCount > 1 ? nodes[i].fallback[1] : i);
+        }
+    }
+
     void PMM::ReclaimBootMemory()
     {
         MemmapEntry mmapEntryStore[MemmapProcessSize];
@@ -255,84 +590,149 @@ namespace Npk::Memory
 
     PageInfo* PMM::Lookup(uintptr_t physAddr)
     {
-        for (PmInfoSegment* scan = segments; scan != nullptr; scan = scan->next)
-        {
-            if (physAddr < scan->base || physAddr >= scan->base + scan->length)
-                continue;
+        const size_t pfn = physAddr / PageSize;
+        const size_t rootIndex = pfn >> (PmInfoLeafBits + PmInfoMidBits);
+        if (rootIndex >= infoRootCount)
+            return nullptr;
 
-            const size_t index = (physAddr - scan->base) / PageSize;
-            return scan->info + index;
-        }
+        PmInfoMid* mid = infoRoot[rootIndex].Load(sl::Acquire);
+        if (mid == nullptr)
+            return nullptr;
+        PmInfoLeaf* leaf = mid->leaves[(pfn >> PmInfoLeafBits) & (PmInfoMidEntries - 1)].Load(sl::Acquire);
+        if (leaf == nullptr)
+            return nullptr;
 
-        return nullptr;
+        const size_t index = pfn & (PmInfoLeafEntries - 1);
+        if ((leaf->present[index / 64].Load(sl::Relaxed) & (1ul << (index % 64))) == 0)
+            return nullptr;
+        return &leaf->info[index];
     }
 
-    uintptr_t PMM::Alloc(size_t count)
+    uintptr_t PMM::Alloc(size_t count, PmAllocLimits limits)
     {
         if (count == 0)
             return 0;
-        if (count == 1)
+
+        uintptr_t base = DoAlloc(count, limits);
+        if (!reclaim.ready)
+            return base;
+
+        /* If we're under the low watermark (or the allocation failed) try to free some memory
+         * ourselves, using only the shrinkers that are safe to call from here. Anything under
+         * the high watermark wakes the reclaim thread, which can call all of the shrinkers.
+         */
+        const size_t freePages = FreePages();
+        if (base == 0 || freePages < reclaim.lowWatermark)
         {
-            sl::ScopedLock scopeLock(freelist.lock);
-            auto freeEntry = freelist.head;
-            ASSERT_(freeEntry != nullptr);
+            const size_t wanted = sl::Max(count, reclaim.lowWatermark - sl::Min(freePages, reclaim.lowWatermark));
+            if (DirectReclaim(wanted) && base == 0)
+                base = DoAlloc(count, limits);
+        }
 
-            if (freeEntry->runLength > 1)
+        if (freePages < reclaim.highWatermark && CoreLocalAvailable() && CoreLocal().runLevel < RunLevel::Clock
+            && !reclaim.pending.Exchange(true))
+            reclaim.event.Signal();
+
+        return base;
+    }
+
+    uintptr_t PMM::DoAlloc(size_t count, PmAllocLimits limits)
+    {
+        const size_t preferredNode = limits.node < nodeCount ? limits.node : LocalNode();
+
+        //single pages without any limits can come from the freelist, everything else uses the contiguous zones.
+        const bool limited = limits.lowerBound != 0 || limits.upperBound != -1ul || limits.alignment > PageSize;
+        if (count == 1 && !limited)
+        {
+            uintptr_t page = 0;
+            sl::Opt<RunLevel> prevRl {};
+            if (CoreLocalAvailable())
+                prevRl = EnsureRunLevel(RunLevel::Dpc);
+            PmCoreCache* cache = LocalCache();
+            if (cache != nullptr && (limits.node == PmAnyNode || limits.node == cache->node))
             {
-                const uintptr_t nextHead = reinterpret_cast<uintptr_t>(freeEntry) + PageSize;
-                freelist.head = reinterpret_cast<PmFreeEntry*>(nextHead);
-                freelist.head->runLength = freeEntry->runLength - 1;
-                freelist.head->next = freeEntry->next;
+                if (cache->count == 0)
+                {
+                    cache->misses++;
+                    cache->count = FreelistPopNear(cache->node, cache->pages, cache->lowWatermark);
+                    if (cache->count > 0)
+                        cache->refills++;
+                }
+                else
+                    cache->hits++;
+
+                if (cache->count > 0)
+                    page = cache->pages[--cache->count];
             }
-            else
-                freelist.head = freeEntry->next;
+            if (prevRl.HasValue())
+                LowerRunLevel(*prevRl);
+
+            if (page == 0)
+                FreelistPopNear(preferredNode, &page, 1);
 
-            if (trashBeforeUse)
+            if (page != 0)
             {
-                uint64_t* access = reinterpret_cast<uint64_t*>(freeEntry);
-                for (size_t i = 0; i < PageSize / sizeof(uint64_t); i++)
-                    access[i] = rng.Next();
+                if (trashBeforeUse)
+                    TrashPage(page);
+                return page;
             }
-            return reinterpret_cast<uintptr_t>(freeEntry) - hhdmBase;
         }
 
-        for (PmContigZone* zone = zones; zone != nullptr; zone = zone->next)
+        for (size_t i = 0; i < nodeCount; i++)
         {
-            size_t runningCount = 0;
-            size_t runStartIndex = 0;
-
-            sl::ScopedLock zoneLock(zone->lock);
-            for (size_t i = 0; i < zone->count; i++)
+            const size_t node = nodes[preferredNode].fallback[i];
+            for (PmContigZone* zone = zones; zone != nullptr; zone = zone->next)
             {
-                if (sl::BitmapGet(zone->bitmap, i))
-                {
-                    runningCount = 0;
+                if (zone->node != node)
+                    continue;
+                if (zone->base + zone->count * PageSize <= limits.lowerBound || zone->base >= limits.upperBound)
                     continue;
-                }
 
-                if (runningCount == 0)
-                    runStartIndex = i;
-                runningCount++;
-                if (runningCount == count)
-                    break;
+                sl::ScopedLock zoneLock(zone->lock);
+                if (zone->freeCount < count)
+                    continue;
+                const uintptr_t base = ZoneAlloc(zone, count, limits);
+                zoneLock.Release();
+                if (base == 0)
+                    continue;
+
+                nodes[node].allocs.FetchAdd(count, sl::Relaxed);
+                if (trashBeforeUse)
+                {
+                    for (size_t j = 0; j < count; j++)
+                        TrashPage(base + (j * PageSize));
+                }
+                return base;
             }
+        }
 
-            if (runningCount != count)
-                continue;
+        return 0;
+    }
 
-            for (size_t i = runStartIndex; i < runStartIndex + count; i++)
-                sl::BitmapSet(zone->bitmap, i);
+    uintptr_t PMM::AllocZeroed()
+    {
+        uintptr_t page = 0;
+        sl::ScopedLock scopeLock(zeroPool.lock);
+        if (zeroPool.count > 0)
+            page = zeroPool.pages[--zeroPool.count];
+        const bool wantRefill = zeroPool.capacity != 0 && zeroPool.count < zeroPool.lowWatermark;
+        scopeLock.Release();
 
-            if (trashBeforeUse)
-            {
-                uint64_t* access = reinterpret_cast<uint64_t*>(zone->base + (runStartIndex * PageSize));
-                for (size_t i = 0; i < PageSize / sizeof(uint64_t); i++)
-                    access[i] = rng.Next();
-            }
-            return zone->base + (runStartIndex * PageSize);
+        if (wantRefill && !zeroPool.refillPending.Exchange(true))
+            zeroPool.refillEvent.Signal();
+
+        if (page != 0)
+        {
+            zeroPool.hits.FetchAdd(1, sl::Relaxed);
+            return page;
         }
 
-        return 0;
+        //pool is empty (or disabled), zero a page ourselves.
+        zeroPool.misses.FetchAdd(1, sl::Relaxed);
+        page = Alloc();
+        if (page != 0)
+            ClearPage(reinterpret_cast<void*>(page + hhdmBase));
+        return page;
     }
 
     void PMM::Free(uintptr_t base, size_t count)
@@ -355,20 +755,39 @@ namespace Npk::Memory
             if (base < zone->base || base >= zone->base + (zone->count * PageSize))
                 continue;
 
+            if (base + (count * PageSize) > zone->base + (zone->count * PageSize))
+            {
+                Log("Free of %zu physical pages at 0x%tx overruns contiguous zone", LogLevel::Error,
+                    count, base);
+                return;
+            }
+
             const size_t beginIndex = (base - zone->base) / PageSize;
+            size_t runStart = 0;
+            size_t freed = 0;
             sl::ScopedLock scopeLock(zone->lock);
             for (size_t i = 0; i < count; i++)
             {
                 if (!sl::BitmapClear(zone->bitmap, beginIndex + i))
+                {
+                    //dont hand this page back to the buddy lists twice, but keep freeing the rest of the range.
                     Log("Double free of physical page 0x%tx", LogLevel::Error, base + (i * PageSize));
+                    if (i > runStart)
+                        ZoneFreeRange(zone, base + (runStart * PageSize), i - runStart);
+                    freed += i - runStart;
+                    runStart = i + 1;
+                    continue;
+                }
 
                 if (trashAfterUse)
-                {
-                    uint64_t* access = reinterpret_cast<uint64_t*>(base + hhdmBase);
-                    for (size_t i = 0; i < PageSize / sizeof(uint64_t); i++)
-                        access[i] = rng.Next();
-                }
+                    TrashPage(base + (i * PageSize));
             }
+            if (count > runStart)
+                ZoneFreeRange(zone, base + (runStart * PageSize), count - runStart);
+            freed += count - runStart;
+            scopeLock.Release();
+
+            nodes[zone->node].frees.FetchAdd(freed, sl::Relaxed);
             return;
         }
 
@@ -380,19 +799,620 @@ namespace Npk::Memory
         }
 
         //TOOD: PMM accounting, allow setting of a flag that checks ALL phys addresses freed, by scanning the 
-        //info segment mappings - rather than adding straight to the freelist. Would be slow, but useful for debugging.
-        auto freeEntry = reinterpret_cast<PmFreeEntry*>(base + hhdmBase);
-        freeEntry->runLength = 1;
+        //PageInfo tables - rather than adding straight to the freelist. Would be slow, but useful for debugging.
+        if (trashAfterUse)
+            TrashPage(base);
 
-        sl::ScopedLock scopeLock(freelist.lock);
-        freeEntry->next = freelist.head;
-        freelist.head = freeEntry;
+        sl::Opt<RunLevel> prevRl {};
+        if (CoreLocalAvailable())
+            prevRl = EnsureRunLevel(RunLevel::Dpc);
+        PmCoreCache* cache = LocalCache();
+        if (cache != nullptr)
+        {
+            cache->pages[cache->count++] = base;
+            if (cache->count >= cache->highWatermark)
+                DrainCache(cache, cache->lowWatermark);
+        }
+        if (prevRl.HasValue())
+            LowerRunLevel(*prevRl);
 
-        if (trashAfterUse)
+        if (cache == nullptr)
+            FreelistPush(&base, 1);
+    }
+
+    void PMM::TrashPage(uintptr_t physAddr)
+    {
+        uint64_t* access = reinterpret_cast<uint64_t*>(physAddr + hhdmBase);
+        for (size_t i = 0; i < PageSize / sizeof(uint64_t); i++)
+            access[i] = rng.Next();
+    }
+
+    size_t PMM::NodeOf(uintptr_t physAddr, uintptr_t* rangeEnd)
+    {
+        const size_t rangeCount = nodeRangeCount.Load(sl::Acquire);
+        uintptr_t nextBase = -1ul;
+        const PmNodeRange* below = nullptr;
+        const PmNodeRange* above = nullptr;
+        for (size_t i = 0; i < rangeCount; i++)
+        {
+            const PmNodeRange& range = nodeRanges[i];
+            if (physAddr >= range.base && physAddr < range.base + range.length)
+            {
+                if (rangeEnd != nullptr)
+                    *rangeEnd = range.base + range.length;
+                return range.node;
+            }
+
+            if (range.base > physAddr && range.base < nextBase)
+            {
+                nextBase = range.base;
+                above = &range;
+            }
+            else if (range.base < physAddr && (below == nullptr || range.base > below->base))
+                below = &range;
+        }
+
+        /* Memory not described by the SRAT: firmware usually only leaves out small holes next to a
+         * described range, so assign it to the node of the closest range below it (or above it).
+         */
+        if (rangeEnd != nullptr)
+            *rangeEnd = nextBase;
+        if (below != nullptr)
+            return below->node;
+        return above != nullptr ? above->node : 0;
+    }
+
+    bool PMM::NodeRangeKnown(uintptr_t base, size_t length)
+    {
+        const size_t rangeCount = nodeRangeCount.Load(sl::Acquire);
+        const uintptr_t top = base + length;
+        while (base < top)
+        {
+            bool found = false;
+            for (size_t i = 0; i < rangeCount && !found; i++)
+            {
+                const PmNodeRange& range = nodeRanges[i];
+                if (base >= range.base && base < range.base + range.length)
+                {
+                    base = range.base + range.length;
+                    found = true;
+                }
+            }
+
+            if (!found)
+                return false;
+        }
+        return true;
+    }
+
+    size_t PMM::FindCoreNode(size_t hwId)
+    {
+        using namespace Config;
+        auto maybeSrat = FindAcpiTable(SigSrat);
+        if (!maybeSrat.HasValue())
+            return 0;
+        auto srat = static_cast<const Srat*>(*maybeSrat);
+
+        sl::Opt<uint32_t> domain {};
+        for (auto sras = FindSras(srat, SrasType::LocalApic); sras.HasValue() && !domain.HasValue();
+            sras = FindSras(srat, SrasType::LocalApic, *sras))
+        {
+            auto lapic = static_cast<const SratStructs::LocalApicSras*>(*sras);
+            if ((lapic->flags & 1) == 0 || lapic->apicId != hwId)
+                continue;
+            domain = lapic->domain0 | (lapic->domain1[0] << 8) | (lapic->domain1[1] << 16)
+                | ((uint32_t)lapic->domain1[2] << 24);
+        }
+        for (auto sras = FindSras(srat, SrasType::X2Apic); sras.HasValue() && !domain.HasValue();
+            sras = FindSras(srat, SrasType::X2Apic, *sras))
+        {
+            auto x2apic = static_cast<const SratStructs::X2ApicSras*>(*sras);
+            if ((x2apic->flags & 1) == 0 || x2apic->apicId != hwId)
+                continue;
+            domain = x2apic->domain;
+        }
+
+        if (!domain.HasValue())
+            return 0;
+        const size_t count = nodeCount.Load(sl::Acquire);
+        for (size_t i = 0; i < count; i++)
+        {
+            if (nodes[i].domain == *domain)
+                return i;
+        }
+        return 0;
+    }
+
+    size_t PMM::LocalNode()
+    {
+        if (!CoreLocalAvailable())
+            return 0;
+
+        auto cache = static_cast<PmCoreCache*>(CoreLocal()[LocalPtr::PmmCache]);
+        return cache == nullptr ? 0 : cache->node;
+    }
+
+    void PMM::FreelistAddRun(uintptr_t base, size_t count)
+    {
+        const uintptr_t end = base + count * PageSize;
+        while (base < end)
+        {
+            uintptr_t rangeEnd;
+            const size_t node = NodeOf(base, &rangeEnd);
+            rangeEnd = sl::Min(sl::AlignDown(rangeEnd, PageSize), end);
+            if (rangeEnd <= base)
+                rangeEnd = base + PageSize;
+
+            auto entry = reinterpret_cast<PmFreeEntry*>(base + hhdmBase);
+            entry->runLength = (rangeEnd - base) / PageSize;
+
+            sl::ScopedLock scopeLock(nodes[node].lock);
+            entry->next = nodes[node].head;
+            nodes[node].head = entry;
+            nodes[node].freePages += entry->runLength;
+            scopeLock.Release();
+
+            base = rangeEnd;
+        }
+    }
+
+    size_t PMM::FreelistPop(size_t node, uintptr_t* pages, size_t count)
+    {
+        size_t popped = 0;
+        PmNode& pmNode = nodes[node];
+        sl::ScopedLock scopeLock(pmNode.lock);
+
+        while (popped < count && pmNode.head != nullptr)
+        {
+            auto freeEntry = pmNode.head;
+            if (freeEntry->runLength > 1)
+            {
+                const uintptr_t nextHead = reinterpret_cast<uintptr_t>(freeEntry) + PageSize;
+                pmNode.head = reinterpret_cast<PmFreeEntry*>(nextHead);
+                pmNode.head->runLength = freeEntry->runLength - 1;
+                pmNode.head->next = freeEntry->next;
+            }
+            else
+                pmNode.head = freeEntry->next;
+
+            pages[popped++] = reinterpret_cast<uintptr_t>(freeEntry) - hhdmBase;
+        }
+        pmNode.freePages -= popped;
+        scopeLock.Release();
+
+        pmNode.allocs.FetchAdd(popped, sl::Relaxed);
+        return popped;
+    }
+
+    size_t PMM::FreelistPopNear(size_t node, uintptr_t* pages, size_t count)
+    {
+        size_t popped = 0;
+        for (size_t i = 0; i < nodeCount && popped < count; i++)
+            popped += FreelistPop(nodes[node].fallback[i], pages + popped, count - popped);
+
+        return popped;
+    }
+
+    void PMM::FreelistPush(const uintptr_t* pages, size_t count)
+    {
+        //build a chain for each run of pages from the same node, and splice it in with a single lock.
+        size_t i = 0;
+        while (i < count)
+        {
+            const size_t node = NodeOf(pages[i]);
+            PmFreeEntry* chainHead = nullptr;
+            PmFreeEntry* chainTail = nullptr;
+            size_t chainLength = 0;
+
+            for (; i < count; i++)
+            {
+                if (chainLength != 0 && nodeRangeCount != 0 && NodeOf(pages[i]) != node)
+                    break;
+
+                auto entry = reinterpret_cast<PmFreeEntry*>(pages[i] + hhdmBase);
+                entry->runLength = 1;
+                entry->next = chainHead;
+                chainHead = entry;
+                if (chainTail == nullptr)
+                    chainTail = entry;
+                chainLength++;
+            }
+
+            PmNode& pmNode = nodes[node];
+            sl::ScopedLock scopeLock(pmNode.lock);
+            chainTail->next = pmNode.head;
+            pmNode.head = chainHead;
+            pmNode.freePages += chainLength;
+            scopeLock.Release();
+
+            pmNode.frees.FetchAdd(chainLength, sl::Relaxed);
+        }
+    }
+
+    PmCoreCache* PMM::LocalCache()
+    {
+        //caller is expected to be at RunLevel::Dpc already, so we cant be moved to another core.
+        if (!CoreLocalAvailable() || RunLevel::Dpc < CoreLocal().runLevel)
+            return nullptr;
+
+        auto cache = static_cast<PmCoreCache*>(CoreLocal()[LocalPtr::PmmCache]);
+        if (cache == nullptr || cache->highWatermark == 0)
+            return nullptr;
+        return cache;
+    }
+
+    void PMM::DrainCache(PmCoreCache* cache, size_t target)
+    {
+        if (cache->count <= target)
+            return;
+
+        FreelistPush(cache->pages + target, cache->count - target);
+        cache->count = target;
+        cache->drains++;
+    }
+
+    void PMM::DrainCacheDpc(void* arg)
+    {
+        //dpcs run at RunLevel::Dpc on the owning core, so this cant race with Alloc()/Free() there.
+        auto cache = static_cast<PmCoreCache*>(arg);
+        cache->drainPending.Store(false);
+        globalPmm.DrainCache(cache, 0);
+    }
+
+    void PMM::InitLocalCache()
+    {
+        ASSERT_(CoreLocal()[LocalPtr::PmmCache] == nullptr);
+
+        //the cache is created even if caching is disabled, as it also stores the core's numa node.
+        PmCoreCache* cache = new PmCoreCache();
+        ASSERT_(cache != nullptr);
+        cache->coreId = CoreLocal().id;
+        cache->node = FindCoreNode(ArchCoreHardwareId());
+        cache->count = 0;
+        cache->lowWatermark = coreCaches.lowWatermark;
+        cache->highWatermark = coreCaches.highWatermark;
+        cache->hits = cache->misses = cache->refills = cache->drains = 0;
+        cache->drainDpc.data.function = DrainCacheDpc;
+        cache->drainDpc.data.arg = cache;
+        cache->drainPending = false;
+
+        coreCaches.lock.Lock();
+        cache->next = coreCaches.head;
+        coreCaches.head = cache;
+        coreCaches.lock.Unlock();
+
+        CoreLocal()[LocalPtr::PmmCache] = cache;
+        Log("Core %zu PMM cache created: node=%zu, high=%zu, low=%zu", LogLevel::Verbose, cache->coreId,
+            cache->node, cache->highWatermark, cache->lowWatermark);
+    }
+
+    void PMM::DrainLocalCache()
+    {
+        if (!CoreLocalAvailable())
+            return;
+
+        const auto prevRl = EnsureRunLevel(RunLevel::Dpc);
+        if (PmCoreCache* cache = LocalCache(); cache != nullptr)
+            DrainCache(cache, 0);
+        if (prevRl.HasValue())
+            LowerRunLevel(*prevRl);
+    }
+
+    void PMM::DrainCache(size_t coreId)
+    {
+        PmCoreCache* cache = nullptr;
+        coreCaches.lock.Lock();
+        for (cache = coreCaches.head; cache != nullptr; cache = cache->next)
+        {
+            if (cache->coreId == coreId)
+                break;
+        }
+        coreCaches.lock.Unlock();
+
+        //queueing a remote dpc needs core-local state too, and nothing is cached this early anyway.
+        if (cache == nullptr || !CoreLocalAvailable())
+            return;
+
+        //raise before checking the core id, otherwise we could migrate between the check and the drain
+        //and race the owning core refilling its cache. There's only one drainDpc per cache, so it's
+        //only queued if it isn't already.
+        const auto prevRl = EnsureRunLevel(RunLevel::Dpc);
+        bool notPending = false;
+        if (CoreLocal().id == coreId)
+            DrainCache(cache, 0);
+        else if (cache->drainPending.CompareExchange(notPending, true))
+            Tasking::QueueRemoteDpc(coreId, &cache->drainDpc);
+        if (prevRl.HasValue())
+            LowerRunLevel(*prevRl);
+    }
+
+    sl::Opt<PmCacheStats> PMM::GetCacheStats(size_t coreId)
+    {
+        sl::ScopedLock scopeLock(coreCaches.lock);
+        for (PmCoreCache* cache = coreCaches.head; cache != nullptr; cache = cache->next)
+        {
+            if (cache->coreId != coreId)
+                continue;
+
+            //these are only written by the owning core, so this is a best-effort snapshot.
+            PmCacheStats stats;
+            stats.cached = cache->count;
+            stats.hits = cache->hits;
+            stats.misses = cache->misses;
+            stats.refills = cache->refills;
+            stats.drains = cache->drains;
+            return stats;
+        }
+
+        return {};
+    }
+
+    void PMM::ZeroPoolThread(void* arg)
+    {
+        PMM& pmm = *static_cast<PMM*>(arg);
+        Tasking::WaitEntry waitEntry;
+
+        while (true)
+        {
+            Tasking::WaitManager::WaitOne(&pmm.zeroPool.refillEvent, &waitEntry, { sl::TimeScale::Millis, -1ul });
+            pmm.zeroPool.refillPending = false;
+
+            //there's no thread priorities yet, so yield between batches to avoid hogging the cpu.
+            bool filled = false;
+            while (!filled)
+            {
+                for (size_t i = 0; i < PmZeroPoolRefillBatch && !filled; i++)
+                {
+                    //dont compete with the reclaim thread for memory.
+                    if (pmm.reclaim.ready && pmm.FreePages() < pmm.reclaim.highWatermark)
+                    {
+                        filled = true;
+                        break;
+                    }
+
+                    const uintptr_t page = pmm.Alloc();
+                    if (page == 0)
+                    {
+                        filled = true;
+                        break;
+                    }
+                    ClearPage(reinterpret_cast<void*>(page + hhdmBase));
+
+                    sl::ScopedLock scopeLock(pmm.zeroPool.lock);
+                    if (pmm.zeroPool.count == pmm.zeroPool.capacity)
+                    {
+                        scopeLock.Release();
+                        pmm.Free(page);
+                        filled = true;
+                        break;
+                    }
+                    pmm.zeroPool.pages[pmm.zeroPool.count++] = page;
+                    filled = pmm.zeroPool.count == pmm.zeroPool.capacity;
+                }
+
+                Tasking::Scheduler::Global().Yield();
+            }
+        }
+    }
+
+    void PMM::InitZeroPool()
+    {
+        zeroPool.count = 0;
+        zeroPool.capacity = Config::GetConfigNumber("kernel.pmm.zero_pool_size", PmZeroPoolDefaultSize);
+        zeroPool.lowWatermark = zeroPool.capacity / 2;
+        if (zeroPool.capacity == 0)
+        {
+            Log("Pre-zeroed page pool disabled.", LogLevel::Info);
+            return;
+        }
+
+        zeroPool.pages = new uintptr_t[zeroPool.capacity];
+        ASSERT_(zeroPool.pages != nullptr);
+
+        //pooled pages are the cheapest thing to give back under memory pressure.
+        zeroPool.shrinker.name = "pmm-zero-pool";
+        zeroPool.shrinker.priority = PmZeroPoolShrinkerPriority;
+        zeroPool.shrinker.directSafe = true;
+        zeroPool.shrinker.count = ZeroPoolCount;
+        zeroPool.shrinker.reclaim = ZeroPoolReclaim;
+        zeroPool.shrinker.arg = this;
+        RegisterShrinker(&zeroPool.shrinker);
+
+        using namespace Tasking;
+        auto thread = Thread::Create(Process::Kernel().Id(), ZeroPoolThread, this);
+        ASSERT_(thread != nullptr);
+        zeroPool.refillPending = true;
+        zeroPool.refillEvent.Signal();
+        thread->Start(nullptr);
+
+        Log("Pre-zeroed page pool created: capacity=%zu, thread=%zu", LogLevel::Info, zeroPool.capacity, thread->Id());
+    }
+
+    PmZeroPoolStats PMM::GetZeroPoolStats()
+    {
+        PmZeroPoolStats stats;
+        stats.pooled = zeroPool.count;
+        stats.capacity = zeroPool.capacity;
+        stats.hits = zeroPool.hits.Load(sl::Relaxed);
+        stats.misses = zeroPool.misses.Load(sl::Relaxed);
+        return stats;
+    }
+
+    size_t PMM::ZeroPoolCount(void* arg)
+    {
+        PMM& pmm = *static_cast<PMM*>(arg);
+        return pmm.zeroPool.count;
+    }
+
+    size_t PMM::ZeroPoolReclaim(void* arg, size_t pages)
+    {
+        PMM& pmm = *static_cast<PMM*>(arg);
+
+        size_t freed = 0;
+        while (freed < pages)
+        {
+            sl::ScopedLock scopeLock(pmm.zeroPool.lock);
+            if (pmm.zeroPool.count == 0)
+                break;
+            const uintptr_t page = pmm.zeroPool.pages[--pmm.zeroPool.count];
+            scopeLock.Release();
+
+            pmm.Free(page);
+            freed++;
+        }
+
+        return freed;
+    }
+
+    size_t PMM::RunShrinkers(size_t pages, bool direct)
+    {
+        size_t freed = 0;
+        reclaim.lock.ReaderLock();
+        for (PmShrinker* shrinker = reclaim.head; shrinker != nullptr && freed < pages; shrinker = shrinker->next)
         {
-            uint64_t* access = reinterpret_cast<uint64_t*>(base + hhdmBase);
-            for (size_t i = 0; i < PageSize / sizeof(uint64_t); i++)
-                access[i] = rng.Next();
+            if (direct && !shrinker->directSafe)
+                continue;
+            if (shrinker->count(shrinker->arg) == 0)
+                continue;
+
+            const size_t count = shrinker->reclaim(shrinker->arg, pages - freed);
+            Log("Shrinker %s reclaimed %zu pages (%s).", LogLevel::Verbose, shrinker->name, count,
+                direct ? "direct" : "background");
+            freed += count;
+        }
+        reclaim.lock.ReaderUnlock();
+
+        reclaim.pagesReclaimed.FetchAdd(freed, sl::Relaxed);
+        return freed;
+    }
+
+    bool PMM::DirectReclaim(size_t pages)
+    {
+        //shrinkers may sleep, so only reclaim from a thread context. Allocations made by the
+        //shrinkers themselves (or by other threads while we're busy) dont recurse into here.
+        if (!CoreLocalAvailable() || CoreLocal().runLevel != RunLevel::Normal)
+            return false;
+        if (Tasking::Thread::Current().Id() == reclaim.threadId)
+            return false;
+        if (reclaim.directActive.Exchange(true))
+            return false;
+
+        reclaim.directReclaims.FetchAdd(1, sl::Relaxed);
+        const size_t freed = RunShrinkers(pages, true);
+        reclaim.directActive = false;
+
+        return freed > 0;
+    }
+
+    void PMM::ReclaimThread(void* arg)
+    {
+        PMM& pmm = *static_cast<PMM*>(arg);
+        Tasking::WaitEntry waitEntry;
+
+        while (true)
+        {
+            Tasking::WaitManager::WaitOne(&pmm.reclaim.event, &waitEntry, { sl::TimeScale::Millis, -1ul });
+            pmm.reclaim.pending = false;
+
+            //keep reclaiming until we're back above the high watermark, or the shrinkers run dry.
+            while (true)
+            {
+                const size_t freePages = pmm.FreePages();
+                if (freePages >= pmm.reclaim.highWatermark)
+                    break;
+
+                pmm.reclaim.backgroundReclaims.FetchAdd(1, sl::Relaxed);
+                if (pmm.RunShrinkers(pmm.reclaim.highWatermark - freePages, false) == 0)
+                    break;
+
+                Tasking::Scheduler::Global().Yield();
+            }
+        }
+    }
+
+    void PMM::InitReclaim()
+    {
+        using namespace Tasking;
+        auto thread = Thread::Create(Process::Kernel().Id(), ReclaimThread, this);
+        ASSERT_(thread != nullptr);
+        reclaim.threadId = thread->Id();
+        thread->Start(nullptr);
+        reclaim.ready = true;
+
+        Log("PMM reclaim thread started: low=%zu, high=%zu, thread=%zu", LogLevel::Info, reclaim.lowWatermark,
+            reclaim.highWatermark, thread->Id());
+    }
+
+    void PMM::RegisterShrinker(PmShrinker* shrinker)
+    {
+        VALIDATE_(shrinker != nullptr, );
+        VALIDATE_(shrinker->count != nullptr && shrinker->reclaim != nullptr, );
+
+        //keep the list sorted by priority, shrinkers with equal priority are called in the order they were added.
+        reclaim.lock.WriterLock();
+        PmShrinker** prev = &reclaim.head;
+        while (*prev != nullptr && (*prev)->priority <= shrinker->priority)
+            prev = &(*prev)->next;
+        shrinker->next = *prev;
+        *prev = shrinker;
+        reclaim.lock.WriterUnlock();
+    }
+
+    void PMM::UnregisterShrinker(PmShrinker* shrinker)
+    {
+        VALIDATE_(shrinker != nullptr, );
+
+        reclaim.lock.WriterLock();
+        for (PmShrinker** prev = &reclaim.head; *prev != nullptr; prev = &(*prev)->next)
+        {
+            if (*prev != shrinker)
+                continue;
+            *prev = shrinker->next;
+            reclaim.lock.WriterUnlock();
+            return;
         }
+        reclaim.lock.WriterUnlock();
+
+        Log("Attempted to unregister unknown shrinker %s", LogLevel::Error, shrinker->name);
+    }
+
+    size_t PMM::FreePages()
+    {
+        size_t count = 0;
+        for (size_t i = 0; i < nodeCount; i++)
+            count += nodes[i].freePages;
+        for (PmContigZone* zone = zones; zone != nullptr; zone = zone->next)
+            count += zone->freeCount;
+        return count;
+    }
+
+    PmReclaimStats PMM::GetReclaimStats()
+    {
+        PmReclaimStats stats;
+        stats.freePages = FreePages();
+        stats.lowWatermark = reclaim.lowWatermark;
+        stats.highWatermark = reclaim.highWatermark;
+        stats.directReclaims = reclaim.directReclaims.Load(sl::Relaxed);
+        stats.backgroundReclaims = reclaim.backgroundReclaims.Load(sl::Relaxed);
+        stats.pagesReclaimed = reclaim.pagesReclaimed.Load(sl::Relaxed);
+        return stats;
+    }
+
+    size_t PMM::NodeCount()
+    {
+        return nodeCount;
+    }
+
+    sl::Opt<PmNodeStats> PMM::GetNodeStats(size_t node)
+    {
+        if (node >= nodeCount)
+            return {};
+
+        PmNodeStats stats;
+        stats.domain = nodes[node].domain;
+        stats.freePages = nodes[node].freePages;
+        stats.allocs = nodes[node].allocs.Load(sl::Relaxed);
+        stats.frees = nodes[node].frees.Load(sl::Relaxed);
+        return stats;
     }
 }
@@ -1,5 +1,6 @@
 #include <memory/Slab.h>
 #include <memory/Vmm.h>
+#include <arch/Platform.h>
 #include <debug/Log.h>
 #include <Random.h>
 
@@ -57,6 +58,19 @@ namespace Npk::Memory
         VALIDATE_(VMM::Kernel().Free(seg->base), );
     }
 
+    size_t SlabAlloc::SegmentPages()
+    {
+        return sl::AlignUp(slabSize * slabsPerSeg, PageSize) / PageSize;
+    }
+
+    bool SlabAlloc::SegmentEmpty(SlabSegment* seg)
+    {
+        const size_t usableSlabs = slabsPerSeg - (sl::AlignUp(sizeof(SlabSegment), slabSize) / slabSize);
+
+        sl::ScopedLock segLock(seg->lock);
+        return seg->freeCount == usableSlabs;
+    }
+
     void SlabAlloc::Init(size_t slabBytes, size_t slabCountPerSeg)
     {
         slabSize = slabBytes;
@@ -147,6 +161,65 @@ namespace Npk::Memory
         return false;
     }
 
+    size_t SlabAlloc::TrimmablePages()
+    {
+        //segments with bounds checking enabled can never appear empty, see CreateSegment().
+        if (doBoundsCheck)
+            return 0;
+
+        size_t emptyCount = 0;
+        segmentsLock.ReaderLock();
+        for (auto seg = segments.Begin(); seg != segments.End(); seg = seg->next)
+        {
+            if (SegmentEmpty(seg))
+                emptyCount++;
+        }
+        segmentsLock.ReaderUnlock();
+
+        //we always keep one empty segment around to avoid thrashing.
+        return emptyCount > 1 ? (emptyCount - 1) * SegmentPages() : 0;
+    }
+
+    size_t SlabAlloc::Trim(size_t maxPages)
+    {
+        if (doBoundsCheck)
+            return 0;
+
+        size_t freedPages = 0;
+        while (freedPages < maxPages)
+        {
+            /* Empty segments are removed under the writer lock, so no allocations
+             * can race with us and take a slab from them. Once removed we're the
+             * only ones who can see the segment and it can be destroyed without locks.
+             */
+            SlabSegment* found = nullptr;
+            size_t emptyCount = 0;
+            segmentsLock.WriterLock();
+            for (auto seg = segments.Begin(); seg != segments.End(); seg = seg->next)
+            {
+                if (!SegmentEmpty(seg))
+                    continue;
+                if (++emptyCount == 2)
+                {
+                    found = seg;
+                    break;
+                }
+            }
+            if (found != nullptr)
+                segments.Remove(found);
+            segmentsLock.WriterUnlock();
+
+            if (found == nullptr)
+                break;
+            DestroySegment(found);
+            freedPages += SegmentPages();
+        }
+
+        if (logHeapExpansion && freedPages > 0)
+            Log("Heap slab trimmed: size=%ub, freed %zu pages", LogLevel::Verbose, slabSize, freedPages);
+        return freedPages;
+    }
+
     void SlabAlloc::CheckBounds()
     {
         if (!doBoundsCheck)
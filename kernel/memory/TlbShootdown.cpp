@@ -0,0 +1,278 @@
+#include <memory/TlbShootdown.h>
+#include <arch/Hat.h>
+#include <arch/Platform.h>
+#include <interrupts/Ipi.h>
+#include <tasking/RunLevels.h>
+#include <debug/Log.h>
+#include <containers/Vector.h>
+#include <Maths.h>
+#include <ArchHints.h>
+#include <Locks.h>
+
+namespace Npk::Memory
+{
+    struct TlbCoreState
+    {
+        sl::Atomic<HatMap*> loadedMap;
+        TlbGeneration* loadedGeneration;
+        size_t flushedGeneration;
+        sl::Atomic<bool> lazy;
+
+        size_t nextVictim;
+        struct
+        {
+            size_t owner;
+            size_t generation;
+        } tags[MaxTlbTags];
+    };
+
+    struct TlbShootdownRequest
+    {
+        HatMap* map;
+        uintptr_t base;
+        size_t length;
+        sl::Atomic<size_t> pending;
+    };
+
+    sl::RwLock coreStatesLock;
+    sl::Vector<TlbCoreState*> coreStates;
+    sl::Atomic<size_t> nextContextId = 1;
+
+    struct
+    {
+        sl::Atomic<size_t> shootdowns;
+        sl::Atomic<size_t> ipisSent;
+        sl::Atomic<size_t> pagesInvalidated;
+        sl::Atomic<size_t> lazySkips;
+        sl::Atomic<size_t> lazyFlushes;
+        sl::Atomic<size_t> tagHits;
+        sl::Atomic<size_t> tagMisses;
+    } shootdownStats;
+
+    static TlbCoreState* LocalState()
+    {
+        if (!CoreLocalAvailable())
+            return nullptr;
+
+        TlbCoreState* state = nullptr;
+        coreStatesLock.ReaderLock();
+        if (CoreLocal().id < coreStates.Size())
+            state = coreStates[CoreLocal().id];
+        coreStatesLock.ReaderUnlock();
+
+        return state;
+    }
+
+    static void TlbShootdownHandler(void* arg)
+    {
+        auto request = static_cast<TlbShootdownRequest*>(arg);
+        HatFlushLocal(request->base, request->length);
+        request->pending.FetchSub(1, sl::Release);
+    }
+
+    static void TlbReleaseHandler(void* arg)
+    {
+        auto request = static_cast<TlbShootdownRequest*>(arg);
+        TlbCoreState* state = LocalState();
+        if (state != nullptr && state->loadedMap.Load(sl::Acquire) == request->map)
+        {
+            HatMakeActive(KernelMap(), true);
+            CoreLocal()[LocalPtr::UserVmm] = nullptr;
+        }
+        request->pending.FetchSub(1, sl::Release);
+    }
+
+    //sends `request` to all other cores with the map loaded (or all cores for the kernel map),
+    //and waits for them to process it. Returns the number of ipis sent.
+    static size_t SendToCores(TlbShootdownRequest& request, void (*handler)(void*), bool skipLazy, size_t& lazySkips)
+    {
+        /* We must stay on this core until every target has acknowledged the request, and our own
+         * ipi handler can't be allowed to run while we're polling our mailbox: it takes the same
+         * mailbox lock, and would spin on it forever. Interrupts are disabled for the duration,
+         * pending mail for this core is processed by polling instead.
+         */
+        const auto prevRl = Tasking::EnsureRunLevel(RunLevel::Dpc);
+        const bool restoreIntrs = InterruptsEnabled();
+        DisableInterrupts();
+
+        //the kernel half is shared between all address spaces, so any core could have cached it.
+        const bool kernelMap = request.map == KernelMap();
+        const size_t localId = CoreLocal().id;
+        const bool hasMailbox = LocalState() != nullptr;
+
+        size_t ipisSent = 0;
+        coreStatesLock.ReaderLock();
+        for (size_t i = 0; i < coreStates.Size(); i++)
+        {
+            TlbCoreState* state = coreStates[i];
+            if (state == nullptr || i == localId)
+                continue;
+            if (!kernelMap && state->loadedMap.Load(sl::SeqCst) != request.map)
+                continue;
+            if (!kernelMap && skipLazy && state->lazy.Load(sl::SeqCst))
+            {
+                lazySkips++;
+                continue;
+            }
+
+            request.pending.FetchAdd(1, sl::Relaxed);
+            while (!Interrupts::TrySendIpiMail(i, handler, &request))
+            {
+                if (hasMailbox)
+                    Interrupts::ProcessIpiMail(); //target's mailbox is full, it may be waiting on us.
+                sl::HintSpinloop();
+            }
+            ipisSent++;
+        }
+        coreStatesLock.ReaderUnlock();
+
+        //process our own mail while waiting, in case another core is trying to shoot us down.
+        while (request.pending.Load(sl::Acquire) != 0)
+        {
+            if (hasMailbox)
+                Interrupts::ProcessIpiMail();
+            sl::HintSpinloop();
+        }
+
+        if (restoreIntrs)
+            EnableInterrupts();
+        if (prevRl.HasValue())
+            Tasking::LowerRunLevel(*prevRl);
+        return ipisSent;
+    }
+
+    void InitTlbShootdown()
+    {
+        TlbCoreState* state = new TlbCoreState();
+        state->loadedMap = KernelMap(); //PerCoreEntry() loads the kernel map before we're called.
+        state->loadedGeneration = nullptr;
+        state->flushedGeneration = 0;
+        state->lazy = false;
+        state->nextVictim = 0;
+        for (size_t i = 0; i < MaxTlbTags; i++)
+            state->tags[i].owner = 0;
+
+        coreStatesLock.WriterLock();
+        coreStates.EmplaceAt(CoreLocal().id, state);
+        coreStatesLock.WriterUnlock();
+    }
+
+    void InitTlbContext(TlbContext& context)
+    {
+        context.generation = 0;
+        context.id = nextContextId.FetchAdd(1, sl::Relaxed);
+    }
+
+    TlbLoadResult TlbMapLoaded(HatMap* map, TlbContext& context, size_t maxTags)
+    {
+        TlbCoreState* state = LocalState();
+        if (state == nullptr)
+            return { .tag = 0, .flush = true };
+
+        //publish the new map before reading its generation, this pairs with TlbShootdown():
+        //either it sees the map is loaded here and sends an ipi, or we see the new generation.
+        state->loadedMap.Store(map, sl::SeqCst);
+        state->loadedGeneration = &context.generation;
+        const size_t generation = context.generation.Load(sl::SeqCst);
+        state->flushedGeneration = generation;
+
+        maxTags = sl::Min(maxTags, MaxTlbTags);
+        if (maxTags == 0 || context.id == 0)
+            return { .tag = 0, .flush = true };
+
+        //translations cached under a tag are still valid if no shootdowns have occured for
+        //this address space since we last loaded it.
+        for (size_t i = 0; i < maxTags; i++)
+        {
+            if (state->tags[i].owner != context.id)
+                continue;
+
+            const bool stale = state->tags[i].generation != generation;
+            state->tags[i].generation = generation;
+            if (!stale)
+                shootdownStats.tagHits.FetchAdd(1, sl::Relaxed);
+            else
+                shootdownStats.tagMisses.FetchAdd(1, sl::Relaxed);
+            return { .tag = i + 1, .flush = stale };
+        }
+
+        //no tag for this address space, recycle the one that was claimed longest ago.
+        const size_t victim = state->nextVictim++ % maxTags;
+        state->tags[victim].owner = context.id;
+        state->tags[victim].generation = generation;
+        shootdownStats.tagMisses.FetchAdd(1, sl::Relaxed);
+        return { .tag = victim + 1, .flush = true };
+    }
+
+    void TlbEnterLazy()
+    {
+        TlbCoreState* state = LocalState();
+        if (state == nullptr || state->loadedGeneration == nullptr)
+            return;
+
+        //any shootdowns before this point were sent to us via ipi, so we're up to date.
+        state->flushedGeneration = state->loadedGeneration->Load(sl::Acquire);
+        state->lazy.Store(true, sl::SeqCst);
+    }
+
+    void TlbExitLazy()
+    {
+        TlbCoreState* state = LocalState();
+        if (state == nullptr || !state->lazy.Load(sl::Relaxed))
+            return;
+
+        //pairs with TlbShootdown(): either it sees we're no longer lazy and sends an ipi, or
+        //we see the new generation and flush here.
+        state->lazy.Store(false, sl::SeqCst);
+        const size_t generation = state->loadedGeneration->Load(sl::SeqCst);
+        if (generation == state->flushedGeneration)
+            return;
+
+        HatFlushLocal(0, 0);
+        state->flushedGeneration = generation;
+        shootdownStats.lazyFlushes.FetchAdd(1, sl::Relaxed);
+    }
+
+    void TlbShootdown(HatMap* map, TlbContext& context, uintptr_t base, size_t length)
+    {
+        context.generation.FetchAdd(1, sl::SeqCst);
+        if (!CoreLocalAvailable())
+            return; //early init, only the bsp is running.
+
+        TlbShootdownRequest request { .map = map, .base = base, .length = length, .pending = 0 };
+        size_t lazySkips = 0;
+        const size_t ipisSent = SendToCores(request, TlbShootdownHandler, true, lazySkips);
+
+        shootdownStats.shootdowns.FetchAdd(1, sl::Relaxed);
+        shootdownStats.ipisSent.FetchAdd(ipisSent, sl::Relaxed);
+        shootdownStats.pagesInvalidated.FetchAdd(ipisSent * (length / PageSize), sl::Relaxed);
+        shootdownStats.lazySkips.FetchAdd(lazySkips, sl::Relaxed);
+    }
+
+    void TlbReleaseMap(HatMap* map)
+    {
+        ASSERT(map != KernelMap(), "Attempted to release kernel map");
+
+        TlbShootdownRequest request { .map = map, .base = 0, .length = 0, .pending = 1 };
+        TlbReleaseHandler(&request);
+        if (!CoreLocalAvailable())
+            return;
+
+        //lazy cores still have the map loaded, so they're included here.
+        size_t lazySkips = 0;
+        SendToCores(request, TlbReleaseHandler, false, lazySkips);
+    }
+
+    TlbShootdownStats GetTlbShootdownStats()
+    {
+        TlbShootdownStats stats;
+        stats.shootdowns = shootdownStats.shootdowns.Load(sl::Relaxed);
+        stats.ipisSent = shootdownStats.ipisSent.Load(sl::Relaxed);
+        stats.pagesInvalidated = shootdownStats.pagesInvalidated.Load(sl::Relaxed);
+        stats.lazySkips = shootdownStats.lazySkips.Load(sl::Relaxed);
+        stats.lazyFlushes = shootdownStats.lazyFlushes.Load(sl::Relaxed);
+        stats.tagHits = shootdownStats.tagHits.Load(sl::Relaxed);
+        stats.tagMisses = shootdownStats.tagMisses.Load(sl::Relaxed);
+        return stats;
+    }
+}
@@ -3,11 +3,17 @@
 #include <memory/virtual/KernelVmDriver.h>
 #include <memory/Pmm.h>
 #include <memory/Heap.h>
+#include <memory/TlbShootdown.h>
+#include <memory/CompressedSwap.h>
+#include <memory/PageMerging.h>
+#include <memory/PageAging.h>
 #include <tasking/Threads.h>
+#include <tasking/Scheduler.h>
 #include <arch/Hat.h>
 #include <boot/LinkerSyms.h>
+#include <config/ConfigStore.h>
 #include <debug/Log.h>
-#include <Bitmap.h>
+#include <ArchHints.h>
 #include <Memory.h>
 #include <Lazy.h>
 #include <Maths.h>
@@ -73,103 +79,594 @@ namespace Npk::Memory
     };
 
     constexpr size_t VmmMetaSlabPages = 1;
+    constexpr size_t VmmMetaShrinkerPriority = 30;
+    constexpr size_t VmmSwapShrinkerPriority = 50; //compressing pages is expensive, so try this last.
+    constexpr size_t FindRangeAttempts = 8;
+    //a red-black tree with 2^64 nodes has a max depth of 128, so anything deeper is a walk that raced a writer.
+    constexpr size_t FindRangeMaxDepth = 128;
+    constexpr size_t PrefetchBatchPages = 256; //max pages prefetched before looking at the queue again.
+
+    constexpr size_t VmMetaCacheBatch = VmMetaCacheDepth / 2;
+    static_assert(VmmMetaSlabPages == 1, "PMM only guarantees page alignment, MetaSlabOf() needs slabs to be naturally aligned");
+
+    static void LinkMetaSlab(VmmMetaSlab*& head, VmmMetaSlab* slab)
+    {
+        slab->prev = nullptr;
+        slab->next = head;
+        if (head != nullptr)
+            head->prev = slab;
+        head = slab;
+    }
+
+    static void UnlinkMetaSlab(VmmMetaSlab*& head, VmmMetaSlab* slab)
+    {
+        if (slab->prev != nullptr)
+            slab->prev->next = slab->next;
+        else
+            head = slab->next;
+        if (slab->next != nullptr)
+            slab->next->prev = slab->prev;
+        slab->next = slab->prev = nullptr;
+    }
+
+    static inline VmmMetaSlab* MetaSlabOf(void* ptr)
+    {
+        const uintptr_t addr = sl::AlignDown(reinterpret_cast<uintptr_t>(ptr), VmmMetaSlabPages * PageSize);
+        return reinterpret_cast<VmmMetaSlab*>(addr);
+    }
 
     VmmMetaSlab* VMM::CreateMetaSlab(VmmMetaType type)
     {
+        //expects the slab lock for this type to be held.
         const size_t index = static_cast<size_t>(type);
         const size_t size = VmmSlabSizes[index];
 
-        const uintptr_t base = PMM::Global().Alloc(VmmMetaSlabPages) + hhdmBase;
+        const uintptr_t phys = PMM::Global().Alloc(VmmMetaSlabPages);
+        VALIDATE(phys != 0, nullptr, "PMM allocation failed for VMM meta slab");
+        const uintptr_t base = phys + hhdmBase;
         const size_t totalSpace = VmmMetaSlabPages * PageSize;
-        const uintptr_t usableBase = sl::AlignUp(base + sizeof(VmmMetaSlab), size);
-        const size_t usableSpace = totalSpace - (usableBase - base);
-
-        size_t slabCount = usableSpace / size;
-        size_t bitmapBytes = sl::AlignUp(slabCount, 8) / 8;
-        while ((slabCount * size + bitmapBytes > usableSpace) && (slabCount > 0))
-        {
-            slabCount--;
-            bitmapBytes = sl::AlignUp(slabCount, 8) / 8;
-        }
+        const uintptr_t usableBase = sl::AlignUp(base + sizeof(VmmMetaSlab), sl::Max(alignof(VmRange), alignof(VmHole)));
+        const size_t slabCount = (base + totalSpace - usableBase) / size;
         ASSERT(slabCount > 0, "Bad VMM meta slab params");
 
         VmmMetaSlab* slab = new(reinterpret_cast<void*>(base)) VmmMetaSlab();
-        slab->next = metaSlabs[index];
+        slab->type = type;
         slab->total = slabCount;
         slab->free = slabCount;
-        slab->data = usableBase;
-        slab->bitmap = reinterpret_cast<uint8_t*>(usableBase + slabCount * size);
 
-        sl::memset(slab->bitmap, 0, bitmapBytes);
-        metaSlabs[index] = slab;
+        //thread the freelist through the objects, in address order.
+        slab->freelist = nullptr;
+        for (size_t i = slabCount; i > 0; i--)
+        {
+            void** entry = reinterpret_cast<void**>(usableBase + (i - 1) * size);
+            *entry = slab->freelist;
+            slab->freelist = entry;
+        }
+
+        LinkMetaSlab(metaSlabs[index], slab);
+        emptyMetaSlabs[index]++;
+        StatAdd(stats.metaSlabPages, VmmMetaSlabPages);
 
-        Log("VMM metadata slab created: type=%zu, %zu entries + %zub early slack",
-            LogLevel::Verbose, index, slabCount, totalSpace - usableSpace);
+        Log("VMM metadata slab created: type=%zu, %zu entries + %zub slack",
+            LogLevel::Verbose, index, slabCount, totalSpace - slabCount * size);
 
         return slab;
     }
 
-    bool VMM::DestroyMetaSlab(VmmMetaType type)
+    bool VMM::DestroyMetaSlab(VmmMetaType type, bool keepOne)
     {
-        //return if there are more slabs of this type
-        ASSERT_UNREACHABLE(); (void)type;
+        //destroys the first empty slab of this type, returns whether a slab was destroyed.
+        const size_t index = static_cast<size_t>(type);
+
+        sl::ScopedLock slabLock(metaSlabLocks[index]);
+        if (keepOne && (metaSlabs[index] == nullptr || metaSlabs[index]->next == nullptr))
+            return false;
+
+        VmmMetaSlab* slab = metaSlabs[index];
+        while (slab != nullptr && slab->free != slab->total)
+            slab = slab->next;
+        if (slab == nullptr)
+            return false;
+
+        UnlinkMetaSlab(metaSlabs[index], slab);
+        emptyMetaSlabs[index]--;
+        slabLock.Release();
+
+        StatSub(stats.metaSlabPages, VmmMetaSlabPages);
+        PMM::Global().Free(reinterpret_cast<uintptr_t>(slab) - hhdmBase, VmmMetaSlabPages);
+        return true;
     }
 
-    void* VMM::AllocMeta(VmmMetaType type)
+    size_t VMM::MetaShrinkerCount(void* arg)
     {
-        const size_t slabIndex = static_cast<size_t>(type);
-        const size_t slabSize = VmmSlabSizes[slabIndex];
+        VMM& vmm = *static_cast<VMM*>(arg);
 
-        sl::ScopedLock allocLock(metaSlabLocks[slabIndex]);
-        VmmMetaSlab* slab = metaSlabs[slabIndex];
-        while (slab != nullptr && slab->free == 0)
-            slab = slab->next;
+        //range slabs are never reclaimed while the vmm is alive, FindRange() relies on this.
+        const size_t index = static_cast<size_t>(VmmMetaType::Hole);
+        sl::ScopedLock slabLock(vmm.metaSlabLocks[index]);
+        VmmMetaSlab* slab = vmm.metaSlabs[index];
+        if (slab == nullptr || slab->next == nullptr)
+            return 0;
 
+        //the last slab with free space is never reclaimed, so the vmm can always make forward progress.
+        return vmm.emptyMetaSlabs[index] * VmmMetaSlabPages;
+    }
+
+    size_t VMM::MetaShrinkerReclaim(void* arg, size_t pages)
+    {
+        VMM& vmm = *static_cast<VMM*>(arg);
+
+        size_t freed = 0;
+        while (freed < pages && vmm.DestroyMetaSlab(VmmMetaType::Hole, true))
+            freed += VmmMetaSlabPages;
+
+        return freed;
+    }
+
+    void* VMM::MetaSlabPop(VmmMetaType type)
+    {
+        //expects the slab lock for this type to be held.
+        const size_t index = static_cast<size_t>(type);
+
+        VmmMetaSlab* slab = metaSlabs[index];
         if (slab == nullptr)
         {
             slab = CreateMetaSlab(type);
             VALIDATE(slab != nullptr, nullptr, "VMM meta slab creation failed");
         }
 
-        const size_t found = sl::BitmapFindClear(slab->bitmap, slab->total);
-        ASSERT(found != slab->total, "VMM meta slab exhausted");
-        sl::BitmapSet(slab->bitmap, found);
+        if (slab->free == slab->total)
+            emptyMetaSlabs[index]--;
+        void** entry = static_cast<void**>(slab->freelist);
+        ASSERT(entry != nullptr, "VMM meta slab exhausted");
+        slab->freelist = *entry;
         slab->free--;
 
-        return reinterpret_cast<void*>(slab->data + (found * slabSize));
+        if (slab->free == 0)
+        {
+            UnlinkMetaSlab(metaSlabs[index], slab);
+            LinkMetaSlab(fullMetaSlabs[index], slab);
+        }
+
+        return entry;
+    }
+
+    VmmMetaSlab* VMM::MetaSlabPush(void* ptr, VmmMetaType type)
+    {
+        //expects the slab lock for this type to be held. Returns the owning slab if it
+        //was emptied and unlinked, and should be returned to the PMM by the caller.
+        const size_t index = static_cast<size_t>(type);
+        VmmMetaSlab* slab = MetaSlabOf(ptr);
+        ASSERT(slab->type == type, "VMM metadata freed to wrong slab type");
+        ASSERT(slab->free < slab->total, "VMM metadata double free");
+
+        /* Only the first word of the object (its base field) is overwritten, the tree hook in
+         * a freed VmRange is left as-is so a racing FindRange() still sees sane pointers.
+         */
+        void** entry = static_cast<void**>(ptr);
+        *entry = slab->freelist;
+        slab->freelist = entry;
+        slab->free++;
+
+        if (slab->free == 1)
+        {
+            UnlinkMetaSlab(fullMetaSlabs[index], slab);
+            LinkMetaSlab(metaSlabs[index], slab);
+        }
+        if (slab->free != slab->total)
+            return nullptr;
+
+        //keep a single empty slab around to absorb alloc/free churn, the shrinker can
+        //take that one later. Range slabs are kept until the VMM is destroyed.
+        if (type == VmmMetaType::Hole && emptyMetaSlabs[index] > 0)
+        {
+            UnlinkMetaSlab(metaSlabs[index], slab);
+            return slab;
+        }
+
+        emptyMetaSlabs[index]++;
+        return nullptr;
+    }
+
+    void* VMM::AllocMeta(VmmMetaType type)
+    {
+        const size_t index = static_cast<size_t>(type);
+
+        void* ptr = nullptr;
+        sl::Opt<RunLevel> prevRl {};
+        if (CoreLocalAvailable())
+            prevRl = EnsureRunLevel(RunLevel::Dpc);
+        if (VmQuantumCache* cache = LocalQuantumCache(); cache != nullptr)
+        {
+            if (cache->metaCounts[index] == 0)
+            {
+                //refill half of the magazine, so alloc/free pairs dont bounce on the slab lock.
+                sl::ScopedLock slabLock(metaSlabLocks[index]);
+                while (cache->metaCounts[index] < VmMetaCacheBatch)
+                {
+                    void* entry = MetaSlabPop(type);
+                    if (entry == nullptr)
+                        break;
+                    cache->metas[index][cache->metaCounts[index]++] = entry;
+                }
+            }
+            if (cache->metaCounts[index] > 0)
+                ptr = cache->metas[index][--cache->metaCounts[index]];
+        }
+        else
+        {
+            sl::ScopedLock slabLock(metaSlabLocks[index]);
+            ptr = MetaSlabPop(type);
+        }
+        if (prevRl.HasValue())
+            LowerRunLevel(*prevRl);
+
+        return ptr;
     }
 
     void VMM::FreeMeta(void* ptr, VmmMetaType type)
     {
-        const size_t slabIndex = static_cast<size_t>(type);
-        const size_t slabSize = VmmSlabSizes[slabIndex];
+        const size_t index = static_cast<size_t>(type);
 
-        sl::ScopedLock allocLock(metaSlabLocks[slabIndex]);
-        VmmMetaSlab* slab = metaSlabs[slabIndex];
+        VmmMetaSlab* emptied[VmMetaCacheBatch];
+        size_t emptiedCount = 0;
 
-        while (slab != nullptr)
+        sl::Opt<RunLevel> prevRl {};
+        if (CoreLocalAvailable())
+            prevRl = EnsureRunLevel(RunLevel::Dpc);
+        if (VmQuantumCache* cache = LocalQuantumCache(); cache != nullptr)
         {
-            const uintptr_t top = slab->data + (slab->total * slabSize);
-            if ((uintptr_t)ptr < slab->data || (uintptr_t)ptr > top)
+            if (cache->metaCounts[index] == VmMetaCacheDepth)
             {
-                slab = slab->next;
+                sl::ScopedLock slabLock(metaSlabLocks[index]);
+                for (size_t i = 0; i < VmMetaCacheBatch; i++)
+                {
+                    void* entry = cache->metas[index][--cache->metaCounts[index]];
+                    if (VmmMetaSlab* slab = MetaSlabPush(entry, type); slab != nullptr)
+                        emptied[emptiedCount++] = slab;
+                }
+            }
+            cache->metas[index][cache->metaCounts[index]++] = ptr;
+        }
+        else
+        {
+            sl::ScopedLock slabLock(metaSlabLocks[index]);
+            if (VmmMetaSlab* slab = MetaSlabPush(ptr, type); slab != nullptr)
+                emptied[emptiedCount++] = slab;
+        }
+        if (prevRl.HasValue())
+            LowerRunLevel(*prevRl);
+
+        for (size_t i = 0; i < emptiedCount; i++)
+        {
+            StatSub(stats.metaSlabPages, VmmMetaSlabPages);
+            PMM::Global().Free(reinterpret_cast<uintptr_t>(emptied[i]) - hhdmBase, VmmMetaSlabPages);
+        }
+    }
+
+    size_t VMM::SwapShrinkerCount(void* arg)
+    {
+        VMM& vmm = *static_cast<VMM*>(arg);
+        if (!CompressedSwap::Global().Enabled())
+            return 0;
+
+        //a rough estimate, some of these pages will be shared or not compress well.
+        return __atomic_load_n(&vmm.stats.anonResidentSize, __ATOMIC_RELAXED) / PageSize;
+    }
+
+    size_t VMM::SwapShrinkerReclaim(void* arg, size_t pages)
+    {
+        using namespace Virtual;
+        VMM& vmm = *static_cast<VMM*>(arg);
+
+        /* Ranges are visited in address order starting from where the last call left off, so
+         * each call continues the clock sweep of the previous one. We may wrap around the
+         * address space twice: pages skipped on the first pass because they had been accessed
+         * can be taken on the second pass if they haven't been touched since.
+         */
+        size_t freed = 0;
+        size_t wraps = 0;
+        const bool aging = PageAging::Global().Enabled();
+        while (freed < pages && wraps < 2)
+        {
+            //holding the ranges lock prevents the range being freed while the driver is using it.
+            sl::ScopedLock rangeTreeLock(vmm.rangesLock);
+            VmRange* range = vmm.NextRange(vmm.swapHand);
+            if (range == nullptr)
+            {
+                vmm.swapHand = 0;
+                wraps++;
                 continue;
             }
 
-            //found the owning slab.
-            const size_t index = ((uintptr_t)ptr - slab->data) / slabSize;
-            sl::BitmapClear(slab->bitmap, index);
-            return;
+            uintptr_t cursor = sl::Max(vmm.swapHand, range->base);
+            VmDriver* driver = VmDriver::GetDriver(range->flags);
+            if (range->flags.Has(VmFlag::Anon) && driver != nullptr)
+            {
+                VmDriverContext context { .lock = range->mapLock, .map = vmm.hatMap, .range = *range, .stats = vmm.stats };
+                //prefer pages that have been idle for a while, but take anything on the second pass.
+                const size_t minAge = aging && wraps == 0 ? ReclaimMinIdleAge : 0;
+                freed += driver->Reclaim(context, cursor, pages - freed, minAge);
+            }
+            else
+                cursor = range->Top();
+            vmm.swapHand = cursor;
+        }
+
+        return freed;
+    }
+
+    //user VMMs, for the same-page merging scanner to walk.
+    sl::RwLock userVmmsLock;
+    VMM* userVmms = nullptr;
+
+    //pending VmAdvice::WillNeed requests, see PrefetchThread().
+    struct VmPrefetchRequest
+    {
+        VmPrefetchRequest* next;
+        VMM* vmm;
+        uintptr_t base;
+        size_t length;
+    };
+
+    sl::TicketLock prefetchLock;
+    VmPrefetchRequest* prefetchHead = nullptr;
+    VmPrefetchRequest* prefetchTail = nullptr;
+    VmPrefetchRequest* prefetchActive = nullptr; //the request being worked on, outside of the queue
+    bool prefetchCancelled = false; //the active request's VMM is being destroyed
+    Tasking::Waitable prefetchEvent;
+    bool prefetchReady = false;
+
+    size_t VMM::MergeRanges(size_t budget)
+    {
+        using namespace Virtual;
+
+        //like SwapShrinkerReclaim() this resumes from where the last call left off, but stops
+        //after one full pass so an address space with nothing to merge doesnt spin.
+        size_t scanned = 0;
+        bool wrapped = false;
+        while (scanned < budget)
+        {
+            sl::ScopedLock rangeTreeLock(rangesLock);
+            VmRange* range = NextRange(mergeHand);
+            if (range == nullptr)
+            {
+                mergeHand = 0;
+                if (wrapped)
+                    break;
+                wrapped = true;
+                continue;
+            }
+
+            uintptr_t cursor = sl::Max(mergeHand, range->base);
+            VmDriver* driver = VmDriver::GetDriver(range->flags);
+            if (range->flags.Has(VmFlag::Anon) && driver != nullptr)
+            {
+                VmDriverContext context { .lock = range->mapLock, .map = hatMap, .range = *range, .stats = stats };
+                scanned += driver->Merge(context, cursor, budget - scanned);
+            }
+            else
+                cursor = range->Top();
+            mergeHand = cursor;
+        }
+
+        return scanned;
+    }
+
+    size_t VMM::MergeScan(size_t budget)
+    {
+        userVmmsLock.ReaderLock();
+        size_t count = 0;
+        for (VMM* scan = userVmms; scan != nullptr; scan = scan->nextUser)
+            count++;
+
+        //split the budget evenly, so one large address space cant starve the others.
+        size_t scanned = 0;
+        const size_t share = count == 0 ? 0 : sl::Max(budget / count, 1ul);
+        for (VMM* scan = userVmms; scan != nullptr; scan = scan->nextUser)
+            scanned += scan->MergeRanges(share);
+        userVmmsLock.ReaderUnlock();
+
+        return scanned;
+    }
+
+    struct AgingPass
+    {
+        VmAgeHistogram histogram;
+        size_t scanned;
+    };
+
+    static void AgeTranslation(void* arg, uintptr_t vaddr, uintptr_t paddr, size_t mode, bool accessed, bool dirty)
+    {
+        (void)vaddr;
+        (void)dirty;
+        AgingPass& pass = *static_cast<AgingPass*>(arg);
+        const size_t pages = HatGetLimits().modes[mode].granularity / PageSize;
+        const uint32_t age = PageAging::Global().Touch(paddr, accessed);
+
+        //bucket 0 is age 0, after that bucket N holds ages [2^(N-1), 2^N).
+        const size_t bucket = age == 0 ? 0 : sl::Min<size_t>(32 - __builtin_clz(age), VmAgeBuckets - 1);
+        pass.histogram.pages[bucket] += pages;
+        if (age < VmWorkingSetAge)
+            pass.histogram.workingSet += pages * PageSize;
+        pass.scanned++;
+    }
+
+    size_t VMM::AgeRanges()
+    {
+        size_t scanned = 0;
+        size_t accessed = 0;
+        sl::ScopedLock rangeTreeLock(rangesLock);
+        for (VmRange* range = NextRange(0); range != nullptr; range = NextRange(range->Top()))
+        {
+            //mmio ranges dont have PageInfo for their physical memory, so there's nothing to track.
+            if (!range->flags.Has(VmFlag::Anon) && !range->flags.Has(VmFlag::File))
+                continue;
+
+            AgingPass pass {};
+            sl::ScopedLock mapLock(range->mapLock);
+            accessed += HatTestClearRange(hatMap, range->base, range->length, false, AgeTranslation, &pass, false);
+
+            StatSub(stats.workingSetSize, range->ages.workingSet);
+            StatAdd(stats.workingSetSize, pass.histogram.workingSet);
+            range->ages = pass.histogram;
+            scanned += pass.scanned;
         }
 
-        ASSERT_UNREACHABLE() //means the metadata wasnt allocated from one of our slabs.
+        PageAging::Global().CountPass(scanned, accessed);
+        return scanned;
+    }
+
+    size_t VMM::AgeScan()
+    {
+        size_t scanned = 0;
+        userVmmsLock.ReaderLock();
+        for (VMM* scan = userVmms; scan != nullptr; scan = scan->nextUser)
+            scanned += scan->AgeRanges();
+        userVmmsLock.ReaderUnlock();
+
+        return scanned;
+    }
+
+    void VMM::PrefetchThread(void* arg)
+    {
+        (void)arg;
+        Tasking::WaitEntry waitEntry;
+
+        /* Requests are handled in batches, putting the rest of a request back at the head of the
+         * queue in between. The request being worked on is published as prefetchActive, this acts
+         * as a reference to its VMM: a VMM's destructor removes any requests for it that are still
+         * queued, and waits for the active one to finish its current batch. No other locks are
+         * held while prefetching, so this doesn't stall VMM creation or destruction elsewhere.
+         * The kernel VMM is never destroyed.
+         */
+        while (true)
+        {
+            Tasking::WaitManager::WaitOne(&prefetchEvent, &waitEntry, { sl::TimeScale::Millis, -1ul });
+
+            while (true)
+            {
+                prefetchLock.Lock();
+                VmPrefetchRequest* request = prefetchHead;
+                if (request != nullptr)
+                {
+                    prefetchHead = request->next;
+                    if (prefetchHead == nullptr)
+                        prefetchTail = nullptr;
+                }
+                prefetchActive = request;
+                prefetchCancelled = false;
+                prefetchLock.Unlock();
+
+                if (request == nullptr)
+                    break;
+
+                const size_t batchLength = sl::Min(request->length, PrefetchBatchPages * PageSize);
+                request->vmm->Prefetch(request->base, batchLength);
+                request->base += batchLength;
+                request->length -= batchLength;
+
+                prefetchLock.Lock();
+                const bool finished = request->length == 0 || prefetchCancelled;
+                if (!finished)
+                {
+                    request->next = prefetchHead;
+                    prefetchHead = request;
+                    if (prefetchTail == nullptr)
+                        prefetchTail = request;
+                }
+                prefetchActive = nullptr;
+                prefetchLock.Unlock();
+
+                if (finished)
+                    delete request;
+            }
+        }
+    }
+
+    void VMM::InitPrefetch()
+    {
+        using namespace Tasking;
+        auto thread = Thread::Create(Process::Kernel().Id(), PrefetchThread, nullptr);
+        ASSERT_(thread != nullptr);
+        thread->Start(nullptr);
+        prefetchReady = true;
+
+        Log("VMM prefetch thread started: thread=%zu", LogLevel::Info, thread->Id());
+    }
+
+    bool VMM::QueuePrefetch(uintptr_t base, size_t length)
+    {
+        if (!prefetchReady)
+        {
+            Prefetch(base, length);
+            return true;
+        }
+
+        VmPrefetchRequest* request = new VmPrefetchRequest();
+        if (request == nullptr)
+            return false;
+        request->next = nullptr;
+        request->vmm = this;
+        request->base = base;
+        request->length = length;
+
+        prefetchLock.Lock();
+        if (prefetchTail == nullptr)
+            prefetchHead = request;
+        else
+            prefetchTail->next = request;
+        prefetchTail = request;
+        prefetchLock.Unlock();
+
+        prefetchEvent.Signal();
+        return true;
+    }
+
+    void VMM::Prefetch(uintptr_t base, size_t length)
+    {
+        using namespace Virtual;
+
+        //the ranges may have changed since the advice was given, so only prefetch what's still there.
+        const uintptr_t top = base + length;
+        while (base < top)
+        {
+            //holding the ranges lock prevents the range being freed while the driver is using it.
+            sl::ScopedLock rangeTreeLock(rangesLock);
+            VmRange* range = NextRange(base);
+            if (range == nullptr || range->base >= top)
+                break;
+
+            const uintptr_t begin = sl::Max(base, range->base);
+            const uintptr_t end = sl::Min(top, range->Top());
+            VmDriver* driver = VmDriver::GetDriver(range->flags);
+            if (driver != nullptr)
+            {
+                VmDriverContext context { .lock = range->mapLock, .map = hatMap, .range = *range, .stats = stats };
+                driver->Advise(context, begin, end - begin, VmAdvice::WillNeed);
+            }
+            base = end;
+        }
     }
 
     void VMM::CommonInit()
     {
         //initialize meta allocators
         for (size_t i = 0; i < (size_t)VmmMetaType::Count; i++)
+        {
             metaSlabs[i] = nullptr;
+            fullMetaSlabs[i] = nullptr;
+            emptyMetaSlabs[i] = 0;
+        }
+        rangesSeq = 0;
+        pinnedSpans = nullptr;
+        metaShrinker.name = "vmm-meta";
+        metaShrinker.priority = VmmMetaShrinkerPriority;
+        metaShrinker.directSafe = false;
+        metaShrinker.count = MetaShrinkerCount;
+        metaShrinker.reclaim = MetaShrinkerReclaim;
+        metaShrinker.arg = this;
+        PMM::Global().RegisterShrinker(&metaShrinker);
 
         //Create the initial VM hole representing the initial address space
         VmHole* initialHole = new(AllocMeta(VmmMetaType::Hole)) VmHole();
@@ -205,44 +702,332 @@ namespace Npk::Memory
         }
     }
 
+    //Returns the lowest hole in the subtree rooted at `hole` that can fit an allocation of
+    //`length` bytes within `limits`, and the base address the allocation would use within it.
+    //Subtrees are skipped if their largest hole is too small, or they're outside the bounds.
+    static VmHole* FindHole(VmHole* hole, size_t length, const VmAllocLimits& limits, uintptr_t& base)
+    {
+        if (hole == nullptr || hole->largestHole < length)
+            return nullptr;
+
+        //everything in the left subtree is below this hole, it can be ignored if this hole
+        //starts below the lower bound.
+        if (hole->base > limits.lowerBound)
+        {
+            if (VmHole* found = FindHole(VmHoleTree::GetLeft(hole), length, limits, base); found != nullptr)
+                return found;
+        }
+
+        const uintptr_t start = sl::AlignUp(sl::Max(hole->base, limits.lowerBound), limits.alignment);
+        const uintptr_t top = sl::Min(hole->base + hole->length, limits.upperBound);
+        if (start >= hole->base && start < top && top - start >= length)
+        {
+            base = start;
+            return hole;
+        }
+
+        //likewise everything in the right subtree is above this hole.
+        if (hole->base + hole->length >= limits.upperBound)
+            return nullptr;
+        return FindHole(VmHoleTree::GetRight(hole), length, limits, base);
+    }
+
+    sl::Opt<uintptr_t> VMM::ReserveSpace(size_t length, VmAllocLimits limits)
+    {
+        VALIDATE(sl::IsPowerOfTwo(limits.alignment), {}, "VM alignment must be a power of 2");
+        VALIDATE(limits.lowerBound < limits.upperBound, {}, "Bad VM allocation bounds");
+
+        //find an empty part of the address that meets our criteria.
+        sl::ScopedLock holyLock(holesLock);
+        uintptr_t rangeBase = 0;
+        VmHole* hole = FindHole(holes.GetRoot(), length, limits, rangeBase);
+        VALIDATE(hole != nullptr, {}, "No hole in address space large enough.");
+
+        AdjustHole(hole, rangeBase - hole->base, length);
+        FreeMeta(hole, VmmMetaType::Hole);
+        holyLock.Release();
+        VALIDATE(rangeBase != 0, {}, "Will not allocate VM at address 0");
+
+        return rangeBase;
+    }
+
+    void VMM::ReleaseSpace(uintptr_t base, size_t length)
+    {
+        sl::ScopedLock holyLock(holesLock);
+
+        //find the holes immediately before and after the released space.
+        VmHole* pred = nullptr;
+        VmHole* succ = nullptr;
+        for (VmHole* scan = holes.GetRoot(); scan != nullptr;)
+        {
+            if (scan->base < base)
+            {
+                pred = scan;
+                scan = holes.GetRight(scan);
+            }
+            else
+            {
+                succ = scan;
+                scan = holes.GetLeft(scan);
+            }
+        }
+
+        //merge the space into any adjacent holes rather than creating a new one, so the
+        //address space doesn't fragment over time. Resizing a hole in-place doesn't change
+        //its order in the tree, so only the aggregate values need updating.
+        const bool mergePred = pred != nullptr && pred->base + pred->length == base;
+        const bool mergeSucc = succ != nullptr && base + length == succ->base;
+        if (mergePred && mergeSucc)
+        {
+            holes.Remove(succ);
+            pred->length += length + succ->length;
+            holes.AggregatePath(pred);
+            FreeMeta(succ, VmmMetaType::Hole);
+        }
+        else if (mergePred)
+        {
+            pred->length += length;
+            holes.AggregatePath(pred);
+        }
+        else if (mergeSucc)
+        {
+            succ->base = base;
+            succ->length += length;
+            holes.AggregatePath(succ);
+        }
+        else
+        {
+            VmHole* hole = new(AllocMeta(VmmMetaType::Hole)) VmHole();
+            hole->base = base;
+            hole->length = length;
+            holes.Insert(hole);
+        }
+    }
+
+    void VMM::BeginRangesWrite()
+    {
+        //caller must hold rangesLock.
+        rangesSeq.FetchAdd(1, sl::AcqRel);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+
+    void VMM::EndRangesWrite()
+    {
+        rangesSeq.FetchAdd(1, sl::Release);
+    }
+
+    VmRange* VMM::WalkRanges(uintptr_t addr, size_t maxDepth)
+    {
+        VmRange* scan = ranges.GetRoot();
+        for (size_t depth = 0; scan != nullptr && depth < maxDepth; depth++)
+        {
+            if (addr >= scan->base && addr < scan->Top())
+                return scan;
+
+            if (addr < scan->base)
+                scan = ranges.GetLeft(scan); 
+            else
+                scan = ranges.GetRight(scan);
+        }
+
+        return nullptr;
+    }
+
     VmRange* VMM::FindRange(uintptr_t addr)
     {
         if (addr < globalLowerBound || addr >= globalUpperBound)
             return nullptr;
 
+        /* Range lookups happen on every page fault, so they dont take the ranges lock. Instead the
+         * tree is walked optimistically and the result is only used if no writers modified the tree
+         * while we were walking it (rangesSeq is odd during a write, and incremented after).
+         * This is safe because VmRanges only ever come from the range meta slabs, which are kept for the
+         * lifetime of the VMM: a walk that races with a writer may see stale or inconsistent pointers,
+         * but they'll always point to a VmRange (or be null). The walk depth is bounded in case it sees
+         * a partially rotated tree. If we keep losing to writers we fall back to taking the lock.
+         */
+        for (size_t attempt = 0; attempt < FindRangeAttempts; attempt++)
+        {
+            const size_t seq = rangesSeq.Load(sl::Acquire);
+            if ((seq & 1) != 0)
+            {
+                sl::HintSpinloop();
+                continue;
+            }
+
+            VmRange* found = WalkRanges(addr, FindRangeMaxDepth);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (rangesSeq.Load(sl::Relaxed) == seq)
+                return found;
+        }
+
         sl::ScopedLock rangeTreeLock(rangesLock);
+        return WalkRanges(addr, -1ul);
+    }
+    
+    VmRange* VMM::NextRange(uintptr_t addr)
+    {
+        //returns the range containing `addr`, or the first one above it. Expects the ranges lock to be held.
         VmRange* scan = ranges.GetRoot();
+        VmRange* found = nullptr;
         while (scan != nullptr)
         {
             if (addr >= scan->base && addr < scan->Top())
                 return scan;
 
             if (addr < scan->base)
-                scan = ranges.GetLeft(scan); 
-            else if (addr >= scan->Top())
+            {
+                found = scan;
+                scan = ranges.GetLeft(scan);
+            }
+            else
                 scan = ranges.GetRight(scan);
         }
 
-        return nullptr;
+        return found;
     }
-    
+
+    constexpr size_t VmQuantumDefaultDepth = 8;
+
     VMM* kernelVmm;
+    size_t quantumDepth;
+
     void VMM::InitKernel()
     {
         HatInit(); //arch-specific setup of the MMU.
         Virtual::VmDriver::InitAll(); //Bring-up VM drivers
         kernelVmm = &Tasking::Process::Kernel().vmm;
         new(kernelVmm) VMM(VmmKey{});
+
+        quantumDepth = Config::GetConfigNumber("kernel.vmm.quantum_cache_depth", VmQuantumDefaultDepth);
+        quantumDepth = sl::Min(quantumDepth, VmQuantumMaxDepth);
+        Log("Kernel VMM quantum caches: classes=%zu, depth=%zu", LogLevel::Verbose, 
+            VmQuantumClasses, quantumDepth);
+    }
+
+    void VMM::InitLocalCache()
+    {
+        ASSERT_(CoreLocal()[LocalPtr::VmQuantumCache] == nullptr);
+
+        //the cache is created even if quantum caching is disabled, as it also holds the meta magazines.
+        VmQuantumCache* cache = new VmQuantumCache();
+        ASSERT_(cache != nullptr);
+        for (size_t i = 0; i < VmQuantumClasses; i++)
+            cache->counts[i] = 0;
+        for (size_t i = 0; i < (size_t)VmmMetaType::Count; i++)
+            cache->metaCounts[i] = 0;
+
+        CoreLocal()[LocalPtr::VmQuantumCache] = cache;
+    }
+
+    VmQuantumCache* VMM::LocalQuantumCache()
+    {
+        //caller is expected to be at RunLevel::Dpc already, so we cant be moved to another core.
+        if (this != kernelVmm || !CoreLocalAvailable() || RunLevel::Dpc < CoreLocal().runLevel)
+            return nullptr;
+        return static_cast<VmQuantumCache*>(CoreLocal()[LocalPtr::VmQuantumCache]);
+    }
+
+    VmRange* VMM::QuantumAlloc(size_t length, VmAllocLimits limits)
+    {
+        //cached spans are only guaranteed to be aligned to the base page size.
+        if (quantumDepth == 0)
+            return nullptr;
+        const size_t granuleSize = HatGetLimits().modes[0].granularity;
+        const size_t index = length / granuleSize - 1;
+        if (length % granuleSize != 0 || index >= VmQuantumClasses)
+            return nullptr;
+        if (limits.lowerBound != 0 || limits.upperBound != -1ul || limits.alignment > granuleSize)
+            return nullptr;
+        if (!CoreLocalAvailable())
+            return nullptr; //early in a core's init, use the global allocator.
+
+        VmRange* range = nullptr;
+        bool haveCache = false;
+        const auto prevRl = EnsureRunLevel(RunLevel::Dpc);
+        if (VmQuantumCache* cache = LocalQuantumCache(); cache != nullptr)
+        {
+            haveCache = true;
+            if (cache->counts[index] > 0)
+                range = cache->spans[index][--cache->counts[index]];
+        }
+        if (prevRl.HasValue())
+            LowerRunLevel(*prevRl);
+
+        if (range != nullptr)
+        {
+            StatAdd(stats.quantumHits, 1);
+            StatSub(stats.quantumCached, 1);
+        }
+        else if (haveCache)
+            StatAdd(stats.quantumMisses, 1);
+        return range;
+    }
+
+    bool VMM::QuantumFree(VmRange* range)
+    {
+        const size_t granuleSize = HatGetLimits().modes[0].granularity;
+        const size_t index = range->length / granuleSize - 1;
+        if (range->length % granuleSize != 0 || index >= VmQuantumClasses)
+            return false;
+        if (!CoreLocalAvailable())
+            return false;
+
+        bool cached = false;
+        const auto prevRl = EnsureRunLevel(RunLevel::Dpc);
+        if (VmQuantumCache* cache = LocalQuantumCache(); cache != nullptr && cache->counts[index] < quantumDepth)
+        {
+            cache->spans[index][cache->counts[index]++] = range;
+            cached = true;
+        }
+        if (prevRl.HasValue())
+            LowerRunLevel(*prevRl);
+
+        if (cached)
+            StatAdd(stats.quantumCached, 1);
+        return cached;
+    }
+
+    void VMM::DrainLocalQuantumCache()
+    {
+        if (!CoreLocalAvailable())
+            return;
+
+        const auto prevRl = EnsureRunLevel(RunLevel::Dpc);
+        if (VmQuantumCache* cache = LocalQuantumCache(); cache != nullptr)
+        {
+            for (size_t i = 0; i < VmQuantumClasses; i++)
+            {
+                while (cache->counts[i] > 0)
+                {
+                    VmRange* range = cache->spans[i][--cache->counts[i]];
+                    ReleaseSpace(range->base, range->length);
+                    FreeMeta(range, VmmMetaType::Range);
+                    StatSub(stats.quantumCached, 1);
+                }
+            }
+        }
+        if (prevRl.HasValue())
+            LowerRunLevel(*prevRl);
     }
 
     VMM& VMM::Kernel()
     { return *kernelVmm; }
 
     VMM& VMM::Current()
-    { return *static_cast<VMM*>(CoreLocal()[LocalPtr::UserVmm]); }
+    { 
+        ASSERT_(CurrentActive());
+        return Tasking::Thread::Current().Parent().Vmm();
+    }
 
     bool VMM::CurrentActive()
-    { return CoreLocal()[LocalPtr::UserVmm] != nullptr; }
+    {
+        //kernel threads run on whatever user address space was already loaded (lazy TLB), but it
+        //isn't theirs: only threads belonging to a user process have a current user VMM.
+        if (!CoreLocalAvailable() || CoreLocal()[LocalPtr::Thread] == nullptr)
+            return false;
+        return &Tasking::Thread::Current().Parent() != &Tasking::Process::Kernel();
+    }
 
     VMM::VirtualMemoryManager()
     {
@@ -268,6 +1053,23 @@ namespace Npk::Memory
 
         CommonInit();
         hatMap = HatCreateMap();
+        ASSERT(hatMap != nullptr, "Failed to create HAT map for new VMM");
+
+        //kernel memory is never swapped, so only user VMMs have a swap shrinker.
+        swapHand = 0;
+        swapShrinker.name = "vmm-swap";
+        swapShrinker.priority = VmmSwapShrinkerPriority;
+        swapShrinker.directSafe = false;
+        swapShrinker.count = SwapShrinkerCount;
+        swapShrinker.reclaim = SwapShrinkerReclaim;
+        swapShrinker.arg = this;
+        PMM::Global().RegisterShrinker(&swapShrinker);
+
+        mergeHand = 0;
+        userVmmsLock.WriterLock();
+        nextUser = userVmms;
+        userVmms = this;
+        userVmmsLock.WriterUnlock();
 
         const size_t usableSpace = globalUpperBound - globalLowerBound;
         auto conv = sl::ConvertUnits(usableSpace, sl::UnitBase::Binary);
@@ -304,10 +1106,59 @@ namespace Npk::Memory
     VMM::~VirtualMemoryManager()
     {
         ASSERT(hatMap != KernelMap(), "Attempted to destroy kernel VMM.");
+        PMM::Global().UnregisterShrinker(&metaShrinker);
+        PMM::Global().UnregisterShrinker(&swapShrinker);
+
+        userVmmsLock.WriterLock();
+        VMM** prev = &userVmms;
+        while (*prev != nullptr && *prev != this)
+            prev = &(*prev)->nextUser;
+        if (*prev != nullptr)
+            *prev = nextUser;
+        userVmmsLock.WriterUnlock();
+
+        //remove our queued prefetch requests, and make sure the active one isn't requeued.
+        prefetchLock.Lock();
+        if (prefetchActive != nullptr && prefetchActive->vmm == this)
+            prefetchCancelled = true;
+        VmPrefetchRequest* discard = nullptr;
+        prefetchTail = nullptr;
+        for (VmPrefetchRequest** request = &prefetchHead; *request != nullptr;)
+        {
+            if ((*request)->vmm != this)
+            {
+                prefetchTail = *request;
+                request = &(*request)->next;
+                continue;
+            }
 
-        //Not strictly necessary, but better to know we're not using the VMM we're
-        //about to destroy. Switch to the kernel map.
-        HatMakeActive(KernelMap(), true);
+            VmPrefetchRequest* found = *request;
+            *request = found->next;
+            found->next = discard;
+            discard = found;
+        }
+        prefetchLock.Unlock();
+
+        while (true)
+        {
+            prefetchLock.Lock();
+            const bool busy = prefetchActive != nullptr && prefetchActive->vmm == this;
+            prefetchLock.Unlock();
+            if (!busy)
+                break;
+            Tasking::Scheduler::Global().Yield();
+        }
+
+        while (discard != nullptr)
+        {
+            VmPrefetchRequest* next = discard->next;
+            delete discard;
+            discard = next;
+        }
+
+        //Cores running kernel threads may still have this address space loaded (see lazy TLB
+        //in TlbShootdown.h), switch them (and us) to the kernel map before destroying it.
+        Memory::TlbReleaseMap(hatMap);
         
         //iterate through active ranges, detaching each one and freeing the backing memory.
         //This also frees the VM range structs as well.
@@ -331,9 +1182,24 @@ namespace Npk::Memory
                 LogLevel::Warning);
         }
 
-        //Free memory used by meta allocators
-        while (DestroyMetaSlab(VmmMetaType::Range)) {}
-        while (DestroyMetaSlab(VmmMetaType::Hole)) {}
+        //Free memory used by meta allocators, any slabs still in use here are leaked structs
+        //and would otherwise leak their pages too.
+        for (size_t i = 0; i < (size_t)VmmMetaType::Count; i++)
+        {
+            VmmMetaSlab* lists[] = { metaSlabs[i], fullMetaSlabs[i] };
+            for (VmmMetaSlab* slab : lists)
+            {
+                while (slab != nullptr)
+                {
+                    VmmMetaSlab* next = slab->next;
+                    if (slab->free != slab->total)
+                        Log("VMM meta slab freed with %zu live entries", LogLevel::Warning, slab->total - slab->free);
+                    PMM::Global().Free(reinterpret_cast<uintptr_t>(slab) - hhdmBase, VmmMetaSlabPages);
+                    slab = next;
+                }
+            }
+            metaSlabs[i] = fullMetaSlabs[i] = nullptr;
+        }
 
         //cleanup memory used by HAT structures, no need to lock as no one else
         //can access the VMM at this stage in its life.
@@ -350,7 +1216,7 @@ namespace Npk::Memory
     {
         if (addr < globalLowerBound || addr >= globalUpperBound)
             return false;
-        stats.faults++;
+        StatAdd(stats.faults, 1);
         
         //determine if this is a good or bad page fault by trying to locate a range
         //containing the faulting address.
@@ -372,7 +1238,7 @@ namespace Npk::Memory
         VmDriver* driver = VmDriver::GetDriver(range->flags);
         VALIDATE(driver != nullptr, false, "VmRange exists without a known driver");
 
-        VmDriverContext context { .lock = mapLock, .map = hatMap, .range = *range, .stats = stats };
+        VmDriverContext context { .lock = range->mapLock, .map = hatMap, .range = *range, .stats = stats };
         const EventResult result = driver->HandleFault(context, addr, flags);
 
         return result.goodFault;
@@ -412,65 +1278,48 @@ namespace Npk::Memory
         const QueryResult query = driver->Query(length, flags, initArg); //TODO: tell vmdriver about alignment request
         if (!query.success)
             return {};
-        if (limits.alignment > 1 && (query.alignment % limits.alignment) != 0)
-            return {};
 
-        sl::ScopedLock holyLock(holesLock);
-        VmHole* hole = holes.GetRoot();
-        VALIDATE(hole != nullptr, {}, "No address space holes?");
+        //the range must satisfy the alignment requested by both the caller and the driver.
+        limits.alignment = sl::Max(sl::Max(limits.alignment, query.alignment), 1ul);
 
-        //find an empty part of the address that meets our criteria.
+        //small kernel allocations can reuse a span (and its range struct) from the local
+        //quantum cache, otherwise take some space from the hole tree.
+        VmRange* vmRange = QuantumAlloc(query.length, limits);
         uintptr_t rangeBase = 0;
-        while (true)
+        if (vmRange != nullptr)
+            rangeBase = vmRange->base;
+        else
         {
-            //TODO: respect upper + lower bounds + alignment
-            if (VmHole* left = holes.GetLeft(hole); 
-                left != nullptr && left->largestHole >= query.length)
+            auto maybeBase = ReserveSpace(query.length, limits);
+            if (!maybeBase.HasValue())
             {
-                //there's a hole with a lower address and it (or one of its children)
-                //has enough space for the allocation.
-                hole = left;
-                continue;
+                //spans in our quantum cache may be preventing a larger allocation, try again without them.
+                DrainLocalQuantumCache();
+                maybeBase = ReserveSpace(query.length, limits);
             }
-
-            //check if the current hole can meet the requirements
-            if (hole->length >= query.length)
-            {
-                rangeBase = hole->base;
-                AdjustHole(hole, 0, query.length);
-                FreeMeta(hole, VmmMetaType::Hole);
-                hole = nullptr;
-                break;
-            }
-            
-            //all else failed, look at the next hole higher up the address space
-            hole = holes.GetRight(hole);
-            VALIDATE(hole != nullptr, {}, "No hole in address space large enough.");
-            VALIDATE(hole->largestHole >= query.length, {}, "No hole in address space large enough.");
+            if (!maybeBase.HasValue())
+                return {};
+            rangeBase = *maybeBase;
+            vmRange = static_cast<VmRange*>(AllocMeta(VmmMetaType::Range));
         }
-        holyLock.Release();
-        VALIDATE(rangeBase != 0, {}, "Will not allocate VM at address 0");
 
         //create VM range struct, start populating it
-        VmRange* vmRange = new(AllocMeta(VmmMetaType::Range)) VmRange();
+        new(vmRange) VmRange();
         vmRange->base = rangeBase;
         vmRange->length = query.length;
         vmRange->flags = flags;
         vmRange->mdlCount = 0;
 
         //attach the VM driver to this range, store the offset and token.
-        VmDriverContext context { .lock = mapLock, .map = hatMap, .range = *vmRange, .stats = stats };
+        VmDriverContext context { .lock = vmRange->mapLock, .map = hatMap, .range = *vmRange, .stats = stats };
         const AttachResult attachResult = driver->Attach(context, query, initArg);
         if (!attachResult.success)
         {
-            VmHole* returnHole = new(AllocMeta(VmmMetaType::Hole)) VmHole();
-            returnHole->base = vmRange->base;
-            returnHole->length = vmRange->length;
-            holesLock.Lock();
-            holes.Insert(returnHole);
-            holesLock.Unlock();
-
-            FreeMeta(vmRange, VmmMetaType::Range);
+            if (!QuantumFree(vmRange))
+            {
+                ReleaseSpace(vmRange->base, vmRange->length);
+                FreeMeta(vmRange, VmmMetaType::Range);
+            }
             return {};
         };
 
@@ -479,15 +1328,17 @@ namespace Npk::Memory
         
         //make range known to the rest of the VMM.
         rangesLock.Lock();
+        BeginRangesWrite();
         ranges.Insert(vmRange);
+        EndRangesWrite();
         rangesLock.Unlock();
 
         if (flags.Has(VmFlag::Anon))
-            stats.anonRanges++;
+            StatAdd(stats.anonRanges, 1);
         else if (flags.Has(VmFlag::File))
-            stats.fileRanges++;
+            StatAdd(stats.fileRanges, 1);
         else if (flags.Has(VmFlag::Mmio))
-            stats.mmioRanges++;
+            StatAdd(stats.mmioRanges, 1);
 
         return vmRange->base + vmRange->offset;
     }
@@ -517,21 +1368,25 @@ namespace Npk::Memory
         VALIDATE(range->mdlCount == 0, false, "Cannot free VM range with mdlCount > 0 (it's still in use)");
 
         rangesLock.Lock();
+        BeginRangesWrite();
         ranges.Remove(range);
+        EndRangesWrite();
         rangesLock.Unlock();
 
+        //the range is out of the tree, so the aging scanner cant update this anymore.
+        StatSub(stats.workingSetSize, range->ages.workingSet);
         if (range->flags.Has(VmFlag::Anon))
-            stats.anonRanges--;
+            StatSub(stats.anonRanges, 1);
         else if (range->flags.Has(VmFlag::File))
-            stats.fileRanges--;
+            StatSub(stats.fileRanges, 1);
         else if (range->flags.Has(VmFlag::Mmio))
-            stats.mmioRanges--;
+            StatSub(stats.mmioRanges, 1);
 
         using namespace Virtual;
         VmDriver* driver = VmDriver::GetDriver(range->flags);
         VALIDATE(driver != nullptr, false, "Active VmRange with no known driver");
 
-        VmDriverContext context { .lock = mapLock, .map = hatMap, .range = *range, .stats = stats };
+        VmDriverContext context { .lock = range->mapLock, .map = hatMap, .range = *range, .stats = stats };
         const bool detachSuccess = driver->Detach(context);
         if (!detachSuccess)
         {
@@ -541,17 +1396,117 @@ namespace Npk::Memory
             return false;
         }
 
-        VmHole* hole = new(AllocMeta(VmmMetaType::Hole)) VmHole();
-        hole->length = range->length;
-        hole->base = range->base;
-
-        FreeMeta(range, VmmMetaType::Range);
-        holesLock.Lock();
-        holes.Insert(hole);
-        holesLock.Unlock();
+        if (!QuantumFree(range))
+        {
+            ReleaseSpace(range->base, range->length);
+            FreeMeta(range, VmmMetaType::Range);
+        }
         return true;
     }
 
+    sl::Opt<uintptr_t> VMM::Duplicate(uintptr_t base, VirtualMemoryManager& dest)
+    {
+        VmRange* range = FindRange(base);
+        if (range == nullptr)
+            return {};
+        VALIDATE(range->mdlCount == 0, {}, "Cannot duplicate VM range with mdlCount > 0");
+
+        using namespace Virtual;
+        VmDriver* driver = VmDriver::GetDriver(range->flags);
+        VALIDATE(driver != nullptr, {}, "Active VmRange with no known driver");
+
+        //keep the new range at the same offset within the largest translation size the source could be
+        //using, otherwise the driver can't map superpages (or shared file cache units) in the copy.
+        VmAllocLimits limits {};
+        const HatLimits& hatLimits = HatGetLimits();
+        for (size_t i = hatLimits.modeCount; i > 0; i--)
+        {
+            const size_t granularity = hatLimits.modes[i - 1].granularity;
+            if (granularity <= range->length && range->base % granularity == 0)
+            {
+                limits.alignment = granularity;
+                break;
+            }
+        }
+
+        const auto destBase = dest.ReserveSpace(range->length, limits);
+        if (!destBase.HasValue())
+            return {};
+
+        VmRange* destRange = new(dest.AllocMeta(VmmMetaType::Range)) VmRange();
+        destRange->base = *destBase;
+        destRange->length = range->length;
+        destRange->flags = range->flags;
+        destRange->offset = range->offset;
+        destRange->token = range->token;
+        destRange->mdlCount = 0;
+
+        VmDriverContext sourceContext { .lock = range->mapLock, .map = hatMap, .range = *range, .stats = stats };
+        VmDriverContext destContext { .lock = destRange->mapLock, .map = dest.hatMap, .range = *destRange, .stats = dest.stats };
+        const AttachResult result = driver->Duplicate(sourceContext, destContext);
+        if (!result.success)
+        {
+            //nothing is attached to the new range, the driver has already cleaned up after itself.
+            dest.ReleaseSpace(destRange->base, destRange->length);
+            dest.FreeMeta(destRange, VmmMetaType::Range);
+            return {};
+        }
+        destRange->token = result.token;
+        destRange->offset = result.offset;
+
+        dest.rangesLock.Lock();
+        dest.BeginRangesWrite();
+        dest.ranges.Insert(destRange);
+        dest.EndRangesWrite();
+        dest.rangesLock.Unlock();
+
+        if (destRange->flags.Has(VmFlag::Anon))
+            StatAdd(dest.stats.anonRanges, 1);
+        else if (destRange->flags.Has(VmFlag::File))
+            StatAdd(dest.stats.fileRanges, 1);
+        else if (destRange->flags.Has(VmFlag::Mmio))
+            StatAdd(dest.stats.mmioRanges, 1);
+
+        return destRange->base + destRange->offset;
+    }
+
+    sl::Opt<VmAgeHistogram> VMM::GetAgeHistogram(uintptr_t addr)
+    {
+        sl::ScopedLock rangeTreeLock(rangesLock);
+        VmRange* range = NextRange(addr);
+        if (range == nullptr || addr < range->base)
+            return {};
+
+        sl::ScopedLock mapLock(range->mapLock);
+        return range->ages;
+    }
+
+    static void FindWritten(void* arg, uintptr_t vaddr, uintptr_t paddr, size_t mode, bool accessed, bool dirty)
+    {
+        (void)paddr;
+        (void)mode;
+        (void)accessed;
+        uintptr_t& lowest = *static_cast<uintptr_t*>(arg);
+        if (dirty && vaddr < lowest)
+            lowest = vaddr;
+    }
+
+    sl::Opt<uintptr_t> VMM::LowestWritten(uintptr_t base, size_t length)
+    {
+        sl::ScopedLock rangeTreeLock(rangesLock);
+        VmRange* range = NextRange(base);
+        if (range == nullptr || base < range->base || base + length > range->Top())
+            return {};
+
+        //this clears the accessed flags too, so the pages may look idle for one more aging pass.
+        uintptr_t lowest = base + length;
+        sl::ScopedLock mapLock(range->mapLock);
+        HatTestClearRange(hatMap, base, length, false, FindWritten, &lowest, false);
+        if (lowest == base + length)
+            return {};
+        return sl::Max(lowest, base); //superpages are reported by their base address
+    }
+
     sl::Opt<VmFlags> VMM::GetFlags(uintptr_t base, size_t length)
     {
         const VmRange* range = FindRange(base);
@@ -575,7 +1530,7 @@ namespace Npk::Memory
             return false;
         flags &= ~VmFlagTypeMask;
 
-        VmDriverContext context { .lock = mapLock, .map = hatMap, .range = *range, .stats = stats };
+        VmDriverContext context { .lock = range->mapLock, .map = hatMap, .range = *range, .stats = stats };
         ModifyRangeArgs args {};
         args.setFlags = flags.Raw() & ~range->flags.Raw();
         args.clearFlags = range->flags.Raw() & ~flags.Raw();
@@ -592,15 +1547,13 @@ namespace Npk::Memory
         VmRange* range = FindRange(base);
         if (range == nullptr)
             return {};
-        VALIDATE(range->mdlCount == 0, {}, "Cannot split VM range with mdlCount > 0");
-
         offset += base - (range->base + range->offset);
         using namespace Virtual;
         VmDriver* driver = VmDriver::GetDriver(range->flags);
         if (driver == nullptr)
             return {};
 
-        VmDriverContext context { .lock = mapLock, .map = hatMap, .range = *range, .stats = stats };
+        VmDriverContext context { .lock = range->mapLock, .map = hatMap, .range = *range, .stats = stats };
         const SplitResult result = driver->Split(context, offset);
         if (!result.success)
             return {};
@@ -608,6 +1561,21 @@ namespace Npk::Memory
         if (result.offset == range->length)
             return range->base + offset; //effectively a no-op
 
+        //MDLs only pin the pages they cover, so the range can be split anywhere that isn't inside one.
+        //The pins lock is held until the new range is visible so no MDL is created across the split.
+        const uintptr_t splitAddr = range->base + result.offset;
+        sl::ScopedLock pinsScopeLock(pinsLock);
+        size_t movedMdls = 0;
+        for (VmPinnedSpan* span = pinnedSpans; span != nullptr; span = span->next)
+        {
+            if (span->base >= range->Top() || span->base + span->length <= range->base)
+                continue;
+            VALIDATE(span->base >= splitAddr || span->base + span->length <= splitAddr, {}, 
+                "Cannot split VM range inside an MDL");
+            if (span->base >= splitAddr)
+                movedMdls++;
+        }
+
         VmRange* newRange = new(AllocMeta(VmmMetaType::Range)) VmRange();
 
         newRange->base = range->base + result.offset;
@@ -615,25 +1583,76 @@ namespace Npk::Memory
         newRange->flags = range->flags;
         newRange->offset = 0;
         newRange->token = result.tokenHigh;
-        newRange->mdlCount = 0;
-
-        range->length = newRange->base - range->base;
-        range->token = result.tokenLow;
+        newRange->mdlCount = movedMdls;
+        newRange->faultHistory.pattern = range->faultHistory.pattern;
 
         if (range->flags.Has(VmFlag::Anon))
-            stats.anonRanges++;
+            StatAdd(stats.anonRanges, 1);
         else if (range->flags.Has(VmFlag::File))
-            stats.fileRanges++;
+            StatAdd(stats.fileRanges, 1);
         else if (range->flags.Has(VmFlag::Mmio))
-            stats.mmioRanges++;
+            StatAdd(stats.mmioRanges, 1);
 
+        //shrinking the existing range is visible to lockless lookups, so it happens inside the write too.
         rangesLock.Lock();
+        BeginRangesWrite();
+        range->length = newRange->base - range->base;
+        range->token = result.tokenLow;
+        range->mdlCount -= movedMdls;
         ranges.Insert(newRange);
+        EndRangesWrite();
         rangesLock.Unlock();
 
         return result.offset - range->offset;
     }
 
+    bool VMM::Advise(uintptr_t base, size_t length, VmAdvice advice)
+    {
+        const size_t granuleSize = HatGetLimits().modes[0].granularity;
+        const uintptr_t top = sl::AlignUp(base + length, granuleSize);
+        base = sl::AlignDown(base, granuleSize);
+        if (length == 0 || base < globalLowerBound || top > globalUpperBound)
+            return false;
+
+        //prefetching can take a while, so it's left to the prefetch thread.
+        if (advice == VmAdvice::WillNeed)
+            return QueuePrefetch(base, top - base);
+
+        using namespace Virtual;
+        bool success = true;
+        for (uintptr_t scan = base; scan < top;)
+        {
+            sl::ScopedLock rangeTreeLock(rangesLock);
+            VmRange* range = NextRange(scan);
+            if (range == nullptr || range->base >= top)
+                return false;
+            if (range->base > scan)
+                success = false; //part of the area isn't allocated
+
+            const uintptr_t begin = sl::Max(scan, range->base);
+            const uintptr_t end = sl::Min(top, range->Top());
+            scan = end;
+            VmDriver* driver = VmDriver::GetDriver(range->flags);
+            if (driver == nullptr)
+            {
+                success = false;
+                continue;
+            }
+
+            VmDriverContext context { .lock = range->mapLock, .map = hatMap, .range = *range, .stats = stats };
+            const AdviseResult result = driver->Advise(context, begin, end - begin, advice);
+            if (!result.success)
+                success = false;
+            else if (result.token != nullptr)
+            {
+                sl::ScopedLock mapLock(range->mapLock);
+                range->token = result.token;
+            }
+        }
+
+        return success;
+    }
+
     bool VMM::MemoryExists(uintptr_t base, size_t length, sl::Opt<VmFlags> flags)
     {
         const VmRange* range = FindRange(base);
@@ -653,58 +1672,148 @@ namespace Npk::Memory
         return HatGetMap(hatMap, vaddr, ignored);
     }
 
-    size_t VMM::CopyIn(void* foreignBase, void* localBase, size_t length)
+    //below this copying is cheaper than the page table updates and TLB shootdowns of remapping.
+    constexpr size_t CopyRemapMinLength = 64 * KiB;
+
+    //returns the VMM that manages `addr` in the current address space.
+    static VMM* LocalVmm(uintptr_t addr)
+    {
+        if (addr >= hhdmBase)
+            return &VMM::Kernel();
+        return VMM::CurrentActive() ? &VMM::Current() : nullptr;
+    }
+
+    size_t VMM::RemapPages(VMM& source, uintptr_t srcAddr, VMM& dest, uintptr_t destAddr, size_t length)
+    {
+        VmRange* srcRange = source.FindRange(srcAddr);
+        VmRange* destRange = dest.FindRange(destAddr);
+        if (srcRange == nullptr || destRange == nullptr || srcRange == destRange)
+            return 0;
+        if (srcAddr + length > srcRange->Top() || destAddr + length > destRange->Top())
+            return 0;
+        if (!destRange->flags.Has(VmFlag::Write))
+            return 0;
+
+        using namespace Virtual;
+        VmDriver* driver = VmDriver::GetDriver(srcRange->flags);
+        if (driver == nullptr || driver != VmDriver::GetDriver(destRange->flags))
+            return 0;
+
+        VmDriverContext srcContext { .lock = srcRange->mapLock, .map = source.hatMap, .range = *srcRange, .stats = source.stats };
+        VmDriverContext destContext { .lock = destRange->mapLock, .map = dest.hatMap, .range = *destRange, .stats = dest.stats };
+        return driver->SharePages(srcContext, srcAddr, destContext, destAddr, length);
+    }
+
+    size_t VMM::CopyIn(void* foreignBase, void* localBase, size_t length, bool allowRemap)
     {
         if (!MemoryExists((uintptr_t)foreignBase, length, {}))
             return 0;
 
-        sl::NativePtr local = localBase;
-        size_t count = 0;
+        const uintptr_t foreign = reinterpret_cast<uintptr_t>(foreignBase);
+        const uintptr_t local = reinterpret_cast<uintptr_t>(localBase);
 
+        //only the page-aligned middle of the transfer can be remapped, the head and tail are copied.
+        size_t remapBegin = length;
+        size_t remapLength = 0;
+        if (allowRemap && length >= CopyRemapMinLength && foreign % PageSize == local % PageSize)
+        {
+            remapBegin = sl::AlignUp(foreign, PageSize) - foreign;
+            remapLength = sl::AlignDown(length - remapBegin, PageSize);
+        }
+
+        size_t count = 0;
         while (count < length)
         {
+            if (count == remapBegin && remapLength != 0)
+            {
+                VMM* localVmm = LocalVmm(local + count);
+                if (localVmm != nullptr)
+                    count += RemapPages(*localVmm, local + count, *this, foreign + count, remapLength);
+                remapLength = 0;
+                continue;
+            }
+
+            const uintptr_t where = foreign + count;
             size_t ignored;
-            auto maybePhys = HatGetMap(hatMap, (uintptr_t)foreignBase + count, ignored);
-            if (!maybePhys.HasValue())
+            const auto maybePhys = HatGetMap(hatMap, where, ignored);
+
+            //writing to a shared page (including the zero page) through the hhdm would modify it for
+            //every mapping, so it's faulted for writing first, the same as an unbacked page.
+            const PageInfo* info = maybePhys.HasValue() ? PMM::Global().Lookup(sl::AlignDown(*maybePhys, PageSize)) : nullptr;
+            if (!maybePhys.HasValue() || (info != nullptr && info->shares.Load() != 0))
             {
-                if (!HandleFault((uintptr_t)foreignBase + count, VmFaultFlag::Write))
+                if (!HandleFault(where, VmFaultFlag::Write))
                     return count;
-                maybePhys = HatGetMap(hatMap, (uintptr_t)foreignBase + count, ignored);
+                continue;
             }
-            
-            size_t copyLength = sl::Min(PageSize, length - count);
-            //first copy can be misaligned (in the destination address space), so handle that.
-            if (count == 0)
-                copyLength = sl::Min(copyLength, PageSize - ((uintptr_t)foreignBase % PageSize));
 
-            sl::memcopy(local.ptr, reinterpret_cast<void*>(AddHhdm(*maybePhys)), copyLength);
+            //first copy can be misaligned (in the destination address space), so handle that.
+            const size_t copyLength = sl::Min(PageSize - (where % PageSize), length - count);
+            sl::memcopy(reinterpret_cast<void*>(local + count), reinterpret_cast<void*>(AddHhdm(*maybePhys)), copyLength);
             count += copyLength;
-            local.raw += copyLength;
         }
         return count;
     }
 
-    size_t VMM::CopyOut(void* localBase, void* foreignBase, size_t length)
+    size_t VMM::CopyOut(void* localBase, void* foreignBase, size_t length, bool allowRemap)
     {
-        sl::NativePtr local = localBase;
-        size_t count = 0;
+        if (!MemoryExists((uintptr_t)foreignBase, length, {}))
+            return 0;
+
+        const uintptr_t foreign = reinterpret_cast<uintptr_t>(foreignBase);
+        const uintptr_t local = reinterpret_cast<uintptr_t>(localBase);
+
+        size_t remapBegin = length;
+        size_t remapLength = 0;
+        if (allowRemap && length >= CopyRemapMinLength && foreign % PageSize == local % PageSize)
+        {
+            remapBegin = sl::AlignUp(foreign, PageSize) - foreign;
+            remapLength = sl::AlignDown(length - remapBegin, PageSize);
+        }
 
+        size_t count = 0;
         while (count < length)
         {
+            if (count == remapBegin && remapLength != 0)
+            {
+                VMM* localVmm = LocalVmm(local + count);
+                if (localVmm != nullptr)
+                    count += RemapPages(*this, foreign + count, *localVmm, local + count, remapLength);
+                remapLength = 0;
+                continue;
+            }
+
+            //the source may be unbacked or have been reclaimed, either way a read fault brings it back.
+            const uintptr_t where = foreign + count;
             size_t ignored;
-            auto maybePhys = HatGetMap(hatMap, (uintptr_t)foreignBase + count, ignored);
-            if (!maybePhys)
-                return count;
-            
-            size_t copyLength = sl::Min(PageSize, length - count);
-            if (count == 0)
-                copyLength = sl::AlignUp((uintptr_t)foreignBase, PageSize) - (uintptr_t)foreignBase;
-            sl::memcopy(AddHhdm(reinterpret_cast<void*>(*maybePhys)), local.ptr, copyLength);
-            local.raw += copyLength;
+            const auto maybePhys = HatGetMap(hatMap, where, ignored);
+            if (!maybePhys.HasValue())
+            {
+                if (!HandleFault(where, VmFaultFlag::Read))
+                    return count;
+                continue;
+            }
+
+            const size_t copyLength = sl::Min(PageSize - (where % PageSize), length - count);
+            sl::memcopy(AddHhdm(reinterpret_cast<void*>(*maybePhys)), reinterpret_cast<void*>(local + count), copyLength);
+            count += copyLength;
         }
         return count;
     }
 
+    void VMM::UnpinPages(VmPinnedSpan& span)
+    {
+        //the translations may have changed since the pages were pinned (e.g. a copy-on-write fault
+        //on a page pinned for reading), so release the pages we recorded rather than walking the map.
+        for (size_t i = 0; i < span.pinned.Size(); i++)
+        {
+            PageInfo* info = PMM::Global().Lookup(span.pinned[i]);
+            if (info != nullptr)
+                info->pins.FetchSub(1);
+        }
+        span.pinned.Clear();
+    }
+
     sl::Opt<Mdl> VMM::AcquireMdl(uintptr_t base, size_t length)
     {
         VmRange* range = FindRange(base);
@@ -712,29 +1821,74 @@ namespace Npk::Memory
             return {};
         length = sl::Min(base + length, range->base + range->length) - base;
 
-        //TODO: store mdlCount in the smallest unit possible (page or group-of-pages level) instead of pinning the entire range.
+        /* Only the pages covered by the MDL are pinned, using the pin count in their PageInfo.
+         * VmDrivers leave pinned pages alone when reclaiming or merging. The span is recorded before
+         * any pages are pinned, so Split() can't cut through it while we're working, and so
+         * ReleaseMdl() can find its length again.
+         */
+        VmPinnedSpan* span = new VmPinnedSpan();
+        if (span == nullptr)
+            return {};
+        span->base = base;
+        span->length = length;
+
+        pinsLock.Lock();
+        span->next = pinnedSpans;
+        pinnedSpans = span;
         range->mdlCount++;
+        pinsLock.Unlock();
 
-        //create the mdl list
+        //writable memory is faulted in for writing, so a device never writes into the zero page
+        //or a page that's shared copy-on-write.
+        const bool forWrite = range->flags.Has(VmFlag::Write);
         sl::Vector<MdlPtr> ptrs;
-        for (size_t scan = base; scan < base + length;)
+        for (uintptr_t scan = base; scan < base + length;)
         {
             size_t mode = 0;
+            range->mapLock.Lock();
+            const auto maybeMap = HatGetMap(hatMap, scan, mode);
+            PageInfo* info = maybeMap.HasValue() ? PMM::Global().Lookup(sl::AlignDown(*maybeMap, PageSize)) : nullptr;
+            if (!maybeMap.HasValue() || (forWrite && info != nullptr && info->shares.Load() != 0))
+            {
+                range->mapLock.Unlock();
+                if (HandleFault(scan, forWrite ? VmFaultFlag::Write : VmFaultFlag::Read))
+                    continue;
+
+                Log("Failed to back MDL page at 0x%tx", LogLevel::Error, scan);
+                UnpinPages(*span);
+                pinsLock.Lock();
+                VmPinnedSpan** prev = &pinnedSpans;
+                while (*prev != span)
+                    prev = &(*prev)->next;
+                *prev = span->next;
+                range->mdlCount--;
+                pinsLock.Unlock();
+
+                delete span;
+                return {};
+            }
 
-            //get physical memory or fault it in if necessary
-            auto maybeMap = HatGetMap(hatMap, scan, mode);
-            if (!maybeMap.HasValue())
+            if (info != nullptr)
             {
-                ASSERT_(HandleFault(scan, VmFaultFlag::Write));
-                maybeMap = HatGetMap(hatMap, scan, mode);
+                info->pins.FetchAdd(1);
+                span->pinned.PushBack(sl::AlignDown(*maybeMap, PageSize));
             }
+            range->mapLock.Unlock();
 
-            ASSERT_(maybeMap.HasValue());
-            auto& ptr = ptrs.EmplaceBack();
-            ptr.physAddr = *maybeMap;
-            ptr.length = sl::Min(HatGetLimits().modes[mode].granularity, length + base - scan);
+            const size_t granuleSize = HatGetLimits().modes[mode].granularity;
+            const uintptr_t next = sl::Min(sl::AlignDown(scan, granuleSize) + granuleSize, base + length);
 
-            scan += ptr.length;
+            //HatGetMap() includes the offset into the page, so contiguous runs can be merged directly.
+            if (!ptrs.Empty() && ptrs.Back().physAddr + ptrs.Back().length == *maybeMap)
+                ptrs.Back().length += next - scan;
+            else
+            {
+                auto& ptr = ptrs.EmplaceBack();
+                ptr.physAddr = *maybeMap;
+                ptr.length = next - scan;
+            }
+
+            scan = next;
         }
 
         Mdl mdl {};
@@ -748,11 +1902,20 @@ namespace Npk::Memory
 
     void VMM::ReleaseMdl(uintptr_t base)
     {
+        sl::ScopedLock scopeLock(pinsLock);
+        VmPinnedSpan** prev = &pinnedSpans;
+        while (*prev != nullptr && (*prev)->base != base)
+            prev = &(*prev)->next;
+        VALIDATE_(*prev != nullptr, );
+
+        VmPinnedSpan* span = *prev;
+        *prev = span->next;
         VmRange* range = FindRange(base);
-        if (range == nullptr)
-            return;
-        ASSERT_(range->mdlCount > 0);
-
+        ASSERT_(range != nullptr && range->mdlCount > 0);
         range->mdlCount--;
+        scopeLock.Release();
+
+        UnpinPages(*span);
+        delete span;
     }
 }
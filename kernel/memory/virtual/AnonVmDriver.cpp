@@ -1,24 +1,429 @@
 #include <memory/virtual/AnonVmDriver.h>
 #include <memory/Pmm.h>
+#include <memory/CompressedSwap.h>
+#include <memory/PageMerging.h>
 #include <boot/CommonInit.h>
+#include <config/ConfigStore.h>
 #include <debug/Log.h>
 #include <Maths.h>
 #include <Memory.h>
 
 namespace Npk::Memory::Virtual
 {
-    constexpr size_t FaultMaxMapAhead = 8;
+    constexpr size_t FaultAroundInitialWindow = 8;
+    constexpr size_t ReclaimScanBatch = 256; //max granules looked at per call to Reclaim().
+    //superpages must come from a single buddy block in a contiguous zone.
+    constexpr size_t MaxSuperpageSize = (1ul << (PmBuddyOrders - 1)) * PageSize;
+
+    //guarded ranges have a granule at either end that's never backed, so running off the end of
+    //the range (like a stack overflow) faults instead of corrupting whatever is next to it.
+    static inline uintptr_t UsableBase(const VmRange& range)
+    {
+        if (!range.flags.Has(VmFlag::Guarded))
+            return range.base;
+        return range.base + HatGetLimits().modes[0].granularity;
+    }
+
+    static inline uintptr_t UsableTop(const VmRange& range)
+    {
+        if (!range.flags.Has(VmFlag::Guarded))
+            return range.Top();
+        return range.Top() - HatGetLimits().modes[0].granularity;
+    }
+
+    /* Ranges using superpages have each naturally aligned, superpage-sized chunk that fits entirely
+     * inside the range backed by a single superpage when possible. If we cant get the physical memory
+     * for one the chunk falls back to base pages, and we always map the first page of the chunk when
+     * this happens. This means we can tell if a chunk is still eligible for a superpage by checking
+     * if its base is mapped, rather than scanning all the base pages within it.
+     */
+    bool AnonVmDriver::SuperpageEligible(VmDriverContext& context, size_t hatMode, uintptr_t where)
+    {
+        if (hatMode == 0)
+            return false;
+
+        const size_t granuleSize = HatGetLimits().modes[hatMode].granularity;
+        const uintptr_t chunkBase = sl::AlignDown(where, granuleSize);
+        if (chunkBase < context.range.base || chunkBase + granuleSize > context.range.Top())
+            return false;
+
+        size_t existingMode;
+        return !HatGetMap(context.map, chunkBase, existingMode).HasValue();
+    }
+
+    bool AnonVmDriver::MapSuperpage(VmDriverContext& context, size_t hatMode, uintptr_t where, HatFlags flags)
+    {
+        const size_t granuleSize = HatGetLimits().modes[hatMode].granularity;
+        const uintptr_t chunkBase = sl::AlignDown(where, granuleSize);
+
+        PmAllocLimits limits;
+        limits.alignment = granuleSize;
+        const uintptr_t paddr = PMM::Global().Alloc(granuleSize / PageSize, limits);
+        if (paddr == 0)
+            return false;
+
+        for (size_t i = 0; i < granuleSize; i += PageSize)
+            ClearPage(reinterpret_cast<void*>(AddHhdm(paddr + i)));
+        if (!HatDoMap(context.map, chunkBase, paddr, hatMode, flags, false))
+        {
+            PMM::Global().Free(paddr, granuleSize / PageSize);
+            return false;
+        }
+
+        StatAdd(context.stats.anonResidentSize, granuleSize);
+        return true;
+    }
     
+    /* Base pages can be shared between ranges (and VMMs) after a call to Duplicate(), in which case
+     * they're mapped read-only in all ranges and the page's `shares` count in its PageInfo is the
+     * number of additional mappings. A write fault on a shared page either copies it into a new
+     * page, or if all other mappings have already done that, makes the page writable again.
+     * Superpages and the zero page are never counted as shared, and pinned pages are never shared
+     * by Duplicate().
+     */
+    bool AnonVmDriver::BreakShare(VmDriverContext& context, uintptr_t vaddr, uintptr_t paddr, HatFlags flags)
+    {
+        PageInfo* info = PMM::Global().Lookup(paddr);
+        ASSERT_(info != nullptr);
+        ASSERT_(info->pins.Load(sl::Relaxed) == 0); //pinned pages are unshared before pinning, and copied by Duplicate().
+
+        //copy the page before giving up our share, so no one else can write to it while we're copying.
+        const bool merged = PageMerger::Global().IsMerged(paddr);
+        uintptr_t copy = 0;
+        size_t shares = info->shares.Load();
+        while (true)
+        {
+            if (shares == 0)
+            {
+                //we're the only user of this page now, we can write to it directly.
+                PMM::Global().Free(copy);
+                return HatSyncMap(context.map, vaddr, {}, flags, true);
+            }
+
+            if (copy == 0)
+            {
+                copy = PMM::Global().Alloc();
+                if (copy == 0)
+                    return false;
+                sl::memcopy(reinterpret_cast<void*>(AddHhdm(paddr)), reinterpret_cast<void*>(AddHhdm(copy)), PageSize);
+                shares = info->shares.Load();
+                continue;
+            }
+
+            if (info->shares.CompareExchange(shares, shares - 1))
+            {
+                if (merged)
+                    StatSub(context.stats.anonMergedSize, PageSize);
+                return HatSyncMap(context.map, vaddr, copy, flags, true);
+            }
+        }
+    }
+
+    void AnonVmDriver::ReleasePage(uintptr_t paddr, size_t length)
+    {
+        if (paddr == zeroPage)
+            return;
+
+        if (length == PageSize)
+        {
+            //if the page is shared, drop our share rather than freeing it.
+            PageInfo* info = PMM::Global().Lookup(paddr);
+            size_t shares = info->shares.Load();
+            while (shares != 0 && !info->shares.CompareExchange(shares, shares - 1))
+            {}
+            if (shares != 0)
+                return;
+        }
+
+        PMM::Global().Free(paddr, length / PageSize);
+    }
+
+    bool AnonVmDriver::IsShared(uintptr_t paddr)
+    {
+        if (paddr == zeroPage)
+            return true;
+
+        PageInfo* info = PMM::Global().Lookup(paddr);
+        return info != nullptr && info->shares.Load(sl::Relaxed) != 0;
+    }
+
+    bool AnonVmDriver::IsPinned(uintptr_t paddr)
+    {
+        PageInfo* info = PMM::Global().Lookup(paddr);
+        return info != nullptr && info->pins.Load(sl::Relaxed) != 0;
+    }
+
+    //backs a base page that's unmapped (or mapped to the zero page), returns whether anything was mapped
+    //or an empty optional if there was no memory to back it with. Must be called with the range lock held.
+    sl::Opt<bool> AnonVmDriver::BackPage(VmDriverContext& context, uintptr_t vaddr, HatFlags flags)
+    {
+        //NOTE: right now the only reason we'd be getting a fault is due to demand
+        //paging/zero paging, so if this logic seems to make a lot of assumptions - thats why.
+        const size_t granuleSize = HatGetLimits().modes[0].granularity;
+        size_t existingMode;
+        const auto existing = HatGetMap(context.map, vaddr, existingMode);
+        if (existing.HasValue() && *existing != zeroPage)
+            return false; //already backed by usable memory
+
+        //the page may have been reclaimed into compressed swap, rather than never being backed.
+        //Pages are only stored while holding the range lock, so the stat is stable for us.
+        //The stored copy is only discarded once the page is mapped, so running out of memory
+        //anywhere along the way fails the fault without losing the contents.
+        if (!existing.HasValue() && context.stats.anonSwappedSize != 0
+            && CompressedSwap::Global().Contains(context.map, vaddr, granuleSize))
+        {
+            const auto swapped = CompressedSwap::Global().Load(context.map, vaddr, true);
+            if (!swapped.HasValue())
+                return {};
+            if (!HatDoMap(context.map, vaddr, *swapped, 0, flags, false))
+            {
+                PMM::Global().Free(*swapped);
+                return {};
+            }
+
+            CompressedSwap::Global().Discard(context.map, vaddr, granuleSize);
+            StatAdd(context.stats.anonResidentSize, granuleSize);
+            StatSub(context.stats.anonSwappedSize, granuleSize);
+            return true;
+        }
+
+        const uintptr_t paddr = PMM::Global().AllocZeroed();
+        if (paddr == 0)
+            return {};
+
+        if (existing.HasValue())
+            HatSyncMap(context.map, vaddr, paddr, flags, true);
+        else if (!HatDoMap(context.map, vaddr, paddr, 0, flags, false))
+        {
+            PMM::Global().Free(paddr);
+            return {}; //couldn't allocate page tables
+        }
+        StatAdd(context.stats.anonResidentSize, granuleSize);
+        return true;
+    }
+
+    //backs the first base page of a chunk that couldn't get a superpage, returns false if we're out of memory.
+    bool AnonVmDriver::BackChunkBase(VmDriverContext& context, uintptr_t chunkBase, HatFlags flags)
+    {
+        const uintptr_t paddr = PMM::Global().AllocZeroed();
+        if (paddr == 0)
+            return false;
+        if (!HatDoMap(context.map, chunkBase, paddr, 0, flags, false))
+        {
+            PMM::Global().Free(paddr);
+            return false;
+        }
+
+        StatAdd(context.stats.anonResidentSize, HatGetLimits().modes[0].granularity);
+        return true;
+    }
+
+    size_t AnonVmDriver::PrefetchPages(VmDriverContext& context, uintptr_t base, size_t length)
+    {
+        const size_t hatMode = reinterpret_cast<size_t>(context.range.token);
+        const HatLimits& hatLimits = HatGetLimits();
+        const size_t granuleSize = hatLimits.modes[0].granularity;
+        const HatFlags flags = ConvertFlags(context.range.flags);
+
+        //the lock is taken for each page, so faults elsewhere in the range aren't held up for long.
+        size_t backed = 0;
+        for (uintptr_t vaddr = base; vaddr < base + length;)
+        {
+            sl::ScopedLock scopeLock(context.lock);
+            size_t mode = 0;
+            if (HatGetMap(context.map, vaddr, mode).HasValue() && mode != 0)
+            {
+                vaddr = sl::AlignDown(vaddr, hatLimits.modes[mode].granularity) + hatLimits.modes[mode].granularity;
+                continue;
+            }
+
+            if (SuperpageEligible(context, hatMode, vaddr))
+            {
+                const size_t chunkSize = hatLimits.modes[hatMode].granularity;
+                if (MapSuperpage(context, hatMode, vaddr, flags))
+                {
+                    backed += chunkSize;
+                    vaddr = sl::AlignDown(vaddr, chunkSize) + chunkSize;
+                    continue;
+                }
+
+                //same as HandleFault(): the chunk is backed with base pages from now on.
+                if (!BackChunkBase(context, sl::AlignDown(vaddr, chunkSize), flags))
+                    break;
+                backed += granuleSize;
+            }
+
+            const auto mapped = BackPage(context, vaddr, flags);
+            if (!mapped.HasValue())
+                break;
+            if (*mapped)
+                backed += granuleSize;
+            vaddr += granuleSize;
+        }
+
+        StatAdd(context.stats.prefetchedSize, backed);
+        return backed;
+    }
+
+    /* Dropped base pages are replaced with the zero page if it's enabled, otherwise they're unmapped
+     * and backed again on the next fault. Like Reclaim() we keep the first page of each superpage-sized
+     * chunk mapped, so that SuperpageEligible() still works: this only matters when unmapping, as
+     * the zero page keeps the chunk mapped anyway. Superpages are only dropped if the advice covers
+     * all of them, and pinned pages are always left alone.
+     */
+    bool AnonVmDriver::DropPages(VmDriverContext& context, uintptr_t base, size_t length)
+    {
+        //the range may be accessed at any time after this, so it must be able to take faults.
+        if (CoresInEarlyInit() || !CoreLocalAvailable() || !features.faultHandler)
+            return false;
+
+        const size_t hatMode = reinterpret_cast<size_t>(context.range.token);
+        const HatLimits& hatLimits = HatGetLimits();
+        const size_t granuleSize = hatLimits.modes[0].granularity;
+        const size_t chunkSize = hatLimits.modes[hatMode].granularity;
+        const HatFlags zeroFlags = ConvertFlags(context.range.flags) & ~HatFlags::Write;
+        const uintptr_t top = base + length;
+
+        sl::ScopedLock scopeLock(context.lock);
+        size_t dropped = 0;
+        for (uintptr_t vaddr = base; vaddr < top;)
+        {
+            size_t mode = 0;
+            const auto existing = HatGetMap(context.map, vaddr, mode);
+            const size_t size = hatLimits.modes[mode].granularity;
+            const uintptr_t mapBase = sl::AlignDown(vaddr, size);
+            vaddr = mapBase + size;
+
+            if (!existing.HasValue())
+                continue;
+            const uintptr_t paddr = sl::AlignDown(*existing, size);
+            if (paddr == zeroPage)
+                continue;
+            if (mode != 0 && (mapBase < base || mapBase + size > top))
+                continue;
+            if (mode == 0 && !features.zeroPage && hatMode != 0 && mapBase % chunkSize == 0)
+                continue;
+
+            bool pinned = false;
+            for (size_t i = 0; i < size && !pinned; i += PageSize)
+                pinned = IsPinned(paddr + i);
+            if (pinned)
+                continue;
+
+            if (mode == 0 && features.zeroPage)
+                HatSyncMap(context.map, mapBase, zeroPage, zeroFlags, true);
+            else
+            {
+                uintptr_t unmappedAddr;
+                size_t unmappedMode;
+                ASSERT_(HatDoUnmap(context.map, mapBase, unmappedAddr, unmappedMode, true));
+            }
+
+            if (mode == 0 && PageMerger::Global().IsMerged(paddr))
+                StatSub(context.stats.anonMergedSize, size);
+            ReleasePage(paddr, size);
+            StatSub(context.stats.anonResidentSize, size);
+            dropped += size;
+        }
+
+        if (context.stats.anonSwappedSize != 0)
+        {
+            const size_t discarded = CompressedSwap::Global().Discard(context.map, base, length);
+            StatSub(context.stats.anonSwappedSize, discarded * granuleSize);
+        }
+
+        StatAdd(context.stats.droppedSize, dropped);
+        return true;
+    }
+
+    /* Switches the range to superpage backing. Chunks that were already backed with base pages stay
+     * that way, but chunks only mapped to the zero page (or not at all) are unmapped so that their
+     * next fault can back them with a superpage. An MDL may have pinned the zero page mappings
+     * of a chunk (for reading), those chunks are left alone so the MDL keeps describing them.
+     */
+    AdviseResult AnonVmDriver::PreferSuperpages(VmDriverContext& context, uintptr_t base, size_t length)
+    {
+        if (!features.superpages)
+            return { .success = false };
+
+        const HatLimits& hatLimits = HatGetLimits();
+        const size_t granuleSize = hatLimits.modes[0].granularity;
+        const size_t chunkSize = hatLimits.modes[superpageMode].granularity;
+
+        sl::ScopedLock scopeLock(context.lock);
+        for (uintptr_t chunk = sl::AlignUp(base, chunkSize); chunk + chunkSize <= base + length; chunk += chunkSize)
+        {
+            bool onlyZero = true;
+            for (size_t i = 0; i < chunkSize && onlyZero; i += granuleSize)
+            {
+                size_t mode = 0;
+                const auto existing = HatGetMap(context.map, chunk + i, mode);
+                onlyZero = !existing.HasValue() || (mode == 0 && *existing == zeroPage);
+                if (existing.HasValue() && IsPinned(sl::AlignDown(*existing, granuleSize)))
+                    onlyZero = false;
+            }
+            if (!onlyZero)
+                continue;
+            if (context.stats.anonSwappedSize != 0 && CompressedSwap::Global().Contains(context.map, chunk, chunkSize))
+                continue;
+
+            HatUnmapBatch batch;
+            for (size_t i = 0; i < chunkSize;)
+                i += HatUnmapRange(context.map, chunk + i, chunkSize - i, batch, true);
+        }
+
+        return { .token = reinterpret_cast<void*>(superpageMode), .success = true };
+    }
+
+    sl::Opt<uintptr_t> AnonVmDriver::ZeroPagePhys(void* arg, size_t offset)
+    {
+        (void)offset;
+        auto mapArg = static_cast<AnonMapArg*>(arg);
+        mapArg->mapped++;
+        return mapArg->driver->zeroPage;
+    }
+
+    sl::Opt<uintptr_t> AnonVmDriver::AllocZeroedPhys(void* arg, size_t offset)
+    {
+        (void)offset;
+        const uintptr_t paddr = PMM::Global().AllocZeroed();
+        if (paddr == 0)
+            return {};
+
+        static_cast<AnonMapArg*>(arg)->mapped++;
+        return paddr;
+    }
+
+    HatFlags AnonVmDriver::ProtectFilter(void* arg, uintptr_t paddr, size_t mode, HatFlags flags)
+    {
+        //shared pages stay read-only, they're made writable when the share is broken.
+        if (mode == 0 && static_cast<AnonVmDriver*>(arg)->IsShared(paddr))
+            flags &= ~HatFlags::Write;
+        return flags;
+    }
+
     void AnonVmDriver::Init(uintptr_t enableFeatures)
     {
         //extract enabled features
         features.faultHandler = enableFeatures & (uintptr_t)AnonFeature::FaultHandler;
         features.zeroPage = enableFeatures & (uintptr_t)AnonFeature::ZeroPage;
+        features.superpages = enableFeatures & (uintptr_t)AnonFeature::Superpages;
+        features.superpages = features.superpages && Config::GetConfigNumber("kernel.vmm.anon_superpages", true);
+
+        //we only use a single superpage size: the largest one we can reliably get physical memory for.
+        superpageMode = 0;
+        const HatLimits& hatLimits = HatGetLimits();
+        for (size_t i = 1; i < hatLimits.modeCount && features.superpages; i++)
+        {
+            if (hatLimits.modes[i].granularity <= MaxSuperpageSize)
+                superpageMode = i;
+        }
+        features.superpages = superpageMode != 0;
 
         if (features.zeroPage)
         {
             //initialize zero page:
-            //This is a primitive version of copy-on-write, until we have anon-objects.
+            //This is a primitive version of copy-on-write, specialized for zeroed memory.
             //When memory is requested its immediately backed, but with a readonly
             //page of all zeroes. Upon writing to this page the page is remapped to
             //a freshly allocated one. This can help reduce kernel entries for page
@@ -28,39 +433,84 @@ namespace Npk::Memory::Virtual
             //ranges completely unmapped until accessed, before allocating usable memory,
             //as you'd expect from traditional demand paging.
             zeroPage = PMM::Global().Alloc();
+            ASSERT(zeroPage != 0, "Failed to allocate anon zero page");
             sl::memset((void*)AddHhdm(zeroPage), 0, PageSize);
+            //the zero page is never written to, marking it as shared lets code outside this driver
+            //(like VMM::AcquireMdl) know that it needs a write fault before it can be written.
+            PMM::Global().Lookup(zeroPage)->shares.Store(1);
         }
 
-        Log("VmDriver init: anon, faultHandler=%s, zeroPage=%s", LogLevel::Info, 
-            features.faultHandler ? "yes" : "no", features.zeroPage ? "yes" : "no");
+        CompressedSwap::Global().Init();
+
+        Log("VmDriver init: anon, faultHandler=%s, zeroPage=%s, superpages=%s", LogLevel::Info, 
+            features.faultHandler ? "yes" : "no", features.zeroPage ? "yes" : "no",
+            features.superpages ? "yes" : "no");
     }
 
     EventResult AnonVmDriver::HandleFault(VmDriverContext& context, uintptr_t where, VmFaultFlags flags)
     {
         //if we've reached this point, the fault wasn't caused by a permissions violation,
         //so we map some usable memory here and return to the program.
-        (void)flags;
         const size_t hatMode = reinterpret_cast<size_t>(context.range.token);
-        const size_t granuleSize = HatGetLimits().modes[hatMode].granularity;
-        const size_t mapLength = sl::Min(FaultMaxMapAhead * granuleSize, context.range.Top() - where);
-        const size_t mapCount = sl::AlignUp(mapLength, granuleSize) / granuleSize;
-        where = sl::AlignDown(where, granuleSize);
-
+        const size_t granuleSize = HatGetLimits().modes[0].granularity;
         const auto convFlags = ConvertFlags(context.range.flags);
+        const uintptr_t usableTop = UsableTop(context.range);
+        if (where < UsableBase(context.range) || where >= usableTop)
+        {
+            Log("Guard page accessed at 0x%tx (range 0x%tx-0x%tx)", LogLevel::Error, where,
+                UsableBase(context.range), usableTop);
+            return { .goodFault = false };
+        }
         sl::ScopedLock scopeLock(context.lock);
-        for (size_t i = 0; i < mapCount; i++)
-        {
-            //NOTE: right now the only reason we'd be getting a fault is due to demand
-            //paging/zero paging, so if this logic seems to make a lot of assumptions - thats why.
-            const uintptr_t paddr = PMM::Global().Alloc();
-            ASSERT(granuleSize == PageSize, "TODO: allocate an appropriate amount of physical memory for the granule size");
-            if (features.zeroPage)
-                HatSyncMap(context.map, where + i * granuleSize, paddr, convFlags, true);
-            else
-                ASSERT_(HatDoMap(context.map, where + i * granuleSize, paddr, hatMode, convFlags, false));
+
+        //writing to a page that's shared with another range.
+        size_t existingMode;
+        const auto existing = HatGetMap(context.map, where, existingMode);
+        if (flags.Has(VmFaultFlag::Write) && existing.HasValue() && existingMode == 0
+            && sl::AlignDown(*existing, granuleSize) != zeroPage)
+        {
+            const uintptr_t vaddr = sl::AlignDown(where, granuleSize);
+            return { .goodFault = BreakShare(context, vaddr, sl::AlignDown(*existing, granuleSize), convFlags) };
         }
 
-        context.stats.anonResidentSize += mapCount * granuleSize;
+        if (SuperpageEligible(context, hatMode, where))
+        {
+            if (MapSuperpage(context, hatMode, where, convFlags))
+                return { .goodFault = true };
+
+            //no contiguous memory available, back this chunk with base pages from now on.
+            const size_t chunkSize = HatGetLimits().modes[hatMode].granularity;
+            if (!BackChunkBase(context, sl::AlignDown(where, chunkSize), convFlags))
+                return { .goodFault = false };
+        }
+
+        const size_t mapCount = FaultAroundBegin(context, where, granuleSize, FaultAroundInitialWindow);
+        where = sl::AlignDown(where, granuleSize);
+
+        size_t mappedAhead = 0;
+        size_t i = 0;
+        for (; i < mapCount; i++)
+        {
+            //dont map ahead into a chunk that could still be backed by a superpage.
+            const uintptr_t vaddr = where + i * granuleSize;
+            if (vaddr >= usableTop)
+                break;
+            if (i > 0 && SuperpageEligible(context, hatMode, vaddr))
+                break;
+
+            const auto mapped = BackPage(context, vaddr, convFlags);
+            if (!mapped.HasValue())
+            {
+                //out of memory: only the faulting page itself is required.
+                if (i == 0)
+                    return { .goodFault = false };
+                break;
+            }
+            if (*mapped && i > 0)
+                mappedAhead++;
+        }
+
+        FaultAroundEnd(context, where + i * granuleSize, mappedAhead);
         return { .goodFault = true };
     }
 
@@ -71,27 +521,30 @@ namespace Npk::Memory::Virtual
         if (args.setFlags.Has(VmFlag::Guarded) || args.clearFlags.Has(VmFlag::Guarded))
             return false;
 
-        const size_t hatMode = reinterpret_cast<size_t>(context.range.token);
-        const size_t granuleSize = HatGetLimits().modes[hatMode].granularity;
-        const bool doFlush = args.clearFlags.Any() || HatLimits().flushOnPermsUpgrade;
+        const bool doFlush = args.clearFlags.Any() || HatGetLimits().flushOnPermsUpgrade;
 
         HatFlags flags = ConvertFlags(context.range.flags);
         flags &= ~ConvertFlags(args.clearFlags);
         flags |= ConvertFlags(args.setFlags);
 
+        //the range may contain a mix of base pages and superpages, the HAT handles both.
         sl::ScopedLock lock(context.lock);
-        for (size_t i = 0; i < context.range.length; i += granuleSize)
-            HatSyncMap(context.map, context.range.base + i, {}, flags, doFlush);
+        HatProtectRange(context.map, context.range.base, context.range.length, flags, ProtectFilter, this, doFlush);
 
         return true;
     }
 
     SplitResult AnonVmDriver::Split(VmDriverContext& context, size_t offset)
     {
-        const size_t hatMode = reinterpret_cast<size_t>(context.range.token);
-        const size_t granuleSize = HatGetLimits().modes[hatMode].granularity;
+        //we cant split a superpage, so if one is mapped at the split point move it to the end of the superpage.
+        size_t mode = 0;
+        const HatLimits& hatLimits = HatGetLimits();
+        sl::ScopedLock scopeLock(context.lock);
+        HatGetMap(context.map, context.range.base + offset, mode);
+        scopeLock.Release();
 
-        offset = sl::AlignUp(offset, granuleSize);
+        const size_t granuleSize = hatLimits.modes[mode].granularity;
+        offset = sl::AlignUp(context.range.base + offset, granuleSize) - context.range.base;
         if (offset > context.range.length)
             return { .success = false };
 
@@ -108,17 +561,28 @@ namespace Npk::Memory::Virtual
 
     QueryResult AnonVmDriver::Query(size_t length, VmFlags flags, uintptr_t attachArg)
     {
-        (void)attachArg;
         QueryResult result;
         result.success = true;
         
         const HatLimits limits = HatGetLimits();
         result.hatMode = 0;
-        result.alignment = limits.modes[result.hatMode].granularity;
+        result.alignment = limits.modes[0].granularity;
         result.length = sl::AlignUp(length, result.alignment);
 
+        //ranges big enough to hold a superpage ask for superpage alignment, so that as much
+        //of the range as possible can use them. The length remains a multiple of the base page size,
+        //any parts of the range that dont fill a superpage are backed by base pages.
+        //guarded ranges only use base pages, so the guard granules dont have to be superpage-sized.
+        const bool superpagesAllowed = features.superpages && !(attachArg & (uintptr_t)AnonFeature::Superpages)
+            && !flags.Has(VmFlag::Guarded);
+        if (superpagesAllowed && result.length >= limits.modes[superpageMode].granularity)
+        {
+            result.hatMode = superpageMode;
+            result.alignment = limits.modes[superpageMode].granularity;
+        }
+
         if (flags.Has(VmFlag::Guarded))
-            result.length += 2 * result.alignment;
+            result.length += 2 * limits.modes[0].granularity;
 
         return result;
     }
@@ -136,13 +600,15 @@ namespace Npk::Memory::Virtual
         const bool doZeroPage = demandAllowed && features.zeroPage 
             && !(attachArg & (uintptr_t)AnonFeature::ZeroPage);
 
+        const uintptr_t usableBase = UsableBase(context.range);
+        const uintptr_t usableTop = UsableTop(context.range);
         const AttachResult result
         {
             .token = reinterpret_cast<void*>(query.hatMode),
-            .offset = 0,
+            .offset = usableBase - context.range.base,
             .success = true,
         };
-        context.stats.anonWorkingSize += context.range.length - result.offset;
+        StatAdd(context.stats.anonWorkingSize, usableTop - usableBase);
 
         if (doDemand && !doZeroPage)
             return result;
@@ -152,43 +618,466 @@ namespace Npk::Memory::Virtual
             flags.Clear(VmFlag::Write); //fault on next write to this page
 
         const HatFlags hatFlags = ConvertFlags(flags);
-        const size_t granuleSize = HatGetLimits().modes[query.hatMode].granularity;
+        const size_t chunkSize = HatGetLimits().modes[query.hatMode].granularity;
+        const HatPhysFunc getPhys = doZeroPage ? ZeroPagePhys : AllocZeroedPhys;
 
+        /* Chunks that could be backed by a superpage are left unmapped when using the zero page,
+         * the first access to them will fault and back the whole chunk at once. If we're
+         * not using demand paging we try to back them with superpages now.
+         * Everything else is mapped with base pages, in runs that end at the next chunk boundary.
+         */
         sl::ScopedLock scopeLock(context.lock);
-        for (size_t i = 0; i < context.range.length; i += granuleSize)
+        for (size_t i = usableBase - context.range.base; i < usableTop - context.range.base;)
         {
-            const uintptr_t phys = doZeroPage ? zeroPage : PMM::Global().Alloc();
-            HatDoMap(context.map, context.range.base + i, phys, 0, hatFlags, false);
+            const uintptr_t where = context.range.base + i;
+            if (SuperpageEligible(context, query.hatMode, where))
+            {
+                if (doZeroPage || MapSuperpage(context, query.hatMode, where, ConvertFlags(context.range.flags)))
+                {
+                    i += chunkSize;
+                    continue;
+                }
+            }
+
+            size_t runLength = usableTop - where;
+            if (query.hatMode != 0)
+                runLength = sl::Min(runLength, sl::AlignUp(where + 1, chunkSize) - where);
+
+            //only count what was actually mapped, HatMapRange() keeps a partial run if it fails.
+            AnonMapArg mapArg { .driver = this, .mapped = 0 };
+            const bool mapped = HatMapRange(context.map, where, runLength, 0, hatFlags, getPhys, &mapArg, false);
+            if (!doZeroPage)
+                StatAdd(context.stats.anonResidentSize, mapArg.mapped * HatGetLimits().modes[0].granularity);
+            if (!mapped)
+            {
+                //out of memory: undo what we've mapped so far, the vmm doesn't detach failed attaches.
+                scopeLock.Release();
+                Detach(context);
+                return { .success = false };
+            }
+            i += runLength;
         }
 
-        if (!doZeroPage)
-            context.stats.anonResidentSize += context.range.length;
         return result;
     }
 
     bool AnonVmDriver::Detach(VmDriverContext& context)
     {
-        context.stats.anonWorkingSize -= context.range.length - context.range.offset;
+        StatSub(context.stats.anonWorkingSize, UsableTop(context.range) - UsableBase(context.range));
         const HatLimits& hatLimits = HatGetLimits();
 
         sl::ScopedLock scopeLock(context.lock);
 
+        //the HAT flushes the TLB before returning each batch, so the pages can be released immediately.
+        HatUnmapBatch batch;
         for (size_t i = 0; i < context.range.length;)
         {
-            uintptr_t phys;
-            size_t mode;
-            if (HatDoUnmap(context.map, context.range.base, phys, mode, true))
+            i += HatUnmapRange(context.map, context.range.base + i, context.range.length - i, batch, true);
+            for (size_t j = 0; j < batch.count; j++)
             {
-                const size_t length = hatLimits.modes[mode].granularity;
-                if (phys != zeroPage)
-                    PMM::Global().Free(phys, length / PageSize);
-                i += length;
-                context.stats.anonResidentSize -= length;
+                const size_t length = hatLimits.modes[batch.entries[j].mode].granularity;
+                if (batch.entries[j].paddr == zeroPage)
+                    continue; //never counted as resident
+                if (length == PageSize && PageMerger::Global().IsMerged(batch.entries[j].paddr))
+                    StatSub(context.stats.anonMergedSize, PageSize);
+                ReleasePage(batch.entries[j].paddr, length);
+                StatSub(context.stats.anonResidentSize, length);
             }
-            else
-                i += hatLimits.modes[0].granularity; //nothing was mapped, try the next area.
+        }
+
+        if (context.stats.anonSwappedSize != 0)
+        {
+            const size_t discarded = CompressedSwap::Global().Discard(context.map, context.range.base, context.range.length);
+            StatSub(context.stats.anonSwappedSize, discarded * hatLimits.modes[0].granularity);
         }
         
         return true;
     }
+
+    AttachResult AnonVmDriver::Duplicate(VmDriverContext& source, VmDriverContext& dest)
+    {
+        //superpage chunks only line up if both ranges have the same offset within a superpage.
+        const HatLimits& hatLimits = HatGetLimits();
+        size_t hatMode = reinterpret_cast<size_t>(source.range.token);
+        if (hatMode != 0 && (dest.range.base - source.range.base) % hatLimits.modes[hatMode].granularity != 0)
+            hatMode = 0;
+
+        AttachResult result
+        {
+            .token = reinterpret_cast<void*>(hatMode),
+            .offset = source.range.offset,
+            .success = true,
+        };
+        StatAdd(dest.stats.anonWorkingSize, UsableTop(dest.range) - UsableBase(dest.range));
+
+        const HatFlags flags = ConvertFlags(source.range.flags);
+        const HatFlags sharedFlags = flags & ~HatFlags::Write;
+
+        //take both range locks in a consistent order.
+        sl::TicketLock* firstLock = &source.lock;
+        sl::TicketLock* secondLock = &dest.lock;
+        if (firstLock > secondLock)
+            sl::Swap(firstLock, secondLock);
+        firstLock->Lock();
+        if (secondLock != firstLock)
+            secondLock->Lock();
+
+        for (size_t i = 0; i < source.range.length;)
+        {
+            size_t mode = 0;
+            const auto phys = HatGetMap(source.map, source.range.base + i, mode);
+            const size_t length = hatLimits.modes[mode].granularity;
+            const uintptr_t destAddr = dest.range.base + i;
+
+            if (!phys.HasValue())
+            {
+                //swapped out pages are copied into the new range, the source keeps its compressed copy.
+                //Anything else is unbacked, which reads as zeroes so the new range can be backed on demand too.
+                const bool isSwapped = source.stats.anonSwappedSize != 0 
+                    && CompressedSwap::Global().Contains(source.map, source.range.base + i, length);
+                if (isSwapped)
+                {
+                    const auto swapped = CompressedSwap::Global().Load(source.map, source.range.base + i, true);
+                    if (!swapped.HasValue())
+                    {
+                        result.success = false; //out of memory, dont let the copy read zeroes instead.
+                        break;
+                    }
+                    HatDoMap(dest.map, destAddr, *swapped, 0, flags, false);
+                    StatAdd(dest.stats.anonResidentSize, length);
+                }
+
+                i += length;
+                continue;
+            }
+
+            if (*phys == zeroPage)
+                HatDoMap(dest.map, destAddr, zeroPage, 0, sharedFlags, false);
+            else if (mode != 0)
+            {
+                //superpages are copied rather than shared, so we never need to split one on a write fault.
+                for (size_t j = 0; j < length && result.success; j += PageSize)
+                {
+                    const uintptr_t copy = PMM::Global().Alloc();
+                    if (copy == 0)
+                    {
+                        result.success = false;
+                        break;
+                    }
+
+                    sl::memcopy(reinterpret_cast<void*>(AddHhdm(*phys + j)), reinterpret_cast<void*>(AddHhdm(copy)), PageSize);
+                    HatDoMap(dest.map, destAddr + j, copy, 0, flags, false);
+                    StatAdd(dest.stats.anonResidentSize, PageSize);
+                }
+                if (!result.success)
+                    break;
+            }
+            else if (IsPinned(*phys))
+            {
+                //a device may still be writing into a pinned page, so the child gets its own copy now.
+                //Sharing it would let a later write fault move the parent away from the pinned page.
+                const uintptr_t copy = PMM::Global().Alloc();
+                if (copy == 0)
+                {
+                    result.success = false;
+                    break;
+                }
+
+                sl::memcopy(reinterpret_cast<void*>(AddHhdm(*phys)), reinterpret_cast<void*>(AddHhdm(copy)), PageSize);
+                HatDoMap(dest.map, destAddr, copy, 0, flags, false);
+                StatAdd(dest.stats.anonResidentSize, PageSize);
+            }
+            else
+            {
+                PMM::Global().Lookup(*phys)->shares.FetchAdd(1);
+                HatSyncMap(source.map, source.range.base + i, {}, sharedFlags, true);
+                HatDoMap(dest.map, destAddr, *phys, 0, sharedFlags, false);
+                StatAdd(dest.stats.anonResidentSize, PageSize);
+                if (PageMerger::Global().IsMerged(*phys))
+                    StatAdd(dest.stats.anonMergedSize, PageSize);
+            }
+
+            i += length;
+        }
+
+        if (secondLock != firstLock)
+            secondLock->Unlock();
+        firstLock->Unlock();
+
+        //release whatever we managed to copy, Detach() doesn't care how the range was populated.
+        if (!result.success)
+            Detach(dest);
+        return result;
+    }
+
+    /* Reclaim is a simple clock algorithm: the VMM calls this for each anon range in turn, and
+     * any base pages that haven't been accessed since the last pass are compressed into the
+     * compressed swap and their physical memory is freed. Pages that have been accessed have
+     * their accessed flag cleared, so they're candidates on the next pass. If page aging is running
+     * the page's idle age must also be at least `minAge`, so recently used pages are kept even if
+     * they happen to not have been touched since the last aging pass. Shared pages, the zero
+     * page and superpages are left alone, as is the first page of each superpage-sized chunk so
+     * that SuperpageEligible() still works.
+     */
+    size_t AnonVmDriver::Reclaim(VmDriverContext& context, uintptr_t& cursor, size_t pages, size_t minAge)
+    {
+        CompressedSwap& swap = CompressedSwap::Global();
+        if (!swap.Enabled())
+        {
+            cursor = context.range.Top();
+            return 0;
+        }
+
+        const size_t hatMode = reinterpret_cast<size_t>(context.range.token);
+        const HatLimits& hatLimits = HatGetLimits();
+        const size_t granuleSize = hatLimits.modes[0].granularity;
+        const size_t chunkSize = hatLimits.modes[hatMode].granularity;
+        const HatFlags flags = ConvertFlags(context.range.flags);
+
+        sl::ScopedLock scopeLock(context.lock);
+        size_t freed = 0;
+        cursor = sl::AlignDown(cursor, granuleSize);
+        for (size_t scanned = 0; cursor < context.range.Top() && freed < pages && scanned < ReclaimScanBatch; scanned++)
+        {
+            const uintptr_t vaddr = cursor;
+            size_t mode = 0;
+            const auto existing = HatGetMap(context.map, vaddr, mode);
+            cursor = sl::AlignDown(vaddr, hatLimits.modes[mode].granularity) + hatLimits.modes[mode].granularity;
+
+            if (!existing.HasValue() || mode != 0)
+                continue;
+            if (hatMode != 0 && vaddr % chunkSize == 0)
+                continue;
+            const uintptr_t paddr = sl::AlignDown(*existing, granuleSize);
+            if (IsShared(paddr))
+                continue;
+            if (IsPinned(paddr))
+                continue; //pinned by an MDL, it must stay where it is.
+            PageInfo* info = PMM::Global().Lookup(paddr);
+            if (HatClearAccessed(context.map, vaddr, false))
+            {
+                info->idleAge = 0;
+                continue;
+            }
+            if (info->idleAge < minAge)
+                continue;
+
+            //unmap the page first so nothing can modify it while it's being compressed.
+            uintptr_t unmappedAddr;
+            size_t unmappedMode;
+            ASSERT_(HatDoUnmap(context.map, vaddr, unmappedAddr, unmappedMode, true));
+            if (!swap.Store(context.map, vaddr, paddr))
+            {
+                ASSERT_(HatDoMap(context.map, vaddr, paddr, 0, flags, false));
+                continue;
+            }
+
+            PMM::Global().Free(paddr);
+            StatSub(context.stats.anonResidentSize, granuleSize);
+            StatAdd(context.stats.anonSwappedSize, granuleSize);
+            freed++;
+        }
+
+        return freed;
+    }
+
+    /* Same-page merging: stable base pages are write-protected and offered to the PageMerger,
+     * which either hands back an identical page to map instead (in which case our copy is freed),
+     * keeps our page as the copy others will be merged into, or declines. Merged pages are ordinary
+     * shared pages from our point of view, so a write fault breaks the share via BreakShare().
+     * The page is write-protected before it's compared, otherwise it could change after the
+     * contents were checked but before the mapping was swapped.
+     */
+    size_t AnonVmDriver::Merge(VmDriverContext& context, uintptr_t& cursor, size_t budget)
+    {
+        PageMerger& merger = PageMerger::Global();
+        const HatLimits& hatLimits = HatGetLimits();
+        const size_t granuleSize = hatLimits.modes[0].granularity;
+        const HatFlags flags = ConvertFlags(context.range.flags);
+        const HatFlags frozenFlags = flags & ~HatFlags::Write;
+        const uintptr_t mergeZeroPage = features.zeroPage ? zeroPage : 0;
+
+        sl::ScopedLock scopeLock(context.lock);
+        size_t scanned = 0;
+        cursor = sl::AlignDown(cursor, granuleSize);
+        for (; cursor < context.range.Top() && scanned < budget; scanned++)
+        {
+            const uintptr_t vaddr = cursor;
+            size_t mode = 0;
+            const auto existing = HatGetMap(context.map, vaddr, mode);
+            cursor = sl::AlignDown(vaddr, hatLimits.modes[mode].granularity) + hatLimits.modes[mode].granularity;
+
+            if (!existing.HasValue() || mode != 0)
+                continue;
+            const uintptr_t paddr = sl::AlignDown(*existing, granuleSize);
+            if (IsShared(paddr) || IsPinned(paddr) || !merger.IsStable(paddr))
+                continue;
+
+            HatSyncMap(context.map, vaddr, {}, frozenFlags, true);
+            const auto target = merger.Merge(paddr, mergeZeroPage);
+            if (!target.HasValue())
+            {
+                HatSyncMap(context.map, vaddr, {}, flags, hatLimits.flushOnPermsUpgrade);
+                continue;
+            }
+
+            if (*target == paddr)
+            {
+                //our page is now the merge table's copy, it stays mapped but is shared with the table.
+                StatAdd(context.stats.anonMergedSize, granuleSize);
+                continue;
+            }
+
+            HatSyncMap(context.map, vaddr, *target, frozenFlags, true);
+            PMM::Global().Free(paddr);
+            if (*target == zeroPage)
+                StatSub(context.stats.anonResidentSize, granuleSize);
+            else
+                StatAdd(context.stats.anonMergedSize, granuleSize);
+        }
+
+        return scanned;
+    }
+
+    /* Used for zero-copy transfers between address spaces (see VMM::CopyIn()). Each destination
+     * page is released and replaced with a share of the source page, the same as Duplicate() does
+     * for whole ranges. We stop at the first page that can't be shared: superpages, unbacked or
+     * pinned pages, and base pages inside a chunk that could still become a superpage.
+     * The pages are checked first so the source can be write-protected with one HatProtectRange()
+     * and a single flush. Replaced destination pages are released in batches, after a flush.
+     */
+    size_t AnonVmDriver::SharePages(VmDriverContext& source, uintptr_t srcAddr, VmDriverContext& dest, 
+        uintptr_t destAddr, size_t length)
+    {
+        const size_t granuleSize = HatGetLimits().modes[0].granularity;
+        const size_t destHatMode = reinterpret_cast<size_t>(dest.range.token);
+        const HatFlags srcFlags = ConvertFlags(source.range.flags) & ~HatFlags::Write;
+        const HatFlags destFlags = ConvertFlags(dest.range.flags) & ~HatFlags::Write;
+
+        //take both range locks in a consistent order.
+        sl::TicketLock* firstLock = &source.lock;
+        sl::TicketLock* secondLock = &dest.lock;
+        if (firstLock > secondLock)
+            sl::Swap(firstLock, secondLock);
+        firstLock->Lock();
+        if (secondLock != firstLock)
+            secondLock->Lock();
+
+        size_t shared = 0;
+        for (; shared < length; shared += granuleSize)
+        {
+            size_t srcMode = 0;
+            const auto srcPhys = HatGetMap(source.map, srcAddr + shared, srcMode);
+            if (!srcPhys.HasValue() || srcMode != 0)
+                break;
+            if (IsPinned(sl::AlignDown(*srcPhys, granuleSize)))
+                break;
+
+            const uintptr_t vaddr = destAddr + shared;
+            size_t destMode = 0;
+            const auto destPhys = HatGetMap(dest.map, vaddr, destMode);
+            if (destPhys.HasValue() && (destMode != 0 || IsPinned(sl::AlignDown(*destPhys, granuleSize))))
+                break;
+            if (!destPhys.HasValue() && SuperpageEligible(dest, destHatMode, vaddr))
+                break;
+        }
+
+        //the source must be read-only everywhere before the destination can see its pages.
+        if (shared != 0)
+            HatProtectRange(source.map, srcAddr, shared, srcFlags, nullptr, nullptr, true);
+
+        //replaced pages may still be cached by other cores until the destination is flushed. The
+        //mappings already have destFlags, so HatProtectRange() is only used for its batched flush.
+        uintptr_t stalePages[HatUnmapBatch::Capacity];
+        size_t staleCount = 0;
+        uintptr_t flushBase = destAddr;
+        auto ReleaseStale = [&](uintptr_t flushTop)
+        {
+            if (staleCount != 0)
+                HatProtectRange(dest.map, flushBase, flushTop - flushBase, destFlags, nullptr, nullptr, true);
+            for (size_t i = 0; i < staleCount; i++)
+                ReleasePage(stalePages[i], granuleSize);
+            staleCount = 0;
+            flushBase = flushTop;
+        };
+
+        for (size_t offset = 0; offset < shared; offset += granuleSize)
+        {
+            size_t mode = 0;
+            const uintptr_t paddr = sl::AlignDown(*HatGetMap(source.map, srcAddr + offset, mode), granuleSize);
+            const uintptr_t vaddr = destAddr + offset;
+            const auto destPhys = HatGetMap(dest.map, vaddr, mode);
+            if (destPhys.HasValue() && sl::AlignDown(*destPhys, granuleSize) == paddr)
+                continue; //already sharing this page
+
+            //the zero page is never counted as shared, see BreakShare().
+            if (paddr != zeroPage)
+            {
+                PMM::Global().Lookup(paddr)->shares.FetchAdd(1);
+                if (PageMerger::Global().IsMerged(paddr))
+                    StatAdd(dest.stats.anonMergedSize, granuleSize);
+            }
+
+            //mappings of the zero page aren't counted as resident.
+            if (paddr != zeroPage)
+                StatAdd(dest.stats.anonResidentSize, granuleSize);
+            if (destPhys.HasValue())
+            {
+                const uintptr_t oldPage = sl::AlignDown(*destPhys, granuleSize);
+                HatSyncMap(dest.map, vaddr, paddr, destFlags, false);
+                if (oldPage != zeroPage)
+                {
+                    if (PageMerger::Global().IsMerged(oldPage))
+                        StatSub(dest.stats.anonMergedSize, granuleSize);
+                    StatSub(dest.stats.anonResidentSize, granuleSize);
+                }
+
+                stalePages[staleCount++] = oldPage;
+                if (staleCount == HatUnmapBatch::Capacity)
+                    ReleaseStale(vaddr + granuleSize);
+                continue;
+            }
+
+            if (dest.stats.anonSwappedSize != 0 && CompressedSwap::Global().Discard(dest.map, vaddr, granuleSize) != 0)
+                StatSub(dest.stats.anonSwappedSize, granuleSize);
+            ASSERT_(HatDoMap(dest.map, vaddr, paddr, 0, destFlags, false));
+        }
+        ReleaseStale(destAddr + shared);
+
+        if (secondLock != firstLock)
+            secondLock->Unlock();
+        firstLock->Unlock();
+
+        return shared;
+    }
+
+    AdviseResult AnonVmDriver::Advise(VmDriverContext& context, uintptr_t base, size_t length, VmAdvice advice)
+    {
+        switch (advice)
+        {
+            case VmAdvice::Normal:
+            case VmAdvice::Sequential:
+            case VmAdvice::Random:
+            {
+                //access patterns apply to the whole range, there's only one fault history.
+                sl::ScopedLock scopeLock(context.lock);
+                FaultAroundSetPattern(context, advice);
+                return { .success = true };
+            }
+            case VmAdvice::WillNeed:
+            {
+                const uintptr_t top = sl::Min(base + length, UsableTop(context.range));
+                base = sl::Max(base, UsableBase(context.range));
+                if (base < top)
+                    PrefetchPages(context, base, top - base);
+                return { .success = true };
+            }
+            case VmAdvice::DontNeed:
+                return { .success = DropPages(context, base, length) };
+            case VmAdvice::HugePage:
+                return PreferSuperpages(context, base, length);
+        }
+
+        return { .success = false };
+    }
 }
@@ -96,6 +96,9 @@ namespace Npk::Memory::Virtual
         return result;
     }
     
+    static sl::Opt<uintptr_t> MmioPhys(void* arg, size_t offset)
+    { return *static_cast<uintptr_t*>(arg) + offset; }
+
     AttachResult KernelVmDriver::Attach(VmDriverContext& context, const QueryResult& query, uintptr_t attachArg)
     {
         HatFlags flags = HatFlags::Global;
@@ -111,10 +114,9 @@ namespace Npk::Memory::Virtual
 
         attachArg = sl::AlignDown(attachArg, query.alignment);
         sl::ScopedLock scopeLock(context.lock);
-        for (size_t i = 0; i < context.range.length; i += query.alignment)
-            HatDoMap(context.map, context.range.base + i, attachArg + i, query.hatMode, flags, false);
+        HatMapRange(context.map, context.range.base, context.range.length, query.hatMode, flags, MmioPhys, &attachArg, false);
 
-        context.stats.mmioWorkingSize += context.range.length;
+        StatAdd(context.stats.mmioWorkingSize, context.range.length);
         return result;
     }
     
@@ -123,19 +125,22 @@ namespace Npk::Memory::Virtual
         const HatLimits& hatLimits = HatGetLimits();
         sl::ScopedLock ptLock(context.lock);
 
-        for (uintptr_t base = context.range.base; base < context.range.base + context.range.length;)
+        HatUnmapBatch batch;
+        for (size_t i = 0; i < context.range.length;)
         {
-            uintptr_t ignored;
-            size_t mode;
-            if (HatDoUnmap(context.map, base, ignored, mode, true))
-            {
-                base += hatLimits.modes[mode].granularity;
-                context.stats.mmioWorkingSize -= hatLimits.modes[mode].granularity;
-            }
-            else
-                base += hatLimits.modes[0].granularity;
+            i += HatUnmapRange(context.map, context.range.base + i, context.range.length - i, batch, true);
+            for (size_t j = 0; j < batch.count; j++)
+                StatSub(context.stats.mmioWorkingSize, hatLimits.modes[batch.entries[j].mode].granularity);
         }
         
         return true;
     }
+
+    AttachResult KernelVmDriver::Duplicate(VmDriverContext& source, VmDriverContext& dest)
+    {
+        //mmio ranges map device memory, there's no sensible way to duplicate them.
+        (void)source;
+        (void)dest;
+        return { .success = false };
+    }
 }
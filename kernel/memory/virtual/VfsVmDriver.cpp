@@ -8,7 +8,7 @@
 
 namespace Npk::Memory::Virtual
 {
-    constexpr size_t FaultMaxMapAhead = 2 * 0x1000;
+    constexpr size_t FaultAroundInitialWindow = 2;
 
     void VfsVmDriver::Init(uintptr_t enableFeatures)
     { 
@@ -36,26 +36,38 @@ namespace Npk::Memory::Virtual
         const HatFlags hatFlags = ConvertFlags(context.range.flags);
 
         where = sl::AlignDown(where, granuleSize);
-        const size_t mapLength = sl::Min(FaultMaxMapAhead, context.range.Top() - where);
         const uintptr_t mappingOffset = where - context.range.base;
 
+        //the lock is held from reading the fault-around history until it's updated, so concurrent
+        //faults in this range see each other's window. Looking up file cache units only takes the
+        //cache's lock, which always nests inside the range lock.
+        sl::ScopedLock scopeLock(context.lock);
+        const size_t mapLength = FaultAroundBegin(context, where, granuleSize, FaultAroundInitialWindow) * granuleSize;
+
         auto cachePart = GetFileCacheUnit(cache, mappingOffset + link->fileOffset);
         VALIDATE_(cachePart.Valid(), { .goodFault = false });
 
-        for (size_t i = 0; i < mapLength; i += granuleSize)
+        size_t mappedAhead = 0;
+        size_t i = 0;
+        for (; i < mapLength; i += granuleSize)
         {
-            if ((mappingOffset + i + link->fileOffset) % fcInfo.unitSize == 0)
+            if (i != 0 && (mappingOffset + i + link->fileOffset) % fcInfo.unitSize == 0)
             {
                 cachePart = GetFileCacheUnit(cache, link->fileOffset + mappingOffset + i);
-                VALIDATE_(cachePart.Valid(), { .goodFault = false });
+                if (!cachePart.Valid())
+                    break; //only the faulting granule is required, and that's already mapped.
             }
 
-            sl::ScopedLock scopeLock(context.lock);
-            HatDoMap(context.map, context.range.base + mappingOffset + i, cachePart->physBase + ((i + mappingOffset + link->fileOffset) % fcInfo.unitSize), 
-                fcInfo.hatMode, hatFlags, false);
-            context.stats.fileResidentSize += granuleSize;
+            if (!HatDoMap(context.map, context.range.base + mappingOffset + i, cachePart->physBase + ((i + mappingOffset + link->fileOffset) % fcInfo.unitSize), 
+                fcInfo.hatMode, hatFlags, false))
+                continue; //already mapped
+
+            StatAdd(context.stats.fileResidentSize, granuleSize);
+            if (i > 0)
+                mappedAhead++;
         }
 
+        FaultAroundEnd(context, where + i, mappedAhead);
         return { .goodFault = true };
     }
 
@@ -144,7 +156,7 @@ namespace Npk::Memory::Virtual
             .offset = arg->offset % granuleSize,
             .success = true,
         };
-        context.stats.fileWorkingSize += context.range.length - result.offset;
+        StatAdd(context.stats.fileWorkingSize, context.range.length - result.offset);
 
         //we found the file and were able to acquire it's cache, next step depends on our backing strategy.
         //if we're mapping on a page fault then we can exit now. Otherwise map the entire
@@ -163,7 +175,7 @@ namespace Npk::Memory::Virtual
             sl::ScopedLock scopeLock(context.lock);
             HatDoMap(context.map, context.range.base + i, handle->physBase + (i % fcInfo.unitSize), 
                 query.hatMode, hatFlags, false);
-            context.stats.fileResidentSize += granuleSize;
+            StatAdd(context.stats.fileResidentSize, granuleSize);
         }
 
         return result;
@@ -171,25 +183,172 @@ namespace Npk::Memory::Virtual
 
     bool VfsVmDriver::Detach(VmDriverContext& context)
     {
-        context.stats.fileWorkingSize -= context.range.length - context.range.offset;
+        StatSub(context.stats.fileWorkingSize, context.range.length - context.range.offset);
         using namespace Filesystem;
         const FileCacheInfo fcInfo = GetFileCacheInfo();
 
         VfsVmLink* link = static_cast<VfsVmLink*>(context.range.token);
 
         const size_t granuleSize = HatGetLimits().modes[fcInfo.hatMode].granularity;
-        size_t mode;
-        size_t phys;
 
+        //the memory belongs to the file cache, so we only need to count what was unmapped.
         sl::ScopedLock scopeLock(context.lock);
-        for (size_t i = 0; i < context.range.length; i += granuleSize)
+        HatUnmapBatch batch;
+        for (size_t i = 0; i < context.range.length;)
         {
             //TODO: if page has dirty bit set, we'll need to mark the file cache entry as dirtied as well
-            if (HatDoUnmap(context.map, context.range.base + i, phys, mode, true))
-                context.stats.fileResidentSize -= granuleSize;
+            i += HatUnmapRange(context.map, context.range.base + i, context.range.length - i, batch, true);
+            StatSub(context.stats.fileResidentSize, batch.count * granuleSize);
         }
 
         delete link;
         return true;
     }
+
+    AttachResult VfsVmDriver::Duplicate(VmDriverContext& source, VmDriverContext& dest)
+    {
+        using namespace Filesystem;
+        auto sourceLink = static_cast<VfsVmLink*>(source.range.token);
+        ASSERT(sourceLink != nullptr, "VFS link is nullptr");
+        if (sourceLink->isPrivate)
+            return { .success = false }; //TODO: private mappings need copy-on-write of the cache units
+
+        //file mappings are shared, so the new range references the same file cache units as the
+        //source. The memory is owned by the file cache, so there are no page references to take.
+        VfsVmLink* link = new VfsVmLink();
+        if (link == nullptr)
+            return { .success = false };
+        link->isReadonly = sourceLink->isReadonly;
+        link->isPrivate = sourceLink->isPrivate;
+        link->node = sourceLink->node;
+        link->fileOffset = sourceLink->fileOffset;
+
+        const AttachResult result
+        {
+            .token = link,
+            .offset = source.range.offset,
+            .success = true,
+        };
+        StatAdd(dest.stats.fileWorkingSize, dest.range.length - result.offset);
+
+        //copy whatever the source has mapped, anything else is backed on demand (or was never available).
+        const size_t granuleSize = HatGetLimits().modes[GetFileCacheInfo().hatMode].granularity;
+        const HatFlags hatFlags = ConvertFlags(dest.range.flags);
+
+        sl::TicketLock* firstLock = &source.lock;
+        sl::TicketLock* secondLock = &dest.lock;
+        if (firstLock > secondLock)
+            sl::Swap(firstLock, secondLock);
+        firstLock->Lock();
+        if (secondLock != firstLock)
+            secondLock->Lock();
+
+        for (size_t i = 0; i < source.range.length; i += granuleSize)
+        {
+            size_t mode;
+            const auto phys = HatGetMap(source.map, source.range.base + i, mode);
+            if (!phys.HasValue())
+                continue;
+            if (HatDoMap(dest.map, dest.range.base + i, sl::AlignDown(*phys, granuleSize), mode, hatFlags, false))
+                StatAdd(dest.stats.fileResidentSize, granuleSize);
+        }
+
+        if (secondLock != firstLock)
+            secondLock->Unlock();
+        firstLock->Unlock();
+
+        return result;
+    }
+
+    bool VfsVmDriver::PrefetchPages(VmDriverContext& context, uintptr_t base, size_t length)
+    {
+        using namespace Filesystem;
+
+        auto link = static_cast<VfsVmLink*>(context.range.token);
+        auto node = GetVfsNode(link->node, true);
+        VALIDATE_(node.Valid(), false);
+        auto cache = node->cache;
+        VALIDATE_(cache.Valid(), false);
+
+        const FileCacheInfo fcInfo = GetFileCacheInfo();
+        const size_t granuleSize = HatGetLimits().modes[fcInfo.hatMode].granularity;
+        const HatFlags hatFlags = ConvertFlags(context.range.flags);
+        const uintptr_t top = base + length;
+
+        //the file cache units are acquired one at a time, this may read them in from the filesystem.
+        size_t backed = 0;
+        for (uintptr_t vaddr = sl::AlignDown(base, granuleSize); vaddr < top;)
+        {
+            const size_t fileOffset = vaddr - context.range.base + link->fileOffset;
+            auto cachePart = GetFileCacheUnit(cache, fileOffset);
+            if (!cachePart.Valid())
+                break;
+
+            const uintptr_t unitTop = sl::Min(vaddr + fcInfo.unitSize - (fileOffset % fcInfo.unitSize), top);
+            for (; vaddr < unitTop; vaddr += granuleSize)
+            {
+                const size_t unitOffset = (vaddr - context.range.base + link->fileOffset) % fcInfo.unitSize;
+                sl::ScopedLock scopeLock(context.lock);
+                if (!HatDoMap(context.map, vaddr, cachePart->physBase + unitOffset, fcInfo.hatMode, hatFlags, false))
+                    continue; //already mapped
+
+                StatAdd(context.stats.fileResidentSize, granuleSize);
+                backed += granuleSize;
+            }
+        }
+
+        StatAdd(context.stats.prefetchedSize, backed);
+        return true;
+    }
+
+    AdviseResult VfsVmDriver::Advise(VmDriverContext& context, uintptr_t base, size_t length, VmAdvice advice)
+    {
+        const size_t granuleSize = HatGetLimits().modes[Filesystem::GetFileCacheInfo().hatMode].granularity;
+
+        switch (advice)
+        {
+            case VmAdvice::Normal:
+            case VmAdvice::Sequential:
+            case VmAdvice::Random:
+            {
+                sl::ScopedLock scopeLock(context.lock);
+                FaultAroundSetPattern(context, advice);
+                return { .success = true };
+            }
+            case VmAdvice::WillNeed:
+                return { .success = PrefetchPages(context, base, length) };
+            case VmAdvice::DontNeed:
+            {
+                //the memory belongs to the file cache, so all we can do is remove our mappings of it.
+                //Pages pinned by an MDL must stay mapped, see VMM::AcquireMdl().
+                sl::ScopedLock scopeLock(context.lock);
+                for (uintptr_t vaddr = sl::AlignDown(base, granuleSize); vaddr < base + length; vaddr += granuleSize)
+                {
+                    size_t mode = 0;
+                    const auto existing = HatGetMap(context.map, vaddr, mode);
+                    if (!existing.HasValue())
+                        continue;
+                    bool pinned = false;
+                    for (size_t i = 0; i < granuleSize && !pinned; i += PageSize)
+                    {
+                        PageInfo* info = PMM::Global().Lookup(sl::AlignDown(*existing, granuleSize) + i);
+                        pinned = info != nullptr && info->pins.Load(sl::Relaxed) != 0;
+                    }
+                    if (pinned)
+                        continue;
+
+                    //TODO: same as Detach(), dirty pages need to be marked in the file cache
+                    uintptr_t unmappedAddr;
+                    size_t unmappedMode;
+                    ASSERT_(HatDoUnmap(context.map, vaddr, unmappedAddr, unmappedMode, true));
+                    StatSub(context.stats.fileResidentSize, granuleSize);
+                }
+                return { .success = true };
+            }
+            case VmAdvice::HugePage:
+                break; //the file cache decides what page size is used.
+        }
+
+        return { .success = false };
+    }
 }
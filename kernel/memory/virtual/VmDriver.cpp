@@ -4,9 +4,65 @@
 #include <memory/virtual/VfsVmDriver.h>
 #include <debug/Log.h>
 #include <Lazy.h>
+#include <Maths.h>
 
 namespace Npk::Memory::Virtual
 {
+    constexpr size_t FaultAroundMaxWindow = 64;
+
+    size_t FaultAroundBegin(VmDriverContext& context, uintptr_t where, size_t granuleSize, size_t initialWindow)
+    {
+        VmFaultHistory& history = context.range.faultHistory;
+        where = sl::AlignDown(where, granuleSize);
+
+        if (history.pattern == VmAdvice::Random)
+        {
+            history.lastFault = where;
+            return 1;
+        }
+
+        if (history.pattern == VmAdvice::Sequential)
+        {
+            if (where > history.lastFault && where <= history.windowTop)
+                StatAdd(context.stats.faultsAvoided, history.pendingAhead);
+            history.window = FaultAroundMaxWindow;
+        }
+        else if (history.window == 0)
+            history.window = initialWindow;
+        else if (where > history.lastFault && where <= history.windowTop)
+        {
+            //positive stride that landed at (or before) the end of what we mapped last time:
+            //the program is streaming through the range, so everything we mapped ahead was used.
+            StatAdd(context.stats.faultsAvoided, history.pendingAhead);
+            history.window = sl::Min(history.window * 2, FaultAroundMaxWindow);
+        }
+        else
+            history.window = sl::Max(history.window / 2, 1ul);
+
+        history.lastFault = where;
+        const size_t remaining = sl::AlignUp(context.range.Top() - where, granuleSize) / granuleSize;
+        return sl::Min(history.window, remaining);
+    }
+
+    void FaultAroundEnd(VmDriverContext& context, uintptr_t top, size_t mappedAhead)
+    {
+        VmFaultHistory& history = context.range.faultHistory;
+        history.windowTop = top;
+        history.pendingAhead = mappedAhead;
+        StatAdd(context.stats.faultAheadMapped, mappedAhead);
+    }
+
+    void FaultAroundSetPattern(VmDriverContext& context, VmAdvice pattern)
+    {
+        ASSERT_(pattern == VmAdvice::Normal || pattern == VmAdvice::Sequential || pattern == VmAdvice::Random);
+
+        //start over with the initial window, the history is from a different access pattern.
+        VmFaultHistory& history = context.range.faultHistory;
+        history.pattern = pattern;
+        history.window = 0;
+        history.pendingAhead = 0;
+    }
+
     sl::Lazy<AnonVmDriver> anonDriver;
     sl::Lazy<KernelVmDriver> kernelDriver;
     sl::Lazy<VfsVmDriver> vfsDriver;
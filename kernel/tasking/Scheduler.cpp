@@ -3,6 +3,7 @@
 #include <boot/CommonInit.h>
 #include <debug/Log.h>
 #include <interrupts/Ipi.h>
+#include <memory/TlbShootdown.h>
 
 namespace Npk::Tasking
 {
@@ -16,6 +17,23 @@ namespace Npk::Tasking
         Halt();
     }
 
+    //Kernel threads only use the higher half, which is the same in every address space, so they
+    //run on whatever address space is already loaded (lazy TLB) rather than reloading the MMU.
+    static void SwitchAddressSpace(Thread* next)
+    {
+        Process& parent = next->Parent();
+        if (&parent == &Process::Kernel())
+            return Memory::TlbEnterLazy();
+
+        Memory::TlbExitLazy();
+        VMM* vmm = &parent.Vmm();
+        if (CoreLocal()[LocalPtr::UserVmm] == vmm)
+            return;
+
+        vmm->MakeActive();
+        CoreLocal()[LocalPtr::UserVmm] = vmm;
+    }
+
     static Thread* GetRunnableThread(WorkQueue& queue)
     {
         sl::ScopedLock scopeLock(queue.lock);
@@ -213,9 +231,13 @@ namespace Npk::Tasking
             queue->lock.Unlock();
         }
 
+        SwitchAddressSpace(engine.pendingThread);
+
         //make pending thread the current one and switch
         TrapFrame* nextFrame = engine.pendingThread->frame;
         CoreLocal()[LocalPtr::Thread] = engine.pendingThread;
+        //threads only have the one stack for now, so it's also where traps from user mode land.
+        SetKernelStack(engine.pendingThread->stackBase + engine.pendingThread->stackSize);
         engine.pendingThread = nullptr;
 
         SwitchFrame(prevFrame, nextFrame);
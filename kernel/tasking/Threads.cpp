@@ -1,11 +1,15 @@
 #include <tasking/Threads.h>
 #include <tasking/Scheduler.h>
 #include <tasking/Waitable.h>
+#include <config/ConfigStore.h>
 #include <debug/Log.h>
+#include <Maths.h>
 
 namespace Npk::Tasking
 {
     constexpr size_t DefaultThreadStackSize = 64 * KiB;
+    constexpr size_t MinThreadStackSize = 8 * KiB;
+    constexpr size_t StackCommitSize = 8 * KiB; //backed when a thread is created, if stacks are demand paged
 
     static sl::Span<uint8_t> GetAttribInternal(sl::Span<ProgramAttribHeader> headers, ProgramAttribType type)
     {
@@ -137,7 +141,7 @@ namespace Npk::Tasking
     Thread* Thread::Create(size_t procId, ThreadEntry entry, void* arg)
     {
         auto maybeId = ProgramManager::Global().CreateThread(procId, entry, arg, 
-            NoCoreAffinity, DefaultThreadStackSize);
+            NoCoreAffinity, ProgramManager::Global().DefaultStackSize());
 
         if (!maybeId.HasValue())
             return nullptr;
@@ -174,6 +178,21 @@ namespace Npk::Tasking
         return sl::StringSpan(reinterpret_cast<const char*>(existing.Begin()), existing.SizeBytes() / sizeof(char));
     }
 
+    size_t Thread::StackHighWater()
+    {
+        //only this thread writes to its stack, so the lowest written page is as deep as it's been.
+        //The dirty flags may be lost if the pages are reclaimed, so keep the deepest we've seen.
+        const auto lowest = parent->Vmm().LowestWritten(stackBase, stackSize);
+        if (!lowest.HasValue())
+            return stackHighWater.Load(sl::Relaxed);
+
+        const size_t depth = stackBase + stackSize - *lowest;
+        size_t highest = stackHighWater.Load(sl::Relaxed);
+        while (depth > highest && !stackHighWater.CompareExchange(highest, depth))
+        {}
+        return sl::Max(depth, highest);
+    }
+
     void Thread::SetAffinity(size_t newAffinity)
     {
         ASSERT_UNREACHABLE();
@@ -198,7 +217,8 @@ namespace Npk::Tasking
     void Thread::Exit(size_t code)
     {
         //TODO: put thread into reclaimable queue
-        Log("Thread %zu.%zu exiting with code %zu", LogLevel::Verbose, parent->Id(), id, code);
+        Log("Thread %zu.%zu exiting with code %zu, stack used %zu/%zu bytes", LogLevel::Verbose, 
+            parent->Id(), id, code, StackHighWater(), stackSize);
         const bool selfExit = CoreLocal()[LocalPtr::Thread] == this;
 
         const RunLevel prevLevel = RaiseRunLevel(RunLevel::Dpc);
@@ -223,6 +243,8 @@ namespace Npk::Tasking
     void ProgramManager::Init()
     {
         nextId = 1;
+        defaultStackSize = Config::GetConfigNumber("kernel.tasking.stack_size", DefaultThreadStackSize);
+        defaultStackSize = sl::AlignUp(sl::Max(defaultStackSize, MinThreadStackSize), PageSize);
         kernelProcess.id = nextId++;
         kernelProcess.attribs = { nullptr, 0 };
         processes.PushBack(&kernelProcess);
@@ -263,8 +285,16 @@ namespace Npk::Tasking
         const uintptr_t entryAddr = reinterpret_cast<uintptr_t>(entry);
         VALIDATE_(parent->vmm.MemoryExists(entryAddr, 2, execFlag), {});
 
-        //TODO: for user stacks we dont need to immediately back the memory (the const 3 arg)
-        auto maybeStack = parent->vmm.Alloc(stackSize, 3, VmFlag::Anon | VmFlag::Write); //TODO: guarded?
+        /* Stacks are reserved with a guard page below them (and above), so an overflow faults
+         * rather than writing over whatever memory comes next. If page faults run on a separate stack
+         * (DemandPagedStacks) only the top of the stack is backed now, the rest is backed as it
+         * grows (the const 2 arg only disables the zero page, stacks are always written first).
+         * Otherwise traps push their frame onto the interrupted stack, so a fault on an unbacked
+         * stack page can't be handled and the whole stack is backed up front (3 also disables demand paging).
+         */
+        stackSize = sl::AlignUp(stackSize, PageSize);
+        const uintptr_t stackInitArg = DemandPagedStacks ? 2 : 3;
+        auto maybeStack = parent->vmm.Alloc(stackSize, stackInitArg, VmFlag::Anon | VmFlag::Write | VmFlag::Guarded);
         VALIDATE_(maybeStack, {});
         const uintptr_t stackTop = *maybeStack + stackSize;
 
@@ -275,6 +305,9 @@ namespace Npk::Tasking
         thread->affinity = affinity;
         thread->state = ThreadState::Setup;
         thread->extRegs = nullptr; //these are populated on-demand
+        thread->stackBase = *maybeStack;
+        thread->stackSize = stackSize;
+        thread->stackHighWater = 0;
 
         //setup the trap frame in the local address space and copy it into the target one,
         //leaving room for a dummy stack frame (all zero) to terminate any traces.
@@ -291,6 +324,16 @@ namespace Npk::Tasking
         uintptr_t traceTerminator[2] { 0, 0 };
         ASSERT_(parent->vmm.CopyIn((void*)traceTermAddr, traceTerminator, TerminatorSize) == TerminatorSize);
 
+        //back the rest of the top of the stack, most threads never go deeper than this. If we're
+        //out of memory that's fine, the pages are faulted in when first used instead.
+        const uintptr_t commitBase = stackTop - sl::Min(stackSize, StackCommitSize);
+        for (uintptr_t page = sl::AlignDown(frameAddr, PageSize); page > commitBase;)
+        {
+            page -= PageSize;
+            if (!parent->vmm.GetPhysical(page).HasValue())
+                parent->vmm.HandleFault(page, Memory::VmFaultFlag::Write);
+        }
+
         threadLock.WriterLock();
         threads.PushBack(thread);
         threadLock.WriterUnlock();
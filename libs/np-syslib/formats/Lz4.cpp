@@ -0,0 +1,189 @@
+#include <formats/Lz4.h>
+#include <Memory.h>
+
+namespace sl
+{
+    constexpr size_t Lz4MinMatch = 4;
+    constexpr size_t Lz4LastLiterals = 5; //the last 5 bytes of a block are always literals.
+    constexpr size_t Lz4MatchLimit = 12; //the last match must start at least 12 bytes before the end.
+    constexpr size_t Lz4MaxOffset = 0xFFFF;
+    constexpr size_t Lz4RunMask = 0xF;
+
+    static inline uint32_t Read32(const uint8_t* ptr)
+    {
+        uint32_t value;
+        sl::memcopy(ptr, &value, sizeof(value));
+        return value;
+    }
+
+    static inline uint32_t Hash(uint32_t sequence)
+    { return (sequence * 2654435761u) >> (32 - Lz4HashBits); }
+
+    //returns the number of extra bytes needed to encode a length that didnt fit in the token.
+    static inline size_t ExtraLengthBytes(size_t length)
+    { return length < Lz4RunMask ? 0 : (length - Lz4RunMask) / 255 + 1; }
+
+    static inline uint8_t* WriteExtraLength(uint8_t* out, size_t length)
+    {
+        if (length < Lz4RunMask)
+            return out;
+
+        length -= Lz4RunMask;
+        for (; length >= 255; length -= 255)
+            *out++ = 255;
+        *out++ = static_cast<uint8_t>(length);
+        return out;
+    }
+
+    static inline bool ReadExtraLength(const uint8_t*& in, const uint8_t* inEnd, size_t& length)
+    {
+        if (length != Lz4RunMask)
+            return true;
+
+        uint8_t next;
+        do
+        {
+            if (in == inEnd)
+                return false;
+            next = *in++;
+            length += next;
+        }
+        while (next == 255);
+
+        return true;
+    }
+
+    static uint8_t* WriteSequence(uint8_t* out, const uint8_t* outEnd, const uint8_t* literals,
+        size_t literalLength, size_t offset, size_t matchLength)
+    {
+        const bool hasMatch = offset != 0;
+        const size_t required = 1 + ExtraLengthBytes(literalLength) + literalLength
+            + (hasMatch ? 2 + ExtraLengthBytes(matchLength) : 0);
+        if (required > static_cast<size_t>(outEnd - out))
+            return nullptr;
+
+        uint8_t* token = out++;
+        *token = static_cast<uint8_t>((literalLength < Lz4RunMask ? literalLength : Lz4RunMask) << 4);
+        out = WriteExtraLength(out, literalLength);
+        sl::memcopy(literals, out, literalLength);
+        out += literalLength;
+
+        if (!hasMatch)
+            return out;
+
+        *out++ = offset & 0xFF;
+        *out++ = (offset >> 8) & 0xFF;
+        *token |= static_cast<uint8_t>(matchLength < Lz4RunMask ? matchLength : Lz4RunMask);
+        return WriteExtraLength(out, matchLength);
+    }
+
+    size_t Lz4Compress(const void* src, size_t srcLength, void* dest, size_t destLength, uint32_t* table)
+    {
+        const uint8_t* const in = static_cast<const uint8_t*>(src);
+        const uint8_t* const inEnd = in + srcLength;
+        uint8_t* out = static_cast<uint8_t*>(dest);
+        const uint8_t* const outEnd = out + destLength;
+        const uint8_t* anchor = in;
+
+        if (srcLength > Lz4MatchLimit)
+        {
+            //positions of recently seen 4-byte sequences, a stale or colliding entry is harmless
+            //since every candidate is checked before it's used.
+            sl::memset(table, 0, Lz4TableEntries * sizeof(uint32_t));
+
+            const uint8_t* const matchStartLimit = inEnd - Lz4MatchLimit;
+            const uint8_t* const matchEndLimit = inEnd - Lz4LastLiterals;
+            const uint8_t* scan = in;
+
+            while (scan <= matchStartLimit)
+            {
+                const uint32_t sequence = Read32(scan);
+                const uint32_t hash = Hash(sequence);
+                const uint8_t* ref = in + table[hash];
+                table[hash] = static_cast<uint32_t>(scan - in);
+
+                if (ref >= scan || static_cast<size_t>(scan - ref) > Lz4MaxOffset || Read32(ref) != sequence)
+                {
+                    scan++;
+                    continue;
+                }
+
+                const uint8_t* matchEnd = scan + Lz4MinMatch;
+                const uint8_t* refEnd = ref + Lz4MinMatch;
+                while (matchEnd < matchEndLimit && *matchEnd == *refEnd)
+                {
+                    matchEnd++;
+                    refEnd++;
+                }
+
+                //the match may also extend backwards into bytes we would have emitted as literals.
+                while (scan > anchor && ref > in && scan[-1] == ref[-1])
+                {
+                    scan--;
+                    ref--;
+                }
+
+                out = WriteSequence(out, outEnd, anchor, scan - anchor, scan - ref,
+                    (matchEnd - scan) - Lz4MinMatch);
+                if (out == nullptr)
+                    return 0;
+
+                scan = matchEnd;
+                anchor = scan;
+            }
+        }
+
+        out = WriteSequence(out, outEnd, anchor, inEnd - anchor, 0, 0);
+        if (out == nullptr)
+            return 0;
+        return out - static_cast<uint8_t*>(dest);
+    }
+
+    size_t Lz4Decompress(const void* src, size_t srcLength, void* dest, size_t destLength)
+    {
+        const uint8_t* in = static_cast<const uint8_t*>(src);
+        const uint8_t* const inEnd = in + srcLength;
+        uint8_t* const outBegin = static_cast<uint8_t*>(dest);
+        uint8_t* out = outBegin;
+        const uint8_t* const outEnd = out + destLength;
+
+        while (in < inEnd)
+        {
+            const uint8_t token = *in++;
+
+            size_t literalLength = token >> 4;
+            if (!ReadExtraLength(in, inEnd, literalLength))
+                return 0;
+            if (literalLength > static_cast<size_t>(inEnd - in) || literalLength > static_cast<size_t>(outEnd - out))
+                return 0;
+
+            sl::memcopy(in, out, literalLength);
+            in += literalLength;
+            out += literalLength;
+            if (in == inEnd)
+                break; //the last sequence has no match.
+
+            if (inEnd - in < 2)
+                return 0;
+            const size_t offset = in[0] | (static_cast<size_t>(in[1]) << 8);
+            in += 2;
+            if (offset == 0 || offset > static_cast<size_t>(out - outBegin))
+                return 0;
+
+            size_t matchLength = token & Lz4RunMask;
+            if (!ReadExtraLength(in, inEnd, matchLength))
+                return 0;
+            matchLength += Lz4MinMatch;
+            if (matchLength > static_cast<size_t>(outEnd - out))
+                return 0;
+
+            //the match can overlap the bytes being written (offset < length), so copy forwards one byte at a time.
+            const uint8_t* ref = out - offset;
+            for (size_t i = 0; i < matchLength; i++)
+                out[i] = ref[i];
+            out += matchLength;
+        }
+
+        return out - outBegin;
+    }
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace sl
+{
+    /*
+        Compression and decompression of raw LZ4 blocks (no frame header or checksums),
+        as described in https://github.com/lz4/lz4/blob/dev/doc/lz4_Block_format.md.
+        The compressor is a simple greedy one with a small hash table provided by the caller,
+        it favours speed over ratio. Matches can only refer back 64KiB, so larger inputs
+        work but compress worse.
+    */
+    constexpr size_t Lz4HashBits = 10;
+    constexpr size_t Lz4TableEntries = 1 << Lz4HashBits;
+
+    //returns the worst case compressed size for `length` bytes of input.
+    constexpr size_t Lz4MaxCompressedSize(size_t length)
+    { return length + length / 255 + 16; }
+
+    //returns the number of bytes written to `dest`, or 0 if the output didnt fit. `table` is
+    //scratch space of Lz4TableEntries entries, its contents dont need to be initialized.
+    size_t Lz4Compress(const void* src, size_t srcLength, void* dest, size_t destLength, uint32_t* table);
+
+    //returns the number of bytes written to `dest`, or 0 if the input is malformed or the
+    //output didnt fit.
+    size_t Lz4Decompress(const void* src, size_t srcLength, void* dest, size_t destLength);
+}